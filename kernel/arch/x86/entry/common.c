@@ -69,9 +69,11 @@ int x86_kernel_entry(struct regs_state *regs)
     return 0;
 }
 
-int x86_kernel_exit(void)
+int x86_kernel_exit(struct regs_state *regs)
 {
     do_kernel_exit_work();
+    if (regs->cs & 3)
+        load_fp_regs();
     if (current->flags.signaled) {
         current->flags.signaled = 0;
         return -1;
@@ -83,6 +85,10 @@ void arch_pre_context_switch(struct task *prev, struct task *next)
 {
     set_tss_esp0((uintptr_t)next->kstack_base + __KERNEL_STACK_SZ);
     prev->tls = (void*)(uintptr_t)rdmsr(IA32_FS_BASE);
+    fpu_switch(prev);
+#ifdef __x86_64__
+    arch_switch_mm(next);
+#endif
 }
 
 void arch_post_context_switch(struct task *p)
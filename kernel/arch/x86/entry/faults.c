@@ -4,6 +4,7 @@
 #include <lilac/signal.h>
 #include <lilac/sched.h>
 #include <mm/mm.h>
+#include <asm/fpu.h>
 #include <asm/idt.h>
 #include <asm/regs.h>
 #include "paging.h"
@@ -198,6 +199,11 @@ void bnd_handler(struct regs_state *frame)
 
 void dna_handler(struct regs_state *frame)
 {
+    if (frame->ip < __USER_STACK) { // first FPU use by a user task
+        fpu_dna();
+        return;
+    }
+    x86_dump_regs(frame);
     kerror("Device not available (FPU) fault detected\n");
 }
 
@@ -0,0 +1,168 @@
+/*
+ * The vDSO: the time and getcpu calls, run in user mode. The clock is read
+ * straight from the TSC and scaled with the parameters the kernel keeps in
+ * the data page mapped just below this code, giving the same answer the
+ * syscalls would. Anything it can't answer from there goes to the syscall.
+ */
+#include <lilac/types.h>
+#include <asm/vdso.h>
+
+/* The user ABI, the same numbers the syscall table and lilac/timer.h use */
+#define SYS_time                11
+#define SYS_gettimeofday        47
+#define SYS_clock_gettime       102
+#define SYS_clock_getres        103
+#define SYS_getcpu              104
+
+#define CLOCK_REALTIME          0
+#define CLOCK_MONOTONIC         1
+#define CLOCK_MONOTONIC_RAW     4
+#define CLOCK_REALTIME_COARSE   5
+#define CLOCK_MONOTONIC_COARSE  6
+#define CLOCK_BOOTTIME          7
+
+#define NS_PER_SEC              1000000000LL
+
+struct timeval {
+    time_t tv_sec;
+    suseconds_t tv_usec;
+};
+
+struct timezone {
+    int tz_minuteswest;
+    int tz_dsttime;
+};
+
+// Placed by the linker script one page below the start of the image
+extern const volatile struct vdso_data vvar_data
+    __attribute__((visibility("hidden")));
+
+static inline long vsyscall3(long nr, long a, long b, long c)
+{
+    long ret;
+    __asm__ volatile ("syscall"
+        : "=a"(ret)
+        : "a"(nr), "D"(a), "S"(b), "d"(c)
+        : "rcx", "r11", "memory");
+    return ret;
+}
+
+static inline u64 vread_tsc(void)
+{
+    u32 lo, hi;
+    // lfence keeps the read from running ahead of the seq load
+    __asm__ volatile ("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((u64)hi << 32) | lo;
+}
+
+/*
+ * Nanoseconds since boot and the boot time in unix seconds, as
+ * get_sys_time_ns and boot_unix_time. False when the clock can't be read
+ * from user mode.
+ */
+static bool vread_time(s64 *ns, s64 *boot)
+{
+    const volatile struct vdso_data *vd = &vvar_data;
+    u32 seq;
+
+    do {
+        seq = vd->seq;
+        if (seq & 1)
+            continue;
+        if (vd->vclock_mode != VCLOCK_TSC)
+            return false;
+        u64 cycles = vread_tsc() - vd->start_tick;
+        *ns = vd->base_ns +
+            (s64)(((__uint128_t)cycles * vd->mult) >> vd->shift);
+        *boot = vd->boot_unix_time;
+        __asm__ volatile ("" ::: "memory");
+    } while (seq & 1 || seq != vd->seq);
+    return true;
+}
+
+int __vdso_clock_gettime(int which, struct timespec *ts)
+{
+    s64 ns, boot;
+
+    switch (which) {
+        case CLOCK_REALTIME:
+        case CLOCK_REALTIME_COARSE:
+            if (!vread_time(&ns, &boot))
+                break;
+            ns += boot * NS_PER_SEC;
+            ts->tv_sec = ns / NS_PER_SEC;
+            ts->tv_nsec = ns % NS_PER_SEC;
+            return 0;
+        case CLOCK_MONOTONIC:
+        case CLOCK_MONOTONIC_RAW:
+        case CLOCK_MONOTONIC_COARSE:
+        case CLOCK_BOOTTIME:
+            if (!vread_time(&ns, &boot))
+                break;
+            ts->tv_sec = ns / NS_PER_SEC;
+            ts->tv_nsec = ns % NS_PER_SEC;
+            return 0;
+    }
+    return vsyscall3(SYS_clock_gettime, which, (long)ts, 0);
+}
+
+int __vdso_gettimeofday(struct timeval *tv, struct timezone *tz)
+{
+    s64 ns, boot;
+
+    if (!vread_time(&ns, &boot))
+        return vsyscall3(SYS_gettimeofday, (long)tv, (long)tz, 0);
+    if (tv) {
+        tv->tv_sec = boot + ns / NS_PER_SEC;
+        tv->tv_usec = ns / 1000 % 1000000;
+    }
+    if (tz) {
+        tz->tz_minuteswest = 0;
+        tz->tz_dsttime = 0;
+    }
+    return 0;
+}
+
+time_t __vdso_time(time_t *t)
+{
+    s64 ns, boot;
+    time_t now;
+
+    if (!vread_time(&ns, &boot))
+        return vsyscall3(SYS_time, (long)t, 0, 0);
+    now = boot + ns / NS_PER_SEC;
+    if (t)
+        *t = now;
+    return now;
+}
+
+int __vdso_getcpu(unsigned int *cpu, unsigned int *node, void *unused)
+{
+    u32 mode = vvar_data.getcpu_mode;
+    u32 aux;
+
+    if (mode == VGETCPU_RDPID) {
+        u64 val;
+        __asm__ volatile ("rdpid %0" : "=r"(val));
+        aux = (u32)val;
+    } else if (mode == VGETCPU_RDTSCP) {
+        __asm__ volatile ("rdtscp" : "=c"(aux) :: "eax", "edx");
+    } else {
+        return vsyscall3(SYS_getcpu, (long)cpu, (long)node, (long)unused);
+    }
+
+    if (cpu)
+        *cpu = aux;
+    if (node)
+        *node = 0;
+    return 0;
+}
+
+int clock_gettime(int, struct timespec *)
+    __attribute__((weak, alias("__vdso_clock_gettime")));
+int gettimeofday(struct timeval *, struct timezone *)
+    __attribute__((weak, alias("__vdso_gettimeofday")));
+time_t time(time_t *)
+    __attribute__((weak, alias("__vdso_time")));
+int getcpu(unsigned int *, unsigned int *, void *)
+    __attribute__((weak, alias("__vdso_getcpu")));
@@ -1,4 +1,7 @@
-#include <lilac/types.h>
+#include <lilac/lilac.h>
+#include <lilac/timer.h>
+#include <mm/page.h>
+#include <asm/cpu.h>
 
 void x86_memcpy_dwords(void *dst, const void *src, size_t size)
 {
@@ -85,3 +88,257 @@ void x86_memcpy_sse_nt(void *dst, const void *src, size_t size)
     while (size--)
         *d++ = *s++;
 }
+
+/*
+ * memcpy, memset and the page primitives, each picked at boot from the
+ * variants below for what the CPU's string instructions are fast at. Until
+ * then they run the word copies every x86 CPU does well enough.
+ *
+ * rep movsb/stosb are the fastest with ERMS, but without FSRM (or FSRS for
+ * stosb) their startup cost loses to the word copies on the short lengths
+ * most calls are. Whole pages are long enough for ERMS alone. Streaming
+ * stores skip the cache, so they're only used to clear runs of pages too
+ * big to stay cached anyway. Every variant copies forwards.
+ */
+#define MEM_WORDS       0
+#define MEM_ERMS        1
+#define MEM_NT          2
+#define NR_MEM_VARIANTS 3
+
+// Cleared with streaming stores from this many pages up, about an L2
+#define MEM_NT_PAGES    64
+
+#ifdef DEBUG_MEMBENCH
+#define MEM_BENCH_PAGES     64
+#define MEM_BENCH_ROUNDS    16
+#endif
+
+#ifdef __x86_64__
+#define WORD_SUFFIX     "q"
+#else
+#define WORD_SUFFIX     "l"
+#endif
+
+struct mem_variant {
+    const char *name;
+    void (*copy)(void *dst, const void *src, size_t size);
+    void (*fill)(void *dst, int c, size_t size);
+};
+
+static void copy_words(void *dst, const void *src, size_t size)
+{
+    arch_memcpy_opt(dst, src, size);
+}
+
+static void fill_words(void *dst, int c, size_t size)
+{
+    unsigned long pattern = (unsigned long)-1 / 0xff * (u8)c;
+    u8 *d = dst;
+    size_t n;
+
+    while (((uintptr_t)d & (sizeof(long) - 1)) && size > 0) {
+        *d++ = c;
+        size--;
+    }
+
+    n = size / sizeof(long);
+    asm volatile (
+        "rep stos" WORD_SUFFIX
+        : "+D"(d), "+c"(n)
+        : "a"(pattern)
+        : "memory"
+    );
+
+    size %= sizeof(long);
+    while (size--)
+        *d++ = c;
+}
+
+static void copy_movsb(void *dst, const void *src, size_t size)
+{
+    asm volatile (
+        "rep movsb"
+        : "+D"(dst), "+S"(src), "+c"(size)
+        : : "memory"
+    );
+}
+
+static void fill_stosb(void *dst, int c, size_t size)
+{
+    asm volatile (
+        "rep stosb"
+        : "+D"(dst), "+c"(size)
+        : "a"(c)
+        : "memory"
+    );
+}
+
+#ifdef DEBUG_MEMBENCH
+// Only mem_bench copies with streaming stores
+static void copy_nt(void *dst, const void *src, size_t size)
+{
+    u8 *d = dst;
+    const u8 *s = src;
+
+    while (((uintptr_t)d & (sizeof(long) - 1)) && size > 0) {
+        *d++ = *s++;
+        size--;
+    }
+
+    for (; size >= sizeof(long); size -= sizeof(long)) {
+        asm volatile ("movnti %1, %0"
+            : "=m"(*(unsigned long *)d) : "r"(*(const unsigned long *)s));
+        d += sizeof(long);
+        s += sizeof(long);
+    }
+
+    while (size--)
+        *d++ = *s++;
+    // Streaming stores are weakly ordered, fence them before anyone looks
+    asm volatile ("sfence" ::: "memory");
+}
+#endif
+
+static void fill_nt(void *dst, int c, size_t size)
+{
+    unsigned long pattern = (unsigned long)-1 / 0xff * (u8)c;
+    u8 *d = dst;
+
+    while (((uintptr_t)d & (sizeof(long) - 1)) && size > 0) {
+        *d++ = c;
+        size--;
+    }
+
+    for (; size >= sizeof(long); size -= sizeof(long)) {
+        asm volatile ("movnti %1, %0"
+            : "=m"(*(unsigned long *)d) : "r"(pattern));
+        d += sizeof(long);
+    }
+
+    while (size--)
+        *d++ = c;
+    asm volatile ("sfence" ::: "memory");
+}
+
+static const struct mem_variant mem_variants[NR_MEM_VARIANTS] = {
+    [MEM_WORDS] = { "movs" WORD_SUFFIX "/stos" WORD_SUFFIX, copy_words, fill_words },
+    [MEM_ERMS]  = { "movsb/stosb", copy_movsb, fill_stosb },
+#ifdef DEBUG_MEMBENCH
+    [MEM_NT]    = { "movnti", copy_nt, fill_nt },
+#endif
+};
+
+static const struct mem_variant *memcpy_ops = &mem_variants[MEM_WORDS];
+static const struct mem_variant *memset_ops = &mem_variants[MEM_WORDS];
+static const struct mem_variant *page_ops = &mem_variants[MEM_WORDS];
+static bool has_movnti;
+
+// Called once on the boot CPU, before anything else has run much
+void mem_ops_init(void)
+{
+    u32 a, b, c, d, max_sub;
+    bool erms = false, fsrm = false, fsrs = false;
+
+    if (__get_cpuid_count(7, 0, &max_sub, &b, &c, &d)) {
+        erms = b & bit_ERMS;
+        fsrm = d & bit_FSRM;
+        if (max_sub >= 1) {
+            __cpuid_count(7, 1, a, b, c, d);
+            fsrs = a & bit_FSRS;
+        }
+    }
+    __cpuid(1, a, b, c, d);
+    has_movnti = d & bit_SSE2;
+
+    if (erms && fsrm)
+        memcpy_ops = &mem_variants[MEM_ERMS];
+    if (erms && fsrs)
+        memset_ops = &mem_variants[MEM_ERMS];
+    if (erms)
+        page_ops = &mem_variants[MEM_ERMS];
+}
+
+void *memcpy(void *__restrict__ dst, const void *__restrict__ src, size_t size)
+{
+    memcpy_ops->copy(dst, src, size);
+    return dst;
+}
+
+void *memset(void *buf, int val, size_t size)
+{
+    memset_ops->fill(buf, val, size);
+    return buf;
+}
+
+void clear_page(void *page)
+{
+    page_ops->fill(page, 0, PAGE_SIZE);
+}
+
+void clear_pages(void *addr, u32 pgcnt)
+{
+    if (has_movnti && pgcnt >= MEM_NT_PAGES) {
+        fill_nt(addr, 0, (size_t)pgcnt * PAGE_SIZE);
+        return;
+    }
+    for (u32 i = 0; i < pgcnt; i++)
+        clear_page((u8 *)addr + (size_t)i * PAGE_SIZE);
+}
+
+void copy_page(void *dst, const void *src)
+{
+    page_ops->copy(dst, src, PAGE_SIZE);
+}
+
+#ifdef DEBUG_MEMBENCH
+// GB/s in hundredths, which is bytes per ns
+static unsigned long mem_rate(size_t bytes, ktime_t ns)
+{
+    return (unsigned long)((u64)bytes * 100 / (u64)MAX(ns, 1));
+}
+
+/**
+ * Time every variant copying and filling a buffer about the size of an L2,
+ * and log how fast each went. Needs the system clock.
+ */
+void mem_bench(void)
+{
+    size_t size = MEM_BENCH_PAGES * PAGE_SIZE;
+    size_t bytes = size * MEM_BENCH_ROUNDS;
+    u8 *src, *dst;
+
+    src = get_free_pages(2 * MEM_BENCH_PAGES, ALLOC_NORMAL);
+    if (!src) {
+        klog(LOG_WARN, "mem_bench: Out of memory\n");
+        return;
+    }
+    dst = src + size;
+    page_ops->fill(src, 0x5a, size);
+
+    for (int i = 0; i < NR_MEM_VARIANTS; i++) {
+        const struct mem_variant *v = &mem_variants[i];
+        unsigned long copy, fill;
+        ktime_t start;
+
+        if (i == MEM_NT && !has_movnti)
+            continue;
+
+        start = get_sys_time_ns();
+        for (int r = 0; r < MEM_BENCH_ROUNDS; r++)
+            v->copy(dst, src, size);
+        copy = mem_rate(bytes, get_sys_time_ns() - start);
+
+        start = get_sys_time_ns();
+        for (int r = 0; r < MEM_BENCH_ROUNDS; r++)
+            v->fill(dst, 0, size);
+        fill = mem_rate(bytes, get_sys_time_ns() - start);
+
+        klog(LOG_INFO, "mem: %s copy %lu.%02lu GB/s, fill %lu.%02lu GB/s\n",
+            v->name, copy / 100, copy % 100, fill / 100, fill % 100);
+    }
+    klog(LOG_INFO, "mem: memcpy %s, memset %s, pages %s\n",
+        memcpy_ops->name, memset_ops->name, page_ops->name);
+
+    free_pages(src, 2 * MEM_BENCH_PAGES);
+}
+#endif
@@ -12,6 +12,7 @@ extern u32 max_cpuid_leaf;
 void x86_memcpy_dwords(void *dst, const void *src, size_t size);
 void x86_memcpy_qwords(void *dst, const void *src, size_t size);
 void x86_memcpy_sse_nt(void *dst, const void *src, size_t size);
+void mem_ops_init(void);
 
 #ifdef __x86_64__
 void * x64_memcpy_opt(void *dst, const void *src, size_t size);
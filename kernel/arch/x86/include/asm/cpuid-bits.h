@@ -31,6 +31,7 @@
 #define bit_SSSE3	(1 << 9)
 #define bit_FMA		(1 << 12)
 #define bit_CMPXCHG16B	(1 << 13)
+#define bit_PCID	(1 << 17)
 #define bit_SSE4_1	(1 << 19)
 #define bit_SSE4_2	(1 << 20)
 #define bit_MOVBE	(1 << 22)
@@ -78,6 +79,7 @@
 
 /* %edx */
 #define bit_MMXEXT	(1 << 22)
+#define bit_RDTSCP	(1 << 27)
 #define bit_LM		(1 << 29)
 #define bit_3DNOWP	(1 << 30)
 #define bit_3DNOW	(1u << 31)
@@ -95,6 +97,8 @@
 #define bit_AVX2	(1 << 5)
 #define bit_SMEP	(1 << 7)
 #define bit_BMI2	(1 << 8)
+#define bit_ERMS	(1 << 9)
+#define bit_INVPCID	(1 << 10)
 #define bit_RTM		(1 << 11)
 #define bit_AVX512F	(1 << 16)
 #define bit_AVX512DQ	(1 << 17)
@@ -130,6 +134,7 @@
 #define bit_ENQCMD	(1 << 29)
 
 /* %edx */
+#define bit_FSRM	(1 << 4)
 #define bit_UINTR	(1 << 5)
 #define bit_AVX512VP2INTERSECT	(1 << 8)
 #define bit_SERIALIZE	(1 << 14)
@@ -151,6 +156,7 @@
 #define bit_AVX512BF16  (1 << 5)
 #define bit_CMPCCXADD   (1 << 7)
 #define bit_AMX_COMPLEX (1 << 8)
+#define bit_FSRS	(1 << 11)
 #define bit_AMX_FP16    (1 << 21)
 #define bit_HRESET      (1 << 22)
 #define bit_AVXIFMA     (1 << 23)
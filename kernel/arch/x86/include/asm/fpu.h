@@ -0,0 +1,29 @@
+#ifndef _ASM_FPU_H
+#define _ASM_FPU_H
+
+#include <lilac/types.h>
+
+/* XCR0 components the kernel enables for user mode */
+#define XFEATURE_X87    (1 << 0)
+#define XFEATURE_SSE    (1 << 1)
+#define XFEATURE_AVX    (1 << 2)
+
+/* How task FPU state is saved and restored, best the CPU has */
+#define FPU_FXSAVE      0
+#define FPU_XSAVE       1
+#define FPU_XSAVEOPT    2
+#define FPU_XSAVES      3
+
+struct fpu_stats {
+    unsigned long saves;
+    unsigned long restores;
+    unsigned long restores_skipped; /* registers still held the task's state */
+    unsigned long first_uses;       /* #NM traps initializing a task's state */
+};
+
+void fpu_cpu_init(void);
+void fpu_dna(void);
+void fpu_get_stats(struct fpu_stats *stats);
+void print_fpu_stats(void);
+
+#endif
@@ -15,6 +15,7 @@
 #define IA32_MTRR_CAP       0x0FE
 #define IA32_PAT            0x277
 #define IA32_MTRR_DEF_TYPE  0x2ff
+#define IA32_XSS            0xda0
 #define IA32_MTRR_PHYSBASEn(x) (0x200 + 2*(x))
 #define IA32_MTRR_PHYSMASKn(x) (0x201 + 2*(x))
 
@@ -85,6 +85,16 @@ static inline unsigned long read_cr4(void)
     return val;
 }
 
+static inline void write_cr3(unsigned long val)
+{
+    asm volatile ("mov %0, %%cr3" :: "r"(val) : "memory");
+}
+
+static inline void write_cr4(unsigned long val)
+{
+    asm volatile ("mov %0, %%cr4" :: "r"(val) : "memory");
+}
+
 static inline void wbinvd(void)
 {
     asm volatile("wbinvd" ::: "memory");
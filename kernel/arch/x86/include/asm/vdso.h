@@ -0,0 +1,42 @@
+#ifndef X86_VDSO_H
+#define X86_VDSO_H
+
+/*
+ * The vDSO's data page is mapped at VDSO_BASE and its code right after it,
+ * well below the stack and above where the interpreter is loaded.
+ */
+#define VDSO_BASE       0x00007fff00000000ULL
+#define VVAR_SIZE       4096
+
+/* How the vDSO reads the system clock */
+#define VCLOCK_NONE     0   /* it can't, the syscall answers */
+#define VCLOCK_TSC      1
+
+/* How the vDSO finds the cpu, from IA32_TSC_AUX either way */
+#define VGETCPU_NONE    0
+#define VGETCPU_RDTSCP  1
+#define VGETCPU_RDPID   2
+
+#ifndef __ASSEMBLY__
+
+#include <lilac/types.h>
+
+/*
+ * Everything the vDSO needs to turn a clock reading into the time the
+ * kernel would give. Written only by the kernel, under seq like time_seq.
+ */
+struct vdso_data {
+    u32 seq;                /* odd while an update is in progress */
+    u32 vclock_mode;
+    u64 start_tick;         /* clock reading at base_ns */
+    s64 base_ns;
+    u32 mult;
+    u32 shift;
+    s64 boot_unix_time;
+    u64 freq_hz;
+    u32 getcpu_mode;
+};
+
+#endif /* __ASSEMBLY__ */
+
+#endif
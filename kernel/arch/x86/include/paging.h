@@ -42,6 +42,7 @@ typedef u32 pte_t;
 #define PG_HUGE_PAGE       0x80
 #define PG_GLOBAL          0x100
 #define PG_EXEC_DISABLE    (1ULL << 63)
+#define PG_FRAME_MASK      0x000ffffffffff000ULL
 
 #define PG_STRONG_UC (PG_CACHE_DISABLE | PG_WRITE_THROUGH)
 
@@ -72,6 +73,7 @@ void mtrr_dump(void);
 
 #ifdef __x86_64__
 pdpte_t * get_or_alloc_pdpt(pml4e_t *pml4, void *virt, u16 flags);
+pte_t * walk_user_pte(uintptr_t vaddr);
 #endif
 pde_t * get_or_alloc_pd(pdpte_t *pdpt, void *virt, u16 flags);
 pte_t * get_or_alloc_pt(pde_t *pd, void *virt, u16 flags);
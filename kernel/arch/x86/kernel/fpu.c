@@ -0,0 +1,306 @@
+/*
+ * Task FPU/SSE/AVX state. The kernel is built without SSE, so the registers
+ * only ever hold user state, and a CPU's registers keep the last task that
+ * ran user code there until another task's state is loaded over it.
+ *
+ * A task's state is saved when it is switched out with its state live, and
+ * loaded on the way back to user mode only if the registers no longer hold
+ * it. Switching to the idle task or anything that stays in the kernel never
+ * touches the registers. A task that hasn't used the FPU runs with CR0.TS
+ * set and has no save area at all; its first FPU instruction traps to
+ * fpu_dna, which gives it a clean state.
+ *
+ * Saves use the best of XSAVES, XSAVEOPT or XSAVE the CPU has, so the
+ * components left in their init state or untouched since the last restore
+ * aren't written, falling back to FXSAVE without XSAVE.
+ */
+#include <lilac/lilac.h>
+#include <lilac/libc.h>
+#include <lilac/panic.h>
+#include <lilac/percpu.h>
+#include <lilac/process.h>
+#include <lilac/sched.h>
+#include <mm/kmalloc.h>
+#include <asm/cpu-features.h>
+#include <asm/cpu-flags.h>
+#include <asm/fpu.h>
+#include <asm/msr.h>
+#include <asm/regs.h>
+#include <stdatomic.h>
+
+#define FCW_DEFAULT         0x037f
+#define MXCSR_DEFAULT       0x1f80
+#define FXSAVE_MXCSR        24
+#define XSAVE_XCOMP_BV      520
+#define XCOMP_BV_COMPACTED  (1ULL << 63)
+
+#ifdef __x86_64__
+#define FPU_OP(op)          op "64 %0"
+#else
+#define FPU_OP(op)          op " %0"
+#endif
+
+struct fpu_cpu_state {
+    struct task *owner;     /* last task whose state was loaded here */
+    bool ts;                /* CR0.TS, kept here to skip reading CR0 */
+};
+
+static DEFINE_PER_CPU(struct fpu_cpu_state, fpu_state);
+
+static int fpu_mode = FPU_FXSAVE;
+static u32 fpu_size = 512;
+static u64 fpu_xfeatures;
+
+static atomic_ulong fpu_saves;
+static atomic_ulong fpu_restores;
+static atomic_ulong fpu_restores_skipped;
+static atomic_ulong fpu_first_uses;
+
+static inline void xsetbv(u32 reg, u64 val)
+{
+    asm volatile ("xsetbv" :: "c"(reg), "a"((u32)val), "d"((u32)(val >> 32)));
+}
+
+static inline unsigned long fpu_irq_save(void)
+{
+    unsigned long flags;
+    asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void fpu_irq_restore(unsigned long flags)
+{
+    asm volatile ("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
+static inline void fpu_set_ts(struct fpu_cpu_state *st)
+{
+    if (!st->ts) {
+        write_cr0(read_cr0() | X86_CR0_TS);
+        st->ts = true;
+    }
+}
+
+static inline void fpu_clear_ts(struct fpu_cpu_state *st)
+{
+    if (st->ts) {
+        asm volatile ("clts");
+        st->ts = false;
+    }
+}
+
+// True when this CPU's registers hold p's state
+static inline bool fpu_live(struct fpu_cpu_state *st, struct task *p)
+{
+    return st->owner == p && p->fpu_cpu == (int)this_cpu_id();
+}
+
+static void fpu_save(struct fpu_cpu_state *st, struct task *p)
+{
+    u32 lo = (u32)fpu_xfeatures, hi = (u32)(fpu_xfeatures >> 32);
+    void *area = p->fp_regs;
+
+    fpu_clear_ts(st);
+    switch (fpu_mode) {
+        case FPU_XSAVES:
+            asm volatile (FPU_OP("xsaves") : "=m"(*(u8 *)area)
+                : "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_XSAVEOPT:
+            asm volatile (FPU_OP("xsaveopt") : "=m"(*(u8 *)area)
+                : "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_XSAVE:
+            asm volatile (FPU_OP("xsave") : "=m"(*(u8 *)area)
+                : "a"(lo), "d"(hi) : "memory");
+            break;
+        default:
+            asm volatile (FPU_OP("fxsave") : "=m"(*(u8 *)area) :: "memory");
+            break;
+    }
+    atomic_fetch_add_explicit(&fpu_saves, 1, memory_order_relaxed);
+}
+
+static void fpu_restore(struct fpu_cpu_state *st, struct task *p)
+{
+    u32 lo = (u32)fpu_xfeatures, hi = (u32)(fpu_xfeatures >> 32);
+    void *area = p->fp_regs;
+
+    fpu_clear_ts(st);
+    switch (fpu_mode) {
+        case FPU_XSAVES:
+            asm volatile (FPU_OP("xrstors") :: "m"(*(u8 *)area),
+                "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_XSAVEOPT:
+        case FPU_XSAVE:
+            asm volatile (FPU_OP("xrstor") :: "m"(*(u8 *)area),
+                "a"(lo), "d"(hi) : "memory");
+            break;
+        default:
+            asm volatile (FPU_OP("fxrstor") :: "m"(*(u8 *)area) : "memory");
+            break;
+    }
+    st->owner = p;
+    p->fpu_cpu = this_cpu_id();
+}
+
+// A save area that restores to the state a new process starts with
+static void fpu_init_area(void *area)
+{
+    memset(area, 0, fpu_size);
+    *(u16 *)area = FCW_DEFAULT;
+    *(u32 *)((u8 *)area + FXSAVE_MXCSR) = MXCSR_DEFAULT;
+    // A clear XSTATE_BV already puts every component in its init state
+    if (fpu_mode == FPU_XSAVES)
+        *(u64 *)((u8 *)area + XSAVE_XCOMP_BV) =
+            XCOMP_BV_COMPACTED | fpu_xfeatures;
+}
+
+void fpu_cpu_init(void)
+{
+    struct fpu_cpu_state *st = get_cpu_var(fpu_state);
+    u32 a, b, c, d;
+
+    write_cr0((read_cr0() | X86_CR0_MP) & ~(X86_CR0_EM | X86_CR0_TS));
+    st->owner = NULL;
+    st->ts = false;
+
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_XSAVE))
+        return;
+
+    write_cr4(read_cr4() | X86_CR4_OSXSAVE);
+    __cpuid_count(0xd, 0, a, b, c, d);
+    // AVX-512 is left off, its state wouldn't fit a 64 byte aligned kmalloc
+    fpu_xfeatures = a & (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX);
+    xsetbv(0, fpu_xfeatures);
+
+    __cpuid_count(0xd, 1, a, b, c, d);
+    if (a & bit_XSAVES) {
+        wrmsr(IA32_XSS, 0);
+        fpu_mode = FPU_XSAVES;
+    } else if (a & bit_XSAVEOPT) {
+        fpu_mode = FPU_XSAVEOPT;
+    } else {
+        fpu_mode = FPU_XSAVE;
+    }
+
+    // Sizes for the features just enabled, compacted for XSAVES
+    if (fpu_mode == FPU_XSAVES)
+        __cpuid_count(0xd, 1, a, b, c, d);
+    else
+        __cpuid_count(0xd, 0, a, b, c, d);
+    fpu_size = b;
+    assert(fpu_size <= PAGE_SIZE / 2);
+}
+
+/**
+ * Called from the #NM handler when a task runs an FPU instruction with TS
+ * set, which only happens to tasks that haven't used it yet.
+ */
+void fpu_dna(void)
+{
+    struct fpu_cpu_state *st = get_cpu_var(fpu_state);
+    struct task *p = current;
+
+    if (!p->fpu_used) {
+        if (!p->fp_regs)
+            p->fp_regs = kmalloc(fpu_size);
+        if (!p->fp_regs)
+            panic("Out of memory allocating FP regs\n");
+        fpu_init_area(p->fp_regs);
+        p->fpu_used = true;
+        atomic_fetch_add_explicit(&fpu_first_uses, 1, memory_order_relaxed);
+    }
+    fpu_restore(st, p);
+}
+
+// Called with interrupts off as prev is switched out
+void fpu_switch(struct task *prev)
+{
+    struct fpu_cpu_state *st = get_cpu_var(fpu_state);
+
+    // The registers stay as they are, so prev can come back without a load
+    if (prev->fpu_used && fpu_live(st, prev))
+        fpu_save(st, prev);
+}
+
+/**
+ * Make current's state live before it returns to user mode. Leaves
+ * interrupts off, the return to user restores them from its frame.
+ */
+void load_fp_regs(void)
+{
+    struct fpu_cpu_state *st;
+    struct task *p = current;
+
+    arch_disable_interrupts();
+    st = get_cpu_var(fpu_state);
+    if (!p->fpu_used) {
+        fpu_set_ts(st);
+        return;
+    }
+    if (fpu_live(st, p)) {
+        fpu_clear_ts(st);
+        atomic_fetch_add_explicit(&fpu_restores_skipped, 1,
+            memory_order_relaxed);
+        return;
+    }
+    fpu_restore(st, p);
+    atomic_fetch_add_explicit(&fpu_restores, 1, memory_order_relaxed);
+}
+
+void copy_fp_regs(struct task *dst, struct task *src)
+{
+    struct fpu_cpu_state *st;
+    unsigned long flags;
+
+    dst->fp_regs = NULL;
+    dst->fpu_used = false;
+    dst->fpu_cpu = -1;
+    if (!src->fpu_used)
+        return;
+
+    dst->fp_regs = kmalloc(fpu_size);
+    if (!dst->fp_regs)
+        panic("Out of memory allocating FP regs\n");
+
+    // src's latest state may only be in the registers
+    flags = fpu_irq_save();
+    st = get_cpu_var(fpu_state);
+    if (fpu_live(st, src))
+        fpu_save(st, src);
+    fpu_irq_restore(flags);
+
+    memcpy(dst->fp_regs, src->fp_regs, fpu_size);
+    dst->fpu_used = true;
+}
+
+// exec starts over with a clean state, the save area is kept for reuse
+void reset_fp_regs(struct task *p)
+{
+    p->fpu_used = false;
+    p->fpu_cpu = -1;
+}
+
+void fpu_get_stats(struct fpu_stats *stats)
+{
+    if (stats == NULL)
+        return;
+
+    stats->saves = atomic_load(&fpu_saves);
+    stats->restores = atomic_load(&fpu_restores);
+    stats->restores_skipped = atomic_load(&fpu_restores_skipped);
+    stats->first_uses = atomic_load(&fpu_first_uses);
+}
+
+void print_fpu_stats(void)
+{
+    struct fpu_stats stats;
+
+    fpu_get_stats(&stats);
+    klog(LOG_INFO, "fpu: mode=%d size=%u saves=%lu restores=%lu skipped=%lu first_uses=%lu\n",
+        fpu_mode, fpu_size, stats.saves, stats.restores,
+        stats.restores_skipped, stats.first_uses);
+}
@@ -28,6 +28,7 @@ extern u32 mbinfo; // defined in boot asm
 __no_stack_chk
 void kernel_early(void)
 {
+    mem_ops_init();
     gdt_init();
     idt_init();
 
@@ -45,6 +45,7 @@ __noreturn __no_stack_chk
 void x86_64_kernel_early(void)
 {
     set_cpuid_max();
+    mem_ops_init();
     parse_multiboot((uintptr_t)&mbinfo);
 
     serial_init();
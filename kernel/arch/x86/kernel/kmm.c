@@ -4,6 +4,7 @@
 #include <mm/tlb.h>
 #include <lilac/math.h>
 #include <lilac/panic.h>
+#include <lilac/sched.h>
 #include <asm/regs.h>
 #include <asm/cpu-flags.h>
 #include <asm/msr.h>
@@ -46,11 +47,12 @@ uintptr_t arch_get_pgd(void)
 {
     uintptr_t cr3;
     asm volatile("mov %%cr3, %0" : "=r"(cr3));
-    return cr3;
+    return cr3 & ~(uintptr_t)(PAGE_SIZE - 1); // without the PCID
 }
 
 int arch_tlb_flush_mmu(struct tlb_inval *tlb)
 {
+    tlb_mm_changed(tlb->mm ? tlb->mm : current->mm);
     if (tlb->full) {
         __native_flush_tlb();
         return 0;
@@ -112,7 +112,7 @@ static int pde(int index, u16 flags)
     pd[index] = entry;
 
     volatile u32 *pt = ((u32*)0xFFC00000) + (0x400 * index);
-    memset((void*)pt, 0, PAGE_SIZE);
+    clear_page((void*)pt);
 
     // printf("pde %x: %x\n", index, entry);
 
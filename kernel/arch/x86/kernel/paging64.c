@@ -5,6 +5,8 @@
 #include <mm/kmm.h>
 #include <mm/page.h>
 #include <mm/mm.h>
+#include <mm/tlb.h>
+#include <lilac/sched.h>
 
 #include "paging.h"
 
@@ -241,6 +243,10 @@ int unmap_pages(void *virt, int num_pages)
     if (start < end)
         unmap_pdpt_range(pml4e, start, end, kernel_addr);
 
+    if (kernel_addr)
+        tlb_kernel_changed();
+    else
+        tlb_mm_changed(current->mm);
     return 0;
 }
 
@@ -485,6 +491,113 @@ void update_user_page_range(uintptr_t start, size_t size, int flags)
     // Remaining
     if (start < end)
         update_user_pdpt_range(pml4e, start, end, new_flags);
+
+    tlb_mm_changed(current->mm);
+}
+
+// The page directory entry covering vaddr in the current address space
+static pde_t * walk_user_pde(uintptr_t vaddr)
+{
+    pml4e_t *pml4 = (pml4e_t*)ENTRY_ADDR(arch_get_pgd());
+    pml4e_t pml4e = pml4[get_pml4_index(vaddr)];
+    pdpte_t pdpte;
+
+    if (!ENTRY_PRESENT(pml4e))
+        return NULL;
+    pdpte = ((pdpte_t*)ENTRY_ADDR(pml4e))[get_pdpt_index(vaddr)];
+    if (!ENTRY_PRESENT(pdpte) || (pdpte & PG_HUGE_PAGE))
+        return NULL;
+    return (pde_t*)ENTRY_ADDR(pdpte) + get_pd_index(vaddr);
+}
+
+// The 4K page table entry for vaddr in the current address space, or NULL
+pte_t * walk_user_pte(uintptr_t vaddr)
+{
+    pde_t *pde = walk_user_pde(vaddr);
+
+    if (!pde || !ENTRY_PRESENT(*pde) || (*pde & PG_HUGE_PAGE))
+        return NULL;
+    return (pte_t*)ENTRY_ADDR(*pde) + get_pt_index(vaddr);
+}
+
+// Whether a page, even PROT_NONE, is mapped at user address vaddr
+bool user_page_mapped(uintptr_t vaddr)
+{
+    pte_t *pte = walk_user_pte(vaddr);
+    return pte && (*pte & (PG_PRESENT | PG_PROT_NONE));
+}
+
+/*
+ * Clear the dirty bit of the user page mapped at vaddr in the current
+ * address space. Returns the page if it was dirty, otherwise NULL. The
+ * caller holds the page_table_lock.
+ */
+struct page * clear_user_page_dirty(uintptr_t vaddr)
+{
+    pte_t *pte = walk_user_pte(vaddr);
+
+    if (!pte || !ENTRY_PRESENT(*pte) || !(*pte & PG_DIRTY))
+        return NULL;
+
+    *pte &= ~(pte_t)PG_DIRTY;
+    __native_flush_tlb_single((void*)vaddr);
+    // Another CPU's cached entry would store without setting the bit again
+    tlb_mm_changed(current->mm);
+    return phys_to_page(PT_ADDR(*pte));
+}
+
+/*
+ * Move the user mappings in [old, old + size) to start at new, both in the
+ * current address space and new being empty. Entries move as they are, so
+ * frames, flags and dirty bits go along and no data is copied. Where both
+ * ranges cover a whole page table, the table itself is moved. The caller
+ * holds the page_table_lock and flushes the old range from the TLB.
+ */
+void move_user_page_range(uintptr_t old, uintptr_t new, size_t size)
+{
+    pml4e_t *pml4 = (pml4e_t*)ENTRY_ADDR(arch_get_pgd());
+    const u16 flags = PG_USER | PG_WRITE | PG_PRESENT;
+    uintptr_t end = old + size;
+
+    if (end > __USER_MAX_ADDR + 1 || new + size > __USER_MAX_ADDR + 1)
+        panic("Tried to move kernel addr range: %p -> %p\n", (void*)old, (void*)new);
+
+    while (old < end) {
+        pde_t *src_pde = walk_user_pde(old);
+        uintptr_t next = pde_addr_end(old, end);
+
+        if (!src_pde || !ENTRY_PRESENT(*src_pde)) {
+            new += next - old;
+            old = next;
+            continue;
+        }
+
+        // Both sides cover a whole table, move the table
+        if (!(old & (PDE_SIZE - 1)) && !(new & (PDE_SIZE - 1)) &&
+                next - old == PDE_SIZE) {
+            pde_t *pd = get_or_alloc_pd(get_or_alloc_pdpt(pml4, (void*)new, flags),
+                (void*)new, flags);
+            pde_t *dst_pde = pd + get_pd_index(new);
+            if (!ENTRY_PRESENT(*dst_pde)) {
+                *dst_pde = *src_pde;
+                *src_pde = 0;
+                new += PDE_SIZE;
+                old = next;
+                continue;
+            }
+        }
+
+        pte_t *src = (pte_t*)ENTRY_ADDR(*src_pde) + get_pt_index(old);
+        for (; old < next; old += PAGE_SIZE, new += PAGE_SIZE, src++) {
+            if (!*src)
+                continue;
+            pdpte_t *pdpt = get_or_alloc_pdpt(pml4, (void*)new, flags);
+            pde_t *pd = get_or_alloc_pd(pdpt, (void*)new, flags);
+            pte_t *pt = get_or_alloc_pt(pd, (void*)new, flags);
+            pt[get_pt_index(new)] = *src;
+            *src = 0;
+        }
+    }
 }
 
 static pdpte_t phys_map_pdpt[ENTRIES_PER_TABLE] __align(PAGE_SIZE);
@@ -2,6 +2,7 @@
 // GPL-3.0-or-later (see LICENSE.txt)
 #include <lilac/lilac.h>
 #include <lilac/process.h>
+#include <lilac/fs.h>
 #include <lilac/libc.h>
 #include <lilac/rwsem.h>
 #include <lilac/sched.h>
@@ -112,10 +113,14 @@ void arch_unmap_all_user_vm(struct mm_info *info)
 
     klog(LOG_DEBUG, "Unmapping all user VM for mm %p\n", info);
     mmap_write_lock(info);
+    struct vm_desc *desc;
+
+    // Shared file pages are written back while their dirty bits still exist
+    for (desc = info->mmap; desc; desc = desc->vm_next)
+        vma_writeback(desc, desc->start, desc->end);
+
     acquire_lock(&info->page_table_lock);
-    struct vm_desc *desc = info->mmap;
-    while (desc) {
-        struct vm_desc *next = desc->vm_next;
+    for (desc = info->mmap; desc; desc = desc->vm_next) {
     #ifdef DEBUG_MM
         mm_dbg_unmap_requested_pages += (desc->end - desc->start) / PAGE_SIZE;
     #endif
@@ -127,12 +132,18 @@ void arch_unmap_all_user_vm(struct mm_info *info)
         } else {
             drop_user_page_range(desc->start, desc->end - desc->start);
         }
-        kfree(desc);
-        desc = next;
     }
     arch_tlb_flush_mmu(&tlb);
+    desc = info->mmap;
     info->mmap = NULL;
     release_lock(&info->page_table_lock);
+
+    // Putting the last reference to a file can sleep, so not under the lock
+    while (desc) {
+        struct vm_desc *next = desc->vm_next;
+        vma_free(desc);
+        desc = next;
+    }
     mmap_write_unlock(info);
 }
 
@@ -146,10 +157,39 @@ void arch_reclaim_mem(struct task *p)
 
 
 #ifdef __x86_64__
+// Shared file mappings keep mapping the same page cache frames in the child
+static void share_vm_area(void *cr3, struct vm_desc *new_desc)
+{
+    u64 flags = PG_USER | PG_PRESENT;
+
+    if (!(new_desc->vm_flags & VM_PROT_MASK))
+        return;
+    if (new_desc->vm_flags & VM_WRITE)
+        flags |= PG_WRITE;
+    if (!(new_desc->vm_flags & VM_EXEC))
+        flags |= PG_EXEC_DISABLE;
+
+    for (uintptr_t addr = new_desc->start; addr < new_desc->end; addr += PAGE_SIZE) {
+        void *virt = (void*)addr;
+        pte_t *src = walk_user_pte(addr);
+        if (!src || !(*src & PG_PRESENT))
+            continue;
+
+        pml4e_t *pml4 = (pml4e_t*)cr3;
+        pdpte_t *pdpt = get_or_alloc_pdpt(pml4, virt, PG_USER | PG_WRITE | PG_PRESENT);
+        pde_t *pd = get_or_alloc_pd(pdpt, virt, PG_USER | PG_WRITE | PG_PRESENT);
+        pte_t *pt = get_or_alloc_pt(pd, virt, PG_USER | PG_WRITE | PG_PRESENT);
+
+        get_page(phys_to_page(*src & PG_FRAME_MASK));
+        pt[get_pt_index(virt)] = (*src & PG_FRAME_MASK) | flags;
+    }
+}
+
 static void copy_vm_area(void *cr3, struct vm_desc *new_desc)
 {
     int num_pages = PAGE_ROUND_UP(new_desc->end - new_desc->start) / PAGE_SIZE;
-    uintptr_t phys = virt_to_phys(get_zeroed_pages(num_pages, ALLOC_NORMAL));
+    // Every page is copied or cleared below, so no need to zero them first
+    uintptr_t phys = virt_to_phys(get_free_pages(num_pages, ALLOC_NORMAL));
 #ifdef DEBUG_MM
     mm_dbg_fork_copy_pages_alloc += num_pages;
 #endif
@@ -160,13 +200,15 @@ static void copy_vm_area(void *cr3, struct vm_desc *new_desc)
             uintptr_t src_phys = __walk_pages(virt);
             void *dst = phys_mem_mapping + phys + i * PAGE_SIZE;
             if (src_phys)
-                memcpy(dst, phys_mem_mapping + src_phys, PAGE_SIZE);
+                copy_page(dst, phys_mem_mapping + src_phys);
             else
-                memset(dst, 0, PAGE_SIZE);
+                clear_page(dst);
         }
     } else {
         asm ("stac\n\t");
-        memcpy((unsigned char*)phys_mem_mapping + phys, (void*)new_desc->start, num_pages * PAGE_SIZE);
+        for (int i = 0; i < num_pages; i++)
+            copy_page(phys_mem_mapping + phys + i * PAGE_SIZE,
+                (void*)(new_desc->start + i * PAGE_SIZE));
         asm ("clac\n\t");
     }
 
@@ -218,10 +260,15 @@ struct mm_info *arch_copy_mmap(struct mm_info *parent)
         new_desc->mm = child;
         new_desc->vm_next = NULL;
         new_desc->vm_prev = NULL;
+        vma_get_file(new_desc);
         vma_list_insert(new_desc, &child->mmap);
         desc = desc->vm_next;
 
-        copy_vm_area((void*)cr3, new_desc);
+        if (new_desc->vm_file &&
+                (new_desc->vm_flags & (VM_SHARED | VM_IO)) == VM_SHARED)
+            share_vm_area((void*)cr3, new_desc);
+        else
+            copy_vm_area((void*)cr3, new_desc);
     }
 
     return child;
@@ -250,17 +297,20 @@ struct mm_info *arch_copy_mmap(struct mm_info *parent)
         new_desc->mm = child;
         new_desc->vm_next = NULL;
         new_desc->vm_prev = NULL;
+        vma_get_file(new_desc);
         vma_list_insert(new_desc, &child->mmap);
         desc = desc->vm_next;
 
         int num_pages = PAGE_ROUND_UP(new_desc->end - new_desc->start) / PAGE_SIZE;
-        uintptr_t phys = virt_to_phys(get_zeroed_pages(num_pages, ALLOC_NORMAL));
+        uintptr_t phys = virt_to_phys(get_free_pages(num_pages, ALLOC_NORMAL));
     #ifdef DEBUG_MM
         mm_dbg_fork_copy_pages_alloc += num_pages;
     #endif
 
         // Copy data
-        memcpy(phys_to_virt(phys), (void*)new_desc->start, num_pages * PAGE_SIZE);
+        for (int i = 0; i < num_pages; i++)
+            copy_page((u8*)phys_to_virt(phys) + i * PAGE_SIZE,
+                (void*)(new_desc->start + i * PAGE_SIZE));
 
         for (int i = 0; i < num_pages; i++) {
             u32 pdindex = PG_DIR_INDEX(new_desc->start + i * PAGE_SIZE);
@@ -313,44 +363,6 @@ void arch_set_user_sp(struct task *p, void *sp)
     regs->sp = (uintptr_t)sp;
 }
 
-void save_fp_regs(struct task *p)
-{
-    if (!p->fp_regs)
-        p->fp_regs = kzmalloc(512);
-    if (!p->fp_regs)
-        panic("Out of memory allocating FP regs\n");
-#ifdef __x86_64__
-    __builtin_ia32_fxsave64(p->fp_regs);
-#else
-    __builtin_ia32_fxsave(p->fp_regs);
-#endif
-    // set TS flag
-    // write_cr0(read_cr0() | X86_CR0_TS);
-}
-
-// TODO mem leaks
-void copy_fp_regs(struct task *dst, struct task *src)
-{
-    dst->fp_regs = kmalloc(512);
-    if (!src->fp_regs)
-        save_fp_regs(src);
-    if (!dst->fp_regs || !src->fp_regs)
-        panic("FP regs not allocated for copy\n");
-    memcpy(dst->fp_regs, src->fp_regs, 512);
-}
-
-void restore_fp_regs(struct task *p)
-{
-    if (p->fp_regs == NULL)
-        return;
-#ifdef __x86_64__
-    __builtin_ia32_fxrstor64(p->fp_regs);
-#else
-    __builtin_ia32_fxrstor(p->fp_regs);
-#endif
-    // asm ("clts");
-}
-
 __section(".sigtramp") __noreturn
 void sigtramp(void)
 {
@@ -3,8 +3,11 @@
 #include <lilac/percpu.h>
 #include <lilac/timer.h>
 #include <lilac/sched.h>
+#include <lilac/vdso.h>
 #include <mm/kmm.h>
 #include <mm/page.h>
+#include <mm/tlb.h>
+#include <asm/fpu.h>
 
 #include <asm/segments.h>
 #include <asm/msr.h>
@@ -33,15 +36,20 @@ static inline void swapgs(void)
     asm volatile ("swapgs");
 }
 
-uintptr_t __per_cpu_offset[CONFIG_MAX_CPUS];
+extern struct task __rootp;
 
+uintptr_t __per_cpu_offset[CONFIG_MAX_CPUS] = {
+    [0] = (uintptr_t)&_percpu_load,
+};
+
+// self is filled in by the boot code, the linked address here is 0
 __section(PERCPU_SECTION".first") __used
 struct cpu_local cpu_local_storage = {
-    .self = &cpu_local_storage,
     .priv = nullptr,
     .id = 0,
     .scratch = 0,
-    .user_stack = nullptr
+    .user_stack = nullptr,
+    .curr = &__rootp,
 };
 
 __align(16)
@@ -159,7 +167,7 @@ void percpu_mem_init(void)
     for (int cpu = 1; cpu < cpu_count; cpu++) {
         void *area = alloc_percpu_area(alloc_size / PAGE_SIZE);
 
-        memcpy(area, &_percpu_start, mem_region_size);
+        memcpy(area, &_percpu_load, mem_region_size);
 
         if (alloc_size > mem_region_size)
             memset((char *)area + mem_region_size, 0, alloc_size - mem_region_size);
@@ -167,11 +175,11 @@ void percpu_mem_init(void)
         /* set the self-pointer at offset 0 so mov %gs:0 returns 'area' */
         *((uintptr_t *)area) = (uintptr_t)area;
 
-        __per_cpu_offset[cpu] = (uintptr_t)area - (uintptr_t)&_percpu_start;
+        __per_cpu_offset[cpu] = (uintptr_t)area;
         klog(LOG_DEBUG, "Per-CPU area for CPU %d: %p (offset %lx)\n",
              cpu, area, __per_cpu_offset[cpu]);
     }
-    unmap_pages(&_percpu_start, alloc_size / PAGE_SIZE);
+    unmap_pages(&_percpu_load, alloc_size / PAGE_SIZE);
 }
 
 void percpu_bsp_mem_init(void)
@@ -184,7 +192,7 @@ void percpu_bsp_mem_init(void)
 
     void *area = alloc_percpu_area(alloc_size / PAGE_SIZE);
 
-    memcpy(area, &_percpu_start, mem_region_size);
+    memcpy(area, &_percpu_load, mem_region_size);
 
     if (alloc_size > mem_region_size)
         memset((char *)area + mem_region_size, 0, alloc_size - mem_region_size);
@@ -192,7 +200,7 @@ void percpu_bsp_mem_init(void)
     /* set the self-pointer at offset 0 so mov %gs:0 returns 'area' */
     *((uintptr_t *)area) = (uintptr_t)area;
 
-    __per_cpu_offset[0] = (uintptr_t)area - (uintptr_t)&_percpu_start;
+    __per_cpu_offset[0] = (uintptr_t)area;
     klog(LOG_DEBUG, "Per-CPU area for CPU 0: %p (offset %lx)\n",
             area, __per_cpu_offset[0]);
     percpu_init_cpu(0);
@@ -202,8 +210,8 @@ void percpu_bsp_mem_init(void)
 
 void percpu_bsp_mem_init(void)
 {
-    __per_cpu_offset[0] = 0;
-    klog(LOG_DEBUG, "Per-CPU area for CPU 0: %p (offset %lx)\n", &_percpu_start, __per_cpu_offset[0]);
+    __per_cpu_offset[0] = (uintptr_t)&_percpu_load;
+    klog(LOG_DEBUG, "Per-CPU area for CPU 0: %p (offset %lx)\n", &_percpu_load, __per_cpu_offset[0]);
     percpu_init_cpu(0);
 }
 
@@ -214,7 +222,7 @@ void percpu_mem_init(void) {}
 void percpu_init_cpu(int cpu_id)
 {
     u8 lapicid = get_lapic_id();
-    uintptr_t base = (uintptr_t)&_percpu_start + per_cpu_offset(cpu_id);
+    uintptr_t base = per_cpu_offset(cpu_id);
 #ifdef __x86_64__
     set_gs_base(base);
 #else
@@ -222,9 +230,13 @@ void percpu_init_cpu(int cpu_id)
 #endif
 
     struct cpu_local *local = (struct cpu_local *)base;
+    local->self = local;
     local->id = cpu_id;
     local->lapic_id = lapicid;
     local->priv = get_tss(cpu_id);
+    vdso_cpu_init(cpu_id);
+    tlb_cpu_init();
+    fpu_cpu_init();
 
     klog(LOG_DEBUG, "Initialized cpu local struct for CPU %d at %p\n", cpu_id, (void*)base);
 }
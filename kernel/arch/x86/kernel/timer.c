@@ -16,6 +16,7 @@
 #include <asm/apic.h>
 #include <asm/idt.h>
 #include <asm/io.h>
+#include <asm/vdso.h>
 #include <x86gprintrin.h>
 
 #define PIT_FREQUENCY 1193182
@@ -35,6 +36,9 @@ static struct clock_source tsc_clock = {
     .read = tsc_read,
     .freq_hz = 0,
     .scale = { .mult = 0, .shift = 0 },
+#ifdef __x86_64__
+    .vclock_mode = VCLOCK_TSC,
+#endif
 };
 
 static struct clock_source hpet_clock = {
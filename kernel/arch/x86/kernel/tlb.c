@@ -0,0 +1,209 @@
+/*
+ * PCID tagged address spaces. Each CPU hands out the non-zero PCIDs to the
+ * mms that run on it, so switching back to a recently run process finds
+ * its TLB entries still there instead of refilling them from scratch.
+ *
+ * A CPU that runs out of PCIDs starts a new generation: it drops every
+ * tagged entry at once and mms get a fresh PCID the next time they run
+ * there. Within a generation a PCID is only ever given to one mm, so a
+ * new one never holds anything stale. PCID 0 is the boot page tables'.
+ *
+ * Nothing shoots down other CPUs' TLBs, they used to drop everything at
+ * their next CR3 load. Generation counts keep that promise: a flush of an
+ * mm's user mappings bumps its tlb_gen, an unmap in the kernel bumps
+ * kernel_tlb_gen, and a CPU that missed either flushes on its next switch.
+ */
+#include <lilac/lilac.h>
+#include <lilac/percpu.h>
+#include <lilac/process.h>
+#include <lilac/sched.h>
+#include <mm/mm.h>
+#include <mm/tlb.h>
+#include <asm/cpu-features.h>
+#include <asm/cpu-flags.h>
+#include <asm/regs.h>
+#include <stdatomic.h>
+
+#ifdef __x86_64__
+
+#define PCID_MAX        4095
+#define CR3_NOFLUSH     (1UL << 63)
+
+#define INVPCID_ALL_NON_GLOBAL  3
+
+struct pcid_state {
+    u32 gen;            /* 0 until PCIDs are enabled on this CPU */
+    u16 next;           /* next PCID to hand out in this generation */
+    u16 loaded;         /* PCID in CR3 */
+    unsigned long kernel_gen;
+};
+
+static DEFINE_PER_CPU(struct pcid_state, pcid_state);
+static bool has_invpcid;
+
+static atomic_ulong kernel_tlb_gen;
+static atomic_ulong tlb_switches;
+static atomic_ulong tlb_switches_warm;
+static atomic_ulong tlb_rollovers;
+static atomic_ulong tlb_kernel_flushes;
+
+static inline void invpcid(unsigned long type, u16 pcid, uintptr_t addr)
+{
+    struct { u64 pcid, addr; } desc = { pcid, addr };
+    asm volatile ("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
+// Drop the non-global entries of every PCID on this CPU
+static void flush_tlb_all_pcids(void)
+{
+    unsigned long cr4;
+
+    if (has_invpcid) {
+        invpcid(INVPCID_ALL_NON_GLOBAL, 0, 0);
+        return;
+    }
+    // Toggling PGE flushes everything, global entries and all PCIDs
+    cr4 = read_cr4();
+    write_cr4(cr4 ^ X86_CR4_PGE);
+    write_cr4(cr4);
+}
+
+static void pcid_new_generation(struct pcid_state *st)
+{
+    flush_tlb_all_pcids();
+    st->gen++;
+    st->next = 1;
+}
+
+void tlb_cpu_init(void)
+{
+    struct pcid_state *st = get_cpu_var(pcid_state);
+    u32 a, b, c, d;
+
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_PCID))
+        return;
+    __cpuid_count(7, 0, a, b, c, d);
+    has_invpcid = b & bit_INVPCID;
+
+    // Only allowed while CR3 holds PCID 0, which the boot tables do
+    write_cr4(read_cr4() | X86_CR4_PCIDE);
+    st->gen = 1;
+    st->next = 1;
+    st->loaded = 0;
+    st->kernel_gen = atomic_load(&kernel_tlb_gen);
+}
+
+/**
+ * Load next's page tables on this CPU, with interrupts off. The TLB keeps
+ * next's entries from its last run here unless something was unmapped
+ * since, and switching between tasks of one mm doesn't touch CR3 at all.
+ */
+void arch_switch_mm(struct task *next)
+{
+    struct pcid_state *st = get_cpu_var(pcid_state);
+    struct mm_info *mm = next->mm;
+    struct mm_tlb_ctx *ctx;
+    unsigned long kgen, tgen;
+    bool flush = false;
+
+    atomic_fetch_add_explicit(&tlb_switches, 1, memory_order_relaxed);
+    if (!st->gen || !mm) {
+        st->loaded = 0;
+        write_cr3(next->pgd);
+        return;
+    }
+
+    kgen = atomic_load(&kernel_tlb_gen);
+    if (st->kernel_gen != kgen) {
+        atomic_fetch_add_explicit(&tlb_kernel_flushes, 1, memory_order_relaxed);
+        pcid_new_generation(st);
+        st->kernel_gen = kgen;
+    }
+
+    ctx = &mm->tlb_ctx[this_cpu_id()];
+    tgen = atomic_load(&mm->tlb_gen);
+    if (ctx->asid_gen == st->gen) {
+        flush = ctx->tlb_gen != tgen;
+        if (!flush)
+            atomic_fetch_add_explicit(&tlb_switches_warm, 1,
+                memory_order_relaxed);
+        if (!flush && st->loaded == ctx->asid)
+            return;
+    } else {
+        if (st->next > PCID_MAX) {
+            atomic_fetch_add_explicit(&tlb_rollovers, 1, memory_order_relaxed);
+            pcid_new_generation(st);
+        }
+        ctx->asid_gen = st->gen;
+        ctx->asid = st->next++;
+    }
+
+    ctx->tlb_gen = tgen;
+    st->loaded = ctx->asid;
+    write_cr3(next->pgd | ctx->asid | (flush ? 0 : CR3_NOFLUSH));
+}
+
+/*
+ * Call after flushing mm's user mappings from this CPU's TLB. Other CPUs
+ * holding entries for mm flush them when they next switch to it.
+ */
+void tlb_mm_changed(struct mm_info *mm)
+{
+    struct pcid_state *st = get_cpu_var(pcid_state);
+    struct mm_tlb_ctx *ctx;
+    unsigned long gen;
+
+    if (!mm)
+        return;
+    ctx = &mm->tlb_ctx[this_cpu_id()];
+    gen = atomic_fetch_add(&mm->tlb_gen, 1) + 1;
+
+    // This CPU only stays current if it was, and mm is the one in CR3
+    if (ctx->asid_gen == st->gen && st->loaded == ctx->asid &&
+            current->mm == mm && ctx->tlb_gen == gen - 1)
+        ctx->tlb_gen = gen;
+}
+
+// Call after removing a kernel mapping, every other PCID may still hold it
+void tlb_kernel_changed(void)
+{
+    atomic_fetch_add(&kernel_tlb_gen, 1);
+}
+
+void tlb_get_stats(struct tlb_stats *stats)
+{
+    if (stats == NULL)
+        return;
+
+    stats->switches = atomic_load(&tlb_switches);
+    stats->switches_warm = atomic_load(&tlb_switches_warm);
+    stats->rollovers = atomic_load(&tlb_rollovers);
+    stats->kernel_flushes = atomic_load(&tlb_kernel_flushes);
+}
+
+#else
+
+// 32-bit has no PCIDs, the switch itself reloads CR3
+void arch_switch_mm(struct task *next) {}
+void tlb_mm_changed(struct mm_info *mm) {}
+void tlb_kernel_changed(void) {}
+void tlb_cpu_init(void) {}
+
+void tlb_get_stats(struct tlb_stats *stats)
+{
+    if (stats)
+        *stats = (struct tlb_stats){ 0 };
+}
+
+#endif
+
+void print_tlb_stats(void)
+{
+    struct tlb_stats stats;
+
+    tlb_get_stats(&stats);
+    klog(LOG_INFO, "tlb: switches=%lu warm=%lu rollovers=%lu kernel_flushes=%lu\n",
+        stats.switches, stats.switches_warm, stats.rollovers,
+        stats.kernel_flushes);
+}
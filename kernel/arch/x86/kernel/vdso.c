@@ -0,0 +1,159 @@
+/*
+ * The vDSO and the data page it reads the clock from. Both live in one
+ * sealed tmpfs file made at boot, the data page first and the image after
+ * it, which every process maps shared and read-only at VDSO_BASE. Fork
+ * shares the frames like any shared file mapping, and the write seal keeps
+ * mprotect from ever making them writable. The kernel updates the data
+ * page through its own mapping of the frame.
+ */
+#include <lilac/vdso.h>
+#include <lilac/fs.h>
+#include <lilac/fcntl.h>
+#include <lilac/memfd.h>
+#include <lilac/timer.h>
+#include <lilac/log.h>
+#include <lilac/err.h>
+#include <lilac/libc.h>
+#include <mm/kmm.h>
+#include <mm/mm.h>
+#include <mm/page.h>
+#include <asm/cpu-features.h>
+#include <asm/msr.h>
+#include <asm/vdso.h>
+#include <stdatomic.h>
+
+extern const char vdso_start[], vdso_end[];
+
+static struct file *vdso_file;
+static struct vdso_data *vdso_data;
+static unsigned long vdso_pages;    /* image pages, after the data page */
+
+static u32 vgetcpu_mode(void)
+{
+    u32 a, b, c, d;
+
+    __cpuid_count(7, 0, a, b, c, d);
+    if (c & bit_RDPID)
+        return VGETCPU_RDPID;
+    __cpuid(0x80000001, a, b, c, d);
+    if (d & bit_RDTSCP)
+        return VGETCPU_RDTSCP;
+    return VGETCPU_NONE;
+}
+
+// rdtscp and rdpid give user mode the cpu number from IA32_TSC_AUX
+void vdso_cpu_init(int cpu)
+{
+    if (vgetcpu_mode() != VGETCPU_NONE)
+        write_msr(IA32_TSC_AUX, (u32)cpu, 0);
+}
+
+// Called with the clock write lock held, whenever the system clock changes
+void vdso_update_clock(struct clock_source *cs, ktime_t base_ns)
+{
+    struct vdso_data *vd = vdso_data;
+    u32 seq;
+
+    if (!vd)
+        return;
+
+    seq = READ_ONCE(vd->seq);
+    WRITE_ONCE(vd->seq, seq + 1);
+    atomic_thread_fence(memory_order_acq_rel);
+
+    vd->vclock_mode = cs->vclock_mode;
+    vd->start_tick = cs->start_tick;
+    vd->base_ns = base_ns;
+    vd->mult = cs->scale.mult;
+    vd->shift = cs->scale.shift;
+    vd->freq_hz = cs->freq_hz;
+    vd->boot_unix_time = boot_unix_time;
+
+    atomic_thread_fence(memory_order_release);
+    WRITE_ONCE(vd->seq, seq + 2);
+}
+
+static int vdso_fill(struct inode *inode)
+{
+    const struct address_space_operations *a_ops = inode->i_data.a_ops;
+    size_t size = vdso_end - vdso_start;
+    struct page *pg;
+
+    // The data page stays referenced for as long as the kernel writes it
+    pg = a_ops->fault_page(inode, 0);
+    if (!pg)
+        return -ENOMEM;
+    vdso_data = get_page_addr(pg);
+
+    for (unsigned long i = 0; i < vdso_pages; i++) {
+        size_t off = i * PAGE_SIZE;
+
+        pg = a_ops->fault_page(inode, i + 1);
+        if (!pg)
+            return -ENOMEM;
+        memcpy(get_page_addr(pg), vdso_start + off, MIN(size - off, PAGE_SIZE));
+        put_page(pg);
+    }
+    return 0;
+}
+
+void vdso_init(void)
+{
+    struct file *file;
+    int err;
+
+    vdso_pages = PAGE_UP_COUNT(vdso_end - vdso_start);
+    file = memfd_alloc_file("[vdso]", MFD_ALLOW_SEALING);
+    if (IS_ERR(file)) {
+        klog(LOG_ERROR, "vdso_init: Failed to create the vDSO file: %ld\n",
+            PTR_ERR(file));
+        return;
+    }
+
+    err = vfs_ftruncate(file, (1 + vdso_pages) * PAGE_SIZE);
+    if (err >= 0)
+        err = vdso_fill(file->f_dentry->d_inode);
+    if (err >= 0)
+        err = memfd_fcntl(file, F_ADD_SEALS,
+            F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+    if (err < 0) {
+        klog(LOG_ERROR, "vdso_init: Failed to set up the vDSO: %d\n", err);
+        vdso_data = NULL;
+        fput(file);
+        return;
+    }
+
+    vdso_data->getcpu_mode = vgetcpu_mode();
+    vdso_file = file;
+    clock_sync_vdso();
+    klog(LOG_INFO, "vDSO: %lu pages, clock mode %u, getcpu mode %u\n",
+        vdso_pages, vdso_data->vclock_mode, vdso_data->getcpu_mode);
+}
+
+/**
+ * Map the data page and the vDSO into mm, with its mmap write lock held.
+ * Returns the address of the image for AT_SYSINFO_EHDR, or 0 if there is no
+ * vDSO and user space has to make the syscalls.
+ */
+uintptr_t vdso_map(struct mm_info *mm)
+{
+    uintptr_t text = VDSO_BASE + VVAR_SIZE;
+    int err;
+
+    if (!vdso_file)
+        return 0;
+
+    err = mm_map_file(mm, VDSO_BASE, VVAR_SIZE, VM_READ | VM_SHARED,
+        vdso_file, 0);
+    if (err < 0)
+        goto fail;
+    err = mm_map_file(mm, text, vdso_pages * PAGE_SIZE,
+        VM_READ | VM_EXEC | VM_SHARED, vdso_file, VVAR_SIZE);
+    if (err < 0)
+        goto fail;
+    return text;
+
+fail:
+    klog(LOG_WARN, "vdso_map: Failed to map the vDSO: %d\n", err);
+    return 0;
+}
@@ -33,6 +33,12 @@ static int get_part_type(struct gendisk *disk,
     if (buf[510] == 0x55 && buf[511] == 0xAA) {
         return MSDOS;
     }
+
+    // ext2 superblock starts 1024 bytes in, magic 0xEF53 at offset 56
+    disk->ops->disk_read(disk, part->starting_lba + 2, buf, 1);
+    if (buf[56] == 0x53 && buf[57] == 0xEF) {
+        return EXT2;
+    }
     return -1;
 }
 
@@ -123,6 +129,33 @@ struct block_device *get_bdev(int major)
     return NULL;
 }
 
+/*
+ * Find a partition by name: "sda2" (optionally with a "/dev/" prefix) is
+ * the second partition found on the first disk.
+ */
+struct block_device *lookup_bdev(const char *name)
+{
+    struct block_device *bdev;
+    int disk, part = 0;
+
+    if (!name)
+        return NULL;
+    if (!strncmp(name, "/dev/", 5))
+        name += 5;
+    if (strncmp(name, "sd", 2) || name[2] < 'a' || name[2] > 'z')
+        return NULL;
+
+    disk = name[2] - 'a';
+    for (name += 3; *name >= '0' && *name <= '9'; name++)
+        part = part * 10 + (*name - '0');
+    if (*name || part < 1 || disk >= num_disks)
+        return NULL;
+
+    for (bdev = disks[disk]->partitions; bdev && --part; bdev = bdev->next)
+        ;
+    return bdev;
+}
+
 __must_check
 static int create_block_dev(struct gendisk *disk,
     const struct gpt_part_entry *part_entry, int num)
@@ -4,6 +4,7 @@
 #include <lilac/sched.h>
 #include <lilac/device.h>
 #include <lilac/fs.h>
+#include <lilac/poll.h>
 #include <lilac/console.h>
 #include <lilac/syscall.h>
 #include <lilac/uaccess.h>
@@ -11,20 +12,22 @@
 #include <drivers/keyboard.h>
 
 
-ssize_t tty_read(struct file *f, void *buf, size_t count);
-ssize_t tty_write(struct file *f, const void *buf, size_t count);
+ssize_t tty_read(struct file *f, struct iov_iter *to, off_t *ppos);
+ssize_t tty_write(struct file *f, struct iov_iter *from, off_t *ppos);
 int tty_open(struct inode *inode, struct file *file);
 int tty_release(struct inode *inode, struct file *file);
 int tty_ioctl(struct file *f, int op, void *argp);
+unsigned int tty_poll(struct file *f, struct poll_table *pt);
 
 const struct file_operations tty_fops = {
-    .read = tty_read,
-    .write = tty_write,
+    .read_iter = tty_read,
+    .write_iter = tty_write,
     .release = tty_release,
     .flush = NULL,
     .lseek = NULL,
     .readdir = NULL,
-    .ioctl = tty_ioctl
+    .ioctl = tty_ioctl,
+    .poll = tty_poll
 };
 
 const struct inode_operations tty_iops = {
@@ -248,7 +251,7 @@ int __tty_check_change(struct tty *tty, int sig)
 }
 
 
-ssize_t tty_read(struct file *f, void *buf, size_t count)
+ssize_t tty_read(struct file *f, struct iov_iter *to, off_t *ppos)
 {
     struct tty *tty = file_get_tty(f);
 
@@ -259,10 +262,10 @@ ssize_t tty_read(struct file *f, void *buf, size_t count)
     if (ret < 0)
         return ret;
 
-    return tty->ldisc_ops->read(tty, f, buf, count, f->f_pos);
+    return tty->ldisc_ops->read(tty, f, to);
 }
 
-ssize_t tty_write(struct file *f, const void *buf, size_t count)
+ssize_t tty_write(struct file *f, struct iov_iter *from, off_t *ppos)
 {
     struct tty *tty = file_get_tty(f);
 
@@ -275,7 +278,21 @@ ssize_t tty_write(struct file *f, const void *buf, size_t count)
             return ret;
     }
 
-    return tty->ldisc_ops->write(tty, f, buf, count);
+    return tty->ldisc_ops->write(tty, f, from);
+}
+
+// Output never blocks, input is ready once the line discipline says so
+unsigned int tty_poll(struct file *f, struct poll_table *pt)
+{
+    struct tty *tty = file_get_tty(f);
+    unsigned int mask = POLLOUT | POLLWRNORM;
+
+    if (!tty)
+        return POLLERR;
+    poll_wait(f, &tty->read_wait, pt);
+    if (tty_input_available(tty))
+        mask |= POLLIN | POLLRDNORM;
+    return mask;
 }
 
 
@@ -2,6 +2,7 @@
 #include <lilac/lilac.h>
 #include <lilac/sched.h>
 #include <lilac/signal.h>
+#include <lilac/uio.h>
 
 //
 // TTY line discipline
@@ -418,7 +419,36 @@ void default_tty_receive_buf(struct tty *tty, const u8 *cp, const u8 *fp, size_t
     mutex_unlock(&data->read_lock);
 }
 
-static ssize_t c_read(struct tty *tty, u8 *buf, size_t nr)
+/*
+ * Characters taken from the input buffer are gathered here and copied to
+ * the reader in batches rather than one user copy each.
+ */
+struct tty_read_buf {
+    struct iov_iter *to;
+    size_t done;            /* bytes that reached the reader */
+    bool fault;
+    unsigned int n;
+    u8 buf[64];
+};
+
+static void flush_read_buf(struct tty_read_buf *rb)
+{
+    size_t n = rb->fault ? 0 : copy_to_iter(rb->buf, rb->n, rb->to);
+
+    if (n < rb->n)
+        rb->fault = true;
+    rb->done += n;
+    rb->n = 0;
+}
+
+static inline void put_read_char(struct tty_read_buf *rb, u8 c)
+{
+    if (rb->n == sizeof(rb->buf))
+        flush_read_buf(rb);
+    rb->buf[rb->n++] = c;
+}
+
+static ssize_t c_read(struct tty *tty, struct tty_read_buf *rb, size_t nr)
 {
     struct tty_data *data = tty->data;
     size_t copied = 0;
@@ -445,7 +475,8 @@ static ssize_t c_read(struct tty *tty, u8 *buf, size_t nr)
             c = read_char(data);
             if (c < 0) break;
 
-            buf[copied++] = (u8)c;
+            put_read_char(rb, (u8)c);
+            copied++;
 
             if (c == '\n')
                 goto done;
@@ -460,7 +491,7 @@ done:
     return copied;
 }
 
-static ssize_t nc_read(struct tty *tty, u8 *buf, size_t nr)
+static ssize_t nc_read(struct tty *tty, struct tty_read_buf *rb, size_t nr)
 {
     struct tty_data *data = tty->data;
     u8 vmin = tty->termios.c_cc[VMIN];
@@ -478,7 +509,8 @@ static ssize_t nc_read(struct tty *tty, u8 *buf, size_t nr)
         while (copied < nr && !BUF_EMPTY(data)) {
             c = read_char(data);
             if (c >= 0) {
-                buf[copied++] = (u8)c;
+                put_read_char(rb, (u8)c);
+                copied++;
             }
         }
 
@@ -497,14 +529,16 @@ static ssize_t nc_read(struct tty *tty, u8 *buf, size_t nr)
 
             c = read_char(data);
             if (c >= 0) {
-                buf[copied++] = (u8)c;
+                put_read_char(rb, (u8)c);
+                copied++;
             }
 
             if (copied >= vmin) {
                 while (copied < nr && !BUF_EMPTY(data)) {
                     c = read_char(data);
                     if (c >= 0) {
-                        buf[copied++] = (u8)c;
+                        put_read_char(rb, (u8)c);
+                copied++;
                     }
                 }
                 break;
@@ -518,7 +552,8 @@ static ssize_t nc_read(struct tty *tty, u8 *buf, size_t nr)
         while (copied < nr && !BUF_EMPTY(data)) {
             c = read_char(data);
             if (c >= 0) {
-                buf[copied++] = (u8)c;
+                put_read_char(rb, (u8)c);
+                copied++;
             }
         }
 
@@ -537,15 +572,14 @@ static ssize_t nc_read(struct tty *tty, u8 *buf, size_t nr)
             }
             c = read_char(data);
             if (c >= 0) {
-                buf[copied++] = (u8)c;
+                put_read_char(rb, (u8)c);
+                copied++;
             }
         }
     }
 
 #ifdef DEBUG_TTY
-    for (size_t i = 0; i < copied; i++) {
-        klog(LOG_DEBUG, "nc_read: read char 0x%x\n", buf[i]);
-    }
+    klog(LOG_DEBUG, "nc_read: read %lu chars\n", copied);
 #endif
 
     return copied;
@@ -605,26 +639,38 @@ static ssize_t process_output(struct tty *tty, const u8 *buf, size_t nr)
 
 
 
-ssize_t default_tty_read(struct tty *tty, struct file *file, u8 *buf, size_t nr, unsigned long offset)
+ssize_t default_tty_read(struct tty *tty, struct file *file, struct iov_iter *to)
 {
     struct tty_data *data = tty->data;
+    struct tty_read_buf rb = { .to = to };
 
     mutex_lock(&data->read_lock);
 
     ssize_t ret;
     if (L_ICANON(tty)) {
-        ret = c_read(tty, buf, nr);
+        ret = c_read(tty, &rb, iov_iter_count(to));
     } else {
-        ret = nc_read(tty, buf, nr);
+        ret = nc_read(tty, &rb, iov_iter_count(to));
     }
 
     mutex_unlock(&data->read_lock);
-    return ret;
+
+    // Characters staged before a signal still go to the reader
+    flush_read_buf(&rb);
+    if (rb.done)
+        return rb.done;
+    if (rb.fault)
+        return -EFAULT;
+    return ret < 0 ? ret : 0;
 }
 
 
-ssize_t default_tty_write(struct tty *tty, struct file *file, const u8 *buf, size_t nr)
+ssize_t default_tty_write(struct tty *tty, struct file *file, struct iov_iter *from)
 {
+    u8 chunk[128];
+    size_t written = 0;
+    ssize_t ret = 0;
+
     mutex_lock(&tty->write_lock);
 
     if (tty->ctrl.stopped) {
@@ -634,15 +680,27 @@ ssize_t default_tty_write(struct tty *tty, struct file *file, const u8 *buf, siz
         return -EAGAIN;
     }
 
-    ssize_t ret;
-    if (!(tty->termios.c_oflag & (ONLCR|OCRNL|ONLRET|ONOCR))) {
-        ret = tty->ops->write(tty, buf, nr);
-    } else {
-        ret = process_output(tty, buf, nr);
+    while (iov_iter_count(from)) {
+        size_t nr = MIN(iov_iter_count(from), sizeof(chunk));
+
+        if (copy_from_iter(chunk, nr, from) != nr) {
+            ret = -EFAULT;
+            break;
+        }
+        if (!(tty->termios.c_oflag & (ONLCR|OCRNL|ONLRET|ONOCR))) {
+            ret = tty->ops->write(tty, chunk, nr);
+        } else {
+            ret = process_output(tty, chunk, nr);
+        }
+        if (ret < 0)
+            break;
+        written += ret;
+        if ((size_t)ret < nr)
+            break;
     }
 
     mutex_unlock(&tty->write_lock);
-    return ret;
+    return written ? (ssize_t)written : ret;
 }
 
 
@@ -0,0 +1,52 @@
+/*
+ * Files with no name or filesystem behind them, like epoll instances and
+ * eventfds. They all share one inode, so fstat works on them and nothing
+ * has to be allocated beyond the file and its private data.
+ */
+#include <lilac/anon_inodes.h>
+#include <lilac/fcntl.h>
+#include <lilac/sched.h>
+#include <lilac/err.h>
+#include <mm/kmalloc.h>
+
+static struct inode anon_inode = {
+    .i_mode = 0600,
+    .i_nlink = 1,
+    .i_count = 1,
+};
+
+/**
+ * Make a file that calls fops with priv in f_data. Only the access mode,
+ * O_NONBLOCK and O_CLOEXEC are kept from flags.
+ */
+struct file * anon_inode_getfile(const struct file_operations *fops,
+    void *priv, int flags)
+{
+    struct file *file = alloc_file(NULL);
+    if (!file)
+        return ERR_PTR(-ENOMEM);
+
+    file->f_op = fops;
+    file->f_data = priv;
+    file->f_inode = &anon_inode;
+    file->f_mode = flags & (O_ACCMODE | O_NONBLOCK | O_CLOEXEC);
+    return file;
+}
+
+/**
+ * Same as anon_inode_getfile, and install the file in the lowest free fd.
+ * On failure fops->release isn't called, priv is still the caller's.
+ */
+int anon_inode_getfd(const struct file_operations *fops, void *priv, int flags)
+{
+    struct file *file = anon_inode_getfile(fops, priv, flags);
+    int fd;
+
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+    fd = get_next_fd(current->files, file);
+    if (fd < 0)
+        kfree(file);
+    return fd;
+}
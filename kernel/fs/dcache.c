@@ -3,36 +3,144 @@
 #include <lilac/err.h>
 #include <lilac/libc.h>
 #include <lilac/sync.h>
+#include <lilac/sched.h>
+#include <lib/hash.h>
+#include <lib/list_bl.h>
 #include <mm/kmalloc.h>
+#include <mm/page.h>
 
 #include "utils.h"
 
+#define D_HASH_BITS         12
+/* Unused dentries kept around before dput starts trimming the LRU */
+#define DCACHE_MAX_UNUSED   4096
+
 extern struct dentry *root_dentry;
 
-struct dentry *dlookup(struct dentry *parent, char *name)
+/*
+ * Every hashed dentry lives in one global table keyed by (parent, name).
+ * Each bucket has a bit lock in its head pointer, so lookups only ever
+ * contend on the chain they hash to.
+ *
+ * Dentries nobody holds a reference to sit on an LRU list and are freed
+ * from its cold end, either when the list grows past DCACHE_MAX_UNUSED or
+ * when the frame allocator runs out. A child holds a reference on its
+ * parent, so only leaves are ever reclaimed.
+ *
+ * Lock order: a dentry's d_lock before the LRU lock and its hash bucket,
+ * and never two d_locks at once. The shrinker goes LRU lock, d_lock,
+ * parent d_lock against that order, so it only ever trylocks them and
+ * can run from under any of them.
+ *
+ * Path walks first try to get through on cached dentries alone, reading
+ * the hash chains without locks or references and only pinning the final
+ * dentry. Such a walker can be looking at a dentry that is being freed, so
+ * while any are running freed dentries wait on a deferred list instead.
+ * A dentry is marked DCACHE_DEAD under its d_lock before it goes, which
+ * is what the final pin checks for.
+ */
+static struct hlist_bl_head dentry_hashtable[1 << D_HASH_BITS];
+
+static LIST_HEAD(dentry_lru);
+static spinlock_t dentry_lru_lock = SPINLOCK_INIT;
+static unsigned long nr_unused;
+static atomic_bool dcache_shrinking;
+
+static atomic_uint nr_lockless_walkers;
+static LIST_HEAD(dentry_deferred);
+static spinlock_t dentry_deferred_lock = SPINLOCK_INIT;
+
+static inline struct hlist_bl_head *d_bucket(const struct dentry *parent,
+    u32 hash)
+{
+    return dentry_hashtable + hash_32(hash + hash32_ptr(parent), D_HASH_BITS);
+}
+
+static inline bool d_unhashed(const struct dentry *d)
 {
-    struct dentry *d = NULL;
-    if (parent->d_sb->s_type == MSDOS) {
-        for (int i = 0; name[i]; i++)
-            name[i] = toupper(name[i]);
+    return hlist_bl_unhashed(&d->d_hash);
+}
+
+/**
+ * Fill in name->hash for a lookup under parent. MSDOS names compare
+ * without case, so they are hashed folded to upper case.
+ */
+void d_hash_name(const struct dentry *parent, struct qstr *name)
+{
+    bool fold = parent->d_sb->s_type == MSDOS;
+    u32 hash = 0;
+
+    for (u32 i = 0; i < name->len; i++) {
+        unsigned char c = name->name[i];
+        if (fold)
+            c = toupper(c);
+        hash = (hash + (c << 4) + (c >> 4)) * 11;
     }
-    hlist_for_each_entry(d, &parent->d_children, d_sib) {
-        if (strcmp(d->d_name, name) == 0) {
+    name->hash = hash;
+}
+
+static bool d_name_eq(const struct dentry *d, const struct qstr *name)
+{
+    if (d->d_name_hash != name->hash || d->d_name_len != name->len)
+        return false;
+    if (d->d_sb->s_type != MSDOS)
+        return memcmp(d->d_name, name->name, name->len) == 0;
+
+    for (u32 i = 0; i < name->len; i++) {
+        if (toupper(d->d_name[i]) != toupper(name->name[i]))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Find the child of parent called name, which must already be hashed.
+ * Returns the dentry with a reference held, or NULL if it isn't cached.
+ * The result may be negative.
+ */
+struct dentry *dlookup(struct dentry *parent, const struct qstr *name)
+{
+    struct hlist_bl_head *b = d_bucket(parent, name->hash);
+    struct hlist_bl_node *node;
+    struct dentry *d, *found = NULL;
+
+    hlist_bl_lock(b);
+    hlist_bl_for_each_entry(d, node, b, d_hash) {
+        if (d->d_parent == parent && d_name_eq(d, name)) {
             dget(d);
-            return d;
+            found = d;
+            break;
         }
     }
-    return NULL;
+    hlist_bl_unlock(b);
+    return found;
 }
 
+// Make d visible to lookups, the caller holds d->d_parent->d_lock
 void dcache_add(struct dentry *d)
 {
+    struct hlist_bl_head *b = d_bucket(d->d_parent, d->d_name_hash);
+
     hlist_add_head(&d->d_sib, &d->d_parent->d_children);
+    hlist_bl_lock(b);
+    hlist_bl_add_head_lockless(&d->d_hash, b);
+    hlist_bl_unlock(b);
+}
+
+static void d_unhash(struct dentry *d)
+{
+    struct hlist_bl_head *b = d_bucket(d->d_parent, d->d_name_hash);
+
+    hlist_bl_lock(b);
+    hlist_bl_del_init(&d->d_hash);
+    hlist_bl_unlock(b);
 }
 
+// The caller holds d->d_parent->d_lock
 void dcache_remove(struct dentry *d)
 {
-    hlist_del(&d->d_sib);
+    d_unhash(d);
+    hlist_del_init(&d->d_sib);
 }
 
 void dget(struct dentry *d)
@@ -40,149 +148,547 @@ void dget(struct dentry *d)
     d->d_count++;
 }
 
-void dput(struct dentry *d)
+static void dentry_release(struct dentry *d)
 {
-    //struct inode *i = d->d_inode;
-    if (--d->d_count)
+    if (d->d_inode)
+        iput(d->d_inode);
+    kfree(d->d_name);
+    kfree(d);
+}
+
+// Release whatever no lockless walker can still be looking at
+static void dentry_free_deferred(void)
+{
+    LIST_HEAD(list);
+    struct dentry *d, *tmp;
+
+    acquire_lock(&dentry_deferred_lock);
+    list_splice_init(&dentry_deferred, &list);
+    release_lock(&dentry_deferred_lock);
+    if (list_empty(&list))
         return;
 
-    klog(LOG_WARN, "dput: dentry %p (%s) count is zero, but not freeing it yet\n", d, d->d_name);
     /*
-    if (hlist_empty(&d->d_children)) {
-        dcache_remove(d);
-        destroy_dentry(d);
+     * Everything taken off the list was unhashed before now, so only a
+     * walker that is still running can have seen it.
+     */
+    if (nr_lockless_walkers) {
+        acquire_lock(&dentry_deferred_lock);
+        list_splice(&list, &dentry_deferred);
+        release_lock(&dentry_deferred_lock);
+        return;
     }
 
-    if (i)
-        iput(i);
-    */
+    list_for_each_entry_safe(d, tmp, &list, d_lru)
+        dentry_release(d);
 }
 
-struct dentry * alloc_dentry(struct dentry *d_parent, const char *name)
+// Free a dentry that is unhashed, off the LRU and unreferenced
+static void dentry_free(struct dentry *d)
+{
+    struct dentry *parent = d->d_parent;
+
+    if (nr_lockless_walkers) {
+        acquire_lock(&dentry_deferred_lock);
+        list_add_tail(&d->d_lru, &dentry_deferred);
+        release_lock(&dentry_deferred_lock);
+    } else {
+        dentry_release(d);
+    }
+
+    if (parent)
+        dput(parent);
+}
+
+static void dentry_lru_del(struct dentry *d)
+{
+    acquire_lock(&dentry_lru_lock);
+    if (d->d_flags & DCACHE_LRU) {
+        list_del(&d->d_lru);
+        d->d_flags &= ~DCACHE_LRU;
+        nr_unused--;
+    }
+    release_lock(&dentry_lru_lock);
+}
+
+void dput(struct dentry *d)
+{
+    unsigned int count = d->d_count;
+    bool trim = false;
+
+    // Not the last reference, nothing else to do
+    while (count > 1) {
+        if (atomic_compare_exchange_weak(&d->d_count, &count, count - 1))
+            return;
+    }
+
+    /*
+     * Dropping to zero happens under d_lock, which the shrinker must take
+     * before it can free the dentry out from under us.
+     */
+    acquire_lock(&d->d_lock);
+    if (--d->d_count) {
+        release_lock(&d->d_lock);
+        return;
+    }
+
+    if (d->d_flags & DCACHE_DROPPED) {
+        struct dentry *parent = d->d_parent;
+
+        dentry_lru_del(d);
+        d->d_flags |= DCACHE_DEAD;
+        release_lock(&d->d_lock);
+        acquire_lock(&parent->d_lock);
+        hlist_del_init(&d->d_sib);
+        release_lock(&parent->d_lock);
+        dentry_free(d);
+        return;
+    }
+
+    // Filesystem roots are never hashed and live as long as the mount
+    if (d_unhashed(d)) {
+        release_lock(&d->d_lock);
+        return;
+    }
+
+    acquire_lock(&dentry_lru_lock);
+    if (!(d->d_flags & DCACHE_LRU)) {
+        d->d_flags |= DCACHE_LRU;
+        list_add_tail(&d->d_lru, &dentry_lru);
+        nr_unused++;
+    }
+    trim = nr_unused > DCACHE_MAX_UNUSED;
+    release_lock(&dentry_lru_lock);
+    release_lock(&d->d_lock);
+
+    if (trim)
+        shrink_dcache(nr_unused - DCACHE_MAX_UNUSED);
+}
+
+// Hide d from lookups, it is freed once the last reference is dropped
+void d_drop(struct dentry *d)
+{
+    acquire_lock(&d->d_lock);
+    d_unhash(d);
+    d->d_flags |= DCACHE_DROPPED;
+    release_lock(&d->d_lock);
+}
+
+/**
+ * The name d refers to is gone. Open files may still be using the inode,
+ * so the dentry is only unhashed; the next lookup of the name caches a
+ * fresh negative one.
+ */
+void d_delete(struct dentry *d)
+{
+    d_drop(d);
+}
+
+/*
+ * Unhook an unused dentry from the tree so it can be freed. The caller
+ * holds the LRU lock and d->d_lock.
+ */
+static bool dentry_try_unlink(struct dentry *d)
+{
+    struct dentry *parent = d->d_parent;
+    struct hlist_bl_head *b;
+
+    if (d->d_mount || !parent)
+        return false;
+    if (!try_acquire_lock(&parent->d_lock))
+        return false;
+
+    // dlookup takes references under the bucket lock alone
+    b = d_bucket(parent, d->d_name_hash);
+    hlist_bl_lock(b);
+    if (d->d_count) {
+        hlist_bl_unlock(b);
+        release_lock(&parent->d_lock);
+        return false;
+    }
+    hlist_bl_del_init(&d->d_hash);
+    hlist_bl_unlock(b);
+
+    hlist_del_init(&d->d_sib);
+    release_lock(&parent->d_lock);
+    return true;
+}
+
+// One pass over the LRU, returning how many dentries it freed
+static unsigned long shrink_dcache_pass(unsigned long nr)
+{
+    LIST_HEAD(dispose);
+    struct dentry *d, *tmp;
+    unsigned long freed = 0;
+    unsigned long scan;
+
+    if (!try_acquire_lock(&dentry_lru_lock))
+        return 0;
+
+    scan = nr_unused;
+    while (nr && scan-- && !list_empty(&dentry_lru)) {
+        d = list_first_entry(&dentry_lru, struct dentry, d_lru);
+        if (!try_acquire_lock(&d->d_lock)) {
+            list_move_tail(&d->d_lru, &dentry_lru);
+            continue;
+        }
+
+        // Picked up again since it was put, take it off the list lazily
+        if (d->d_count) {
+            list_del(&d->d_lru);
+            d->d_flags &= ~DCACHE_LRU;
+            nr_unused--;
+            release_lock(&d->d_lock);
+            continue;
+        }
+
+        if (!dentry_try_unlink(d)) {
+            list_move_tail(&d->d_lru, &dentry_lru);
+            release_lock(&d->d_lock);
+            continue;
+        }
+
+        list_move(&d->d_lru, &dispose);
+        d->d_flags &= ~DCACHE_LRU;
+        d->d_flags |= DCACHE_DEAD;
+        nr_unused--;
+        release_lock(&d->d_lock);
+        nr--;
+    }
+    release_lock(&dentry_lru_lock);
+
+    // Inodes may need writing back, so free outside the locks
+    list_for_each_entry_safe(d, tmp, &dispose, d_lru) {
+        dentry_free(d);
+        freed++;
+    }
+    dentry_free_deferred();
+    return freed;
+}
+
+/**
+ * Free up to nr unused dentries, oldest first. Freeing a leaf can leave
+ * its parent unused, so keep going while passes make progress.
+ * Returns the number freed.
+ */
+unsigned long shrink_dcache(unsigned long nr)
+{
+    unsigned long freed = 0, n;
+
+    // One shrinker at a time, anyone else just carries on
+    if (atomic_exchange(&dcache_shrinking, true))
+        return 0;
+
+    do {
+        n = shrink_dcache_pass(nr - freed);
+        freed += n;
+    } while (n && freed < nr);
+
+    dcache_shrinking = false;
+    return freed;
+}
+
+static struct shrinker dcache_shrinker = {
+    .scan = shrink_dcache,
+};
+
+void dcache_init(void)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(dentry_hashtable); i++)
+        INIT_HLIST_BL_HEAD(&dentry_hashtable[i]);
+    register_shrinker(&dcache_shrinker);
+}
+
+static struct dentry * d_alloc(struct dentry *d_parent, const struct qstr *name)
 {
-    struct inode *i_parent = d_parent->d_inode;
     struct dentry *new_dentry = kzmalloc(sizeof(*new_dentry));
     if (!new_dentry)
         return ERR_PTR(-ENOMEM);
 
+    new_dentry->d_name = kmalloc(name->len + 1);
+    if (!new_dentry->d_name) {
+        kfree(new_dentry);
+        return ERR_PTR(-ENOMEM);
+    }
+    memcpy(new_dentry->d_name, name->name, name->len);
+    new_dentry->d_name[name->len] = '\0';
+    new_dentry->d_name_len = name->len;
+    new_dentry->d_name_hash = name->hash;
+
+    dget(d_parent);
     new_dentry->d_parent = d_parent;
-    new_dentry->d_sb = i_parent->i_sb;
-    new_dentry->d_name = (char*)strdup(name);
+    new_dentry->d_sb = d_parent->d_inode->i_sb;
     spin_lock_init(&new_dentry->d_lock);
+    INIT_HLIST_BL_NODE(&new_dentry->d_hash);
     INIT_HLIST_HEAD(&new_dentry->d_children);
     INIT_HLIST_NODE(&new_dentry->d_sib);
+    INIT_LIST_HEAD(&new_dentry->d_lru);
     new_dentry->d_count = 1;
 
     return new_dentry;
 }
 
+struct dentry * alloc_dentry(struct dentry *d_parent, const char *name)
+{
+    struct qstr q = { .name = name, .len = strlen(name) };
+
+    d_hash_name(d_parent, &q);
+    return d_alloc(d_parent, &q);
+}
+
+// Free a dentry that never made it into the cache
 void destroy_dentry(struct dentry *d)
 {
+    struct dentry *parent = d->d_parent;
+
     kfree(d->d_name);
     kfree(d);
+    if (parent)
+        dput(parent);
+}
+
+// Wait out a lookup of d that another task has in flight
+static void d_wait_lookup(struct dentry *d)
+{
+    while (READ_ONCE(d->d_flags) & DCACHE_PAR_LOOKUP)
+        yield();
+}
+
+/*
+ * Ask the filesystem about name. The new dentry is hashed before the
+ * lookup starts, marked DCACHE_PAR_LOOKUP, so only tasks after the same
+ * name wait for it; the directory isn't locked while the disk is busy.
+ */
+static struct dentry * lookup_slow(struct dentry *parent, struct qstr *name)
+{
+    struct inode *dir = parent->d_inode;
+    struct dentry *find, *cached;
+    long err;
+
+#ifdef DEBUG_VFS
+    klog(LOG_DEBUG, "VFS: %.*s not in cache\n", (int)name->len, name->name);
+#endif
+    find = d_alloc(parent, name);
+    if (IS_ERR(find))
+        return find;
+    find->d_flags |= DCACHE_PAR_LOOKUP;
+
+    acquire_lock(&parent->d_lock);
+    // Someone may have got here first while we were allocating
+    cached = dlookup(parent, name);
+    if (!cached)
+        dcache_add(find);
+    release_lock(&parent->d_lock);
+
+    if (cached) {
+        destroy_dentry(find);
+        return cached;
+    }
+
+    err = PTR_ERR(dir->i_op->lookup(dir, find, 0));
+
+    acquire_lock(&find->d_lock);
+    find->d_flags &= ~DCACHE_PAR_LOOKUP;
+    release_lock(&find->d_lock);
+
+    if (err < 0) {
+        d_drop(find);
+        dput(find);
+        return ERR_PTR(err);
+    }
+    return find;
 }
 
-static char * next_path_component(const char *path, int *pos)
+/*
+ * Return the child of parent called name, asking the filesystem if it
+ * isn't cached. Misses are cached too, as negative dentries.
+ */
+static struct dentry * lookup_one(struct dentry *parent, struct qstr *name)
+{
+    struct inode *dir = parent->d_inode;
+    struct dentry *find;
+
+    if (!dir)
+        return ERR_PTR(-ENOENT);
+    if (!S_ISDIR(dir->i_mode)) {
+        klog(LOG_DEBUG, "VFS: %s is not a directory\n", parent->d_name);
+        return ERR_PTR(-ENOTDIR);
+    }
+
+    d_hash_name(parent, name);
+    while (1) {
+        find = dlookup(parent, name);
+        if (!find)
+            return lookup_slow(parent, name);
+
+        d_wait_lookup(find);
+        // The lookup we waited on failed, have a go ourselves
+        if (!(find->d_flags & DCACHE_DROPPED))
+            return find;
+        dput(find);
+    }
+}
+
+static int next_path_component(const char *path, int *pos, struct qstr *name)
 {
     while (path[*pos] == '/')
         (*pos)++;
-    int len = path_component_len(path, *pos);
-    if (len == 0)
-        return NULL;
-    char *name = kzmalloc(len+1);
-    if (!name)
-        return ERR_PTR(-ENOMEM);
-    strncpy(name, path + *pos, len);
-    name[len] = '\0';
-    *pos += len;
-    return name;
+    name->name = path + *pos;
+    name->len = path_component_len(path, *pos);
+    *pos += name->len;
+    return name->len;
 }
 
-struct dentry * lookup_path_from(struct dentry *parent, const char *path)
+static bool is_last_component(const char *path, int pos)
+{
+    while (path[pos] == '/')
+        pos++;
+    return path[pos] == '\0';
+}
+
+static inline bool is_dot(const struct qstr *name)
 {
+    return name->len == 1 && name->name[0] == '.';
+}
+
+static inline bool is_dotdot(const struct qstr *name)
+{
+    return name->len == 2 && name->name[0] == '.' && name->name[1] == '.';
+}
+
+// dlookup for lockless walkers: no bucket lock and no reference taken
+static struct dentry * dlookup_lockless(struct dentry *parent,
+    const struct qstr *name)
+{
+    struct hlist_bl_head *b = d_bucket(parent, name->hash);
+    struct hlist_bl_node *node;
+    struct dentry *d;
+
+    // A concurrent unhash can cut the walk short, which is just a miss
+    for (node = hlist_bl_first_lockless(b); node; node = READ_ONCE(node->next)) {
+        d = hlist_bl_entry(node, struct dentry, d_hash);
+        if (READ_ONCE(d->d_parent) == parent && d_name_eq(d, name))
+            return d;
+    }
+    return NULL;
+}
+
+// Pin a dentry found without locks, failing if it is on its way out
+static bool dget_lockless(struct dentry *d)
+{
+    bool live;
+
+    acquire_lock(&d->d_lock);
+    live = !(d->d_flags & (DCACHE_DROPPED | DCACHE_DEAD));
+    if (live)
+        d->d_count++;
+    release_lock(&d->d_lock);
+    return live;
+}
+
+/*
+ * Walk path using only what is already cached, taking no locks or
+ * references until the end. Returns NULL if anything needs the
+ * filesystem, or looks odd, and the caller should walk it properly.
+ */
+static struct dentry * lookup_path_lockless(struct dentry *parent,
+    const char *path)
+{
+    struct dentry *find;
+    struct inode *dir;
+    struct qstr name;
     int n_pos = 0;
-    struct inode *inode;
-    struct dentry *find, *tmp;
-    char *name;
-    long err = 0;
-
-    while (path[n_pos] != '\0') {
-        name = next_path_component(path, &n_pos);
-        if (IS_ERR(name))
-            return ERR_CAST(name);
-        else if (!name)
-            break;
-#ifdef DEBUG_VFS
-        klog(LOG_DEBUG, "VFS: Looking up %s\n", name);
-#endif
-        acquire_lock(&parent->d_lock);
 
-        if (strcmp(name, ".") == 0) {
-            kfree(name);
-            release_lock(&parent->d_lock);
+    while (next_path_component(path, &n_pos, &name)) {
+        if (is_dot(&name)) {
             continue;
-        } else if (strcmp(name, "..") == 0) {
-            kfree(name);
-            tmp = parent;
-            if (parent->d_parent != NULL)
+        } else if (is_dotdot(&name)) {
+            if (parent->d_parent)
                 parent = parent->d_parent;
-            release_lock(&tmp->d_lock);
             continue;
         }
 
-        find = dlookup(parent, name);
-        if (find == NULL) {
-#ifdef DEBUG_VFS
-            klog(LOG_DEBUG, "VFS: %s not in cache\n", name);
-#endif
-            find = alloc_dentry(parent, name);
-            if (IS_ERR_OR_NULL(find)) {
-                kfree(name);
-                release_lock(&parent->d_lock);
-                return find;
-            }
-
-            inode = parent->d_inode;
-            if (!S_ISDIR(inode->i_mode)) {
-                klog(LOG_DEBUG, "VFS: %s is not a directory\n", parent->d_name);
-                kfree(name);
-                destroy_dentry(find);
-                release_lock(&parent->d_lock);
-                return ERR_PTR(-ENOTDIR);
-            }
-
-            if ((err = PTR_ERR(inode->i_op->lookup(inode, find, 0))) < 0) {
-                kfree(name);
-                destroy_dentry(find);
-                release_lock(&parent->d_lock);
-                return ERR_PTR(err);
-            }
-
-            dcache_add(find);
-            kfree(name);
-            // If the inode is NULL, we've reached a dead end (negative dentry)
-            if (find->d_inode == NULL) {
-                release_lock(&parent->d_lock);
-                return find;
-            }
-        } else {
+        dir = READ_ONCE(parent->d_inode);
+        if (!dir || !S_ISDIR(dir->i_mode))
+            return NULL;
+
+        d_hash_name(parent, &name);
+        find = dlookup_lockless(parent, &name);
+        if (!find || (READ_ONCE(find->d_flags) & DCACHE_PAR_LOOKUP))
+            return NULL;
+
+        if (!READ_ONCE(find->d_inode)) {
+            if (is_last_component(path, n_pos))
+                parent = find;
+            else
+                return NULL;
+            break;
+        }
+
+        if (find->d_mount)
+            find = find->d_mount->mnt_root;
+        parent = find;
+    }
+
+    return dget_lockless(parent) ? parent : NULL;
+}
+
+/**
+ * Walk path starting from parent.
+ * Returns the dentry with a reference held, which the caller must dput.
+ * Only the last component may come back negative, a missing directory
+ * along the way is -ENOENT.
+ */
+struct dentry * lookup_path_from(struct dentry *parent, const char *path)
+{
+    struct dentry *find;
+    struct qstr name;
+    int n_pos = 0;
+
+    nr_lockless_walkers++;
+    find = lookup_path_lockless(parent, path);
+    if (--nr_lockless_walkers == 0 && !list_empty(&dentry_deferred))
+        dentry_free_deferred();
+    if (find)
+        return find;
+
+    dget(parent);
+    while (next_path_component(path, &n_pos, &name)) {
 #ifdef DEBUG_VFS
-            klog(LOG_DEBUG, "VFS: Found %s in cache\n", name);
+        klog(LOG_DEBUG, "VFS: Looking up %.*s\n", (int)name.len, name.name);
 #endif
-            kfree(name);
-            if (find->d_inode == NULL) {
-                release_lock(&parent->d_lock);
+        if (is_dot(&name)) {
+            continue;
+        } else if (is_dotdot(&name)) {
+            find = parent->d_parent ? parent->d_parent : parent;
+            dget(find);
+            dput(parent);
+            parent = find;
+            continue;
+        }
+
+        find = lookup_one(parent, &name);
+        dput(parent);
+        if (IS_ERR(find))
+            return find;
+
+        // If the inode is NULL, we've reached a dead end (negative dentry)
+        if (find->d_inode == NULL) {
+            if (is_last_component(path, n_pos))
                 return find;
-            }
+            dput(find);
+            return ERR_PTR(-ENOENT);
+        }
 
-            if (find->d_mount) {
+        if (find->d_mount) {
 #ifdef DEBUG_VFS
-                klog(LOG_DEBUG, "VFS: Found mount point\n");
+            klog(LOG_DEBUG, "VFS: Found mount point\n");
 #endif
-                find = find->d_mount->mnt_root;
-            }
+            parent = find->d_mount->mnt_root;
+            dget(parent);
+            dput(find);
+            find = parent;
         }
-        release_lock(&parent->d_lock);
         parent = find;
     }
     return parent;
@@ -190,7 +696,9 @@ struct dentry * lookup_path_from(struct dentry *parent, const char *path)
 
 struct dentry * lookup_path(const char *path)
 {
-    if (strcmp(path, "/") == 0)
+    if (strcmp(path, "/") == 0) {
+        dget(root_dentry);
         return root_dentry;
+    }
     return lookup_path_from(root_dentry, path);
 }
@@ -0,0 +1,144 @@
+/*
+ * eventfd: a 64-bit counter behind a file. Writes add to it and reads
+ * return and clear it, or take one at a time in semaphore mode. Reads
+ * block while it is zero and writes while the sum would overflow.
+ */
+#include <lilac/eventfd.h>
+#include <lilac/anon_inodes.h>
+#include <lilac/fs.h>
+#include <lilac/poll.h>
+#include <lilac/sched.h>
+#include <lilac/syscall.h>
+#include <lilac/uio.h>
+#include <lilac/wait.h>
+#include <lilac/err.h>
+#include <mm/kmalloc.h>
+
+// The counter never reaches this, writing it is an error
+#define EVENTFD_MAX     (~0ULL)
+
+struct eventfd_ctx {
+    spinlock_t lock;
+    struct waitqueue wq;
+    u64 count;
+    unsigned int flags;
+};
+
+static ssize_t eventfd_read(struct file *file, struct iov_iter *to,
+    __unused off_t *ppos)
+{
+    struct eventfd_ctx *ctx = file->f_data;
+    u64 value;
+    int err;
+
+    if (iov_iter_count(to) < sizeof(value))
+        return -EINVAL;
+
+    acquire_lock(&ctx->lock);
+    while (!ctx->count) {
+        release_lock(&ctx->lock);
+        if (file->f_mode & O_NONBLOCK)
+            return -EAGAIN;
+        err = wait_event_interruptible(ctx->wq, READ_ONCE(ctx->count));
+        if (err)
+            return err;
+        acquire_lock(&ctx->lock);
+    }
+    value = ctx->flags & EFD_SEMAPHORE ? 1 : ctx->count;
+    ctx->count -= value;
+    release_lock(&ctx->lock);
+
+    // Writers may have been waiting for room
+    wake_all(&ctx->wq);
+    if (copy_to_iter(&value, sizeof(value), to) != sizeof(value))
+        return -EFAULT;
+    return sizeof(value);
+}
+
+static ssize_t eventfd_write(struct file *file, struct iov_iter *from,
+    __unused off_t *ppos)
+{
+    struct eventfd_ctx *ctx = file->f_data;
+    u64 value;
+    int err;
+
+    if (iov_iter_count(from) < sizeof(value))
+        return -EINVAL;
+    if (copy_from_iter(&value, sizeof(value), from) != sizeof(value))
+        return -EFAULT;
+    if (value == EVENTFD_MAX)
+        return -EINVAL;
+
+    acquire_lock(&ctx->lock);
+    while (EVENTFD_MAX - ctx->count <= value) {
+        release_lock(&ctx->lock);
+        if (file->f_mode & O_NONBLOCK)
+            return -EAGAIN;
+        err = wait_event_interruptible(ctx->wq,
+            EVENTFD_MAX - READ_ONCE(ctx->count) > value);
+        if (err)
+            return err;
+        acquire_lock(&ctx->lock);
+    }
+    ctx->count += value;
+    release_lock(&ctx->lock);
+
+    if (value)
+        wake_all(&ctx->wq);
+    return sizeof(value);
+}
+
+static unsigned int eventfd_poll(struct file *file, struct poll_table *pt)
+{
+    struct eventfd_ctx *ctx = file->f_data;
+    unsigned int mask = 0;
+    u64 count;
+
+    poll_wait(file, &ctx->wq, pt);
+    acquire_lock(&ctx->lock);
+    count = ctx->count;
+    release_lock(&ctx->lock);
+
+    if (count)
+        mask |= POLLIN | POLLRDNORM;
+    if (count < EVENTFD_MAX - 1)
+        mask |= POLLOUT | POLLWRNORM;
+    return mask;
+}
+
+static int eventfd_release(__unused struct inode *inode, struct file *file)
+{
+    kfree(file->f_data);
+    return 0;
+}
+
+static const struct file_operations eventfd_fops = {
+    .read_iter = eventfd_read,
+    .write_iter = eventfd_write,
+    .poll = eventfd_poll,
+    .release = eventfd_release,
+};
+
+SYSCALL_DECL2(eventfd2, unsigned int, initval, int, flags)
+{
+    struct eventfd_ctx *ctx;
+    int fd;
+
+    if (flags & ~(EFD_SEMAPHORE | EFD_CLOEXEC | EFD_NONBLOCK))
+        return -EINVAL;
+
+    ctx = kzmalloc(sizeof(*ctx));
+    if (!ctx)
+        return -ENOMEM;
+    spin_lock_init(&ctx->lock);
+    spin_lock_init(&ctx->wq.lock);
+    INIT_LIST_HEAD(&ctx->wq.task_list);
+    ctx->count = initval;
+    ctx->flags = flags & EFD_SEMAPHORE;
+
+    fd = anon_inode_getfd(&eventfd_fops, ctx,
+        O_RDWR | (flags & (EFD_CLOEXEC | EFD_NONBLOCK)));
+    if (fd < 0)
+        kfree(ctx);
+    return fd;
+}
@@ -0,0 +1,501 @@
+/*
+ * epoll: an interest list kept across calls, with each watched file's
+ * queues calling back into the instance when it changes. The callback puts
+ * the item on a ready list, so epoll_wait only looks at what is ready rather
+ * than every watched descriptor.
+ */
+#include <lilac/eventpoll.h>
+#include <lilac/anon_inodes.h>
+#include <lilac/fs.h>
+#include <lilac/lilac.h>
+#include <lilac/sched.h>
+#include <lilac/signal.h>
+#include <lilac/syscall.h>
+#include <lilac/timer.h>
+#include <lilac/timer_event.h>
+#include <lilac/uaccess.h>
+#include <lilac/err.h>
+#include <lib/rbtree.h>
+#include <mm/kmalloc.h>
+
+// Most events one epoll_wait can return
+#define EP_MAX_EVENTS   (INT_MAX / sizeof(struct epoll_event))
+
+// Bits that change how an item reports rather than what it waits for
+#define EP_PRIVATE_BITS (EPOLLONESHOT | EPOLLET)
+
+/*
+ * Locking: mtx serialises changes to the interest tree and collecting
+ * events, lock covers the ready list since the wakeup callbacks add to it
+ * from under the watched queue's lock. epmutex is taken before mtx by the
+ * two paths that can tear down an item without going through epoll_ctl:
+ * the watched file going away and the epoll file itself going away.
+ */
+struct eventpoll {
+    mutex_t mtx;
+    spinlock_t lock;
+    struct waitqueue wq;        /* epoll_wait callers and pollers of the fd */
+    struct list_head rdllist;   /* items with something to report */
+    struct rb_root rbr;         /* interest list by (file, fd) */
+};
+
+struct epitem {
+    struct rb_node rbn;
+    struct list_head rdllink;   /* on ep->rdllist, empty if not ready */
+    struct list_head fllink;    /* on file->f_ep_links */
+    struct eventpoll *ep;
+    struct file *file;
+    int fd;
+    struct epoll_event event;
+    struct eppoll_entry *pwqlist;
+};
+
+// An item's hook on one of its file's queues
+struct eppoll_entry {
+    struct eppoll_entry *next;
+    struct epitem *epi;
+    struct waitqueue *whead;
+    struct wq_entry wait;
+};
+
+struct ep_pqueue {
+    struct poll_table pt;
+    struct epitem *epi;
+    int error;
+};
+
+static mutex_t epmutex = {
+    .waiters = LIST_HEAD_INIT(epmutex.waiters),
+    .wait_lock = SPINLOCK_INIT,
+};
+
+static const struct file_operations eventpoll_fops;
+
+static inline bool is_file_epoll(struct file *file)
+{
+    return file->f_op == &eventpoll_fops;
+}
+
+struct ep_key {
+    struct file *file;
+    int fd;
+};
+
+static int ep_cmp(const void *key, const struct rb_node *node)
+{
+    const struct ep_key *k = key;
+    const struct epitem *epi = rb_entry(node, struct epitem, rbn);
+
+    if (k->file != epi->file)
+        return k->file < epi->file ? -1 : 1;
+    return k->fd - epi->fd;
+}
+
+static bool ep_less(struct rb_node *a, const struct rb_node *b)
+{
+    struct epitem *epi = rb_entry(a, struct epitem, rbn);
+    struct ep_key key = { epi->file, epi->fd };
+
+    return ep_cmp(&key, b) < 0;
+}
+
+static struct epitem *ep_find(struct eventpoll *ep, struct file *file, int fd)
+{
+    struct ep_key key = { file, fd };
+    struct rb_node *node = rb_find(&key, &ep->rbr, ep_cmp);
+
+    return node ? rb_entry(node, struct epitem, rbn) : NULL;
+}
+
+// Queue epi as ready unless it already is, the caller holds ep->lock
+static inline void ep_set_ready(struct eventpoll *ep, struct epitem *epi)
+{
+    if (list_empty(&epi->rdllink))
+        list_add_tail(&epi->rdllink, &ep->rdllist);
+}
+
+/*
+ * Called from wake_first/wake_all on a watched queue, with that queue's
+ * lock held. It only records that the item may be ready; the file is
+ * polled again when the events are collected.
+ */
+static int ep_poll_callback(struct wq_entry *wait)
+{
+    struct eppoll_entry *pwq = container_of(wait, struct eppoll_entry, wait);
+    struct epitem *epi = pwq->epi;
+    struct eventpoll *ep = epi->ep;
+
+    // Disarmed by EPOLLONESHOT until the next EPOLL_CTL_MOD
+    if (!(READ_ONCE(epi->event.events) & ~EP_PRIVATE_BITS))
+        return 0;
+
+    acquire_lock(&ep->lock);
+    ep_set_ready(ep, epi);
+    release_lock(&ep->lock);
+
+    wake_first(&ep->wq);
+    return 1;
+}
+
+static void ep_ptable_queue_proc(struct file *file, struct waitqueue *whead,
+    struct poll_table *pt)
+{
+    struct ep_pqueue *epq = container_of(pt, struct ep_pqueue, pt);
+    struct epitem *epi = epq->epi;
+    struct eppoll_entry *pwq = kzmalloc(sizeof(*pwq));
+
+    if (!pwq) {
+        epq->error = -ENOMEM;
+        return;
+    }
+    pwq->epi = epi;
+    pwq->whead = whead;
+    pwq->wait.task = current;
+    pwq->wait.wakeup = ep_poll_callback;
+    pwq->next = epi->pwqlist;
+    epi->pwqlist = pwq;
+    add_wait_queue(whead, &pwq->wait);
+}
+
+// Take epi out of ep entirely and free it, the caller holds ep->mtx
+static void ep_remove(struct eventpoll *ep, struct epitem *epi)
+{
+    struct eppoll_entry *pwq, *next;
+    struct file *file = epi->file;
+
+    // Once off the queues no callback can see epi any more
+    for (pwq = epi->pwqlist; pwq; pwq = next) {
+        next = pwq->next;
+        remove_wait_queue(pwq->whead, &pwq->wait);
+        kfree(pwq);
+    }
+
+    acquire_lock(&file->f_lock);
+    list_del(&epi->fllink);
+    release_lock(&file->f_lock);
+
+    rb_erase(&epi->rbn, &ep->rbr);
+
+    acquire_lock(&ep->lock);
+    if (!list_empty(&epi->rdllink))
+        list_del(&epi->rdllink);
+    release_lock(&ep->lock);
+
+    kfree(epi);
+}
+
+static int ep_insert(struct eventpoll *ep, const struct epoll_event *event,
+    struct file *file, int fd)
+{
+    struct epitem *epi = kzmalloc(sizeof(*epi));
+    struct ep_pqueue epq;
+    unsigned int revents;
+
+    if (!epi)
+        return -ENOMEM;
+    INIT_LIST_HEAD(&epi->rdllink);
+    epi->ep = ep;
+    epi->file = file;
+    epi->fd = fd;
+    epi->event = *event;
+
+    acquire_lock(&file->f_lock);
+    list_add_tail(&epi->fllink, &file->f_ep_links);
+    release_lock(&file->f_lock);
+    rb_add(&epi->rbn, &ep->rbr, ep_less);
+
+    // Hook onto the file's queues and pick up anything already pending
+    epq.pt.qproc = ep_ptable_queue_proc;
+    epq.epi = epi;
+    epq.error = 0;
+    revents = vfs_poll(file, &epq.pt);
+    if (epq.error) {
+        ep_remove(ep, epi);
+        return epq.error;
+    }
+
+    if (revents & event->events) {
+        acquire_lock(&ep->lock);
+        ep_set_ready(ep, epi);
+        release_lock(&ep->lock);
+        wake_first(&ep->wq);
+    }
+    return 0;
+}
+
+static int ep_modify(struct eventpoll *ep, struct epitem *epi,
+    const struct epoll_event *event)
+{
+    WRITE_ONCE(epi->event.events, (u32)event->events);
+    epi->event.data = event->data;
+
+    if (vfs_poll(epi->file, NULL) & event->events) {
+        acquire_lock(&ep->lock);
+        ep_set_ready(ep, epi);
+        release_lock(&ep->lock);
+        wake_first(&ep->wq);
+    }
+    return 0;
+}
+
+/*
+ * Copy out up to maxevents ready items, polling each one again since the
+ * callback only said something changed. Level-triggered items that still
+ * have events go back on the ready list for the next call.
+ */
+static int ep_send_events(struct eventpoll *ep,
+    struct epoll_event __user *events, int maxevents)
+{
+    struct list_head txlist;
+    struct epitem *epi;
+    int res = 0;
+
+    INIT_LIST_HEAD(&txlist);
+    acquire_lock(&ep->lock);
+    list_splice_init(&ep->rdllist, &txlist);
+    release_lock(&ep->lock);
+
+    while (res < maxevents && !list_empty(&txlist)) {
+        struct epoll_event ev;
+
+        epi = list_first_entry(&txlist, struct epitem, rdllink);
+        acquire_lock(&ep->lock);
+        list_del_init(&epi->rdllink);
+        release_lock(&ep->lock);
+
+        ev.events = vfs_poll(epi->file, NULL) & epi->event.events;
+        if (!ev.events)
+            continue;
+        ev.data = epi->event.data;
+        if (copy_to_user(events + res, &ev, sizeof(ev))) {
+            acquire_lock(&ep->lock);
+            ep_set_ready(ep, epi);
+            release_lock(&ep->lock);
+            if (!res)
+                res = -EFAULT;
+            break;
+        }
+        res++;
+
+        if (epi->event.events & EPOLLONESHOT) {
+            WRITE_ONCE(epi->event.events, epi->event.events & EP_PRIVATE_BITS);
+        } else if (!(epi->event.events & EPOLLET)) {
+            acquire_lock(&ep->lock);
+            ep_set_ready(ep, epi);
+            release_lock(&ep->lock);
+        }
+    }
+
+    // Whatever didn't fit stays ready, ahead of anything that came in since
+    acquire_lock(&ep->lock);
+    list_splice(&txlist, &ep->rdllist);
+    release_lock(&ep->lock);
+    return res;
+}
+
+static inline bool ep_events_available(struct eventpoll *ep)
+{
+    return !list_empty(&ep->rdllist);
+}
+
+/*
+ * Wait for events. timeout_ns < 0 waits forever and 0 doesn't wait at all.
+ */
+static int ep_poll(struct eventpoll *ep, struct epoll_event __user *events,
+    int maxevents, s64 timeout_ns)
+{
+    struct timer_event to;
+    struct timer_event *top = NULL;
+    int res;
+
+    if (timeout_ns > 0) {
+        to = TIMER_EV_INIT(to, current, ktime_get() + timeout_ns, NULL, NULL);
+        timer_ev_enqueue(&to, current);
+        top = &to;
+    }
+
+    for (;;) {
+        struct wq_entry wait = WQ_ENTRY_INIT(wait, current, NULL);
+
+        mutex_lock(&ep->mtx);
+        res = ep_send_events(ep, events, maxevents);
+        mutex_unlock(&ep->mtx);
+        if (res || !timeout_ns || (top && !timer_ev_queued(top)))
+            break;
+
+        task_interrupted_ack();
+        if (sig_get_active(current)) {
+            res = -EINTR;
+            break;
+        }
+
+        // Queue before the last check so a callback in between still wakes us
+        set_task_sleeping(current);
+        add_wait_queue(&ep->wq, &wait);
+        if (!ep_events_available(ep) && !sig_get_active(current) &&
+                (!top || timer_ev_queued(top)))
+            schedule();
+        set_task_running(current);
+        remove_wait_queue(&ep->wq, &wait);
+    }
+
+    if (top)
+        timer_ev_dequeue(top);
+    return res;
+}
+
+static unsigned int ep_eventpoll_poll(struct file *file, struct poll_table *pt)
+{
+    struct eventpoll *ep = file->f_data;
+
+    poll_wait(file, &ep->wq, pt);
+    return ep_events_available(ep) ? POLLIN | POLLRDNORM : 0;
+}
+
+static int ep_eventpoll_release(struct inode *inode, struct file *file)
+{
+    struct eventpoll *ep = file->f_data;
+    struct rb_node *node;
+
+    mutex_lock(&epmutex);
+    mutex_lock(&ep->mtx);
+    while ((node = rb_first(&ep->rbr)))
+        ep_remove(ep, rb_entry(node, struct epitem, rbn));
+    mutex_unlock(&ep->mtx);
+    mutex_unlock(&epmutex);
+
+    kfree(ep);
+    return 0;
+}
+
+static const struct file_operations eventpoll_fops = {
+    .poll = ep_eventpoll_poll,
+    .release = ep_eventpoll_release,
+};
+
+/*
+ * file is being freed, drop it from every epoll set still watching it. No
+ * new items can be added since nobody holds a reference to it any more.
+ */
+void eventpoll_release(struct file *file)
+{
+    struct epitem *epi;
+
+    mutex_lock(&epmutex);
+    while (!list_empty(&file->f_ep_links)) {
+        struct eventpoll *ep;
+
+        epi = list_first_entry(&file->f_ep_links, struct epitem, fllink);
+        ep = epi->ep;
+        mutex_lock(&ep->mtx);
+        ep_remove(ep, epi);
+        mutex_unlock(&ep->mtx);
+    }
+    mutex_unlock(&epmutex);
+}
+
+SYSCALL_DECL1(epoll_create1, int, flags)
+{
+    struct eventpoll *ep;
+    int fd;
+
+    if (flags & ~EPOLL_CLOEXEC)
+        return -EINVAL;
+
+    ep = kzmalloc(sizeof(*ep));
+    if (!ep)
+        return -ENOMEM;
+    mutex_init(&ep->mtx);
+    spin_lock_init(&ep->lock);
+    spin_lock_init(&ep->wq.lock);
+    INIT_LIST_HEAD(&ep->wq.task_list);
+    INIT_LIST_HEAD(&ep->rdllist);
+    ep->rbr = RB_ROOT;
+
+    fd = anon_inode_getfd(&eventpoll_fops, ep, O_RDONLY | flags);
+    if (fd < 0)
+        kfree(ep);
+    return fd;
+}
+
+SYSCALL_DECL4(epoll_ctl, int, epfd, int, op, int, fd,
+    struct epoll_event __user *, event)
+{
+    struct epoll_event epds;
+    struct fd f, tf;
+    struct eventpoll *ep;
+    struct epitem *epi;
+    int err;
+
+    if (op != EPOLL_CTL_DEL) {
+        if (copy_from_user(&epds, event, sizeof(epds)))
+            return -EFAULT;
+        // Errors and hangups are always reported
+        epds.events |= EPOLLERR | EPOLLHUP;
+    }
+
+    f = fdget(epfd);
+    if (!f.file)
+        return -EBADF;
+    tf = fdget(fd);
+    if (!tf.file) {
+        err = -EBADF;
+        goto out_f;
+    }
+
+    /*
+     * Nesting epoll sets is refused outright, it would need the loop and
+     * depth checks that keep wakeups from recursing forever.
+     */
+    err = -EINVAL;
+    if (!is_file_epoll(f.file) || is_file_epoll(tf.file))
+        goto out_tf;
+
+    ep = f.file->f_data;
+    mutex_lock(&ep->mtx);
+    epi = ep_find(ep, tf.file, fd);
+    switch (op) {
+    case EPOLL_CTL_ADD:
+        err = epi ? -EEXIST : ep_insert(ep, &epds, tf.file, fd);
+        break;
+    case EPOLL_CTL_DEL:
+        if (epi)
+            ep_remove(ep, epi);
+        err = epi ? 0 : -ENOENT;
+        break;
+    case EPOLL_CTL_MOD:
+        err = epi ? ep_modify(ep, epi, &epds) : -ENOENT;
+        break;
+    default:
+        err = -EINVAL;
+    }
+    mutex_unlock(&ep->mtx);
+
+out_tf:
+    fdput(tf);
+out_f:
+    fdput(f);
+    return err;
+}
+
+SYSCALL_DECL4(epoll_wait, int, epfd, struct epoll_event __user *, events,
+    int, maxevents, int, timeout_ms)
+{
+    s64 timeout_ns = timeout_ms < 0 ? -1 : (s64)timeout_ms * NS_PER_MS;
+    struct fd f;
+    int ret;
+
+    if (maxevents <= 0 || (size_t)maxevents > EP_MAX_EVENTS)
+        return -EINVAL;
+    if (!access_ok(events, maxevents * sizeof(struct epoll_event)))
+        return -EFAULT;
+
+    f = fdget(epfd);
+    if (!f.file)
+        return -EBADF;
+    ret = -EINVAL;
+    if (is_file_epoll(f.file))
+        ret = ep_poll(f.file->f_data, events, maxevents, timeout_ns);
+    fdput(f);
+    return ret;
+}
@@ -0,0 +1,269 @@
+// Block and inode allocation from the cached group bitmaps
+#include <lilac/fs.h>
+#include <lilac/log.h>
+#include <lilac/libc.h>
+#include <lilac/err.h>
+#include <mm/kmalloc.h>
+
+#include "ext2.h"
+
+static inline bool ext2_test_bit(const u8 *map, u32 bit)
+{
+    return map[bit / 8] & (1 << (bit % 8));
+}
+
+static inline void ext2_set_bit(u8 *map, u32 bit)
+{
+    map[bit / 8] |= 1 << (bit % 8);
+}
+
+static inline void ext2_clear_bit(u8 *map, u32 bit)
+{
+    map[bit / 8] &= ~(1 << (bit % 8));
+}
+
+// Bitmaps are a whole block, so they can be scanned a long at a time
+static u32 ext2_find_zero_bit(const u8 *map, u32 nbits, u32 start)
+{
+    const unsigned long *words = (const unsigned long*)map;
+
+    while (start < nbits) {
+        unsigned long bits = ~words[start / BITS_PER_LONG];
+        bits &= ~0UL << (start % BITS_PER_LONG);
+        if (bits) {
+            start = start - start % BITS_PER_LONG + __builtin_ctzl(bits);
+            return MIN(start, nbits);
+        }
+        start = start - start % BITS_PER_LONG + BITS_PER_LONG;
+    }
+    return nbits;
+}
+
+static u8 *ext2_load_bitmap(struct ext2_sb_info *sbi, u8 **cached, u32 blk)
+{
+    u8 *map;
+
+    if (*cached)
+        return *cached;
+
+    map = kmalloc(sbi->s_block_size);
+    if (!map)
+        return NULL;
+    if (ext2_read_blocks(sbi, blk, map, 1)) {
+        kfree(map);
+        return NULL;
+    }
+    *cached = map;
+    return map;
+}
+
+static inline u32 ext2_group_first_block(struct ext2_sb_info *sbi, u32 group)
+{
+    return sbi->s_es.s_first_data_block + group * sbi->s_blocks_per_group;
+}
+
+// The last group is usually shorter than the rest
+static inline u32 ext2_group_nr_blocks(struct ext2_sb_info *sbi, u32 group)
+{
+    return MIN(sbi->s_blocks_per_group,
+        sbi->s_es.s_blocks_count - ext2_group_first_block(sbi, group));
+}
+
+/*
+ * Allocate one block, as close after goal as possible: first in the goal's
+ * own group, then in the following groups. Keeping a file's blocks in
+ * order lets reads of it be merged into large requests.
+ */
+int ext2_new_block(struct super_block *sb, u32 goal, u32 *blk)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(sb);
+    struct ext2_group_desc *gd;
+    struct ext2_group_info *gi;
+    u32 group, start, bit, nbits;
+    u8 *map;
+
+    if (sbi->s_rdonly)
+        return -EROFS;
+    if (goal < sbi->s_es.s_first_data_block || goal >= sbi->s_es.s_blocks_count)
+        goal = sbi->s_es.s_first_data_block;
+    group = (goal - sbi->s_es.s_first_data_block) / sbi->s_blocks_per_group;
+    start = (goal - sbi->s_es.s_first_data_block) % sbi->s_blocks_per_group;
+
+    mutex_lock(&sbi->s_alloc_lock);
+    for (u32 n = 0; n <= sbi->s_groups_count; n++, start = 0) {
+        u32 g = (group + n) % sbi->s_groups_count;
+        gd = &sbi->s_group_desc[g];
+        gi = &sbi->s_group_info[g];
+        if (!gd->bg_free_blocks_count)
+            continue;
+
+        map = ext2_load_bitmap(sbi, &gi->block_bitmap, gd->bg_block_bitmap);
+        if (!map) {
+            mutex_unlock(&sbi->s_alloc_lock);
+            return -EIO;
+        }
+
+        nbits = ext2_group_nr_blocks(sbi, g);
+        // The goal's group is scanned again from its start on the last pass
+        bit = ext2_find_zero_bit(map, nbits, start);
+        if (bit >= nbits)
+            continue;
+
+        ext2_set_bit(map, bit);
+        gi->block_dirty = true;
+        gd->bg_free_blocks_count--;
+        sbi->s_es.s_free_blocks_count--;
+        sbi->s_gdt_dirty = true;
+        sbi->s_sb_dirty = true;
+        mutex_unlock(&sbi->s_alloc_lock);
+
+        *blk = ext2_group_first_block(sbi, g) + bit;
+        return 0;
+    }
+    mutex_unlock(&sbi->s_alloc_lock);
+    return -ENOSPC;
+}
+
+void ext2_free_block(struct super_block *sb, u32 blk)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(sb);
+    u32 group, bit;
+    u8 *map;
+
+    if (blk < sbi->s_es.s_first_data_block || blk >= sbi->s_es.s_blocks_count) {
+        klog(LOG_WARN, "ext2: freeing block %u out of range\n", blk);
+        return;
+    }
+    group = (blk - sbi->s_es.s_first_data_block) / sbi->s_blocks_per_group;
+    bit = (blk - sbi->s_es.s_first_data_block) % sbi->s_blocks_per_group;
+
+    mutex_lock(&sbi->s_alloc_lock);
+    map = ext2_load_bitmap(sbi, &sbi->s_group_info[group].block_bitmap,
+        sbi->s_group_desc[group].bg_block_bitmap);
+    if (map && ext2_test_bit(map, bit)) {
+        ext2_clear_bit(map, bit);
+        sbi->s_group_info[group].block_dirty = true;
+        sbi->s_group_desc[group].bg_free_blocks_count++;
+        sbi->s_es.s_free_blocks_count++;
+        sbi->s_gdt_dirty = true;
+        sbi->s_sb_dirty = true;
+    } else if (map) {
+        klog(LOG_WARN, "ext2: block %u already free\n", blk);
+    }
+    mutex_unlock(&sbi->s_alloc_lock);
+}
+
+/*
+ * New directories go to the group with the most free inodes among those
+ * with an above average number of free blocks, spreading the tree out.
+ * Files stay with their parent directory when it has room.
+ */
+static u32 ext2_find_group(struct ext2_sb_info *sbi, u32 parent_group, bool dir)
+{
+    struct ext2_group_desc *gd;
+    u32 avg_blocks = sbi->s_es.s_free_blocks_count / sbi->s_groups_count;
+    u32 best = -1U, best_free = 0;
+
+    if (dir) {
+        for (u32 g = 0; g < sbi->s_groups_count; g++) {
+            gd = &sbi->s_group_desc[g];
+            if (gd->bg_free_inodes_count > best_free &&
+                    gd->bg_free_blocks_count >= avg_blocks) {
+                best = g;
+                best_free = gd->bg_free_inodes_count;
+            }
+        }
+        if (best != -1U)
+            return best;
+    }
+
+    for (u32 n = 0; n < sbi->s_groups_count; n++) {
+        u32 g = (parent_group + n) % sbi->s_groups_count;
+        gd = &sbi->s_group_desc[g];
+        if (gd->bg_free_inodes_count && (gd->bg_free_blocks_count || n))
+            return g;
+    }
+    return -1U;
+}
+
+int ext2_new_inode(struct super_block *sb, u32 parent_group, bool dir, u32 *ino)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(sb);
+    struct ext2_group_desc *gd;
+    struct ext2_group_info *gi;
+    u32 group, bit;
+    u8 *map;
+
+    if (sbi->s_rdonly)
+        return -EROFS;
+
+    mutex_lock(&sbi->s_alloc_lock);
+    group = ext2_find_group(sbi, parent_group, dir);
+    if (group == -1U) {
+        mutex_unlock(&sbi->s_alloc_lock);
+        return -ENOSPC;
+    }
+
+    for (u32 n = 0; n < sbi->s_groups_count; n++) {
+        u32 g = (group + n) % sbi->s_groups_count;
+        gd = &sbi->s_group_desc[g];
+        gi = &sbi->s_group_info[g];
+        if (!gd->bg_free_inodes_count)
+            continue;
+
+        map = ext2_load_bitmap(sbi, &gi->inode_bitmap, gd->bg_inode_bitmap);
+        if (!map) {
+            mutex_unlock(&sbi->s_alloc_lock);
+            return -EIO;
+        }
+
+        // Reserved inodes are marked in use by mkfs, but skip them anyway
+        bit = ext2_find_zero_bit(map, sbi->s_inodes_per_group,
+            g ? 0 : sbi->s_first_ino - 1);
+        if (bit >= sbi->s_inodes_per_group)
+            continue;
+
+        ext2_set_bit(map, bit);
+        gi->inode_dirty = true;
+        gd->bg_free_inodes_count--;
+        if (dir)
+            gd->bg_used_dirs_count++;
+        sbi->s_es.s_free_inodes_count--;
+        sbi->s_gdt_dirty = true;
+        sbi->s_sb_dirty = true;
+        mutex_unlock(&sbi->s_alloc_lock);
+
+        *ino = g * sbi->s_inodes_per_group + bit + 1;
+        return 0;
+    }
+    mutex_unlock(&sbi->s_alloc_lock);
+    return -ENOSPC;
+}
+
+void ext2_free_inode(struct super_block *sb, u32 ino, bool dir)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(sb);
+    u32 group = ext2_block_group(ino, sb);
+    u32 bit = ext2_group_index(ino, sb);
+    u8 *map;
+
+    if (ino < sbi->s_first_ino || group >= sbi->s_groups_count) {
+        klog(LOG_WARN, "ext2: freeing reserved or invalid inode %u\n", ino);
+        return;
+    }
+
+    mutex_lock(&sbi->s_alloc_lock);
+    map = ext2_load_bitmap(sbi, &sbi->s_group_info[group].inode_bitmap,
+        sbi->s_group_desc[group].bg_inode_bitmap);
+    if (map && ext2_test_bit(map, bit)) {
+        ext2_clear_bit(map, bit);
+        sbi->s_group_info[group].inode_dirty = true;
+        sbi->s_group_desc[group].bg_free_inodes_count++;
+        if (dir)
+            sbi->s_group_desc[group].bg_used_dirs_count--;
+        sbi->s_es.s_free_inodes_count++;
+        sbi->s_gdt_dirty = true;
+        sbi->s_sb_dirty = true;
+    }
+    mutex_unlock(&sbi->s_alloc_lock);
+}
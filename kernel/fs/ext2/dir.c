@@ -0,0 +1,669 @@
+#include <lilac/fs.h>
+#include <lilac/log.h>
+#include <lilac/libc.h>
+#include <lilac/err.h>
+#include <lilac/timer.h>
+#include <mm/kmalloc.h>
+
+#include "ext2.h"
+
+#pragma GCC diagnostic ignored "-Wanalyzer-malloc-leak"
+
+/* Where a directory entry was found */
+struct ext2_dir_loc {
+    u32 lblk;
+    u32 off;
+    int prev;       /* offset of the previous entry in the block, or -1 */
+    u32 ino;
+    u8  file_type;
+};
+
+/* Leaf an htree lookup lands on, and the one after it for collisions */
+struct dx_hint {
+    u32 hash;
+    u32 leaf;
+    u32 next_leaf;
+    u32 next_hash;
+    bool has_next;
+};
+
+static const u8 ext2_type_to_dt[] = {
+    [EXT2_DT_UNKN] = DT_UNKNOWN,
+    [EXT2_DT_REG] = DT_REG,
+    [EXT2_DT_DIR] = DT_DIR,
+    [EXT2_DT_CHR] = DT_CHR,
+    [EXT2_DT_BLK] = DT_BLK,
+    [EXT2_DT_FIFO] = DT_FIFO,
+    [EXT2_DT_SOCK] = DT_SOCK,
+    [EXT2_DT_SLNK] = DT_LNK,
+};
+
+static u8 ext2_mode_to_type(struct super_block *sb, umode_t mode)
+{
+    if (!(EXT2_SB(sb)->s_es.s_feature_incompat & EXT2_FEATURE_FILETYPE))
+        return EXT2_DT_UNKN;
+    if (S_ISREG(mode))
+        return EXT2_DT_REG;
+    if (S_ISDIR(mode))
+        return EXT2_DT_DIR;
+    if (S_ISLNK(mode))
+        return EXT2_DT_SLNK;
+    if (S_ISCHR(mode))
+        return EXT2_DT_CHR;
+    if (S_ISBLK(mode))
+        return EXT2_DT_BLK;
+    if (S_ISFIFO(mode))
+        return EXT2_DT_FIFO;
+    return EXT2_DT_UNKN;
+}
+
+static inline bool ext2_dir_indexed(struct inode *dir)
+{
+    return EXT2_SB(dir->i_sb)->s_dir_index &&
+        (EXT2_I(dir)->raw.i_flags & EXT2_INODE_FLAG_HASHED);
+}
+
+static int ext2_dir_read_block(struct inode *dir, u32 lblk, void *buf)
+{
+    u32 pblk;
+    int err = ext2_bmap(dir, lblk, false, &pblk);
+
+    if (err)
+        return err;
+    if (!pblk)
+        return -EIO;
+    return ext2_read_blocks(EXT2_SB(dir->i_sb), pblk, buf, 1);
+}
+
+static int ext2_dir_write_block(struct inode *dir, u32 lblk, const void *buf)
+{
+    u32 pblk;
+    int err = ext2_bmap(dir, lblk, false, &pblk);
+
+    if (err)
+        return err;
+    if (!pblk)
+        return -EIO;
+    return ext2_write_blocks(EXT2_SB(dir->i_sb), pblk, buf, 1);
+}
+
+static inline bool ext2_dirent_ok(const struct ext2_dir_entry *de, u32 off,
+    u32 bs)
+{
+    return de->rec_len >= 8 && de->rec_len % 4 == 0 &&
+        off + de->rec_len <= bs && EXT2_DIR_REC_LEN(de->name_len) <= de->rec_len;
+}
+
+static u32 ext2_dir_blocks(struct inode *dir)
+{
+    return dir->i_size / EXT2_SB(dir->i_sb)->s_block_size;
+}
+
+// Return 1 and fill loc if the block holds name, 0 if not
+static int ext2_search_block(u8 *buf, u32 bs, const char *name, int len,
+    struct ext2_dir_loc *loc)
+{
+    struct ext2_dir_entry *de;
+    int prev = -1;
+
+    for (u32 off = 0; off < bs; off += de->rec_len) {
+        de = (struct ext2_dir_entry*)(buf + off);
+        if (!ext2_dirent_ok(de, off, bs))
+            return -EIO;
+        if (de->inode && de->name_len == len && !memcmp(de->name, name, len)) {
+            loc->off = off;
+            loc->prev = prev;
+            loc->ino = de->inode;
+            loc->file_type = de->file_type;
+            return 1;
+        }
+        prev = off;
+    }
+    return 0;
+}
+
+/*
+ * Walk the htree index down to the leaf block that holds the hash of name.
+ * Anything unexpected in the index makes the caller fall back to a linear
+ * search, which always works since index blocks look like empty entries.
+ */
+static int ext2_dx_probe(struct inode *dir, const char *name, int len, u8 *buf,
+    struct dx_hint *h)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(dir->i_sb);
+    struct dx_root_info *info;
+    struct dx_countlimit *cl;
+    struct dx_entry *entries;
+    int version, levels, lo, hi, err;
+
+    if ((err = ext2_dir_read_block(dir, 0, buf)))
+        return err;
+
+    info = (struct dx_root_info*)(buf + EXT2_DIR_REC_LEN(1) + EXT2_DIR_REC_LEN(2));
+    if (info->reserved_zero || info->info_length != sizeof(*info) ||
+            info->indirect_levels > 1 || info->hash_version > DX_HASH_TEA)
+        return -EINVAL;
+
+    version = info->hash_version;
+    if (sbi->s_hash_unsigned)
+        version += DX_HASH_LEGACY_UNSIGNED;
+    h->hash = ext2_dirhash(name, len, version, sbi->s_hash_seed);
+    levels = info->indirect_levels;
+    entries = (struct dx_entry*)((u8*)info + info->info_length);
+
+    for (;;) {
+        // The first entry's hash field holds the limit and count
+        cl = (struct dx_countlimit*)entries;
+        if (!cl->count || cl->count > cl->limit ||
+                (u8*)(entries + cl->count) > buf + sbi->s_block_size)
+            return -EINVAL;
+
+        // Last entry whose hash is <= ours; entry 0 covers everything below
+        lo = 1;
+        hi = cl->count - 1;
+        while (lo <= hi) {
+            int mid = (lo + hi) / 2;
+            if (entries[mid].hash > h->hash)
+                hi = mid - 1;
+            else
+                lo = mid + 1;
+        }
+
+        if (levels-- == 0) {
+            h->leaf = entries[lo - 1].block & 0x0FFFFFFF;
+            h->has_next = lo < cl->count;
+            if (h->has_next) {
+                h->next_leaf = entries[lo].block & 0x0FFFFFFF;
+                h->next_hash = entries[lo].hash;
+            }
+            return 0;
+        }
+
+        if ((err = ext2_dir_read_block(dir, entries[lo - 1].block & 0x0FFFFFFF, buf)))
+            return err;
+        // Interior nodes start with an empty entry spanning the block
+        entries = (struct dx_entry*)(buf + 8);
+    }
+}
+
+static int ext2_dx_find(struct inode *dir, const char *name, int len, u8 *buf,
+    struct ext2_dir_loc *loc)
+{
+    struct dx_hint h;
+    int err = ext2_dx_probe(dir, name, len, buf, &h);
+
+    if (err)
+        return err;
+
+    for (;;) {
+        if ((err = ext2_dir_read_block(dir, h.leaf, buf)))
+            return err;
+        err = ext2_search_block(buf, EXT2_SB(dir->i_sb)->s_block_size, name,
+            len, loc);
+        if (err > 0) {
+            loc->lblk = h.leaf;
+            return 0;
+        }
+        if (err < 0)
+            return err;
+
+        // Names with the same hash can spill into the following leaf
+        if (!h.has_next || (h.next_hash & ~1) != h.hash)
+            return -ENOENT;
+        h.leaf = h.next_leaf;
+        h.has_next = false;
+    }
+}
+
+// Find name in dir: 0 on success, -ENOENT if missing. Caller holds its
+// i_dir_lock.
+static int ext2_find_entry(struct inode *dir, const char *name, int len,
+    u8 *buf, struct ext2_dir_loc *loc)
+{
+    const u32 bs = EXT2_SB(dir->i_sb)->s_block_size;
+    u32 nblocks = ext2_dir_blocks(dir);
+    int err;
+
+    if (ext2_dir_indexed(dir)) {
+        err = ext2_dx_find(dir, name, len, buf, loc);
+        if (err != -EINVAL)
+            return err;
+        klog(LOG_WARN, "ext2: bad htree in dir %lu, searching linearly\n",
+            dir->i_ino);
+    }
+
+    for (u32 lblk = 0; lblk < nblocks; lblk++) {
+        if ((err = ext2_dir_read_block(dir, lblk, buf)))
+            return err;
+        err = ext2_search_block(buf, bs, name, len, loc);
+        if (err > 0) {
+            loc->lblk = lblk;
+            return 0;
+        }
+        if (err < 0)
+            return err;
+    }
+    return -ENOENT;
+}
+
+// Put a new entry in the first gap that fits, splitting a live entry's slack
+static bool ext2_insert_in_block(u8 *buf, u32 bs, const char *name, int len,
+    u32 ino, u8 type)
+{
+    const u32 need = EXT2_DIR_REC_LEN(len);
+    struct ext2_dir_entry *de, *new;
+
+    for (u32 off = 0; off < bs; off += de->rec_len) {
+        de = (struct ext2_dir_entry*)(buf + off);
+        if (!ext2_dirent_ok(de, off, bs))
+            return false;
+
+        u32 used = de->inode ? EXT2_DIR_REC_LEN(de->name_len) : 0;
+        if (de->rec_len < used + need)
+            continue;
+
+        if (de->inode) {
+            new = (struct ext2_dir_entry*)((u8*)de + used);
+            new->rec_len = de->rec_len - used;
+            de->rec_len = used;
+            de = new;
+        }
+        de->inode = ino;
+        de->name_len = len;
+        de->file_type = type;
+        memcpy(de->name, name, len);
+        return true;
+    }
+    return false;
+}
+
+static int ext2_add_entry(struct inode *dir, const char *name, int len,
+    u32 ino, u8 type, u8 *buf)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(dir->i_sb);
+    const u32 bs = sbi->s_block_size;
+    u32 nblocks = ext2_dir_blocks(dir);
+    struct ext2_dir_entry *de;
+    struct dx_hint h;
+    u32 pblk;
+    int err;
+
+    /*
+     * Indexed directories keep the index valid as long as the entry fits in
+     * the leaf its hash maps to. Splitting leaves isn't supported, so when
+     * it doesn't fit the index is dropped, as older kernels would do.
+     */
+    if (ext2_dir_indexed(dir)) {
+        if (!ext2_dx_probe(dir, name, len, buf, &h) &&
+                !ext2_dir_read_block(dir, h.leaf, buf) &&
+                ext2_insert_in_block(buf, bs, name, len, ino, type))
+            return ext2_dir_write_block(dir, h.leaf, buf);
+
+        EXT2_I(dir)->raw.i_flags &= ~EXT2_INODE_FLAG_HASHED;
+        EXT2_I(dir)->dirty = true;
+        if ((err = ext2_write_inode(dir, NULL)))
+            return err;
+    }
+
+    for (u32 lblk = 0; lblk < nblocks; lblk++) {
+        if ((err = ext2_dir_read_block(dir, lblk, buf)))
+            return err;
+        if (ext2_insert_in_block(buf, bs, name, len, ino, type))
+            return ext2_dir_write_block(dir, lblk, buf);
+    }
+
+    // Every block is full, grow the directory by one
+    err = ext2_bmap(dir, nblocks, true, &pblk);
+    if (err < 0)
+        return err;
+    memset(buf, 0, bs);
+    de = (struct ext2_dir_entry*)buf;
+    de->rec_len = bs;
+    ext2_insert_in_block(buf, bs, name, len, ino, type);
+    if ((err = ext2_write_blocks(sbi, pblk, buf, 1)))
+        return err;
+
+    ext2_set_size(dir, (u64)(nblocks + 1) * bs);
+    return ext2_write_inode(dir, NULL);
+}
+
+static int ext2_delete_entry(struct inode *dir, struct ext2_dir_loc *loc,
+    u8 *buf)
+{
+    struct ext2_dir_entry *de, *prev;
+    int err;
+
+    if ((err = ext2_dir_read_block(dir, loc->lblk, buf)))
+        return err;
+
+    de = (struct ext2_dir_entry*)(buf + loc->off);
+    if (loc->prev >= 0) {
+        prev = (struct ext2_dir_entry*)(buf + loc->prev);
+        prev->rec_len += de->rec_len;
+    } else {
+        de->inode = 0;
+    }
+    return ext2_dir_write_block(dir, loc->lblk, buf);
+}
+
+static int ext2_dir_empty(struct inode *dir, u8 *buf)
+{
+    const u32 bs = EXT2_SB(dir->i_sb)->s_block_size;
+    struct ext2_dir_entry *de;
+    int err;
+
+    for (u32 lblk = 0; lblk < ext2_dir_blocks(dir); lblk++) {
+        if ((err = ext2_dir_read_block(dir, lblk, buf)))
+            return err;
+        for (u32 off = 0; off < bs; off += de->rec_len) {
+            de = (struct ext2_dir_entry*)(buf + off);
+            if (!ext2_dirent_ok(de, off, bs))
+                return -EIO;
+            if (!de->inode)
+                continue;
+            if (de->name_len > 2 || de->name[0] != '.' ||
+                    (de->name_len == 2 && de->name[1] != '.'))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static int ext2_check_name(struct dentry *dentry)
+{
+    size_t len = strlen(dentry->d_name);
+
+    if (!len)
+        return -ENOENT;
+    if (len > NAME_MAX || len > 255)
+        return -ENAMETOOLONG;
+    return len;
+}
+
+struct dentry *ext2_lookup(struct inode *dir, struct dentry *dentry,
+    unsigned int flags)
+{
+    struct ext2_dir_loc loc;
+    struct inode *inode;
+    int len = ext2_check_name(dentry);
+    u8 *buf;
+    int err;
+
+    if (len < 0)
+        return ERR_PTR(len);
+
+    buf = kmalloc(EXT2_SB(dir->i_sb)->s_block_size);
+    if (!buf)
+        return ERR_PTR(-ENOMEM);
+
+    // The reference is taken before an unlink can free the inode
+    mutex_lock(&EXT2_I(dir)->i_dir_lock);
+    err = ext2_find_entry(dir, dentry->d_name, len, buf, &loc);
+    inode = err ? NULL : ext2_iget(dir->i_sb, loc.ino);
+    mutex_unlock(&EXT2_I(dir)->i_dir_lock);
+    kfree(buf);
+
+    if (err == -ENOENT)
+        return NULL;
+    if (err)
+        return ERR_PTR(err);
+    if (IS_ERR(inode))
+        return ERR_CAST(inode);
+    dentry->d_inode = inode;
+    return NULL;
+}
+
+int ext2_readdir(struct file *file, struct dirent *dirp, unsigned int count)
+{
+    struct inode *dir = file->f_dentry->d_inode;
+    const u32 bs = EXT2_SB(dir->i_sb)->s_block_size;
+    struct ext2_dir_entry *de;
+    off_t pos = 0;
+    u32 i = 0;
+    u8 *buf;
+    int err = 0;
+
+    buf = kmalloc(bs);
+    if (!buf)
+        return -ENOMEM;
+
+    mutex_lock(&EXT2_I(dir)->i_dir_lock);
+    for (u32 lblk = 0; lblk < ext2_dir_blocks(dir) && i < count; lblk++) {
+        if ((err = ext2_dir_read_block(dir, lblk, buf)))
+            break;
+        for (u32 off = 0; off < bs && i < count; off += de->rec_len) {
+            de = (struct ext2_dir_entry*)(buf + off);
+            if (!ext2_dirent_ok(de, off, bs)) {
+                err = -EIO;
+                break;
+            }
+            if (!de->inode || pos++ < file->f_pos)
+                continue;
+
+            u32 n = MIN(de->name_len, sizeof(dirp[i].d_name) - 1);
+            memcpy(dirp[i].d_name, de->name, n);
+            dirp[i].d_name[n] = '\0';
+            dirp[i].d_ino = de->inode;
+            dirp[i].d_reclen = sizeof(struct dirent);
+            dirp[i].d_off = file->f_pos + i;
+            dirp[i].d_type = de->file_type < sizeof(ext2_type_to_dt) ?
+                ext2_type_to_dt[de->file_type] : DT_UNKNOWN;
+            i++;
+        }
+        if (err)
+            break;
+    }
+    mutex_unlock(&EXT2_I(dir)->i_dir_lock);
+
+    kfree(buf);
+    return i ? (int)i : err;
+}
+
+// Allocate an inode and link it into dir under dentry's name
+static struct inode *ext2_new_entry(struct inode *dir, struct dentry *dentry,
+    umode_t mode, u8 *buf)
+{
+    struct ext2_dir_loc loc;
+    int len = ext2_check_name(dentry);
+    int err;
+
+    if (len < 0)
+        return ERR_PTR(len);
+    if (EXT2_SB(dir->i_sb)->s_rdonly)
+        return ERR_PTR(-EROFS);
+
+    err = ext2_find_entry(dir, dentry->d_name, len, buf, &loc);
+    if (!err)
+        return ERR_PTR(-EEXIST);
+    if (err != -ENOENT)
+        return ERR_PTR(err);
+
+    return ext2_new_vfs_inode(dir, mode);
+}
+
+// Unlinked, the final iput gives its blocks and number back
+static void ext2_drop_new_inode(struct inode *inode)
+{
+    inode->i_nlink = 0;
+    iput(inode);
+}
+
+int ext2_create(struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+    struct inode *inode;
+    u8 *buf;
+    int err;
+
+    if (!(mode & 0777))
+        mode |= 0644;
+    mode = S_IFREG | (mode & 07777);
+
+    buf = kmalloc(EXT2_SB(dir->i_sb)->s_block_size);
+    if (!buf)
+        return -ENOMEM;
+
+    mutex_lock(&EXT2_I(dir)->i_dir_lock);
+    inode = ext2_new_entry(dir, dentry, mode, buf);
+    if (IS_ERR(inode)) {
+        err = PTR_ERR(inode);
+        goto out;
+    }
+
+    // The inode goes to disk before the name that points at it
+    err = ext2_write_inode(inode, NULL);
+    if (!err)
+        err = ext2_add_entry(dir, dentry->d_name, strlen(dentry->d_name),
+            inode->i_ino, ext2_mode_to_type(dir->i_sb, mode), buf);
+    if (err) {
+        ext2_drop_new_inode(inode);
+        goto out;
+    }
+    dentry->d_inode = inode;
+
+out:
+    mutex_unlock(&EXT2_I(dir)->i_dir_lock);
+    kfree(buf);
+    return err;
+}
+
+int ext2_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(dir->i_sb);
+    struct ext2_dir_entry *de;
+    struct inode *inode;
+    u32 pblk;
+    u8 *buf;
+    int err;
+
+    if (!(mode & 0777))
+        mode |= 0755;
+    mode = S_IFDIR | (mode & 07777);
+
+    buf = kmalloc(sbi->s_block_size);
+    if (!buf)
+        return -ENOMEM;
+
+    mutex_lock(&EXT2_I(dir)->i_dir_lock);
+    inode = ext2_new_entry(dir, dentry, mode, buf);
+    if (IS_ERR(inode)) {
+        err = PTR_ERR(inode);
+        goto out;
+    }
+
+    err = ext2_bmap(inode, 0, true, &pblk);
+    if (err < 0) {
+        ext2_drop_new_inode(inode);
+        goto out;
+    }
+
+    memset(buf, 0, sbi->s_block_size);
+    de = (struct ext2_dir_entry*)buf;
+    de->inode = inode->i_ino;
+    de->rec_len = EXT2_DIR_REC_LEN(1);
+    de->name_len = 1;
+    de->file_type = ext2_mode_to_type(dir->i_sb, S_IFDIR);
+    de->name[0] = '.';
+    de = (struct ext2_dir_entry*)(buf + EXT2_DIR_REC_LEN(1));
+    de->inode = dir->i_ino;
+    de->rec_len = sbi->s_block_size - EXT2_DIR_REC_LEN(1);
+    de->name_len = 2;
+    de->file_type = ext2_mode_to_type(dir->i_sb, S_IFDIR);
+    de->name[0] = '.';
+    de->name[1] = '.';
+
+    inode->i_nlink = 2;
+    ext2_set_size(inode, sbi->s_block_size);
+    err = ext2_write_blocks(sbi, pblk, buf, 1);
+    if (!err)
+        err = ext2_write_inode(inode, NULL);
+    if (!err)
+        err = ext2_add_entry(dir, dentry->d_name, strlen(dentry->d_name),
+            inode->i_ino, ext2_mode_to_type(dir->i_sb, mode), buf);
+    if (err) {
+        ext2_drop_new_inode(inode);
+        goto out;
+    }
+
+    dir->i_nlink++;
+    EXT2_I(dir)->dirty = true;
+    err = ext2_write_inode(dir, NULL);
+    dentry->d_inode = inode;
+
+out:
+    mutex_unlock(&EXT2_I(dir)->i_dir_lock);
+    kfree(buf);
+    return err;
+}
+
+static int ext2_remove_entry(struct inode *dir, struct dentry *dentry,
+    bool is_dir)
+{
+    struct inode *inode = dentry->d_inode;
+    struct ext2_dir_loc loc;
+    int len = ext2_check_name(dentry);
+    u8 *buf;
+    int err;
+
+    if (len < 0)
+        return len;
+    if (EXT2_SB(dir->i_sb)->s_rdonly)
+        return -EROFS;
+
+    buf = kmalloc(EXT2_SB(dir->i_sb)->s_block_size);
+    if (!buf)
+        return -ENOMEM;
+
+    mutex_lock(&EXT2_I(dir)->i_dir_lock);
+    err = ext2_find_entry(dir, dentry->d_name, len, buf, &loc);
+    if (err)
+        goto out;
+    if (!inode || inode->i_ino != loc.ino) {
+        err = -ENOENT;
+        goto out;
+    }
+
+    if (is_dir) {
+        // Parent before child, the only order two directory locks are taken
+        mutex_lock(&EXT2_I(inode)->i_dir_lock);
+        err = ext2_dir_empty(inode, buf);
+        mutex_unlock(&EXT2_I(inode)->i_dir_lock);
+        if (err <= 0) {
+            err = err ? err : -ENOTEMPTY;
+            goto out;
+        }
+    }
+
+    if ((err = ext2_delete_entry(dir, &loc, buf)))
+        goto out;
+
+    inode->i_ctime = dir->i_mtime = dir->i_ctime = get_unix_time();
+    if (is_dir) {
+        // Drop the link from "." and the one ".." held on the parent
+        inode->i_nlink = 0;
+        dir->i_nlink--;
+    } else if (inode->i_nlink) {
+        inode->i_nlink--;
+    }
+    EXT2_I(dir)->dirty = true;
+    EXT2_I(inode)->dirty = true;
+
+    // Blocks are freed by the final iput, the file may still be open
+    err = ext2_write_inode(inode, NULL);
+    if (!err)
+        err = ext2_write_inode(dir, NULL);
+
+out:
+    mutex_unlock(&EXT2_I(dir)->i_dir_lock);
+    kfree(buf);
+    return err;
+}
+
+int ext2_unlink(struct inode *dir, struct dentry *dentry)
+{
+    return ext2_remove_entry(dir, dentry, false);
+}
+
+int ext2_rmdir(struct inode *dir, struct dentry *dentry)
+{
+    return ext2_remove_entry(dir, dentry, true);
+}
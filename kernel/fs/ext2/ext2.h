@@ -37,46 +37,6 @@
 #define EXT2_FEATURE_RO_LARGE_FILE   0x0002
 #define EXT2_FEATURE_RO_BTREE_DIR    0x0004
 
-struct ext2_sb_mem {
-    u32 s_inodes_count;
-    u32 s_blocks_count;
-    u32 s_r_blocks_count;
-    u32 s_free_blocks_count;
-    u32 s_free_inodes_count;
-    u32 s_first_data_block;
-    u32 s_log_block_size;
-    u32 s_log_frag_size;
-    u32 s_blocks_per_group;
-    u32 s_frags_per_group;
-    u32 s_inodes_per_group;
-    u32 s_mtime;
-    u32 s_wtime;
-    u16 s_mnt_count;
-    u16 s_max_mnt_count;
-    u16 s_magic;
-    u16 s_state;
-    u16 s_errors;
-    u16 s_minor_rev_level;
-    u32 s_lastcheck;
-    u32 s_checkinterval;
-    u32 s_creator_os;
-    u32 s_rev_level;
-    u16 s_def_resuid;
-    u16 s_def_resgid;
-
-    // EXT2_DYNAMIC_REV superblock fields
-    u32 s_first_ino;
-    u16 s_inode_size;
-    u16 s_block_group_nr;
-    u32 s_feature_compat;
-    u32 s_feature_incompat;
-    u32 s_feature_ro_compat;
-    u8  s_uuid[16];
-    char s_volume_name[16];
-    char s_last_mounted[64];
-    u32 s_algorithm_usage_bitmap;
-} __packed;
-
 struct ext2_sb {
     u32 s_inodes_count;
     u32 s_blocks_count;
@@ -132,9 +92,20 @@ struct ext2_sb {
     u16 s_reserved_word_pad;
     u32 s_default_mount_opts;
     u32 s_first_meta_bg;
-    u32 reserved[190];
+    u32 s_mkfs_time;
+    u32 s_jnl_blocks[17];
+    u32 s_blocks_count_hi;
+    u32 s_r_blocks_count_hi;
+    u32 s_free_blocks_hi;
+    u16 s_min_extra_isize;
+    u16 s_want_extra_isize;
+    u32 s_flags;
+    u32 reserved[167];
 } __packed;
 
+#define EXT2_FLAGS_SIGNED_HASH      0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH    0x0002
+
 struct ext2_group_desc {
     u32 bg_block_bitmap;
     u32 bg_inode_bitmap;
@@ -147,13 +118,54 @@ struct ext2_group_desc {
 
 static_assert(sizeof(struct ext2_sb) == 1024, "ext2 superblock size incorrect");
 static_assert(sizeof(struct ext2_group_desc) == 32, "ext2 block group descriptor size incorrect");
+static_assert(offsetof(struct ext2_sb, s_flags) == 0x160, "ext2 superblock layout incorrect");
+
+#define EXT2_ROOT_INO       2
+#define EXT2_GOOD_OLD_FIRST_INO     11
+#define EXT2_GOOD_OLD_INODE_SIZE    128
+
+/* Features this driver understands */
+#define EXT2_FEATURE_INCOMPAT_SUPP  EXT2_FEATURE_FILETYPE
+#define EXT2_FEATURE_RO_COMPAT_SUPP (EXT2_FEATURE_RO_SPARSE_SUPER | \
+                                     EXT2_FEATURE_RO_LARGE_FILE)
 
-#define EXT2_SB(sb) ((struct ext2_sb_mem *)(sb)->s_fs_info)
+struct ext2_group_info {
+    u8 *block_bitmap;       /* loaded on first allocation in the group */
+    u8 *inode_bitmap;
+    bool block_dirty;
+    bool inode_dirty;
+};
+
+/* In-memory superblock, hung off super_block->s_fs_info */
+struct ext2_sb_info {
+    struct ext2_sb s_es;                /* on-disk superblock copy */
+    struct block_device *s_bdev;
+    u32 s_block_size;
+    u32 s_sect_per_block;
+    u32 s_addr_per_block;
+    u32 s_blocks_per_group;
+    u32 s_inodes_per_group;
+    u32 s_inode_size;
+    u32 s_first_ino;
+    u32 s_groups_count;
+    u32 s_desc_per_block;
+    u32 s_gdt_blocks;
+    struct ext2_group_desc *s_group_desc;   /* every descriptor, in order */
+    struct ext2_group_info *s_group_info;
+    u32 s_hash_seed[4];
+    bool s_hash_unsigned;
+    bool s_dir_index;
+    bool s_rdonly;
+    bool s_gdt_dirty;
+    bool s_sb_dirty;
+    mutex_t s_alloc_lock;               /* bitmaps, descriptors, free counts */
+};
+
+#define EXT2_SB(sb) ((struct ext2_sb_info *)(sb)->s_fs_info)
 
 #define EXT2_BLOCKS_PER_GROUP(s)	(EXT2_SB(s)->s_blocks_per_group)
 #define EXT2_DESC_PER_BLOCK(s)		(EXT2_SB(s)->s_desc_per_block)
 #define EXT2_INODES_PER_GROUP(s)	(EXT2_SB(s)->s_inodes_per_group)
-#define EXT2_DESC_PER_BLOCK_BITS(s)	(EXT2_SB(s)->s_desc_per_block_bits)
 #define EXT2_INODE_SIZE(sb)		    (EXT2_SB(sb)->s_inode_size ? EXT2_SB(sb)->s_inode_size : 128)
 
 static inline u32 ext2_block_group(u32 ino, struct super_block *sb)
@@ -185,10 +197,7 @@ struct ext2_inode {
     u32 i_disk_sectors;
     u32 i_flags;
     u32 i_osd1;
-    u32 i_block[12];
-    u32 i_block_indirect;
-    u32 i_block_double_indirect;
-    u32 i_block_triple_indirect;
+    u32 i_block[15];    /* 12 direct, then single, double, triple indirect */
     u32 i_generation;
     u32 i_file_acl;
     u32 i_dir_acl;
@@ -214,7 +223,7 @@ struct ext2_inode {
 #define EXT2_INODE_FLAG_APPEND    0x00000020 /* writes to file may only append */
 #define EXT2_INODE_FLAG_NODUMP    0x00000040 /* do not dump file */
 #define EXT2_INODE_FLAG_NOATIME   0x00000080 /* do not update atime */
-#define EXT2_INODE_FLAG_HASHED    0x00010000 /* hashed directory */
+#define EXT2_INODE_FLAG_HASHED    0x00001000 /* hashed directory */
 #define EXT2_INODE_FLAG_AFS_DIR   0x00020000 /* AFS directory */
 #define EXT2_INODE_FLAG_JDATA     0x00040000 /* journal file data */
 
@@ -235,7 +244,107 @@ struct ext2_dir_entry {
 #define EXT2_DT_SOCK     6
 #define EXT2_DT_SLNK     7
 
+#define EXT2_DIR_PAD            4
+#define EXT2_DIR_REC_LEN(len)   (((len) + 8 + EXT2_DIR_PAD - 1) & ~(EXT2_DIR_PAD - 1))
+
+#define EXT2_NDIR_BLOCKS    12
+#define EXT2_IND_BLOCK      12
+#define EXT2_DIND_BLOCK     13
+#define EXT2_TIND_BLOCK     14
+
+/* htree (EXT2_FEATURE_DIR_HASH) on-disk index */
+#define DX_HASH_LEGACY              0
+#define DX_HASH_HALF_MD4            1
+#define DX_HASH_TEA                 2
+#define DX_HASH_LEGACY_UNSIGNED     3
+#define DX_HASH_HALF_MD4_UNSIGNED   4
+#define DX_HASH_TEA_UNSIGNED        5
+
+struct dx_root_info {
+    u32 reserved_zero;
+    u8  hash_version;
+    u8  info_length;
+    u8  indirect_levels;
+    u8  unused_flags;
+} __packed;
+
+struct dx_entry {
+    u32 hash;
+    u32 block;
+} __packed;
+
+struct dx_countlimit {
+    u16 limit;
+    u16 count;
+} __packed;
+
+/* Recently used indirect blocks of one inode */
+#define EXT2_BMAP_SLOTS 4
+
+struct ext2_bmap_slot {
+    u32 blk;
+    u32 *data;
+};
+
+struct ext2_inode_info {
+    struct ext2_inode raw;
+    u32 i_block_group;
+    u32 i_alloc_goal;       /* try here first when the file grows */
+    struct ext2_bmap_slot i_bmap[EXT2_BMAP_SLOTS];
+    u32 i_bmap_next;
+    mutex_t i_dir_lock;     /* a directory's entries, across lookup and changes */
+    bool dirty;
+};
+
+#define EXT2_I(inode) ((struct ext2_inode_info *)(inode)->i_private)
+
+extern const struct super_operations ext2_sops;
+extern const struct inode_operations ext2_iops;
+extern const struct file_operations ext2_fops;
+extern const struct address_space_operations ext2_aops;
+
+// sb.c
+int ext2_read_blocks(struct ext2_sb_info *sbi, u32 blk, void *buf, u32 count);
+int ext2_write_blocks(struct ext2_sb_info *sbi, u32 blk, const void *buf,
+    u32 count);
+int ext2_sync_metadata(struct super_block *sb);
+int ext2_sync_fs(struct super_block *sb, int wait);
+
+// balloc.c
+int ext2_new_block(struct super_block *sb, u32 goal, u32 *blk);
+void ext2_free_block(struct super_block *sb, u32 blk);
+int ext2_new_inode(struct super_block *sb, u32 parent_group, bool dir,
+    u32 *ino);
+void ext2_free_inode(struct super_block *sb, u32 ino, bool dir);
+
+// inode.c
+struct inode *ext2_iget(struct super_block *sb, u32 ino);
+struct inode *ext2_new_vfs_inode(struct inode *dir, umode_t mode);
+void ext2_destroy_inode(struct inode *inode);
+int ext2_write_inode(struct inode *inode, struct writeback_control *wbc);
+int ext2_bmap(struct inode *inode, u32 lblk, bool create, u32 *pblk);
+void ext2_truncate_blocks(struct inode *inode);
+void ext2_set_size(struct inode *inode, u64 size);
+
+// dir.c
+struct dentry *ext2_lookup(struct inode *dir, struct dentry *dentry,
+    unsigned int flags);
+int ext2_readdir(struct file *file, struct dirent *dirp, unsigned int count);
+int ext2_create(struct inode *dir, struct dentry *dentry, umode_t mode);
+int ext2_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
+int ext2_unlink(struct inode *dir, struct dentry *dentry);
+int ext2_rmdir(struct inode *dir, struct dentry *dentry);
+
+// hash.c
+u32 ext2_dirhash(const char *name, int len, int version, const u32 seed[4]);
 
-struct super_block *ext2_read_super(struct block_device *bdev, struct super_block *sb);
+// file.c
+int ext2_open(struct inode *inode, struct file *file);
+int ext2_release(struct inode *inode, struct file *file);
+ssize_t ext2_read_iter(struct file *file, struct iov_iter *to, off_t *ppos);
+ssize_t ext2_write_iter(struct file *file, struct iov_iter *from, off_t *ppos);
+int ext2_fsync(struct file *file, int datasync);
+int ext2_readpages(struct inode *inode, unsigned long index, void *buf,
+    unsigned int nr_pages);
 
 #endif
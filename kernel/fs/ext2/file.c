@@ -0,0 +1,220 @@
+#include <lilac/fs.h>
+#include <lilac/log.h>
+#include <lilac/libc.h>
+#include <lilac/err.h>
+#include <lilac/timer.h>
+#include <mm/kmm.h>
+#include <mm/page.h>
+
+#include "ext2.h"
+
+// Data staged per disk write, whatever the size of the caller's request
+#define EXT2_WRITE_CHUNK    (64 * 1024)
+
+const struct file_operations ext2_fops = {
+    .read_iter = ext2_read_iter,
+    .write_iter = ext2_write_iter,
+    .readdir = ext2_readdir,
+    .release = ext2_release,
+    .fsync = ext2_fsync,
+};
+
+const struct address_space_operations ext2_aops = {
+    .readpages = ext2_readpages,
+    .fault_page = filemap_get_page,
+    .writepage = filemap_writepage,
+};
+
+int ext2_open(struct inode *inode, struct file *file)
+{
+    file->f_op = &ext2_fops;
+    return 0;
+}
+
+int ext2_release(struct inode *inode, struct file *file)
+{
+    return 0;
+}
+
+ssize_t ext2_read_iter(struct file *file, struct iov_iter *to, off_t *ppos)
+{
+    return filemap_read(file, to, ppos);
+}
+
+// Fill the page cache, reading runs of physically contiguous blocks at once
+int ext2_readpages(struct inode *inode, unsigned long index, void *buf,
+    unsigned int nr_pages)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+    const u32 bs = sbi->s_block_size;
+    u64 pos = (u64)index * PAGE_SIZE;
+    u64 end = MIN(pos + (u64)nr_pages * PAGE_SIZE, inode->i_size);
+    u32 lblk = pos / bs;
+    u32 last = (end + bs - 1) / bs;
+    u8 *dst = buf;
+    int err = 0;
+
+    mutex_lock(&inode->i_mutex);
+    while (lblk < last) {
+        u32 pblk, next, run = 1;
+
+        if ((err = ext2_bmap(inode, lblk, false, &pblk)))
+            break;
+        if (!pblk) {
+            memset(dst, 0, bs);
+            dst += bs;
+            lblk++;
+            continue;
+        }
+
+        while (lblk + run < last && !ext2_bmap(inode, lblk + run, false, &next) &&
+                next == pblk + run)
+            run++;
+
+        if ((err = ext2_read_blocks(sbi, pblk, dst, run)))
+            break;
+        dst += (size_t)run * bs;
+        lblk += run;
+    }
+    mutex_unlock(&inode->i_mutex);
+
+    if (err)
+        return err;
+    // Blocks never extend past a page, so only the file's tail is left
+    memset((u8*)buf + (end - pos), 0, (size_t)nr_pages * PAGE_SIZE - (end - pos));
+    return 0;
+}
+
+/*
+ * Merge the old contents of a partially written block around the new data
+ * staged at buf; a freshly allocated block is zero instead.
+ */
+static int ext2_fill_partial(struct ext2_sb_info *sbi, u32 pblk, bool fresh,
+    u8 *buf, u32 start, u32 end, u8 *tmp)
+{
+    const u32 bs = sbi->s_block_size;
+
+    if (fresh) {
+        memset(tmp, 0, bs);
+    } else if (ext2_read_blocks(sbi, pblk, tmp, 1)) {
+        return -EIO;
+    }
+    memcpy(buf, tmp, start);
+    memcpy(buf + end, tmp + end, bs - end);
+    return 0;
+}
+
+/*
+ * Data is written through to disk in chunks of at most EXT2_WRITE_CHUNK,
+ * each run of physically contiguous blocks as one request, and the cached
+ * pages it covered dropped. The caller's data is staged before i_mutex is
+ * taken, since copying it in can fault on a mapping of this same file.
+ */
+ssize_t ext2_write_iter(struct file *file, struct iov_iter *from, off_t *ppos)
+{
+    struct inode *inode = file->f_dentry->d_inode;
+    struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+    const u32 bs = sbi->s_block_size;
+    const u32 max_blocks = MAX(EXT2_WRITE_CHUNK / bs, 1);
+    const size_t nr_pages = PAGE_UP_COUNT((size_t)(max_blocks + 1) * bs);
+    size_t count = iov_iter_count(from);
+    u64 pos = *ppos;
+    size_t done = 0;
+    u8 *stage, *tmp;
+    int err = 0;
+
+    if (sbi->s_rdonly)
+        return -EROFS;
+    if (!count)
+        return 0;
+    if (pos + count > inode->i_sb->s_maxbytes)
+        return -EFBIG;
+
+    // One extra block for merging partial blocks
+    stage = get_free_pages(nr_pages, 0);
+    if (!stage)
+        return -ENOMEM;
+    tmp = stage + (size_t)max_blocks * bs;
+
+    while (done < count && !err) {
+        u32 off = pos % bs;
+        size_t want = MIN(count - done, (size_t)max_blocks * bs - off);
+        size_t n = copy_from_iter(stage + off, want, from);
+        u32 lblk = pos / bs;
+        u32 nblk, run_start = 0, run_pblk = 0, run = 0;
+
+        if (n < want)
+            err = -EFAULT;
+        if (!n)
+            break;
+        nblk = (off + n + bs - 1) / bs;
+
+        mutex_lock(&inode->i_mutex);
+        for (u32 i = 0; i < nblk; i++) {
+            u32 start = i ? 0 : off;
+            u32 end = i == nblk - 1 ? (off + n - 1) % bs + 1 : bs;
+            u32 pblk;
+            int fresh;
+
+            fresh = ext2_bmap(inode, lblk + i, true, &pblk);
+            if (fresh >= 0 && (start || end < bs))
+                fresh = ext2_fill_partial(sbi, pblk, fresh,
+                    stage + (size_t)i * bs, start, end, tmp);
+            if (fresh < 0) {
+                // The blocks before this one can still go out
+                err = fresh;
+                nblk = i;
+                break;
+            }
+
+            if (run && pblk == run_pblk + run) {
+                run++;
+                continue;
+            }
+            if (run && ext2_write_blocks(sbi, run_pblk,
+                    stage + (size_t)run_start * bs, run)) {
+                err = -EIO;
+                nblk = run_start;
+                run = 0;
+                break;
+            }
+            run_start = i;
+            run_pblk = pblk;
+            run = 1;
+        }
+        if (run && ext2_write_blocks(sbi, run_pblk,
+                stage + (size_t)run_start * bs, run)) {
+            err = -EIO;
+            nblk = run_start;
+        }
+        // Only whole blocks are lost on an error, the first starts at off
+        if (err && err != -EFAULT)
+            n = nblk ? MIN(n, (size_t)nblk * bs - off) : 0;
+
+        if (n) {
+            filemap_write_update(&inode->i_data, pos, stage + off, n);
+            pos += n;
+            done += n;
+            if (pos > inode->i_size)
+                ext2_set_size(inode, pos);
+            inode->i_mtime = inode->i_ctime = get_unix_time();
+            EXT2_I(inode)->dirty = true;
+        }
+        mutex_unlock(&inode->i_mutex);
+    }
+
+    free_pages(stage, nr_pages);
+    *ppos = pos;
+    return done ? (ssize_t)done : err;
+}
+
+int ext2_fsync(struct file *file, int datasync)
+{
+    struct inode *inode = file->f_dentry->d_inode;
+    int err;
+
+    // Data is already on disk, the inode and allocation state may not be
+    if ((err = ext2_write_inode(inode, NULL)))
+        return err;
+    return ext2_sync_metadata(inode->i_sb);
+}
@@ -0,0 +1,162 @@
+// Directory name hashes used by htree indexed directories
+#include <lilac/types.h>
+#include <lilac/libc.h>
+
+#include "ext2.h"
+
+#define TEA_DELTA   0x9E3779B9
+
+static inline u32 rol32(u32 word, unsigned int shift)
+{
+    return (word << (shift & 31)) | (word >> ((-shift) & 31));
+}
+
+static void tea_transform(u32 buf[4], const u32 in[4])
+{
+    u32 sum = 0;
+    u32 b0 = buf[0], b1 = buf[1];
+    u32 a = in[0], b = in[1], c = in[2], d = in[3];
+
+    for (int n = 0; n < 16; n++) {
+        sum += TEA_DELTA;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+#define F(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z)  (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z)  ((x) ^ (y) ^ (z))
+
+#define ROUND(f, a, b, c, d, x, s) \
+    (a += f(b, c, d) + (x), a = rol32(a, s))
+#define K1 0
+#define K2 013240474631U
+#define K3 015666365641U
+
+// MD4 cut down to the three rounds, as used by Linux and e2fsprogs
+static void half_md4_transform(u32 buf[4], const u32 in[8])
+{
+    u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    ROUND(F, a, b, c, d, in[0] + K1,  3);
+    ROUND(F, d, a, b, c, in[1] + K1,  7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1,  3);
+    ROUND(F, d, a, b, c, in[5] + K1,  7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    ROUND(G, a, b, c, d, in[1] + K2,  3);
+    ROUND(G, d, a, b, c, in[3] + K2,  5);
+    ROUND(G, c, d, a, b, in[5] + K2,  9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2,  3);
+    ROUND(G, d, a, b, c, in[2] + K2,  5);
+    ROUND(G, c, d, a, b, in[4] + K2,  9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    ROUND(H, a, b, c, d, in[3] + K3,  3);
+    ROUND(H, d, a, b, c, in[7] + K3,  9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3,  3);
+    ROUND(H, d, a, b, c, in[5] + K3,  9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+static u32 dx_hack_hash(const char *name, int len, bool is_unsigned)
+{
+    u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+    while (len--) {
+        int c = is_unsigned ? (int)(unsigned char)*name : (int)(signed char)*name;
+        name++;
+        hash = hash1 + (hash0 ^ (c * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+// Pack up to num words of the name, padding with its length
+static void str2hashbuf(const char *msg, int len, u32 *buf, int num,
+    bool is_unsigned)
+{
+    u32 pad, val;
+
+    pad = (u32)len | ((u32)len << 8);
+    pad |= pad << 16;
+
+    val = pad;
+    if (len > num * 4)
+        len = num * 4;
+    for (int i = 0; i < len; i++) {
+        int c = is_unsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = c + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+/*
+ * Hash a name the same way mke2fs/e2fsck and Linux do. The low bit is
+ * reserved to mark hash collisions continuing into the next leaf block.
+ */
+u32 ext2_dirhash(const char *name, int len, int version, const u32 seed[4])
+{
+    u32 buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    u32 in[8];
+    u32 hash = 0;
+    bool is_unsigned = version >= DX_HASH_LEGACY_UNSIGNED;
+
+    if (seed && (seed[0] | seed[1] | seed[2] | seed[3]))
+        memcpy(buf, seed, sizeof(buf));
+
+    switch (version) {
+    case DX_HASH_LEGACY:
+    case DX_HASH_LEGACY_UNSIGNED:
+        hash = dx_hack_hash(name, len, is_unsigned);
+        break;
+    case DX_HASH_HALF_MD4:
+    case DX_HASH_HALF_MD4_UNSIGNED:
+        for (; len > 0; len -= 32, name += 32) {
+            str2hashbuf(name, len, in, 8, is_unsigned);
+            half_md4_transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case DX_HASH_TEA:
+    case DX_HASH_TEA_UNSIGNED:
+        for (; len > 0; len -= 16, name += 16) {
+            str2hashbuf(name, len, in, 4, is_unsigned);
+            tea_transform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    }
+
+    hash &= ~1;
+    if (hash == (0x7fffffffU << 1))
+        hash = (0x7fffffffU - 1) << 1;
+    return hash;
+}
@@ -0,0 +1,482 @@
+#include <lilac/fs.h>
+#include <lilac/log.h>
+#include <lilac/libc.h>
+#include <lilac/err.h>
+#include <lilac/timer.h>
+#include <mm/kmalloc.h>
+
+#include "ext2.h"
+
+#pragma GCC diagnostic ignored "-Wanalyzer-malloc-leak"
+
+const struct inode_operations ext2_iops = {
+    .lookup = ext2_lookup,
+    .open = ext2_open,
+    .create = ext2_create,
+    .mkdir = ext2_mkdir,
+    .unlink = ext2_unlink,
+    .rmdir = ext2_rmdir,
+};
+
+static struct inode *ext2_alloc_inode(struct super_block *sb)
+{
+    struct inode *inode = kzmalloc(sizeof(struct inode));
+    struct ext2_inode_info *info = kzmalloc(sizeof(struct ext2_inode_info));
+
+    if (!inode || !info) {
+        kfree(inode);
+        kfree(info);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    inode->i_sb = sb;
+    inode->i_op = &ext2_iops;
+    inode->i_fop = &ext2_fops;
+    inode->i_data.a_ops = &ext2_aops;
+    inode->i_count = 1;
+    inode->i_private = info;
+    spin_lock_init(&inode->i_lock);
+    mutex_init(&inode->i_mutex);
+    mutex_init(&info->i_dir_lock);
+    return inode;
+}
+
+// Where inode number ino sits in its group's inode table
+static void ext2_inode_loc(struct super_block *sb, u32 ino, u32 *blk, u32 *off)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(sb);
+    u32 group = ext2_block_group(ino, sb);
+    u64 byte = (u64)ext2_group_index(ino, sb) * sbi->s_inode_size;
+
+    *blk = sbi->s_group_desc[group].bg_inode_table + byte / sbi->s_block_size;
+    *off = byte % sbi->s_block_size;
+}
+
+static void ext2_fill_vfs_inode(struct inode *inode)
+{
+    struct ext2_inode *raw = &EXT2_I(inode)->raw;
+
+    inode->i_mode = raw->i_mode;
+    inode->i_uid = raw->i_uid | ((u32)raw->linux2.i_uid_high << 16);
+    inode->i_gid = raw->i_gid | ((u32)raw->linux2.i_gid_high << 16);
+    inode->i_nlink = raw->i_nlinks;
+    inode->i_size = raw->i_size;
+    if (S_ISREG(raw->i_mode))
+        inode->i_size |= (u64)raw->i_dir_acl << 32;
+    inode->i_atime = raw->i_atime;
+    inode->i_mtime = raw->i_mtime;
+    inode->i_ctime = raw->i_ctime;
+    inode->i_blocks = raw->i_disk_sectors;
+}
+
+static int ext2_read_inode(struct inode *inode)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+    struct ext2_inode_info *info = EXT2_I(inode);
+    u32 blk, off;
+    u8 *buf;
+    int err;
+
+    if (inode->i_ino < 1 || inode->i_ino > sbi->s_es.s_inodes_count)
+        return -EINVAL;
+
+    buf = kmalloc(sbi->s_block_size);
+    if (!buf)
+        return -ENOMEM;
+
+    ext2_inode_loc(inode->i_sb, inode->i_ino, &blk, &off);
+    err = ext2_read_blocks(sbi, blk, buf, 1);
+    if (!err) {
+        memcpy(&info->raw, buf + off, sizeof(info->raw));
+        info->i_block_group = ext2_block_group(inode->i_ino, inode->i_sb);
+        ext2_fill_vfs_inode(inode);
+    }
+
+    kfree(buf);
+    return err;
+}
+
+int ext2_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+    struct ext2_inode_info *info = EXT2_I(inode);
+    struct ext2_inode *raw;
+    u32 blk, off;
+    u8 *buf;
+    int err;
+
+    if (!info || !info->dirty || sbi->s_rdonly)
+        return 0;
+
+    raw = &info->raw;
+    raw->i_mode = inode->i_mode;
+    raw->i_nlinks = inode->i_nlink;
+    raw->i_size = inode->i_size;
+    if (S_ISREG(inode->i_mode))
+        raw->i_dir_acl = inode->i_size >> 32;
+    raw->i_atime = inode->i_atime;
+    raw->i_mtime = inode->i_mtime;
+    raw->i_ctime = inode->i_ctime;
+
+    buf = kmalloc(sbi->s_block_size);
+    if (!buf)
+        return -ENOMEM;
+
+    // Inodes share table blocks, so update ours in place
+    ext2_inode_loc(inode->i_sb, inode->i_ino, &blk, &off);
+    err = ext2_read_blocks(sbi, blk, buf, 1);
+    if (!err) {
+        memcpy(buf + off, raw, sizeof(*raw));
+        err = ext2_write_blocks(sbi, blk, buf, 1);
+    }
+    if (!err)
+        info->dirty = false;
+
+    kfree(buf);
+    return err;
+}
+
+static void ext2_bmap_drop(struct ext2_inode_info *info)
+{
+    for (int i = 0; i < EXT2_BMAP_SLOTS; i++) {
+        kfree(info->i_bmap[i].data);
+        info->i_bmap[i].data = NULL;
+        info->i_bmap[i].blk = 0;
+    }
+}
+
+/*
+ * Last link and last reference gone: give the blocks and the inode back.
+ * Deferred to here so an open or mapped file keeps its data after unlink,
+ * and the number can't be handed out while its old inode is still around.
+ */
+static void ext2_release_inode(struct inode *inode)
+{
+    struct ext2_inode_info *info = EXT2_I(inode);
+
+    ext2_truncate_blocks(inode);
+    info->raw.i_dtime = get_unix_time();
+    info->dirty = true;
+    if (ext2_write_inode(inode, NULL))
+        klog(LOG_WARN, "ext2: lost update to inode %lu\n", inode->i_ino);
+    ext2_free_inode(inode->i_sb, inode->i_ino, S_ISDIR(inode->i_mode));
+}
+
+// Called from the final iput, which has already taken it off s_inodes
+void ext2_destroy_inode(struct inode *inode)
+{
+    struct ext2_inode_info *info = EXT2_I(inode);
+
+    if (info && !inode->i_nlink && !EXT2_SB(inode->i_sb)->s_rdonly)
+        ext2_release_inode(inode);
+
+    truncate_inode_pages(&inode->i_data);
+    if (info) {
+        if (ext2_write_inode(inode, NULL))
+            klog(LOG_WARN, "ext2: lost update to inode %lu\n", inode->i_ino);
+        ext2_bmap_drop(info);
+        kfree(info);
+    }
+    kfree(inode);
+}
+
+// The in-memory inode for ino with a new reference, called with s_lock held
+static struct inode *ext2_ifind(struct super_block *sb, u32 ino)
+{
+    struct inode *inode;
+
+    list_for_each_entry(inode, &sb->s_inodes, i_list) {
+        if (inode->i_ino == ino) {
+            inode->i_count++;
+            return inode;
+        }
+    }
+    return NULL;
+}
+
+// Return the in-memory inode for ino, reading it from disk if needed
+struct inode *ext2_iget(struct super_block *sb, u32 ino)
+{
+    struct inode *inode, *found;
+    int err;
+
+    acquire_lock(&sb->s_lock);
+    found = ext2_ifind(sb, ino);
+    release_lock(&sb->s_lock);
+    if (found)
+        return found;
+
+    inode = ext2_alloc_inode(sb);
+    if (IS_ERR(inode))
+        return inode;
+
+    inode->i_ino = ino;
+    if ((err = ext2_read_inode(inode))) {
+        kfree(inode->i_private);
+        kfree(inode);
+        return ERR_PTR(err);
+    }
+
+    // Another miss may have read it meanwhile, only one copy goes on the list
+    acquire_lock(&sb->s_lock);
+    found = ext2_ifind(sb, ino);
+    if (!found)
+        list_add_tail(&inode->i_list, &sb->s_inodes);
+    release_lock(&sb->s_lock);
+
+    if (found) {
+        kfree(inode->i_private);
+        kfree(inode);
+        return found;
+    }
+    return inode;
+}
+
+// Allocate an on-disk inode near dir and set it up in memory
+struct inode *ext2_new_vfs_inode(struct inode *dir, umode_t mode)
+{
+    struct super_block *sb = dir->i_sb;
+    struct ext2_inode_info *info;
+    struct inode *inode;
+    u64 now = get_unix_time();
+    u32 ino;
+    int err;
+
+    err = ext2_new_inode(sb, EXT2_I(dir)->i_block_group, S_ISDIR(mode), &ino);
+    if (err)
+        return ERR_PTR(err);
+
+    inode = ext2_alloc_inode(sb);
+    if (IS_ERR(inode)) {
+        ext2_free_inode(sb, ino, S_ISDIR(mode));
+        return inode;
+    }
+
+    info = EXT2_I(inode);
+    info->i_block_group = ext2_block_group(ino, sb);
+    info->raw.i_flags = EXT2_I(dir)->raw.i_flags & EXT2_INODE_FLAG_NOATIME;
+    info->raw.i_generation = (u32)now ^ ino;
+    info->dirty = true;
+
+    inode->i_ino = ino;
+    inode->i_mode = mode;
+    inode->i_nlink = 1;
+    inode->i_atime = inode->i_mtime = inode->i_ctime = now;
+
+    acquire_lock(&sb->s_lock);
+    list_add_tail(&inode->i_list, &sb->s_inodes);
+    release_lock(&sb->s_lock);
+    return inode;
+}
+
+void ext2_set_size(struct inode *inode, u64 size)
+{
+    acquire_lock(&inode->i_lock);
+    inode->i_size = size;
+    release_lock(&inode->i_lock);
+    EXT2_I(inode)->dirty = true;
+}
+
+/*
+ * Split a logical block number into the path of slots leading to it: the
+ * slot in i_block, then one per level of indirect block.
+ */
+static int ext2_block_to_path(struct ext2_sb_info *sbi, u32 lblk, u32 path[4])
+{
+    const u64 apb = sbi->s_addr_per_block;
+    u64 n = lblk;
+
+    if (n < EXT2_NDIR_BLOCKS) {
+        path[0] = n;
+        return 1;
+    }
+    n -= EXT2_NDIR_BLOCKS;
+    if (n < apb) {
+        path[0] = EXT2_IND_BLOCK;
+        path[1] = n;
+        return 2;
+    }
+    n -= apb;
+    if (n < apb * apb) {
+        path[0] = EXT2_DIND_BLOCK;
+        path[1] = n / apb;
+        path[2] = n % apb;
+        return 3;
+    }
+    n -= apb * apb;
+    if (n < apb * apb * apb) {
+        path[0] = EXT2_TIND_BLOCK;
+        path[1] = n / (apb * apb);
+        path[2] = (n / apb) % apb;
+        path[3] = n % apb;
+        return 4;
+    }
+    return -EFBIG;
+}
+
+/*
+ * Return the contents of indirect block blk from the inode's small cache.
+ * Sequential access walks the same one or two indirect blocks for
+ * thousands of data blocks, so this saves a disk read per lookup.
+ */
+static u32 *ext2_bmap_get(struct inode *inode, u32 blk, bool fresh)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+    struct ext2_inode_info *info = EXT2_I(inode);
+    struct ext2_bmap_slot *slot;
+
+    for (int i = 0; i < EXT2_BMAP_SLOTS; i++) {
+        if (info->i_bmap[i].data && info->i_bmap[i].blk == blk)
+            return info->i_bmap[i].data;
+    }
+
+    slot = &info->i_bmap[info->i_bmap_next];
+    info->i_bmap_next = (info->i_bmap_next + 1) % EXT2_BMAP_SLOTS;
+    if (!slot->data) {
+        slot->data = kmalloc(sbi->s_block_size);
+        if (!slot->data)
+            return NULL;
+    }
+    slot->blk = 0;
+
+    if (fresh)
+        memset(slot->data, 0, sbi->s_block_size);
+    else if (ext2_read_blocks(sbi, blk, slot->data, 1))
+        return NULL;
+    slot->blk = blk;
+    return slot->data;
+}
+
+static u32 ext2_find_goal(struct inode *inode)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+    struct ext2_inode_info *info = EXT2_I(inode);
+
+    if (info->i_alloc_goal)
+        return info->i_alloc_goal;
+    return sbi->s_es.s_first_data_block +
+        info->i_block_group * sbi->s_blocks_per_group;
+}
+
+static int ext2_alloc_block(struct inode *inode, u32 *blk)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+    struct ext2_inode_info *info = EXT2_I(inode);
+    int err = ext2_new_block(inode->i_sb, ext2_find_goal(inode), blk);
+
+    if (err)
+        return err;
+    info->i_alloc_goal = *blk + 1;
+    info->raw.i_disk_sectors += sbi->s_block_size / 512;
+    inode->i_blocks = info->raw.i_disk_sectors;
+    info->dirty = true;
+    return 0;
+}
+
+/*
+ * Map logical block lblk of the inode to a disk block, 0 for a hole. With
+ * create, a hole is filled along with any missing indirect blocks, and 1
+ * is returned so the caller knows the block holds no data yet.
+ * The caller holds i_mutex, or i_dir_lock for a directory.
+ */
+int ext2_bmap(struct inode *inode, u32 lblk, bool create, u32 *pblk)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+    struct ext2_inode_info *info = EXT2_I(inode);
+    u32 path[4];
+    u32 *slot, *table = NULL;
+    u32 blk, parent = 0;
+    bool fresh = false;
+    int depth, err;
+
+    depth = ext2_block_to_path(sbi, lblk, path);
+    if (depth < 0)
+        return depth;
+
+    // raw sits at the start of the aligned ext2_inode_info
+    slot = (u32*)(void*)info->raw.i_block + path[0];
+    for (int level = 1; ; level++) {
+        blk = *slot;
+        fresh = false;
+        if (!blk) {
+            if (!create) {
+                *pblk = 0;
+                return 0;
+            }
+            if ((err = ext2_alloc_block(inode, &blk)))
+                return err;
+            fresh = true;
+
+            // A new indirect block must be zero before anything points to it
+            if (level < depth) {
+                void *zero = kzmalloc(sbi->s_block_size);
+                err = zero ? ext2_write_blocks(sbi, blk, zero, 1) : -ENOMEM;
+                kfree(zero);
+                if (err) {
+                    ext2_free_block(inode->i_sb, blk);
+                    return err;
+                }
+            }
+
+            // Indirect blocks are written through, i_block with the inode
+            *slot = blk;
+            if (parent && ext2_write_blocks(sbi, parent, table, 1))
+                return -EIO;
+        }
+
+        if (level == depth)
+            break;
+
+        table = ext2_bmap_get(inode, blk, fresh);
+        if (!table)
+            return -EIO;
+        slot = &table[path[level]];
+        parent = blk;
+    }
+
+    *pblk = blk;
+    return fresh;
+}
+
+static void ext2_free_tree(struct inode *inode, u32 blk, int depth)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(inode->i_sb);
+    u32 *table;
+
+    if (!blk)
+        return;
+
+    if (depth) {
+        table = kmalloc(sbi->s_block_size);
+        if (table && !ext2_read_blocks(sbi, blk, table, 1)) {
+            for (u32 i = 0; i < sbi->s_addr_per_block; i++)
+                ext2_free_tree(inode, table[i], depth - 1);
+        } else {
+            klog(LOG_WARN, "ext2: leaking blocks under %u\n", blk);
+        }
+        kfree(table);
+    }
+    ext2_free_block(inode->i_sb, blk);
+}
+
+// Release every block of the inode, the caller has already dropped its name
+void ext2_truncate_blocks(struct inode *inode)
+{
+    struct ext2_inode_info *info = EXT2_I(inode);
+    struct ext2_inode *raw = &info->raw;
+
+    truncate_inode_pages(&inode->i_data);
+    ext2_bmap_drop(info);
+
+    for (int i = 0; i < EXT2_NDIR_BLOCKS; i++)
+        ext2_free_tree(inode, raw->i_block[i], 0);
+    ext2_free_tree(inode, raw->i_block[EXT2_IND_BLOCK], 1);
+    ext2_free_tree(inode, raw->i_block[EXT2_DIND_BLOCK], 2);
+    ext2_free_tree(inode, raw->i_block[EXT2_TIND_BLOCK], 3);
+
+    memset(raw->i_block, 0, sizeof(raw->i_block));
+    raw->i_disk_sectors = 0;
+    inode->i_blocks = 0;
+    info->i_alloc_goal = 0;
+    ext2_set_size(inode, 0);
+}
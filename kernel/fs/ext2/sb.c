@@ -1,11 +1,293 @@
-#include "ext2.h"
+#include <fs/ext2.h>
 
 #include <lilac/fs.h>
+#include <lilac/log.h>
+#include <lilac/libc.h>
+#include <lilac/err.h>
+#include <lilac/timer.h>
 #include <drivers/blkdev.h>
+#include <mm/kmalloc.h>
+
+#include "ext2.h"
+
+#pragma GCC diagnostic ignored "-Wanalyzer-malloc-leak"
+
+const struct super_operations ext2_sops = {
+    .destroy_inode = ext2_destroy_inode,
+    .write_inode = ext2_write_inode,
+    .sync_fs = ext2_sync_fs,
+};
+
+static int ext2_sector_io(struct ext2_sb_info *sbi, u64 lba, void *buf,
+    u32 sectors, bool write)
+{
+    struct gendisk *gd = sbi->s_bdev->disk;
+    const u32 sector_size = gd->sector_size ? gd->sector_size : 512;
+
+    while (sectors) {
+        u32 n = MIN(sectors, 128);
+        int err = write ? gd->ops->disk_write(gd, lba, buf, n) :
+            gd->ops->disk_read(gd, lba, buf, n);
+        if (err)
+            return -EIO;
+        lba += n;
+        buf += n * sector_size;
+        sectors -= n;
+    }
+    return 0;
+}
+
+int ext2_read_blocks(struct ext2_sb_info *sbi, u32 blk, void *buf, u32 count)
+{
+    return ext2_sector_io(sbi, sbi->s_bdev->first_sector_lba +
+        (u64)blk * sbi->s_sect_per_block, buf, count * sbi->s_sect_per_block,
+        false);
+}
+
+int ext2_write_blocks(struct ext2_sb_info *sbi, u32 blk, const void *buf,
+    u32 count)
+{
+    return ext2_sector_io(sbi, sbi->s_bdev->first_sector_lba +
+        (u64)blk * sbi->s_sect_per_block, (void*)buf,
+        count * sbi->s_sect_per_block, true);
+}
+
+// The superblock always lives 1024 bytes into the partition
+static int ext2_super_io(struct ext2_sb_info *sbi, bool write)
+{
+    struct gendisk *gd = sbi->s_bdev->disk;
+    const u32 sector_size = gd->sector_size ? gd->sector_size : 512;
+
+    if (sector_size > 1024)
+        return -EINVAL;
+    return ext2_sector_io(sbi, sbi->s_bdev->first_sector_lba +
+        1024 / sector_size, &sbi->s_es, sizeof(sbi->s_es) / sector_size, write);
+}
+
+/*
+ * Write back the allocation state kept in memory: dirty bitmaps, the group
+ * descriptor table and the superblock free counts. Only the primary copies
+ * are updated, e2fsck refreshes the backups.
+ */
+int ext2_sync_metadata(struct super_block *sb)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(sb);
+    struct ext2_group_desc *gd;
+    struct ext2_group_info *gi;
+    int err = 0;
+
+    if (sbi->s_rdonly)
+        return 0;
+
+    mutex_lock(&sbi->s_alloc_lock);
+    for (u32 g = 0; g < sbi->s_groups_count; g++) {
+        gd = &sbi->s_group_desc[g];
+        gi = &sbi->s_group_info[g];
+        if (gi->block_dirty) {
+            if (ext2_write_blocks(sbi, gd->bg_block_bitmap, gi->block_bitmap, 1))
+                err = -EIO;
+            else
+                gi->block_dirty = false;
+        }
+        if (gi->inode_dirty) {
+            if (ext2_write_blocks(sbi, gd->bg_inode_bitmap, gi->inode_bitmap, 1))
+                err = -EIO;
+            else
+                gi->inode_dirty = false;
+        }
+    }
+
+    if (sbi->s_gdt_dirty) {
+        if (ext2_write_blocks(sbi, sbi->s_es.s_first_data_block + 1,
+                sbi->s_group_desc, sbi->s_gdt_blocks))
+            err = -EIO;
+        else
+            sbi->s_gdt_dirty = false;
+    }
+
+    if (sbi->s_sb_dirty) {
+        sbi->s_es.s_wtime = get_unix_time();
+        if (ext2_super_io(sbi, true))
+            err = -EIO;
+        else
+            sbi->s_sb_dirty = false;
+    }
+    mutex_unlock(&sbi->s_alloc_lock);
+
+    return err;
+}
+
+int ext2_sync_fs(struct super_block *sb, int wait)
+{
+    struct inode *inode;
+    int err = 0;
+
+    list_for_each_entry(inode, &sb->s_inodes, i_list) {
+        if (ext2_write_inode(inode, NULL))
+            err = -EIO;
+    }
+    if (ext2_sync_metadata(sb))
+        err = -EIO;
+    return err;
+}
+
+static int ext2_fill_sb_info(struct ext2_sb_info *sbi)
+{
+    struct ext2_sb *es = &sbi->s_es;
+    const u32 sector_size = sbi->s_bdev->disk->sector_size ?
+        sbi->s_bdev->disk->sector_size : 512;
+
+    if (es->s_magic != EXT2_SUPER_MAGIC)
+        return -EINVAL;
+    if (es->s_log_block_size > 2) {
+        klog(LOG_WARN, "ext2: block size %u not supported\n",
+            1024 << es->s_log_block_size);
+        return -EINVAL;
+    }
+
+    sbi->s_block_size = 1024 << es->s_log_block_size;
+    sbi->s_sect_per_block = sbi->s_block_size / sector_size;
+    sbi->s_addr_per_block = sbi->s_block_size / sizeof(u32);
+    sbi->s_blocks_per_group = es->s_blocks_per_group;
+    sbi->s_inodes_per_group = es->s_inodes_per_group;
+    if (!sbi->s_blocks_per_group || !sbi->s_inodes_per_group ||
+            sbi->s_blocks_per_group > sbi->s_block_size * 8 ||
+            sbi->s_inodes_per_group > sbi->s_block_size * 8)
+        return -EINVAL;
+
+    if (es->s_rev_level >= EXT2_DYNAMIC_REV) {
+        sbi->s_inode_size = es->s_inode_size;
+        sbi->s_first_ino = es->s_first_ino;
+        if (es->s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_SUPP) {
+            klog(LOG_WARN, "ext2: unsupported incompat features %x\n",
+                es->s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_SUPP);
+            return -EINVAL;
+        }
+        if (es->s_feature_ro_compat & ~EXT2_FEATURE_RO_COMPAT_SUPP) {
+            klog(LOG_WARN, "ext2: unsupported ro_compat features %x, "
+                "mounting read-only\n",
+                es->s_feature_ro_compat & ~EXT2_FEATURE_RO_COMPAT_SUPP);
+            sbi->s_rdonly = true;
+        }
+    } else {
+        sbi->s_inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+        sbi->s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+    }
+    if (sbi->s_inode_size < EXT2_GOOD_OLD_INODE_SIZE ||
+            sbi->s_inode_size > sbi->s_block_size)
+        return -EINVAL;
+
+    sbi->s_groups_count = (es->s_blocks_count - es->s_first_data_block +
+        sbi->s_blocks_per_group - 1) / sbi->s_blocks_per_group;
+    sbi->s_desc_per_block = sbi->s_block_size / sizeof(struct ext2_group_desc);
+    sbi->s_gdt_blocks = (sbi->s_groups_count + sbi->s_desc_per_block - 1) /
+        sbi->s_desc_per_block;
+
+    // A zero seed means the directory hashes use the default one
+    memcpy(sbi->s_hash_seed, es->s_hash_seed, sizeof(sbi->s_hash_seed));
+    sbi->s_hash_unsigned = es->s_flags & EXT2_FLAGS_UNSIGNED_HASH;
+    sbi->s_dir_index = es->s_rev_level >= EXT2_DYNAMIC_REV &&
+        (es->s_feature_compat & EXT2_FEATURE_DIR_HASH);
+    return 0;
+}
 
-struct super_block *ext2_read_super(struct block_device *bdev, struct super_block *sb)
+static void ext2_put_sbi(struct ext2_sb_info *sbi)
 {
-    int sector_size = bdev->disk->sector_size;
-    u64 sb_lba = bdev->first_sector_lba + (1024 / sector_size);
-    u64 sb_offset = 1024 % sector_size;
+    if (sbi->s_group_info) {
+        for (u32 g = 0; g < sbi->s_groups_count; g++) {
+            kfree(sbi->s_group_info[g].block_bitmap);
+            kfree(sbi->s_group_info[g].inode_bitmap);
+        }
+    }
+    kfree(sbi->s_group_info);
+    kfree(sbi->s_group_desc);
+    kfree(sbi);
+}
+
+struct dentry *ext2_init(void *dev, struct super_block *sb)
+{
+    struct block_device *bdev = (struct block_device*)dev;
+    struct ext2_sb_info *sbi;
+    struct inode *root_inode;
+    struct dentry *root_dentry;
+    u64 apb;
+    long err;
+
+    klog(LOG_INFO, "Initializing ext2 filesystem\n");
+    if (!bdev)
+        return ERR_PTR(-ENODEV);
+
+    sbi = kzmalloc(sizeof(*sbi));
+    if (!sbi)
+        return ERR_PTR(-ENOMEM);
+    sbi->s_bdev = bdev;
+    mutex_init(&sbi->s_alloc_lock);
+
+    if (ext2_super_io(sbi, false)) {
+        err = -EIO;
+        goto error;
+    }
+    if ((err = ext2_fill_sb_info(sbi))) {
+        klog(LOG_ERROR, "ext2: bad superblock\n");
+        goto error;
+    }
+
+    // Descriptors are small, keep all of them for the life of the mount
+    err = -ENOMEM;
+    sbi->s_group_desc = kmalloc(sbi->s_gdt_blocks * sbi->s_block_size);
+    sbi->s_group_info = kcalloc(sbi->s_groups_count,
+        sizeof(struct ext2_group_info));
+    if (!sbi->s_group_desc || !sbi->s_group_info)
+        goto error;
+    if (ext2_read_blocks(sbi, sbi->s_es.s_first_data_block + 1,
+            sbi->s_group_desc, sbi->s_gdt_blocks)) {
+        err = -EIO;
+        goto error;
+    }
+
+    apb = sbi->s_addr_per_block;
+    sb->s_blocksize = sbi->s_block_size;
+    sb->s_maxbytes = (EXT2_NDIR_BLOCKS + apb + apb * apb + apb * apb * apb) *
+        sbi->s_block_size;
+    if (!(sbi->s_es.s_feature_ro_compat & EXT2_FEATURE_RO_LARGE_FILE))
+        sb->s_maxbytes = MIN(sb->s_maxbytes, 0x7FFFFFFFULL);
+    sb->s_type = EXT2;
+    sb->s_op = &ext2_sops;
+    sb->s_bdev = bdev;
+    sb->s_fs_info = sbi;
+    INIT_LIST_HEAD(&sb->s_inodes);
+
+    root_inode = ext2_iget(sb, EXT2_ROOT_INO);
+    if (IS_ERR(root_inode)) {
+        err = PTR_ERR(root_inode);
+        goto error;
+    }
+    if (!S_ISDIR(root_inode->i_mode)) {
+        klog(LOG_ERROR, "ext2: root inode is not a directory\n");
+        err = -EINVAL;
+        goto error;
+    }
+
+    root_dentry = kzmalloc(sizeof(struct dentry));
+    if (!root_dentry) {
+        err = -ENOMEM;
+        goto error;
+    }
+    root_dentry->d_sb = sb;
+    root_dentry->d_inode = root_inode;
+    root_dentry->d_count = 1;
+    atomic_store(&sb->s_active, true);
+
+    memcpy(bdev->name, sbi->s_es.s_volume_name,
+        MIN(sizeof(bdev->name) - 1, sizeof(sbi->s_es.s_volume_name)));
+
+    klog(LOG_INFO, "ext2: %u groups, %u byte blocks, %u free blocks%s\n",
+        sbi->s_groups_count, sbi->s_block_size, sbi->s_es.s_free_blocks_count,
+        sbi->s_rdonly ? ", read-only" : "");
+    return root_dentry;
+
+error:
+    sb->s_fs_info = NULL;
+    ext2_put_sbi(sbi);
+    return ERR_PTR(err);
 }
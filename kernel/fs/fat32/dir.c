@@ -14,116 +14,36 @@
 
 #pragma GCC diagnostic ignored "-Wanalyzer-malloc-leak"
 
-// Read a directory and return a buffer containing the raw directory entries
-ssize_t __fat32_read_dir(struct fat_disk *disk, volatile u8 **buffer, int clst)
-{
-    ssize_t bytes_read = 0;
-
-    if (clst < 0)
-        return -EINVAL;
-
-    while (clst < 0x0FFFFFF8) {
-        *buffer = krealloc((void*)*buffer, bytes_read + disk->bytes_per_clst);
-        if (!*buffer)
-            return -ENOMEM;
-        __fat_read_clst(disk, disk->bdev->disk, clst, (void*)*buffer + bytes_read);
-        clst = fat_value(clst, disk);
-        bytes_read += disk->bytes_per_clst;
-    }
-
-    return bytes_read;
-}
-
-
-int __fat32_read_all_dirent(struct file *file, struct dirent **dirents_ptr)
+int fat32_readdir(struct file *file, struct dirent *dir_buf, unsigned int count)
 {
-    int i = 0;
-    int count = 0;
-    struct fat_disk *disk = (struct fat_disk*)file->f_dentry->d_inode->i_sb->s_fs_info;
-    volatile u8 *raw_buf = NULL;
-    struct fat_file *entry;
-    struct dirent *dir_buf;
-    int num_dirents = 8;
-    char lfn[256];
-
-    memset(lfn, 0, sizeof(lfn));
-
-    if ((count = __fat32_read_dir(disk, &raw_buf, __fat_get_clst_num(file, disk))) <= 0) {
-        klog(LOG_ERROR, "__fat32_read_all_dirent: Failed to read directory data\n");
-        return count;
-    }
-
-    dir_buf = kzmalloc(num_dirents * sizeof(struct dirent));
-    if (!dir_buf) {
-        i = -ENOMEM;
-        goto out;
-    }
-
-    for (entry = (struct fat_file*)raw_buf;
-            entry->name[0] != 0 && (u8*)entry < (u8*)raw_buf + count;
-            entry++) {
+    struct inode *inode = file->f_dentry->d_inode;
+    struct fat_dir_index *idx = fat_dir_index_get(inode);
+    struct fat_dirent_loc *loc;
+    const char *name;
+    off_t pos = 0;
+    u32 i = 0;
 
-        if (entry->name[0] == FAT_UNUSED) {
-            memset(lfn, 0, sizeof(lfn));
-            continue;
-        }
+    if (IS_ERR(idx))
+        return PTR_ERR(idx);
 
-        if (entry->attributes == LONG_FNAME) {
-            fat_get_lfn_part(entry, lfn);
-            continue;
-        }
-
-        if (INVALID_ENTRY(entry) || entry->name[0] == 0x0) {
-            memset(lfn, 0, sizeof(lfn));
+    mutex_lock(&idx->lock);
+    list_for_each_entry(loc, &idx->entries, list) {
+        if (i >= count)
+            break;
+        if (pos++ < file->f_pos)
             continue;
-        }
 
-        if (i >= num_dirents) {
-            num_dirents *= 2;
-            void *tmp = kcalloc(num_dirents, sizeof(struct dirent));
-            if (!tmp) {
-                kfree(dir_buf);
-                i = -ENOMEM;
-                goto out;
-            }
-            memcpy(tmp, dir_buf, i * sizeof(struct dirent));
-            kfree(dir_buf);
-            dir_buf = tmp;
-        }
-
-        if (lfn[0]) {
-            strncpy(dir_buf[i].d_name, lfn, sizeof(dir_buf[i].d_name) - 1);
-            dir_buf[i].d_name[sizeof(dir_buf[i].d_name) - 1] = '\0';
-        } else {
-            fat_get_sfn(entry, dir_buf[i].d_name);
-        }
-        memset(lfn, 0, sizeof(lfn));
-
-        dir_buf[i].d_ino = file->f_dentry->d_inode->i_ino;
+        name = loc->lfn ? loc->lfn : loc->sfn;
+        strncpy(dir_buf[i].d_name, name, sizeof(dir_buf[i].d_name) - 1);
+        dir_buf[i].d_name[sizeof(dir_buf[i].d_name) - 1] = '\0';
+        dir_buf[i].d_ino = inode->i_ino;
         dir_buf[i].d_reclen = sizeof(struct dirent);
         dir_buf[i].d_off = file->f_pos + i;
-        dir_buf[i].d_type = (entry->attributes & FAT_DIR_ATTR) ? DT_DIR : DT_REG;
-        ++i;
-    }
-
-    *dirents_ptr = dir_buf;
-#ifdef DEBUG_FAT
-    for (int i = 0; i < num_dirents; i++)
-        klog(LOG_DEBUG, "dirent %d: %s\n", i, dir_buf[i].d_name);
-#endif
-out:
-    kfree((void*)raw_buf);
-    return i;
-}
-
-int fat32_readdir(struct file *file, struct dirent *dir_buf, unsigned int count)
-{
-    struct fat_inode *info = (struct fat_inode*)file->f_dentry->d_inode->i_private;
-    u32 i = 0;
-    while (i < count && i + file->f_pos < info->buf.num_dirent) {
-        dir_buf[i] = info->buf.dirent[i + file->f_pos];
+        dir_buf[i].d_type = (loc->entry.attributes & FAT_DIR_ATTR) ? DT_DIR : DT_REG;
         i++;
     }
+    mutex_unlock(&idx->lock);
+
     return i;
 }
 
@@ -184,85 +104,82 @@ static void mk_new_dirent(struct fat_file *entry, u32 new_clst, const char *name
 
 int fat32_mkdir(struct inode *dir, struct dentry *new_dentry, umode_t mode)
 {
-    struct fat_file *entry = NULL;
     struct fat_disk *disk = (struct fat_disk*)dir->i_sb->s_fs_info;
     struct gendisk *hd = dir->i_sb->s_bdev->disk;
     struct fat_file *parent_dir = (struct fat_file*)dir->i_private;
-    int clst = parent_dir->cl_low + ((u32)parent_dir->cl_high << 16);
-    int prev_clst = clst;
-    volatile unsigned char *buffer = kzmalloc(disk->bytes_per_clst);
+    u32 p_clst = fat_clst_value(parent_dir);
+    struct fat_dir_index *idx;
+    struct fat_inode *fat_i;
+    struct fat_file entry;
+    volatile unsigned char *buffer = NULL;
     char name[8];
+    char sfn[13];
+    long offset;
+    int new_clst;
     int ret = 0;
 
     memset(name, ' ', 8);
     for (int i = 0; i < 8 && isprint(new_dentry->d_name[i]); i++)
         name[i] = new_dentry->d_name[i] = toupper(new_dentry->d_name[i]);
 
-    while (clst < 0x0FFFFFF8) {
-        __fat_read_clst(disk, hd, clst, (void*)buffer);
-        for (entry = (struct fat_file*)buffer;
-            entry < (struct fat_file*)(buffer + disk->bytes_per_clst) &&
-            !(entry->name[0] == 0 || (u8)entry->name[0] == FAT_UNUSED);
-            entry++)
-        {
-            if (!strncmp((char*)entry->name, name, 8)) {
-                klog(LOG_INFO, "Directory %-8s already exists\n", name);
-                ret = -1;
-                goto error;
-            }
-        }
+    idx = fat_dir_index_get(dir);
+    if (IS_ERR(idx))
+        return PTR_ERR(idx);
 
-        if (entry < (struct fat_file*)(buffer + disk->bytes_per_clst) &&
-         (entry->name[0] == 0 || (u8)entry->name[0] == FAT_UNUSED))
-            break;
-        else
-            entry = NULL;
+    memset(&entry, 0, sizeof(entry));
+    mk_new_dirent(&entry, 0, name);
+    fat_get_sfn(&entry, sfn);
 
-        prev_clst = clst;
-        clst = fat_value(clst, disk);
+    mutex_lock(&idx->lock);
+    if (fat_dir_index_find(idx, sfn)) {
+        klog(LOG_INFO, "Directory %-8s already exists\n", name);
+        ret = -EEXIST;
+        goto error;
     }
 
-    if (clst >= 0x0FFFFFF8) {
-        clst = __fat_find_free_clst(disk);
-        if (clst < 0)
-            panic("No free clusters\n");
-        __fat_add_new_clst(disk, prev_clst, clst);
-        klog(LOG_DEBUG, "Added new cluster %x to dir\n", clst);
-        __fat_read_clst(disk, hd, clst, (void*)buffer);
-        memset((void*)buffer, 0, disk->bytes_per_clst);
-        entry = (struct fat_file*)buffer;
+    buffer = kzmalloc(disk->bytes_per_clst);
+    fat_i = kzmalloc(sizeof(struct fat_inode));
+    if (!buffer || !fat_i) {
+        kfree(fat_i);
+        ret = -ENOMEM;
+        goto error;
     }
 
-    if (!entry) {
-        ret = -ENOSPC;
+    offset = fat_dir_alloc_slot(dir, idx);
+    if (offset < 0) {
+        kfree(fat_i);
+        ret = offset;
         goto error;
     }
 
-    int new_clst = __fat_find_alloc_clst(disk, 0);
+    new_clst = __fat_find_alloc_clst(disk, 0);
     if (new_clst < 0) {
+        kfree(fat_i);
         ret = -ENOSPC;
         goto error;
     }
 
-    mk_new_dirent(entry, new_clst, name);
-    __fat_write_clst(disk, hd, clst, (void*)buffer);
-
-    struct fat_inode *fat_i = kzmalloc(sizeof(struct fat_inode));
-    if (!fat_i) {
-        ret = -ENOMEM;
+    entry.cl_low = new_clst & 0xFFFF;
+    entry.cl_high = new_clst >> 16;
+    if ((ret = fat_dir_write_entry(dir, offset, &entry))) {
+        kfree(fat_i);
         goto error;
     }
-    fat_i->entry = *entry;
+    fat_dir_index_add(idx, &entry, offset, NULL);
+
+    fat_i->entry = entry;
+    fat_i->dir_clst = p_clst;
+    fat_i->dir_offset = offset;
     new_dentry->d_inode = fat_build_inode(dir->i_sb, fat_i);
 
-    memset((void*)buffer, 0, disk->bytes_per_clst);
-    mk_dot_dirs((struct fat_file*)buffer, parent_dir, new_clst, clst);
+    // ".." of a top-level directory points at cluster 0, not the root cluster
+    if (p_clst == disk->root_start)
+        p_clst = 0;
+    mk_dot_dirs((struct fat_file*)buffer, parent_dir, new_clst, p_clst);
     __fat_write_clst(disk, hd, new_clst, (void*)buffer);
 
-    fat_write_FAT(disk, hd);
-    // fat32_write_fs_info(disk, hd);
-
 error:
+    mutex_unlock(&idx->lock);
     kfree((void*)buffer);
     return ret;
 }
@@ -20,15 +20,24 @@
 // #define DEBUG_FAT 1
 
 const struct file_operations fat_fops = {
-    .read = fat32_read,
-    .write = fat32_write,
+    .read_iter = fat32_read_iter,
+    .write_iter = fat32_write_iter,
     .readdir = fat32_readdir,
     .release = fat32_close,
+    .fsync = fat32_fsync,
+};
+
+const struct address_space_operations fat_aops = {
+    .readpages = fat_readpages,
+    .fault_page = filemap_get_page,
+    .writepage = filemap_writepage,
 };
 
 const struct super_operations fat_sops = {
     .alloc_inode = fat_alloc_inode,
-    .destroy_inode = fat_destroy_inode
+    .destroy_inode = fat_destroy_inode,
+    .write_inode = fat_write_inode,
+    .sync_fs = fat_sync_fs,
 };
 
 const struct inode_operations fat_iops = {
@@ -36,6 +45,7 @@ const struct inode_operations fat_iops = {
     .open = fat32_open,
     .mkdir = fat32_mkdir,
     .create = fat32_create,
+    .unlink = fat32_unlink,
 };
 
 
@@ -70,10 +80,49 @@ static inline int fat32_read_fs_info(struct fat_disk *fat_disk, struct gendisk *
 __must_check
 int fat32_write_fs_info(struct fat_disk *fat_disk, struct gendisk *gd)
 {
+    fat_disk->fs_info.next_free_clst = fat_disk->FAT.free_hint;
+    fat_disk->fs_info_dirty = false;
     return gd->ops->disk_write(gd, fat_disk->base_lba +
         fat_disk->bpb.extended_section.fs_info, (void*)&fat_disk->fs_info, 1);
 }
 
+// Build the free cluster bitmap and check the FSInfo free count against it
+static int fat_init_free_map(struct fat_disk *fat_disk)
+{
+    const u32 data_sectors = fat_disk->bpb.total_sectors_32 -
+        (fat_disk->clst_begin_lba - fat_disk->base_lba);
+    u32 nr_clst = data_sectors / fat_disk->sect_per_clst + 2;
+    u32 nr_free = 0;
+
+    nr_clst = MIN(nr_clst, fat_disk->FAT.sectors * FAT_ENTRIES_PER_SECTOR);
+    fat_disk->FAT.nr_clst = nr_clst;
+    fat_disk->FAT.dirty = kcalloc(ROUND_UP(fat_disk->FAT.sectors,
+        FAT_BITS_PER_LONG) / 8, 1);
+    fat_disk->FAT.free_map = kcalloc(ROUND_UP(nr_clst, FAT_BITS_PER_LONG) / 8, 1);
+    if (!fat_disk->FAT.dirty || !fat_disk->FAT.free_map)
+        return -ENOMEM;
+
+    for (u32 clst = 2; clst < nr_clst; clst++) {
+        if (FAT_VALUE(fat_disk->FAT, clst) == 0) {
+            fat_bit_set(fat_disk->FAT.free_map, clst);
+            nr_free++;
+        }
+    }
+
+    fat_disk->FAT.free_hint = fat_disk->fs_info.next_free_clst;
+    if (fat_disk->FAT.free_hint < 2 || fat_disk->FAT.free_hint >= nr_clst)
+        fat_disk->FAT.free_hint = 2;
+
+    if (fat_disk->fs_info.free_clst_cnt != nr_free) {
+        klog(LOG_WARN, "FSInfo free count %u, FAT has %u free clusters\n",
+            fat_disk->fs_info.free_clst_cnt, nr_free);
+        fat_disk->fs_info.free_clst_cnt = nr_free;
+        fat_disk->fs_info_dirty = true;
+    }
+
+    return 0;
+}
+
 __must_check
 static int fat_read_FAT(struct fat_disk *fat_disk, struct gendisk *hd)
 {
@@ -107,24 +156,49 @@ static int fat_read_FAT(struct fat_disk *fat_disk, struct gendisk *hd)
     return ret;
 }
 
+// Write back only the FAT sectors marked dirty, to every FAT copy
 __must_check
 int fat_write_FAT(struct fat_disk *fat_disk, struct gendisk *gd)
 {
+    const u32 fat_sz = fat_disk->bpb.extended_section.FAT_size_32;
     const u32 lba = fat_disk->fat_begin_lba +
         (fat_disk->FAT.first_clst * fat_disk->sect_per_clst);
-    u32 i = 0;
-    while (i < fat_disk->FAT.sectors) {
-        if (i + 128 > fat_disk->FAT.sectors) {
-            // Last write might be less than 128 sectors
-            gd->ops->disk_write(gd, lba + i,
-                (void*)fat_disk->FAT.FAT_buf + (i * 512), fat_disk->FAT.sectors - i);
-            break;
+    unsigned long *dirty = fat_disk->FAT.dirty;
+    u32 start = 0, end;
+    int ret = 0, err;
+
+    while (start < fat_disk->FAT.sectors) {
+        if (!dirty[start / FAT_BITS_PER_LONG]) {
+            start = ROUND_UP(start + 1, FAT_BITS_PER_LONG);
+            continue;
         }
-        gd->ops->disk_write(gd, lba + i,
-            (void*)fat_disk->FAT.FAT_buf + (i * 512), 128);
-        i += 128;
+        if (!fat_bit_test(dirty, start)) {
+            start++;
+            continue;
+        }
+
+        // Coalesce a run of dirty sectors, at most 128 per request
+        for (end = start; end < fat_disk->FAT.sectors && end - start < 128 &&
+                fat_bit_test(dirty, end); end++)
+            fat_bit_clear(dirty, end);
+
+        err = 0;
+        for (u32 i = 0; i < fat_disk->bpb.num_FATs; i++) {
+            err |= gd->ops->disk_write(gd, lba + i * fat_sz + start,
+                (void*)fat_disk->FAT.FAT_buf + (start * 512), end - start);
+        }
+        /*
+         * The bits are cleared before the write so a change made during it
+         * stays dirty; put them back if it failed, for the next sync.
+         */
+        if (err) {
+            for (u32 i = start; i < end; i++)
+                fat_bit_set(dirty, i);
+            ret |= err;
+        }
+        start = end;
     }
-    return 0;
+    return ret;
 }
 
 #define LBA_ADDR(cluster_num, disk) \
@@ -145,34 +219,42 @@ void __fat_write_clst(struct fat_disk *fat_disk,
         fat_disk->sect_per_clst);
 }
 
-int __fat_get_clst_num(struct file *file, struct fat_disk *disk)
+// Read count sectors starting sect_off sectors into clst, crossing into
+// the following clusters, which must be physically contiguous
+int __fat_read_sectors(struct fat_disk *fat_disk, struct gendisk *hd,
+    u32 clst, u32 sect_off, void *buf, u32 count)
 {
-    struct fat_file *fat_file = (struct fat_file*)file->f_dentry->d_inode->i_private;
-    u32 clst_num = fat_clst_value(fat_file);
-    u32 clst_off = file->f_pos / disk->bytes_per_clst;
-
-    while (clst_off--) {
-        if (clst_num > 0x0FFFFFF8)
-            return -1;
-        clst_num = fat_value(clst_num, disk);
+    u64 lba = LBA_ADDR(clst, fat_disk) + sect_off;
+
+    while (count) {
+        u32 n = MIN(count, 128);
+        if (hd->ops->disk_read(hd, lba, buf, n))
+            return -EIO;
+        lba += n;
+        buf += n * BYTES_PER_SECTOR;
+        count -= n;
     }
-
-    return clst_num;
+    return 0;
 }
 
+// Scan the free map a word at a time, starting from the last allocation
 int __fat_find_free_clst(struct fat_disk *disk)
 {
-    u32 clst = disk->fs_info.next_free_clst;
+    const u32 nr_words = ROUND_UP(disk->FAT.nr_clst, FAT_BITS_PER_LONG) /
+        FAT_BITS_PER_LONG;
+    const u32 first = disk->FAT.free_hint / FAT_BITS_PER_LONG;
+    unsigned long bits;
 
     if (disk->fs_info.free_clst_cnt == 0)
         return -1;
 
-    while (1) {
-        if (clst > disk->FAT.last_clst)
-            kerror("clst out of fat bounds\n");
-        if (fat_value(clst, disk) == 0)
-            return clst;
-        clst++;
+    for (u32 n = 0; n <= nr_words; n++) {
+        u32 word = (first + n) % nr_words;
+        bits = disk->FAT.free_map[word];
+        if (n == 0)
+            bits &= ~0UL << (disk->FAT.free_hint % FAT_BITS_PER_LONG);
+        if (bits)
+            return word * FAT_BITS_PER_LONG + __builtin_ctzl(bits);
     }
 
     return -1;
@@ -184,8 +266,9 @@ int __fat_add_new_clst(struct fat_disk *disk, u32 prev_clst, u32 new_clst)
         fat_set_value(prev_clst, new_clst, disk);
     fat_set_value(new_clst, 0x0FFFFFFF, disk); // Mark new clst as EOF
 
-    disk->fs_info.free_clst_cnt--;
-    disk->fs_info.next_free_clst = __fat_find_free_clst(disk);
+    disk->FAT.free_hint = new_clst + 1;
+    if (disk->FAT.free_hint >= disk->FAT.nr_clst)
+        disk->FAT.free_hint = 2;
     return new_clst;
 }
 
@@ -197,6 +280,25 @@ int __fat_find_alloc_clst(struct fat_disk *disk, u32 prev_clst)
     return __fat_add_new_clst(disk, prev_clst, new_clst);
 }
 
+int fat_sync_fs(struct super_block *sb, int wait)
+{
+    struct fat_disk *disk = (struct fat_disk*)sb->s_fs_info;
+    struct gendisk *gd = sb->s_bdev->disk;
+    struct inode *inode;
+    int err = 0;
+
+    list_for_each_entry(inode, &sb->s_inodes, i_list) {
+        if (fat_write_inode(inode, NULL))
+            err = -EIO;
+    }
+    if (fat_write_FAT(disk, gd))
+        err = -EIO;
+    if (disk->fs_info_dirty && fat32_write_fs_info(disk, gd))
+        err = -EIO;
+
+    return err;
+}
+
 static void disk_init(struct fat_disk *disk)
 {
     volatile struct fat_BS *id = &disk->bpb;
@@ -266,6 +368,8 @@ struct dentry *fat32_init(void *dev, struct super_block *sb)
     // Read the FAT table
     if (fat_read_FAT(fat_disk, bdev->disk))
         kerror("Failed to read FAT\n");
+    if (fat_init_free_map(fat_disk))
+        kerror("Out of memory allocating FAT bitmaps\n");
 
 #ifdef DEBUG_FAT
     print_fat32_data(&fat_disk->bpb);
@@ -4,6 +4,7 @@
 #include <lilac/types.h>
 #include <lilac/config.h>
 #include <lilac/panic.h>
+#include <lilac/sync.h>
 
 #ifdef DEBUG_FAT_FULL
 #define DEBUG_FAT
@@ -114,18 +115,10 @@ struct fat_FAT_buf {
     u32 last_clst;
     u32 sectors;
     volatile u32 *FAT_buf;
-};
-
-struct fat_file_buf {
-    u32 cl;
-    u32 buf_sz;
-    union {
-        struct {
-            struct dirent *dirent;
-            u32 num_dirent;
-        };
-        volatile u8 *buffer;
-    };
+    unsigned long *dirty;       /* one bit per FAT sector awaiting writeback */
+    unsigned long *free_map;    /* one bit per cluster, set while it is free */
+    u32 nr_clst;                /* clusters covered by free_map */
+    u32 free_hint;              /* where the next free cluster search starts */
 };
 
 struct fat_disk {
@@ -139,6 +132,7 @@ struct fat_disk {
     volatile struct fat_BS bpb;
     volatile struct fat_FSInfo fs_info;
     struct fat_FAT_buf FAT;
+    bool fs_info_dirty;
 };
 
 // Filter out Volume ID entries (0x08) but allow LFN entries (which also have 0x08 set)
@@ -157,11 +151,51 @@ static inline int fat_value(u32 clst, struct fat_disk *disk)
     return FAT_VALUE(disk->FAT, clst);
 }
 
+#define FAT_BITS_PER_LONG       (8 * sizeof(unsigned long))
+#define FAT_ENTRIES_PER_SECTOR  (BYTES_PER_SECTOR / sizeof(u32))
+
+static inline void fat_bit_set(unsigned long *map, u32 bit)
+{
+    map[bit / FAT_BITS_PER_LONG] |= 1UL << (bit % FAT_BITS_PER_LONG);
+}
+
+static inline void fat_bit_clear(unsigned long *map, u32 bit)
+{
+    map[bit / FAT_BITS_PER_LONG] &= ~(1UL << (bit % FAT_BITS_PER_LONG));
+}
+
+static inline bool fat_bit_test(const unsigned long *map, u32 bit)
+{
+    return map[bit / FAT_BITS_PER_LONG] & (1UL << (bit % FAT_BITS_PER_LONG));
+}
+
+// Every FAT update goes through here so the dirty sectors, free map
+// and FSInfo free count stay in sync with FAT_buf
 static inline int fat_set_value(u32 clst, u32 val, struct fat_disk *disk)
 {
+    u32 old;
+
     if (clst < disk->FAT.first_clst || clst > disk->FAT.last_clst)
         panic("clst out of bounds\n");
+    old = FAT_VALUE(disk->FAT, clst);
     FAT_SET_VALUE(disk->FAT, clst, val);
+    fat_bit_set(disk->FAT.dirty,
+        (clst - disk->FAT.first_clst) / FAT_ENTRIES_PER_SECTOR);
+
+    val &= 0x0FFFFFFF;
+    if (clst < 2 || clst >= disk->FAT.nr_clst || !old == !val)
+        return 0;
+
+    if (val) {
+        fat_bit_clear(disk->FAT.free_map, clst);
+        disk->fs_info.free_clst_cnt--;
+    } else {
+        fat_bit_set(disk->FAT.free_map, clst);
+        disk->fs_info.free_clst_cnt++;
+        if (clst < disk->FAT.free_hint)
+            disk->FAT.free_hint = clst;
+    }
+    disk->fs_info_dirty = true;
     return 0;
 }
 
@@ -171,48 +205,99 @@ static inline u32 fat_clst_value(const struct fat_file *entry)
 }
 
 struct super_block;
+struct writeback_control;
 struct inode;
 struct file;
 struct dentry;
 struct gendisk;
 
+/*
+ * In-memory index of a directory, built on first access and kept in sync
+ * by create/mkdir/unlink so lookups don't have to rescan the disk.
+ */
+struct fat_dirent_loc {
+    struct hlist_node sfn_node;
+    struct hlist_node lfn_node;
+    struct list_head list;      /* directory order, for readdir */
+    u32 sfn_hash;
+    u32 lfn_hash;
+    u32 offset;                 /* byte offset of the 8.3 entry in the dir */
+    u32 lfn_offset;             /* first LFN slot, == offset if none */
+    struct fat_file entry;
+    char *lfn;
+    char sfn[13];
+};
+
+struct fat_dir_index {
+    mutex_t lock;
+    struct hlist_head *buckets;
+    u32 bits;
+    u32 count;
+    struct list_head entries;
+    u32 size;                   /* bytes allocated to the directory */
+    u32 end_offset;             /* offset of the 0x00 end marker */
+    u32 *free_slots;            /* offsets of deleted (0xE5) slots */
+    u32 nr_free;
+    u32 free_cap;
+};
+
 struct fat_inode {
     struct fat_file entry;
-    struct fat_file_buf buf;
-    //struct blkio_buffer *buffer;
+    struct fat_dir_index *dir_index;
+    u32 dir_clst;               /* start cluster of the parent, 0 for root */
+    u32 dir_offset;             /* offset of our 8.3 entry in the parent */
+    bool dirty;                 /* entry differs from the on-disk copy */
 };
 
 
 extern const struct file_operations fat_fops;
 extern const struct super_operations fat_sops;
+extern const struct address_space_operations fat_aops;
 extern const struct inode_operations fat_iops;
 
 struct inode *fat_alloc_inode(struct super_block *sb);
 void fat_destroy_inode(struct inode *inode);
 struct inode *fat_build_inode(struct super_block *sb, struct fat_inode *info);
+void fat_free_chain(struct fat_disk *disk, u32 clst);
 
 void get_fat_name(char fatname[12], const struct dentry *find);
 void str_toupper(char *str);
 time_t fat_time_to_unix(u16 date, u16 time);
 
-ssize_t __fat32_read_dir(struct fat_disk *disk, volatile u8 **buffer, int clst);
-int __fat32_read_all_dirent(struct file *file, struct dirent **dirents_ptr);
+struct fat_dir_index *fat_dir_index_get(struct inode *dir);
+void fat_dir_index_destroy(struct fat_dir_index *idx);
+struct fat_dirent_loc *fat_dir_index_find(struct fat_dir_index *idx, const char *name);
+struct fat_dirent_loc *fat_dir_index_add(struct fat_dir_index *idx,
+    const struct fat_file *entry, u32 offset, const char *lfn);
+void fat_dir_index_remove(struct fat_dir_index *idx, struct fat_dirent_loc *loc);
+long fat_dir_alloc_slot(struct inode *dir, struct fat_dir_index *idx);
+int fat_dir_write_entry(struct inode *dir, u32 offset, const struct fat_file *entry);
+int fat_dir_delete_entry(struct inode *dir, struct fat_dirent_loc *loc);
+int __fat_write_dirent(struct fat_disk *disk, u32 dir_clst, u32 offset,
+    const struct fat_file *entry);
 
 void __fat_read_clst(struct fat_disk *fat_disk, struct gendisk *hd, u32 clst, void *buf);
 void __fat_write_clst(struct fat_disk *fat_disk, struct gendisk *hd, u32 clst, const void *buf);
 
-int __fat_get_clst_num(struct file *file, struct fat_disk *disk);
+int __fat_read_sectors(struct fat_disk *fat_disk, struct gendisk *hd,
+    u32 clst, u32 sect_off, void *buf, u32 count);
 int __fat_find_free_clst(struct fat_disk *disk);
 int __fat_add_new_clst(struct fat_disk *disk, u32 prev_clst, u32 new_clst);
 int __fat_find_alloc_clst(struct fat_disk *disk, u32 prev_clst);
 
 int fat32_write_fs_info(struct fat_disk *fat_disk, struct gendisk *gd);
 int fat_write_FAT(struct fat_disk *fat_disk, struct gendisk *gd);
+int fat_write_inode(struct inode *inode, struct writeback_control *wbc);
+int fat_sync_fs(struct super_block *sb, int wait);
+int fat32_fsync(struct file *file, int datasync);
+int fat_readpages(struct inode *inode, unsigned long index, void *buf,
+    unsigned int nr_pages);
 
 int __do_fat32_read(const struct file *file, u32 clst, volatile u8 *buffer, size_t num_clst);
 int __do_fat32_write(const struct file *file, u32 clst, const u8 *buffer, size_t num_clst);
 
 int fat_strcasecmp(const char *s1, const char *s2);
+u32 fat_name_hash(const char *name);
 void fat_get_lfn_part(struct fat_file *entry, char *buffer);
 void fat_get_sfn(struct fat_file *entry, char *buffer);
 
@@ -9,75 +9,179 @@
 
 #include "fat_internal.h"
 
-ssize_t fat32_read(struct file *file, void *file_buf, size_t count)
+// Clusters staged per disk write, whatever the size of the caller's request
+#define FAT_WRITE_CHUNK     (64 * 1024)
+
+ssize_t fat32_read_iter(struct file *file, struct iov_iter *to, off_t *ppos)
 {
-    ssize_t bytes_read = -1;
-    u32 start_clst;
-    struct fat_disk *disk = (struct fat_disk*)file->f_dentry->d_inode->i_sb->s_fs_info;
     struct fat_file *fat_file = (struct fat_file*)file->f_dentry->d_inode->i_private;
-    if (fat_file->cl_low == 0 || file->f_pos >= fat_file->file_size)
+    if (fat_clst_value(fat_file) == 0 || *ppos >= fat_file->file_size)
         return 0;
-    u32 offset = file->f_pos % disk->bytes_per_clst;
 #ifdef DEBUG_FAT
-    klog(LOG_DEBUG, "Fat file size: %u, f_pos: %lu, offset: %u\n",
-        fat_file->file_size, file->f_pos, offset);
+    klog(LOG_DEBUG, "Fat file size: %u, pos: %lu\n",
+        fat_file->file_size, *ppos);
 #endif
-    count = MIN(count, fat_file->file_size - file->f_pos);
+    return filemap_read(file, to, ppos);
+}
+
+// Fill the page cache, merging physically contiguous clusters into one read
+int fat_readpages(struct inode *inode, unsigned long index, void *buf,
+    unsigned int nr_pages)
+{
+    struct fat_disk *disk = (struct fat_disk*)inode->i_sb->s_fs_info;
+    struct gendisk *gd = inode->i_sb->s_bdev->disk;
+    struct fat_file *fat_file = (struct fat_file*)inode->i_private;
+    const u32 bpc = disk->bytes_per_clst;
+    u64 pos = (u64)index * PAGE_SIZE;
+    u64 end = MIN(pos + (u64)nr_pages * PAGE_SIZE, inode->i_size);
+    u32 clst = fat_clst_value(fat_file);
+    u8 *dst = buf;
 
-    u32 num_clst = ROUND_UP(count + offset, disk->bytes_per_clst) /
-        disk->bytes_per_clst;
-    volatile unsigned char *buffer = get_free_pages(PAGE_UP_COUNT(disk->bytes_per_clst * num_clst), 0);
+    for (u64 n = pos / bpc; n && clst < 0x0FFFFFF8; n--)
+        clst = fat_value(clst, disk);
 
-    start_clst = __fat_get_clst_num(file, disk);
-    if (start_clst == 0)
-        goto out;
+    while (pos < end) {
+        u32 skip = pos % bpc;
+        u32 run = 1;
+        u64 bytes;
 
-    if (__do_fat32_read(file, start_clst, buffer, num_clst))
-        goto out;
+        if (clst < 2 || clst >= 0x0FFFFFF8)
+            return -EIO;
+        while (pos - skip + (u64)run * bpc < end &&
+                (u32)fat_value(clst + run - 1, disk) == clst + run)
+            run++;
 
-    memcpy(file_buf, (void*)(buffer + offset), count);
-    bytes_read = count;
+        // Only the final read can end mid-sector, and buf is whole pages
+        bytes = MIN((u64)run * bpc - skip, end - pos);
+        if (__fat_read_sectors(disk, gd, clst, skip / BYTES_PER_SECTOR, dst,
+                ROUND_UP(bytes, BYTES_PER_SECTOR) / BYTES_PER_SECTOR))
+            return -EIO;
 
-out:
-    free_pages((void*)buffer, PAGE_UP_COUNT(disk->bytes_per_clst * num_clst));
-    return bytes_read;
+        dst += bytes;
+        pos += bytes;
+        clst = fat_value(clst + run - 1, disk);
+    }
+
+    memset(dst, 0, (u8*)buf + (size_t)nr_pages * PAGE_SIZE - dst);
+    return 0;
 }
 
-ssize_t fat32_write(struct file *file, const void *file_buf, size_t count)
+/*
+ * Cluster holding byte pos. A pos just past the end of the chain gets a
+ * new cluster linked on, so appends can begin on a cluster boundary.
+ */
+static int fat_clst_at(struct inode *inode, struct fat_disk *disk, u64 pos)
 {
-    ssize_t bytes_written = -1;
-    u32 start_clst;
-    struct fat_disk *disk = (struct fat_disk*)file->f_dentry->d_inode->i_sb->s_fs_info;
-    struct fat_file *fat_file = (struct fat_file*)file->f_dentry->d_inode->i_private;
-    u32 offset = file->f_pos % disk->bytes_per_clst;
-    u32 num_clst = ROUND_UP(count + offset, disk->bytes_per_clst) /
-        disk->bytes_per_clst;
-    unsigned char *buffer = get_free_pages(PAGE_UP_COUNT(disk->bytes_per_clst * num_clst), 0);
-
-    start_clst = __fat_get_clst_num(file, disk);
-    if (start_clst == 0)
-        goto out;
-
-    if (offset) {
-        if(__do_fat32_read(file, start_clst, buffer, 1) < 0)
-            goto out;
+    u32 clst = fat_clst_value((struct fat_file*)inode->i_private);
+    u32 prev = 0;
+    int new_clst;
+
+    for (u64 n = pos / disk->bytes_per_clst; n; n--) {
+        if (clst < 2 || clst >= 0x0FFFFFF8)
+            return -EINVAL;
+        prev = clst;
+        clst = fat_value(clst, disk);
+    }
+
+    if (clst >= 0x0FFFFFF8 && prev) {
+        new_clst = __fat_find_alloc_clst(disk, prev);
+        return new_clst > 0 ? new_clst : -ENOSPC;
     }
+    return clst < 2 ? -EINVAL : (int)clst;
+}
+
+/*
+ * Write through to disk, staging at most FAT_WRITE_CHUNK bytes of whole
+ * clusters at a time. Each chunk carries on from the last cluster of the
+ * previous one instead of walking the chain again.
+ */
+ssize_t fat32_write_iter(struct file *file, struct iov_iter *from, off_t *ppos)
+{
+    struct inode *inode = file->f_dentry->d_inode;
+    struct fat_disk *disk = (struct fat_disk*)inode->i_sb->s_fs_info;
+    struct fat_file *fat_file = (struct fat_file*)inode->i_private;
+    const u32 bpc = disk->bytes_per_clst;
+    const u32 max_clst = MAX(FAT_WRITE_CHUNK / bpc, 1);
+    const size_t nr_pages = PAGE_UP_COUNT((size_t)bpc * max_clst);
+    size_t count = iov_iter_count(from);
+    size_t done = 0;
+    u64 pos = *ppos;
+    unsigned char *buffer;
+    int clst, err = 0;
+
+    buffer = get_free_pages(nr_pages, 0);
+    if (!buffer)
+        return -ENOMEM;
+
+    clst = fat_clst_at(inode, disk, pos);
+    while (done < count) {
+        u32 offset = pos % bpc;
+        size_t n = MIN(count - done, (size_t)max_clst * bpc - offset);
+        u32 num_clst = ROUND_UP(n + offset, bpc) / bpc;
+        int last;
 
-    memcpy(buffer + offset, file_buf, count);
+        if (clst < 0) {
+            err = clst;
+            break;
+        }
 
-    bytes_written = __do_fat32_write(file, start_clst, buffer, num_clst);
-    if (bytes_written < 0)
-        goto out;
-    bytes_written = count;
+        // Keep what the partial clusters at either end already hold
+        if (offset && __do_fat32_read(file, clst, buffer, 1) < 0) {
+            err = -EIO;
+            break;
+        }
+        if ((offset + n) % bpc && (num_clst > 1 || !offset)) {
+            size_t tail_off = (size_t)(num_clst - 1) * bpc;
+            u32 tail = clst;
 
-    if (file->f_pos + count > fat_file->file_size) {
-        fat_file->file_size = file->f_pos + count;
-        file->f_dentry->d_inode->i_size = fat_file->file_size;
+            if (pos + n < fat_file->file_size) {
+                for (u32 i = 1; i < num_clst && tail < 0x0FFFFFF8; i++)
+                    tail = fat_value(tail, disk);
+                if (tail >= 0x0FFFFFF8 ||
+                        __do_fat32_read(file, tail, buffer + tail_off, 1) < 0) {
+                    err = -EIO;
+                    break;
+                }
+            } else {
+                memset(buffer + tail_off, 0, bpc);
+            }
+        }
+
+        if (copy_from_iter(buffer + offset, n, from) != n) {
+            err = -EFAULT;
+            break;
+        }
+
+        last = __do_fat32_write(file, clst, buffer, num_clst);
+        if (last < 0) {
+            err = last;
+            break;
+        }
+        filemap_write_update(&inode->i_data, pos, buffer + offset, n);
+
+        pos += n;
+        done += n;
+        if (done < count) {
+            clst = fat_value(last, disk);
+            if (clst >= 0x0FFFFFF8) {
+                clst = __fat_find_alloc_clst(disk, last);
+                if (clst <= 0)
+                    clst = -ENOSPC;
+            }
+        }
     }
+    free_pages((void*)buffer, nr_pages);
 
-out:
-    free_pages((void*)buffer, PAGE_UP_COUNT(disk->bytes_per_clst * num_clst));
-    return bytes_written;
+    if (done) {
+        if (pos > fat_file->file_size) {
+            fat_file->file_size = pos;
+            inode->i_size = fat_file->file_size;
+            container_of(fat_file, struct fat_inode, entry)->dirty = true;
+        }
+        *ppos = pos;
+    }
+
+    return done ? (ssize_t)done : err;
 }
 
 // Read from a file into a buffer (always multiples of cluster size)
@@ -102,7 +206,10 @@ int __do_fat32_read(const struct file *file, u32 clst, volatile u8 *buffer,
     return 0;
 }
 
-// Write to a file from a buffer (always multiples of cluster size)
+/*
+ * Write to a file from a buffer (always multiples of cluster size),
+ * extending the chain as needed. Returns the last cluster written.
+ */
 int __do_fat32_write(const struct file *file, u32 clst, const u8 *buffer,
     size_t num_clst)
 {
@@ -113,20 +220,43 @@ int __do_fat32_write(const struct file *file, u32 clst, const u8 *buffer,
     const struct inode *inode = file->f_dentry->d_inode;
     struct gendisk *gd = inode->i_sb->s_bdev->disk;
     struct fat_disk *fat_disk = (struct fat_disk*)inode->i_sb->s_fs_info;
+    u32 prev = clst;
 
     while (clst_writ < num_clst) {
         __fat_write_clst(fat_disk, gd, clst, buffer);
         clst_writ++;
 
+        prev = clst;
+        if (clst_writ == num_clst)
+            break;
         clst = fat_value(clst, fat_disk);
-        if (clst >= 0x0FFFFFF8 && clst_writ < num_clst) {
-            clst = __fat_find_alloc_clst(fat_disk, clst);
-            if (clst <= 0)
-                kerror("No free clusters\n");
+        if (clst >= 0x0FFFFFF8) {
+            int new_clst = __fat_find_alloc_clst(fat_disk, prev);
+            if (new_clst <= 0)
+                return -ENOSPC;
+            clst = new_clst;
         }
 
         buffer += fat_disk->bytes_per_clst;
     }
 
+    return prev;
+}
+
+// File data is written through, so only metadata needs flushing here
+int fat32_fsync(struct file *file, int datasync)
+{
+    struct inode *inode = file->f_dentry->d_inode;
+    struct fat_disk *disk = (struct fat_disk*)inode->i_sb->s_fs_info;
+    struct gendisk *gd = inode->i_sb->s_bdev->disk;
+    int err;
+
+    if ((err = fat_write_inode(inode, NULL)))
+        return err;
+    if ((err = fat_write_FAT(disk, gd)))
+        return -EIO;
+    // The FSInfo free count isn't needed to read the data back
+    if (!datasync && disk->fs_info_dirty && fat32_write_fs_info(disk, gd))
+        return -EIO;
     return 0;
 }
@@ -0,0 +1,360 @@
+#include <fs/fat32.h>
+
+#include <lilac/fs.h>
+#include <lilac/log.h>
+#include <lilac/libc.h>
+#include <lilac/err.h>
+#include <lib/hash.h>
+#include <drivers/blkdev.h>
+#include <mm/kmalloc.h>
+
+#include "fat_internal.h"
+
+#pragma GCC diagnostic ignored "-Wanalyzer-malloc-leak"
+
+#define FAT_INDEX_MIN_BITS  4
+#define FAT_INDEX_MAX_BITS  12
+#define FAT_ENTRY_SIZE      sizeof(struct fat_file)
+
+static int fat_index_alloc_buckets(struct fat_dir_index *idx, u32 bits)
+{
+    // One array holds both tables: [0, n) is by 8.3 name, [n, 2n) by LFN
+    struct hlist_head *buckets = kcalloc(2u << bits, sizeof(struct hlist_head));
+    if (!buckets)
+        return -ENOMEM;
+    kfree(idx->buckets);
+    idx->buckets = buckets;
+    idx->bits = bits;
+    return 0;
+}
+
+static inline struct hlist_head *sfn_bucket(struct fat_dir_index *idx, u32 hash)
+{
+    return &idx->buckets[hash_32(hash, idx->bits)];
+}
+
+static inline struct hlist_head *lfn_bucket(struct fat_dir_index *idx, u32 hash)
+{
+    return &idx->buckets[(1u << idx->bits) + hash_32(hash, idx->bits)];
+}
+
+static void fat_index_hash_loc(struct fat_dir_index *idx, struct fat_dirent_loc *loc)
+{
+    hlist_add_head(&loc->sfn_node, sfn_bucket(idx, loc->sfn_hash));
+    if (loc->lfn)
+        hlist_add_head(&loc->lfn_node, lfn_bucket(idx, loc->lfn_hash));
+}
+
+// Keep chains short as the directory grows; failure just leaves them longer
+static void fat_index_grow(struct fat_dir_index *idx)
+{
+    struct fat_dirent_loc *loc;
+
+    if (idx->bits >= FAT_INDEX_MAX_BITS || idx->count <= (2u << idx->bits))
+        return;
+    if (fat_index_alloc_buckets(idx, idx->bits + 1))
+        return;
+
+    list_for_each_entry(loc, &idx->entries, list)
+        fat_index_hash_loc(idx, loc);
+}
+
+static int fat_index_push_free(struct fat_dir_index *idx, u32 offset)
+{
+    if (idx->nr_free == idx->free_cap) {
+        u32 cap = idx->free_cap ? idx->free_cap * 2 : 16;
+        u32 *tmp = krealloc(idx->free_slots, cap * sizeof(u32));
+        if (!tmp)
+            return -ENOMEM;
+        idx->free_slots = tmp;
+        idx->free_cap = cap;
+    }
+    idx->free_slots[idx->nr_free++] = offset;
+    return 0;
+}
+
+static struct fat_dirent_loc *__fat_dir_index_add(struct fat_dir_index *idx,
+    const struct fat_file *entry, u32 offset, const char *lfn, u32 lfn_offset)
+{
+    struct fat_dirent_loc *loc = kzmalloc(sizeof(*loc));
+    if (!loc)
+        return NULL;
+
+    loc->entry = *entry;
+    loc->offset = offset;
+    loc->lfn_offset = lfn_offset;
+    fat_get_sfn(&loc->entry, loc->sfn);
+    loc->sfn_hash = fat_name_hash(loc->sfn);
+    if (lfn && lfn[0]) {
+        loc->lfn = strdup(lfn);
+        if (!loc->lfn) {
+            kfree(loc);
+            return NULL;
+        }
+        loc->lfn_hash = fat_name_hash(loc->lfn);
+    }
+
+    fat_index_hash_loc(idx, loc);
+    list_add_tail(&loc->list, &idx->entries);
+    idx->count++;
+    fat_index_grow(idx);
+    return loc;
+}
+
+struct fat_dirent_loc *fat_dir_index_add(struct fat_dir_index *idx,
+    const struct fat_file *entry, u32 offset, const char *lfn)
+{
+    return __fat_dir_index_add(idx, entry, offset, lfn, offset);
+}
+
+struct fat_dirent_loc *fat_dir_index_find(struct fat_dir_index *idx, const char *name)
+{
+    struct fat_dirent_loc *loc;
+    u32 hash = fat_name_hash(name);
+
+    hlist_for_each_entry(loc, lfn_bucket(idx, hash), lfn_node) {
+        if (loc->lfn_hash == hash && !fat_strcasecmp(loc->lfn, name))
+            return loc;
+    }
+    hlist_for_each_entry(loc, sfn_bucket(idx, hash), sfn_node) {
+        if (loc->sfn_hash == hash && !fat_strcasecmp(loc->sfn, name))
+            return loc;
+    }
+    return NULL;
+}
+
+void fat_dir_index_remove(struct fat_dir_index *idx, struct fat_dirent_loc *loc)
+{
+    hlist_del(&loc->sfn_node);
+    if (loc->lfn)
+        hlist_del(&loc->lfn_node);
+    list_del(&loc->list);
+    idx->count--;
+
+    // Deleted slots get reused by the next create
+    for (u32 off = loc->lfn_offset; off <= loc->offset; off += FAT_ENTRY_SIZE)
+        fat_index_push_free(idx, off);
+
+    kfree(loc->lfn);
+    kfree(loc);
+}
+
+void fat_dir_index_destroy(struct fat_dir_index *idx)
+{
+    struct fat_dirent_loc *loc, *tmp;
+
+    if (!idx)
+        return;
+    list_for_each_entry_safe(loc, tmp, &idx->entries, list) {
+        kfree(loc->lfn);
+        kfree(loc);
+    }
+    kfree(idx->buckets);
+    kfree(idx->free_slots);
+    kfree(idx);
+}
+
+static struct fat_dir_index *fat_dir_index_build(struct inode *dir)
+{
+    struct fat_disk *disk = (struct fat_disk*)dir->i_sb->s_fs_info;
+    struct gendisk *hd = disk->bdev->disk;
+    struct fat_inode *info = (struct fat_inode*)dir->i_private;
+    struct fat_dir_index *idx;
+    struct fat_file *entry;
+    u8 *buffer;
+    u32 clst = fat_clst_value(&info->entry);
+    u32 offset = 0, lfn_offset = 0;
+    bool have_lfn = false, done = false;
+    long err = -ENOMEM;
+    char lfn[256];
+
+    idx = kzmalloc(sizeof(*idx));
+    buffer = kmalloc(disk->bytes_per_clst);
+    if (!idx || !buffer)
+        goto error;
+
+    mutex_init(&idx->lock);
+    INIT_LIST_HEAD(&idx->entries);
+    if (fat_index_alloc_buckets(idx, FAT_INDEX_MIN_BITS))
+        goto error;
+
+    // One cluster at a time, no need to hold the whole directory in memory
+    while (clst >= 2 && clst < 0x0FFFFFF8) {
+        if (!done) {
+            __fat_read_clst(disk, hd, clst, buffer);
+            for (entry = (struct fat_file*)buffer;
+                    entry < (struct fat_file*)(buffer + disk->bytes_per_clst);
+                    entry++, offset += FAT_ENTRY_SIZE) {
+                if (entry->name[0] == 0x00) {
+                    idx->end_offset = offset;
+                    done = true;
+                    break;
+                }
+
+                if (entry->name[0] == FAT_UNUSED) {
+                    if (fat_index_push_free(idx, offset))
+                        goto error;
+                    have_lfn = false;
+                    continue;
+                }
+
+                if (entry->attributes == LONG_FNAME) {
+                    if (!have_lfn) {
+                        memset(lfn, 0, sizeof(lfn));
+                        lfn_offset = offset;
+                        have_lfn = true;
+                    }
+                    fat_get_lfn_part(entry, lfn);
+                    continue;
+                }
+
+                if (INVALID_ENTRY(entry)) {
+                    have_lfn = false;
+                    continue;
+                }
+
+                if (!__fat_dir_index_add(idx, entry, offset,
+                        have_lfn ? lfn : NULL, have_lfn ? lfn_offset : offset))
+                    goto error;
+                have_lfn = false;
+            }
+        }
+        idx->size += disk->bytes_per_clst;
+        clst = fat_value(clst, disk);
+    }
+
+    if (!done)
+        idx->end_offset = idx->size;
+
+#ifdef DEBUG_FAT
+    klog(LOG_DEBUG, "fat: indexed %u entries (%u free slots) in dir %lu\n",
+        idx->count, idx->nr_free, dir->i_ino);
+#endif
+    kfree(buffer);
+    return idx;
+
+error:
+    kfree(buffer);
+    fat_dir_index_destroy(idx);
+    return ERR_PTR(err);
+}
+
+// Build the index on first use; later callers share it
+struct fat_dir_index *fat_dir_index_get(struct inode *dir)
+{
+    struct fat_inode *info = (struct fat_inode*)dir->i_private;
+    struct fat_dir_index *idx = READ_ONCE(info->dir_index);
+
+    if (idx)
+        return idx;
+
+    idx = fat_dir_index_build(dir);
+    if (IS_ERR(idx))
+        return idx;
+
+    acquire_lock(&dir->i_lock);
+    if (info->dir_index) {
+        release_lock(&dir->i_lock);
+        fat_dir_index_destroy(idx);
+        return info->dir_index;
+    }
+    info->dir_index = idx;
+    release_lock(&dir->i_lock);
+    return idx;
+}
+
+static u32 fat_dir_offset_clst(struct fat_disk *disk, u32 clst, u32 offset)
+{
+    u32 n = offset / disk->bytes_per_clst;
+    while (n-- && clst < 0x0FFFFFF8)
+        clst = fat_value(clst, disk);
+    return clst;
+}
+
+// Find a slot for one new 8.3 entry, extending the directory if it is full
+long fat_dir_alloc_slot(struct inode *dir, struct fat_dir_index *idx)
+{
+    struct fat_disk *disk = (struct fat_disk*)dir->i_sb->s_fs_info;
+    struct fat_inode *info = (struct fat_inode*)dir->i_private;
+    u32 offset, last;
+    int new_clst;
+    void *buffer;
+
+    if (idx->nr_free)
+        return idx->free_slots[--idx->nr_free];
+
+    if (idx->end_offset + FAT_ENTRY_SIZE <= idx->size) {
+        offset = idx->end_offset;
+        idx->end_offset += FAT_ENTRY_SIZE;
+        return offset;
+    }
+
+    buffer = kzmalloc(disk->bytes_per_clst);
+    if (!buffer)
+        return -ENOMEM;
+
+    last = fat_clst_value(&info->entry);
+    while (fat_value(last, disk) < 0x0FFFFFF8)
+        last = fat_value(last, disk);
+
+    new_clst = __fat_find_alloc_clst(disk, last);
+    if (new_clst < 0) {
+        kfree(buffer);
+        return -ENOSPC;
+    }
+    __fat_write_clst(disk, disk->bdev->disk, new_clst, buffer);
+    kfree(buffer);
+
+    klog(LOG_DEBUG, "Added new cluster %x to dir\n", new_clst);
+    offset = idx->size;
+    idx->size += disk->bytes_per_clst;
+    idx->end_offset = offset + FAT_ENTRY_SIZE;
+    return offset;
+}
+
+// Write one 32-byte slot, or mark it deleted if entry is NULL
+int __fat_write_dirent(struct fat_disk *disk, u32 dir_clst, u32 offset,
+    const struct fat_file *entry)
+{
+    struct gendisk *hd = disk->bdev->disk;
+    u32 clst = fat_dir_offset_clst(disk, dir_clst, offset);
+    u8 *buffer;
+
+    if (clst >= 0x0FFFFFF8)
+        return -EIO;
+
+    buffer = kmalloc(disk->bytes_per_clst);
+    if (!buffer)
+        return -ENOMEM;
+
+    __fat_read_clst(disk, hd, clst, buffer);
+    if (entry)
+        memcpy(buffer + offset % disk->bytes_per_clst, entry, FAT_ENTRY_SIZE);
+    else
+        buffer[offset % disk->bytes_per_clst] = FAT_UNUSED;
+    __fat_write_clst(disk, hd, clst, buffer);
+
+    kfree(buffer);
+    return 0;
+}
+
+int fat_dir_write_entry(struct inode *dir, u32 offset, const struct fat_file *entry)
+{
+    struct fat_inode *info = (struct fat_inode*)dir->i_private;
+    return __fat_write_dirent((struct fat_disk*)dir->i_sb->s_fs_info,
+        fat_clst_value(&info->entry), offset, entry);
+}
+
+int fat_dir_delete_entry(struct inode *dir, struct fat_dirent_loc *loc)
+{
+    struct fat_inode *info = (struct fat_inode*)dir->i_private;
+    struct fat_disk *disk = (struct fat_disk*)dir->i_sb->s_fs_info;
+    int err;
+
+    for (u32 off = loc->lfn_offset; off <= loc->offset; off += FAT_ENTRY_SIZE) {
+        err = __fat_write_dirent(disk, fat_clst_value(&info->entry), off, NULL);
+        if (err)
+            return err;
+    }
+    return 0;
+}
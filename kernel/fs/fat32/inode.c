@@ -20,7 +20,9 @@ struct inode *fat_alloc_inode(struct super_block *sb)
 
     new_node->i_sb = sb;
     new_node->i_op = &fat_iops;
+    new_node->i_data.a_ops = &fat_aops;
     new_node->i_count = 1;
+    new_node->i_nlink = 1;
     new_node->i_mode = 0777;
 
     return new_node;
@@ -28,10 +30,17 @@ struct inode *fat_alloc_inode(struct super_block *sb)
 
 void fat_destroy_inode(struct inode *inode)
 {
-    if (inode->i_private)
-        kfree(inode->i_private);
-    if (inode->i_list.next)
-        list_del(&inode->i_list);
+    struct fat_inode *info = (struct fat_inode*)inode->i_private;
+
+    truncate_inode_pages(&inode->i_data);
+    if (info) {
+        // Unlinked while open, nothing can reach the clusters any more
+        if (!inode->i_nlink)
+            fat_free_chain((struct fat_disk*)inode->i_sb->s_fs_info,
+                fat_clst_value(&info->entry));
+        fat_dir_index_destroy(info->dir_index);
+        kfree(info);
+    }
     kfree(inode);
 }
 
@@ -86,62 +95,46 @@ struct inode *fat_build_inode(struct super_block *sb, struct fat_inode *info)
     return inode;
 }
 
+// Write the 8.3 entry back if the file size or clusters changed
+int fat_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+    struct fat_inode *info = (struct fat_inode*)inode->i_private;
+    int err;
+
+    // An unlinked file's entry slot may belong to another file by now
+    if (!info || !info->dirty || !info->dir_clst || !inode->i_nlink)
+        return 0;
+
+    err = __fat_write_dirent((struct fat_disk*)inode->i_sb->s_fs_info,
+        info->dir_clst, info->dir_offset, &info->entry);
+    if (!err)
+        info->dirty = false;
+    return err;
+}
+
 // Return 0 if found, 1 if not found, negative on error
 static int fat32_find(struct inode *dir, const char *name,
     struct fat_inode *info)
 {
-    int ret = 1;
-    int bytes = 0;
-    struct fat_file *entry;
-    struct fat_disk *disk = (struct fat_disk*)dir->i_sb->s_fs_info;
-    volatile u8 *buffer = NULL;
-    char lfn[256];
-    char sfn[13];
-
-    memset(lfn, 0, sizeof(lfn));
-
-    struct fat_file *dir_entry = (struct fat_file*)dir->i_private;
-    bytes = __fat32_read_dir(disk, &buffer, fat_clst_value(dir_entry));
-    if (bytes <= 0) {
+    struct fat_dir_index *idx;
+    struct fat_dirent_loc *loc;
+
+    idx = fat_dir_index_get(dir);
+    if (IS_ERR(idx)) {
         klog(LOG_ERROR, "Failed to read directory entries\n");
-        return bytes;
+        return PTR_ERR(idx);
     }
-    entry = (struct fat_file*)buffer;
-
-    while (entry < (struct fat_file*)(buffer + bytes)) {
-        if (entry->name[0] == 0x00) {
-            break;
-        }
 
-        if (entry->attributes == LONG_FNAME) {
-            fat_get_lfn_part(entry, lfn);
-        } else if (entry->name[0] != FAT_UNUSED) {
-            // Check LFN
-            if (lfn[0] != 0) {
-                if (!fat_strcasecmp(lfn, name)) {
-                    memcpy(&info->entry, entry, sizeof(info->entry));
-                    ret = 0;
-                    break;
-                }
-            }
-
-            // Check SFN
-            fat_get_sfn(entry, sfn);
-            if (!fat_strcasecmp(sfn, name)) {
-                memcpy(&info->entry, entry, sizeof(info->entry));
-                ret = 0;
-                break;
-            }
-
-            memset(lfn, 0, sizeof(lfn));
-        } else {
-            memset(lfn, 0, sizeof(lfn));
-        }
-        entry++;
+    mutex_lock(&idx->lock);
+    loc = fat_dir_index_find(idx, name);
+    if (loc) {
+        memcpy(&info->entry, &loc->entry, sizeof(info->entry));
+        info->dir_clst = fat_clst_value(&((struct fat_inode*)dir->i_private)->entry);
+        info->dir_offset = loc->offset;
     }
+    mutex_unlock(&idx->lock);
 
-    kfree((void*)buffer);
-    return ret;
+    return loc ? 0 : 1;
 }
 
 #pragma GCC diagnostic ignored "-Wanalyzer-malloc-leak"
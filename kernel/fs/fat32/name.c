@@ -15,6 +15,18 @@ int fat_strcasecmp(const char *s1, const char *s2)
     return *s1 - *s2;
 }
 
+// Case-insensitive string hash, so "ls" and "LS" land in the same bucket
+u32 fat_name_hash(const char *name)
+{
+    u32 hash = 0;
+    while (*name) {
+        char c = *name++;
+        if (c >= 'a' && c <= 'z') c -= 32;
+        hash = hash * 31 + (u8)c;
+    }
+    return hash;
+}
+
 void fat_get_lfn_part(struct fat_file *entry, char *buffer)
 {
     struct fat_lfn *lfn = (struct fat_lfn*)entry;
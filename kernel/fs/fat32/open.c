@@ -4,6 +4,8 @@
 #include <lilac/libc.h>
 #include <lilac/fs.h>
 #include <lilac/timer.h>
+#include <lilac/err.h>
+#include <mm/kmalloc.h>
 #include <drivers/blkdev.h>
 
 #include "fat_internal.h"
@@ -11,22 +13,30 @@
 int fat32_open(struct inode *inode, struct file *file)
 {
     struct fat_inode *info = (struct fat_inode*)inode->i_private;
+    struct fat_dir_index *idx;
+
     file->f_op = &fat_fops;
-    if (info->entry.attributes & FAT_DIR_ATTR)
-        info->buf.num_dirent = __fat32_read_all_dirent(file, &info->buf.dirent);
+    if (info->entry.attributes & FAT_DIR_ATTR) {
+        idx = fat_dir_index_get(inode);
+        if (IS_ERR(idx))
+            return PTR_ERR(idx);
+    }
     return 0;
 }
 
 int fat32_create(struct inode *parent, struct dentry *new, umode_t mode)
 {
-    struct fat_file *entry = NULL;
     struct fat_disk *disk = (struct fat_disk*)parent->i_sb->s_fs_info;
     struct gendisk *hd = parent->i_sb->s_bdev->disk;
-    struct fat_file *parent_dir = (struct fat_file*)parent->i_private;
-    u32 clst = parent_dir->cl_low + (u32)(parent_dir->cl_high << 16);
-    volatile unsigned char *buffer = kzmalloc(disk->bytes_per_clst);
+    struct fat_dir_index *idx;
+    struct fat_inode *fat_i;
+    struct fat_file entry;
+    volatile unsigned char *buffer = NULL;
     struct timestamp cur_time = get_timestamp();
     char name[8];
+    char sfn[13];
+    long offset;
+    int new_clst;
     int ret = 0;
 
     memset(name, ' ', 8);
@@ -34,75 +44,124 @@ int fat32_create(struct inode *parent, struct dentry *new, umode_t mode)
         name[i] = new->d_name[i] = toupper(new->d_name[i]);
     }
 
-    while (clst < 0x0FFFFFF8) {
-        __fat_read_clst(disk, hd, clst, (void*)buffer);
-        for (entry = (struct fat_file*)buffer;
-            entry < (struct fat_file*)(buffer + disk->bytes_per_clst) &&
-            !(entry->name[0] == 0 || entry->name[0] == FAT_UNUSED);
-            entry++)
-        {
-            if (!strncmp((char*)entry->name, name, 8)) {
-                klog(LOG_INFO, "File %-8s already exists\n", name);
-                ret = -1;
-                goto error;
-            }
-        }
-
-        if (entry->name[0] == 0 || entry->name[0] == FAT_UNUSED)
-            break;
-
-        clst = fat_value(clst, disk);
-    }
-
-    if (clst >= 0x0FFFFFF8)
-        kerror("Need to allocate new cluster\n");
-
-    long new_clst = __fat_find_free_clst(disk);
-    if (new_clst == -1)
-        kerror("No free clusters\n");
-    disk->FAT.FAT_buf[new_clst - disk->FAT.first_clst] |= 0x0fffffffUL;
-
     u16 fat_date = FAT_SET_DATE(cur_time.year, cur_time.month, cur_time.day);
     u16 fat_time = FAT_SET_TIME(cur_time.hour, cur_time.minute, cur_time.second);
 
-    entry->attributes = 0;
-    entry->cl_low = new_clst & 0xFFFF;
-    entry->cl_high = new_clst >> 16;
-    entry->file_size = 0;
-    entry->creation_date = fat_date;
-    entry->creation_time = fat_time;
-    entry->last_write_date = fat_date;
-    entry->last_write_time = fat_time;
-    entry->last_access_date = fat_date;
-
-    strncpy((char*)entry->name, name, 8);
-    strncpy((char*)entry->ext, "   ", 3);
-
-    __fat_write_clst(disk, hd, clst, (const void*)buffer);
+    memset(&entry, 0, sizeof(entry));
+    entry.attributes = 0;
+    entry.file_size = 0;
+    entry.creation_date = fat_date;
+    entry.creation_time = fat_time;
+    entry.last_write_date = fat_date;
+    entry.last_write_time = fat_time;
+    entry.last_access_date = fat_date;
+
+    strncpy((char*)entry.name, name, 8);
+    strncpy((char*)entry.ext, "   ", 3);
+    fat_get_sfn(&entry, sfn);
+
+    idx = fat_dir_index_get(parent);
+    if (IS_ERR(idx))
+        return PTR_ERR(idx);
+
+    mutex_lock(&idx->lock);
+    if (fat_dir_index_find(idx, sfn)) {
+        klog(LOG_INFO, "File %-8s already exists\n", name);
+        ret = -EEXIST;
+        goto error;
+    }
 
-    struct fat_inode *fat_i = kzmalloc(sizeof(struct fat_inode));
-    if (!fat_i) {
+    buffer = kzmalloc(disk->bytes_per_clst);
+    fat_i = kzmalloc(sizeof(struct fat_inode));
+    if (!buffer || !fat_i) {
         klog(LOG_ERROR, "fat32_create: Out of memory allocating fat_inode\n");
+        kfree(fat_i);
         ret = -ENOMEM;
         goto error;
     }
-    fat_i->entry = *entry;
 
-    new->d_inode = fat_build_inode(parent->i_sb, fat_i);
+    offset = fat_dir_alloc_slot(parent, idx);
+    if (offset < 0) {
+        kfree(fat_i);
+        ret = offset;
+        goto error;
+    }
+
+    new_clst = __fat_find_alloc_clst(disk, 0);
+    if (new_clst < 0) {
+        kfree(fat_i);
+        ret = -ENOSPC;
+        goto error;
+    }
+
+    entry.cl_low = new_clst & 0xFFFF;
+    entry.cl_high = new_clst >> 16;
+    if ((ret = fat_dir_write_entry(parent, offset, &entry))) {
+        kfree(fat_i);
+        goto error;
+    }
+    fat_dir_index_add(idx, &entry, offset, NULL);
 
-    disk->fs_info.free_clst_cnt--;
-    disk->fs_info.next_free_clst = __fat_find_free_clst(disk);
+    fat_i->entry = entry;
+    fat_i->dir_clst = fat_clst_value(&((struct fat_inode*)parent->i_private)->entry);
+    fat_i->dir_offset = offset;
+    new->d_inode = fat_build_inode(parent->i_sb, fat_i);
 
-    memset((void*)buffer, 0, disk->bytes_per_clst);
+    // The FAT and FSInfo are written back on sync
     __fat_write_clst(disk, hd, new_clst, (const void*)buffer);
-    fat_write_FAT(disk, hd);
-    // fat32_write_fs_info(disk, hd);
 
 error:
+    mutex_unlock(&idx->lock);
     kfree((void*)buffer);
     return ret;
 }
 
+void fat_free_chain(struct fat_disk *disk, u32 clst)
+{
+    while (clst >= 2 && clst < 0x0FFFFFF8) {
+        u32 next = fat_value(clst, disk);
+        fat_set_value(clst, 0, disk);
+        clst = next;
+    }
+}
+
+int fat32_unlink(struct inode *dir, struct dentry *victim)
+{
+    struct fat_disk *disk = (struct fat_disk*)dir->i_sb->s_fs_info;
+    struct fat_dir_index *idx;
+    struct fat_dirent_loc *loc;
+    int ret = 0;
+
+    idx = fat_dir_index_get(dir);
+    if (IS_ERR(idx))
+        return PTR_ERR(idx);
+
+    mutex_lock(&idx->lock);
+    loc = fat_dir_index_find(idx, victim->d_name);
+    if (!loc) {
+        ret = -ENOENT;
+        goto out;
+    }
+    if (loc->entry.attributes & FAT_DIR_ATTR) {
+        ret = -EISDIR;
+        goto out;
+    }
+
+    if ((ret = fat_dir_delete_entry(dir, loc)))
+        goto out;
+
+    // The file may still be open, its clusters go on the final iput
+    if (victim->d_inode)
+        victim->d_inode->i_nlink = 0;
+    else
+        fat_free_chain(disk, fat_clst_value(&loc->entry));
+    fat_dir_index_remove(idx, loc);
+
+out:
+    mutex_unlock(&idx->lock);
+    return ret;
+}
+
 int fat32_close(struct inode *inode, struct file *file)
 {
     return 0;
@@ -1,16 +1,14 @@
 #include <fs/fcntl.h>
 #include <lilac/lilac.h>
 #include <lilac/fs.h>
+#include <lilac/memfd.h>
 #include <lilac/syscall.h>
 #include <lilac/sched.h>
 #include <lilac/uaccess.h>
 
 
-SYSCALL_DECL3(fcntl, int, fd, int, cmd, unsigned long, arg)
+static long do_fcntl(int fd, struct file *f, int cmd, unsigned long arg)
 {
-    struct file *f = get_file_handle(fd);
-    if (IS_ERR(f))
-        return PTR_ERR(f);
     int new_fd;
 
     switch (cmd) {
@@ -48,11 +46,26 @@ SYSCALL_DECL3(fcntl, int, fd, int, cmd, unsigned long, arg)
             else
                 f->f_mode &= ~O_CLOEXEC;
             return 0;
+        case F_ADD_SEALS:
+        case F_GET_SEALS:
+            return memfd_fcntl(f, cmd, arg);
         default:
             return -EINVAL;
     }
 }
 
+SYSCALL_DECL3(fcntl, int, fd, int, cmd, unsigned long, arg)
+{
+    struct fd f = fdget(fd);
+    long ret;
+
+    if (!f.file)
+        return -EBADF;
+    ret = do_fcntl(fd, f.file, cmd, arg);
+    fdput(f);
+    return ret;
+}
+
 SYSCALL_DECL2(access, const char *, pathname, int, mode)
 {
     if (mode & ~7) return -EINVAL;
@@ -65,12 +78,10 @@ SYSCALL_DECL2(access, const char *, pathname, int, mode)
     if (IS_ERR(d))
         return PTR_ERR(d);
 
-    if (!d->d_inode)
-        return -ENOENT;
-    if (mode == 0)
-        return 0;
+    int err = d->d_inode ? 0 : -ENOENT;
+    dput(d);
     // TODO: full permission check
-    return 0;
+    return err;
 }
 
 SYSCALL_DECL3(faccessat, int, dirfd, const char *, pathname, int, mode)
@@ -81,23 +92,24 @@ SYSCALL_DECL3(faccessat, int, dirfd, const char *, pathname, int, mode)
     if (dirfd == AT_FDCWD || pathname[0] == '/')
         return sys_access(pathname, mode);
 
-    struct file *dir = get_file_handle(dirfd);
-    if (IS_ERR(dir))
-        return PTR_ERR(dir);
-
     const char *path = get_user_path(pathname);
     if (IS_ERR(path))
         return PTR_ERR(path);
 
-    struct dentry *d = lookup_path_from(dir->f_dentry, path);
+    struct fd dir = fdget(dirfd);
+    if (!dir.file) {
+        kfree(path);
+        return -EBADF;
+    }
+
+    struct dentry *d = lookup_path_from(dir.file->f_dentry, path);
+    fdput(dir);
     kfree(path);
     if (IS_ERR(d))
         return PTR_ERR(d);
 
-    if (!d->d_inode)
-        return -ENOENT;
-    if (mode == 0)
-        return 0;
+    int err = d->d_inode ? 0 : -ENOENT;
+    dput(d);
     // TODO: full permission check
-    return 0;
+    return err;
 }
@@ -1,147 +1,320 @@
 #include <lilac/fs.h>
 #include <lilac/fdtable.h>
+#include <lilac/resource.h>
 #include <lilac/err.h>
 #include <lilac/log.h>
 #include <lilac/sched.h>
 
+// Arrays are whole words of bitmap, so the scan never handles a partial one
+#define FDARRAY_MIN     BITS_PER_LONG
+
+static struct fdarray * alloc_fdarray(unsigned int max)
+{
+    struct fdarray *fdt = kzmalloc(sizeof(*fdt));
+    if (!fdt)
+        return NULL;
+
+    fdt->fd = kcalloc(max, sizeof(struct file*));
+    fdt->open_fds = kcalloc(max / BITS_PER_LONG, sizeof(unsigned long));
+    if (!fdt->fd || !fdt->open_fds) {
+        kfree(fdt->fd);
+        kfree(fdt->open_fds);
+        kfree(fdt);
+        return NULL;
+    }
+    fdt->max = max;
+    return fdt;
+}
+
+static void free_fdarrays(struct fdarray *fdt)
+{
+    struct fdarray *old;
+
+    for (; fdt; fdt = old) {
+        old = fdt->old;
+        kfree(fdt->fd);
+        kfree(fdt->open_fds);
+        kfree(fdt);
+    }
+}
+
+static inline unsigned int fdarray_size(unsigned int nr)
+{
+    unsigned int size = FDARRAY_MIN;
+
+    while (size < nr)
+        size *= 2;
+    return size;
+}
+
 struct fdtable * alloc_fdtable(unsigned int size)
 {
-    struct fdtable *files = kmalloc(sizeof(*files));
+    struct fdtable *files = kzmalloc(sizeof(*files));
     if (!files)
         return NULL;
-    files->fdarray = kcalloc(size, sizeof(struct file*));
-    if (!files->fdarray) {
+    files->fdt = alloc_fdarray(fdarray_size(size));
+    if (!files->fdt) {
         kfree(files);
         return NULL;
     }
-    files->max = size;
     spin_lock_init(&files->lock);
     files->ref_count = 1;
     return files;
 }
 
-static int __set_fdtsize(struct fdtable *files, unsigned int size)
+// Copy of src for a new process, with a reference on every open file
+struct fdtable * dup_fdtable(struct fdtable *src)
 {
-    if (size <= files->max)
-        return files->max;
-    if (files->max >= 1024 || size > 1024)
-        return -EMFILE;
+    struct fdtable *files;
+    struct fdarray *fdt, *src_fdt;
 
-    void *tmp = krealloc(files->fdarray, sizeof(struct file*) * size);
-    if (!tmp)
-        return -ENOMEM;
-    files->fdarray = tmp;
-    for (size_t i = files->max; i < size; i++)
-        files->fdarray[i] = NULL;
-    files->max = size;
-    klog(LOG_DEBUG, "Increased max file descriptors to %d\n", size);
-    return files->max;
+    acquire_lock(&src->lock);
+    src_fdt = src->fdt;
+    files = alloc_fdtable(src_fdt->max);
+    if (!files) {
+        release_lock(&src->lock);
+        return NULL;
+    }
+
+    fdt = files->fdt;
+    memcpy(fdt->open_fds, src_fdt->open_fds, src_fdt->max / 8);
+    for (unsigned int i = 0; i < src_fdt->max; i++) {
+        fdt->fd[i] = src_fdt->fd[i];
+        if (fdt->fd[i])
+            fget(fdt->fd[i]);
+    }
+    files->next_fd = src->next_fd;
+    release_lock(&src->lock);
+
+    return files;
 }
 
-static int __get_fd_for(struct fdtable *files)
+// Drop a reference to the table, closing everything once it is unused
+void put_fdtable(struct fdtable *files)
 {
-    unsigned int cur_max = files->max;
+    struct fdarray *fdt = files->fdt;
+
+    if (--files->ref_count)
+        return;
 
-    for (size_t i = 0; i < cur_max; i++) {
-        if (!files->fdarray[i]) {
-            return i;
+    for (unsigned int i = 0; i < fdt->max; i++) {
+        if (fdt->fd[i]) {
+#ifdef DEBUG_VFS
+            klog(LOG_DEBUG, "Cleaning up file descriptor %d, file %p\n", i,
+                fdt->fd[i]);
+#endif
+            vfs_close(fdt->fd[i]);
+            fdt->fd[i] = NULL;
         }
     }
+    free_fdarrays(fdt);
+    kfree(files);
+}
+
+/*
+ * Grow the table so it has at least nr slots, the caller holds the lock.
+ * The new array is filled in before it is published, so a lockless reader
+ * sees either the old slots or the new ones, never a partial copy.
+ */
+static int expand_fdtable(struct fdtable *files, unsigned int nr)
+{
+    struct fdarray *fdt = files->fdt;
+    struct fdarray *new_fdt;
+    unsigned int size;
 
-    if (files->max < 256) {
-        int new_size = __set_fdtsize(files, files->max * 2);
-        if (new_size < 0)
-            return new_size;
-        return cur_max;
-    } else {
-        klog(LOG_DEBUG, "__get_fd_for: No available file descriptors\n");
+    if (nr <= fdt->max)
+        return 0;
+    if (nr > rlimit(RLIMIT_NOFILE) || nr > NR_OPEN_LIMIT)
         return -EMFILE;
+
+    size = MIN(fdarray_size(MAX(nr, fdt->max * 2)), fdarray_size(NR_OPEN_LIMIT));
+    new_fdt = alloc_fdarray(size);
+    if (!new_fdt)
+        return -ENOMEM;
+
+    memcpy(new_fdt->fd, fdt->fd, fdt->max * sizeof(struct file*));
+    memcpy(new_fdt->open_fds, fdt->open_fds, fdt->max / 8);
+    new_fdt->old = fdt;
+    __atomic_store_n(&files->fdt, new_fdt, __ATOMIC_RELEASE);
+#ifdef DEBUG_VFS
+    klog(LOG_DEBUG, "Increased max file descriptors to %u\n", size);
+#endif
+    return 0;
+}
+
+// First clear bit at or after start < max, or max if there is none
+static unsigned int find_next_zero_fd(const unsigned long *open_fds,
+    unsigned int max, unsigned int start)
+{
+    unsigned int word = start / BITS_PER_LONG;
+    unsigned long bits;
+
+    bits = ~open_fds[word] & (~0UL << (start % BITS_PER_LONG));
+    while (!bits) {
+        if (++word >= max / BITS_PER_LONG)
+            return max;
+        bits = ~open_fds[word];
     }
+    return word * BITS_PER_LONG + __builtin_ctzl(bits);
 }
 
+static inline void __install_fd(struct fdarray *fdt, unsigned int fd,
+    struct file *file)
+{
+    fdt->open_fds[fd / BITS_PER_LONG] |= 1UL << (fd % BITS_PER_LONG);
+    // Publish the slot after the file it points at is set up
+    __atomic_store_n(&fdt->fd[fd], file, __ATOMIC_RELEASE);
+}
 
-int get_fd_exact_replace(struct fdtable *files, int fd, struct file *file)
+static inline void __clear_fd(struct fdtable *files, struct fdarray *fdt,
+    unsigned int fd)
 {
-    if (fd < 0 || (unsigned)fd >= 1024)
-        return -EINVAL;
+    fdt->open_fds[fd / BITS_PER_LONG] &= ~(1UL << (fd % BITS_PER_LONG));
+    WRITE_ONCE(fdt->fd[fd], NULL);
+    if (fd < files->next_fd)
+        files->next_fd = fd;
+}
+
+// Put file in the lowest free slot at or above start
+static int alloc_fd(struct fdtable *files, unsigned int start, struct file *file)
+{
+    struct fdarray *fdt;
+    unsigned int fd;
+    int err;
 
     acquire_lock(&files->lock);
-    if (fd >= (int)files->max) {
-        int new_size = __set_fdtsize(files, MIN(fd * 2, 1024));
-        if (new_size < 0) {
-            release_lock(&files->lock);
-            return new_size;
-        }
-    }
+    fdt = files->fdt;
+    fd = MAX(start, files->next_fd);
+    if (fd < fdt->max)
+        fd = find_next_zero_fd(fdt->open_fds, fdt->max, fd);
 
-    if (files->fdarray[fd]) {
-        vfs_close(files->fdarray[fd]);
-        files->fdarray[fd] = NULL;
+    if (fd >= rlimit(RLIMIT_NOFILE)) {
+        err = -EMFILE;
+        goto error;
+    }
+    if (fd >= fdt->max) {
+        if ((err = expand_fdtable(files, fd + 1)) < 0)
+            goto error;
+        fdt = files->fdt;
     }
 
-    files->fdarray[fd] = file;
+    __install_fd(fdt, fd, file);
+    if (start <= files->next_fd)
+        files->next_fd = fd + 1;
     release_lock(&files->lock);
     return fd;
+
+error:
+    release_lock(&files->lock);
+    klog(LOG_DEBUG, "alloc_fd: No available file descriptors\n");
+    return err;
 }
 
-int get_fd_start_at(struct fdtable *files, int start, struct file *file)
+int get_fd_exact_replace(struct fdtable *files, int fd, struct file *file)
 {
-    if (start < 0 || (unsigned)start >= 1023)
-        return -EINVAL;
+    struct fdarray *fdt;
+    struct file *old;
+    int err;
 
-    acquire_lock(&files->lock);
+    if (fd < 0 || (unsigned long)fd >= rlimit(RLIMIT_NOFILE))
+        return -EBADF;
 
-    if (start >= (int)files->max) {
-        int new_size = __set_fdtsize(files, MIN(start * 2, 1024));
-        if (new_size < 0) {
-            release_lock(&files->lock);
-            return new_size;
-        }
-    }
-
-    for (int i = start; i < (int)files->max; i++) {
-        if (!files->fdarray[i]) {
-            files->fdarray[i] = file;
-            release_lock(&files->lock);
-            return i;
-        }
+    acquire_lock(&files->lock);
+    if ((err = expand_fdtable(files, fd + 1)) < 0) {
+        release_lock(&files->lock);
+        return err;
     }
 
+    fdt = files->fdt;
+    old = fdt->fd[fd];
+    __install_fd(fdt, fd, file);
     release_lock(&files->lock);
-    klog(LOG_DEBUG, "get_fd_start_at: No available file descriptors\n");
-    return -EMFILE;
+
+    // Closing can sleep, so it waits until the slot is already replaced
+    if (old)
+        vfs_close(old);
+    return fd;
+}
+
+int get_fd_start_at(struct fdtable *files, int start, struct file *file)
+{
+    if (start < 0 || (unsigned long)start >= rlimit(RLIMIT_NOFILE))
+        return -EINVAL;
+    return alloc_fd(files, start, file);
 }
 
 int get_next_fd(struct fdtable *files, struct file *file)
 {
     if (!files || !file)
         return -EINVAL;
+    return alloc_fd(files, 0, file);
+}
 
-    acquire_lock(&files->lock);
-    int fd = __get_fd_for(files);
-    if (fd < 0)
-        goto unlock;
+/**
+ * Take fd out of the table and hand back the file that was in it, for the
+ * caller to close. Returns NULL if fd wasn't open.
+ */
+struct file * fd_remove(struct fdtable *files, int fd)
+{
+    struct fdarray *fdt;
+    struct file *file = NULL;
 
-    files->fdarray[fd] = file;
-unlock:
+    acquire_lock(&files->lock);
+    fdt = files->fdt;
+    if (fd >= 0 && (unsigned)fd < fdt->max && (file = fdt->fd[fd]))
+        __clear_fd(files, fdt, fd);
     release_lock(&files->lock);
-    return fd;
+    return file;
 }
 
-struct file * get_file_handle(int fd)
+// Lockless lookup, the file may be closed by another thread at any time
+struct file * fd_lookup(struct fdtable *files, int fd)
+{
+    struct fdarray *fdt = __atomic_load_n(&files->fdt, __ATOMIC_ACQUIRE);
+
+    if (fd < 0 || (unsigned)fd >= fdt->max)
+        return NULL;
+    return __atomic_load_n(&fdt->fd[fd], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Look up fd and take a reference to the file, or return NULL if it isn't
+ * open. No lock is taken: the reference is only taken if the file still
+ * has one, and kept only if fd still holds the file afterwards, so a close
+ * racing with the lookup is either seen or retried.
+ */
+struct file * fget_fd(int fd)
 {
-    struct file *file;
     struct fdtable *files = current->files;
+    struct file *file;
 
-    acquire_lock(&files->lock);
-    if (fd < 0 || (unsigned)fd >= files->max) {
-        release_lock(&files->lock);
-        return ERR_PTR(-EBADF);
+    file_lookup_begin();
+    for (;;) {
+        file = fd_lookup(files, fd);
+        if (!file)
+            break;
+        if (fget_not_zero(file)) {
+            if (fd_lookup(files, fd) == file)
+                break;
+            fput(file);
+        }
     }
-    file = files->fdarray[fd];
-    release_lock(&files->lock);
-
-    if (!file)
-        return ERR_PTR(-EBADF);
+    file_lookup_end();
     return file;
 }
+
+/*
+ * Only this task can change an unshared table, so nothing can close fd
+ * before the syscall is done with it and the refcount can be skipped.
+ * Sharing only starts with a clone made by this task, never under us.
+ */
+struct fd fdget(int fd)
+{
+    struct fdtable *files = current->files;
+    struct file *file;
+
+    if (READ_ONCE(files->ref_count) == 1)
+        return (struct fd) { fd_lookup(files, fd), 0 };
+    file = fget_fd(fd);
+    return (struct fd) { file, file ? FDPUT_FPUT : 0 };
+}
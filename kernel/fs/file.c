@@ -1,6 +1,7 @@
 #include <lilac/fs.h>
 #include <lilac/err.h>
 #include <lilac/log.h>
+#include <lilac/eventpoll.h>
 #include <mm/kmalloc.h>
 
 struct file * alloc_file(struct dentry *d)
@@ -13,17 +14,87 @@ struct file * alloc_file(struct dentry *d)
     mutex_init(&file->f_pos_lock);
     file->f_count = 1;
     file->f_pos = 0;
+    file_ra_state_init(&file->f_ra);
+    INIT_LIST_HEAD(&file->f_ep_links);
     if (d)
         dget(d);
     file->f_dentry = d;
     return file;
 }
 
+/*
+ * fget_fd finds files without the fd table lock, so it can be looking at
+ * one whose last reference is being dropped. While any such lookups run,
+ * freed files wait on a deferred list instead of going back to kmalloc,
+ * linked through f_ep_links, which nothing uses by then.
+ */
+static atomic_uint nr_lockless_lookups;
+static LIST_HEAD(file_deferred);
+static spinlock_t file_deferred_lock = SPINLOCK_INIT;
+
+// Free whatever no lockless lookup can still be looking at
+static void file_free_deferred(void)
+{
+    LIST_HEAD(list);
+    struct file *file, *tmp;
+
+    acquire_lock(&file_deferred_lock);
+    list_splice_init(&file_deferred, &list);
+    release_lock(&file_deferred_lock);
+    if (list_empty(&list))
+        return;
+
+    // Every file on the list was out of all fd tables before now
+    if (nr_lockless_lookups) {
+        acquire_lock(&file_deferred_lock);
+        list_splice(&list, &file_deferred);
+        release_lock(&file_deferred_lock);
+        return;
+    }
+
+    list_for_each_entry_safe(file, tmp, &list, f_ep_links)
+        kfree(file);
+}
+
+static void file_free(struct file *file)
+{
+    if (nr_lockless_lookups) {
+        acquire_lock(&file_deferred_lock);
+        list_add_tail(&file->f_ep_links, &file_deferred);
+        release_lock(&file_deferred_lock);
+    } else {
+        kfree(file);
+    }
+}
+
+void file_lookup_begin(void)
+{
+    nr_lockless_lookups++;
+}
+
+void file_lookup_end(void)
+{
+    if (--nr_lockless_lookups == 0 && !list_empty(&file_deferred))
+        file_free_deferred();
+}
+
 void fget(struct file *file)
 {
     file->f_count++;
 }
 
+// Take a reference unless the last one is already gone, for lockless lookups
+bool fget_not_zero(struct file *file)
+{
+    unsigned int count = atomic_load(&file->f_count);
+
+    do {
+        if (!count)
+            return false;
+    } while (!atomic_compare_exchange_weak(&file->f_count, &count, count + 1));
+    return true;
+}
+
 void fput(struct file *file)
 {
     struct dentry *dentry = file->f_dentry;
@@ -36,9 +107,12 @@ void fput(struct file *file)
     if (--file->f_count)
         return;
 
+    // Nobody can add it to an epoll set now, so an unlocked check is enough
+    if (!list_empty(&file->f_ep_links))
+        eventpoll_release(file);
     if (file->f_op->release)
         file->f_op->release(inode, file);
-    kfree(file);
+    file_free(file);
 
     if (dentry)
         dput(dentry);
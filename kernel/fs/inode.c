@@ -1,4 +1,5 @@
 #include <lilac/fs.h>
+#include <lilac/exec_cache.h>
 
 #include <lilac/log.h>
 #include <lilac/err.h>
@@ -82,6 +83,7 @@ void destroy_inode(struct inode *inode)
 {
     struct super_block *sb = inode->i_sb;
 
+    exec_cache_invalidate(inode);
     if (sb->s_op->destroy_inode) {
         sb->s_op->destroy_inode(inode);
     } else {
@@ -118,6 +120,7 @@ void iput(struct inode *inode)
     list_del(&inode->i_list);
     release_lock(&sb->s_lock);
 
+    exec_cache_invalidate(inode);
     if (sb->s_op->destroy_inode) {
         sb->s_op->destroy_inode(inode);
     } else {
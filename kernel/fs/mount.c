@@ -20,11 +20,26 @@ struct vfsmount * get_empty_vfsmount(enum fs_type type)
     return NULL;
 }
 
-static int validate_params(const char *source, const char *target,
+// Flush every mounted filesystem's dirty metadata
+void sync_filesystems(void)
+{
+    for (int i = 0; i < 16; i++) {
+        struct super_block *sb = disks[i].mnt_sb;
+        if (sb && sb->s_op && sb->s_op->sync_fs)
+            sb->s_op->sync_fs(sb, 1);
+    }
+}
+
+static int validate_params(struct block_device *device, const char *target,
     enum fs_type type, unsigned long mountflags)
 {
-    if (type < -1)
+    if (type == NONE)
         return -ENODEV;
+    // Only tmpfs works without a backing device
+    if (!device && type != TMPFS)
+        return -ENODEV;
+    if (device && device->type != type)
+        return -EINVAL;
     if (numdisks >= 8)
         return -ENOMEM;
     return 0;
@@ -34,6 +49,8 @@ static enum fs_type str_to_fs(const char *fs_type)
 {
     if (!strcmp(fs_type, "msdos"))
         return MSDOS;
+    else if (!strcmp(fs_type, "ext2"))
+        return EXT2;
     else if (!strcmp(fs_type, "tmpfs"))
         return TMPFS;
     else
@@ -63,19 +80,18 @@ static struct dentry * get_final_dentry(struct dentry * parent, const char *path
     return lookup_path_from(parent, basename);
 }
 
-// TODO: Implement device layer in fs
 int vfs_mount(const char *source, const char *target,
         const char *filesystemtype, unsigned long mountflags,
         const void *data)
 {
-    void *device = NULL; // str_to_device(source);
+    struct block_device *device = lookup_bdev(source);
     struct super_block *sb;
     struct dentry *dentry;
     struct vfsmount *mnt;
     enum fs_type type = str_to_fs(filesystemtype);
     long err = 0;
 
-    err = validate_params(source, target, type, mountflags);
+    err = validate_params(device, target, type, mountflags);
     if (err)
         return err;
 
@@ -103,10 +119,13 @@ int vfs_mount(const char *source, const char *target,
         parent->d_inode->i_op->mkdir(parent->d_inode, new_dentry, 0);
     }
 
-    struct block_device *bdev = kzmalloc(sizeof(struct block_device));
-    if (!bdev)
-        return -ENOMEM;
-    bdev->type = type;
+    struct block_device *bdev = device;
+    if (!bdev) {
+        bdev = kzmalloc(sizeof(struct block_device));
+        if (!bdev)
+            return -ENOMEM;
+        bdev->type = type;
+    }
     sb = alloc_sb(bdev);
     if (IS_ERR(sb))
         return PTR_ERR(sb);
@@ -123,6 +142,7 @@ int vfs_mount(const char *source, const char *target,
     dentry->d_parent = parent;
     dentry->d_sb = sb;
 
+    // The mount keeps the references on the mount point and its parent
     mnt->mnt_sb = sb;
     mnt->mnt_root = dentry;
     new_dentry->d_mount = mnt;
@@ -171,6 +191,7 @@ int vfs_umount(const char *target)
     }
 
     struct vfsmount *mnt = dentry->d_mount;
+    dput(dentry);
     if (!mnt) {
         klog(LOG_DEBUG, "No mount found for %s\n", target);
         return -EINVAL;
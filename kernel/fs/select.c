@@ -0,0 +1,461 @@
+// poll, ppoll and select on top of the file poll operation
+#include <lilac/poll.h>
+#include <lilac/fs.h>
+#include <lilac/lilac.h>
+#include <lilac/sched.h>
+#include <lilac/signal.h>
+#include <lilac/syscall.h>
+#include <lilac/resource.h>
+#include <lilac/timer.h>
+#include <lilac/timer_event.h>
+#include <lilac/uaccess.h>
+#include <lilac/err.h>
+#include <mm/kmalloc.h>
+
+unsigned int vfs_poll(struct file *file, struct poll_table *pt)
+{
+    if (!file->f_op || !file->f_op->poll)
+        return DEFAULT_POLLMASK;
+    return file->f_op->poll(file, pt);
+}
+
+/*
+ * One queue a polled file asked us to watch. The entry holds a reference to
+ * the file so the queue, which the file owns, outlives the entry.
+ */
+struct poll_table_entry {
+    struct file *file;
+    struct waitqueue *wq;
+    struct wq_entry wait;
+    struct poll_wqueues *pwq;
+};
+
+#define N_INLINE_POLL_ENTRIES   6
+#define POLL_BLOCK_ENTRIES      32
+
+struct poll_table_block {
+    struct poll_table_block *next;
+    unsigned int nr;
+    struct poll_table_entry entries[POLL_BLOCK_ENTRIES];
+};
+
+/*
+ * Everything one poll or select call is waiting on. The queues are only
+ * collected on the first pass; the entries stay on them until the call
+ * returns, and any wakeup just sets triggered and wakes the caller.
+ */
+struct poll_wqueues {
+    struct poll_table pt;
+    struct poll_table_block *blocks;
+    bool triggered;
+    int error;
+    unsigned int inline_nr;
+    struct poll_table_entry inline_entries[N_INLINE_POLL_ENTRIES];
+};
+
+static int pollwake(struct wq_entry *wait)
+{
+    struct poll_table_entry *entry =
+        container_of(wait, struct poll_table_entry, wait);
+
+    WRITE_ONCE(entry->pwq->triggered, true);
+    set_task_running(wait->task);
+    return 1;
+}
+
+static struct poll_table_entry *poll_get_entry(struct poll_wqueues *pwq)
+{
+    struct poll_table_block *block = pwq->blocks;
+
+    if (pwq->inline_nr < N_INLINE_POLL_ENTRIES)
+        return pwq->inline_entries + pwq->inline_nr++;
+
+    if (!block || block->nr == POLL_BLOCK_ENTRIES) {
+        block = kmalloc(sizeof(*block));
+        if (!block)
+            return NULL;
+        block->nr = 0;
+        block->next = pwq->blocks;
+        pwq->blocks = block;
+    }
+    return block->entries + block->nr++;
+}
+
+static void pollwait_queue(struct file *file, struct waitqueue *wq,
+    struct poll_table *pt)
+{
+    struct poll_wqueues *pwq = container_of(pt, struct poll_wqueues, pt);
+    struct poll_table_entry *entry = poll_get_entry(pwq);
+
+    if (!entry) {
+        pwq->error = -ENOMEM;
+        return;
+    }
+    fget(file);
+    entry->file = file;
+    entry->wq = wq;
+    entry->pwq = pwq;
+    entry->wait.task = current;
+    entry->wait.wakeup = pollwake;
+    add_wait_queue(wq, &entry->wait);
+}
+
+static void poll_initwait(struct poll_wqueues *pwq)
+{
+    pwq->pt.qproc = pollwait_queue;
+    pwq->blocks = NULL;
+    pwq->triggered = false;
+    pwq->error = 0;
+    pwq->inline_nr = 0;
+}
+
+static void free_poll_entry(struct poll_table_entry *entry)
+{
+    remove_wait_queue(entry->wq, &entry->wait);
+    fput(entry->file);
+}
+
+static void poll_freewait(struct poll_wqueues *pwq)
+{
+    struct poll_table_block *block = pwq->blocks, *next;
+
+    for (unsigned int i = 0; i < pwq->inline_nr; i++)
+        free_poll_entry(pwq->inline_entries + i);
+    for (; block; block = next) {
+        for (unsigned int i = 0; i < block->nr; i++)
+            free_poll_entry(block->entries + i);
+        next = block->next;
+        kfree(block);
+    }
+}
+
+static inline bool poll_signal_pending(void)
+{
+    task_interrupted_ack();
+    return sig_get_active(current) != 0;
+}
+
+/*
+ * Sleep until one of the watched queues is woken, a signal arrives or the
+ * timeout fires. Returns false once the timeout has passed.
+ */
+static bool poll_schedule(struct poll_wqueues *pwq, struct timer_event *to)
+{
+    set_task_sleeping(current);
+    if (!READ_ONCE(pwq->triggered) && !sig_get_active(current) &&
+            (!to || timer_ev_queued(to)))
+        schedule();
+    set_task_running(current);
+    pwq->triggered = false;
+    return !to || timer_ev_queued(to);
+}
+
+/*
+ * A poll or select pass, given a table to queue on or NULL once that's been
+ * done. Returns the number of ready descriptors or an error.
+ */
+typedef int (*poll_scan_t)(void *ctx, struct poll_table *pt);
+
+/*
+ * Run scan until something is ready. timeout_ns < 0 waits forever and 0
+ * doesn't wait at all.
+ */
+static int do_poll_wait(poll_scan_t scan, void *ctx, s64 timeout_ns)
+{
+    struct poll_wqueues pwq;
+    struct timer_event to;
+    struct timer_event *top = NULL;
+    int count;
+
+    poll_initwait(&pwq);
+    if (timeout_ns > 0) {
+        to = TIMER_EV_INIT(to, current, ktime_get() + timeout_ns, NULL, NULL);
+        timer_ev_enqueue(&to, current);
+        top = &to;
+    }
+
+    for (;;) {
+        count = scan(ctx, timeout_ns ? &pwq.pt : NULL);
+        // The queues are all collected now, later passes only look
+        pwq.pt.qproc = NULL;
+        if (count || !timeout_ns)
+            break;
+        if (pwq.error) {
+            count = pwq.error;
+            break;
+        }
+        if (poll_signal_pending()) {
+            count = -EINTR;
+            break;
+        }
+        if (!poll_schedule(&pwq, top)) {
+            // One last look so an event racing the timeout isn't dropped
+            count = scan(ctx, NULL);
+            break;
+        }
+    }
+
+    if (top)
+        timer_ev_dequeue(top);
+    poll_freewait(&pwq);
+    return count;
+}
+
+struct poll_list {
+    struct pollfd *fds;
+    unsigned int nfds;
+};
+
+static unsigned int do_pollfd(struct pollfd *pfd, struct poll_table *pt)
+{
+    struct fd f;
+    unsigned int mask;
+
+    if (pfd->fd < 0)
+        return 0;
+    f = fdget(pfd->fd);
+    if (!f.file)
+        return POLLNVAL;
+    mask = vfs_poll(f.file, pt);
+    fdput(f);
+    return mask & (pfd->events | POLLERR | POLLHUP);
+}
+
+static int poll_scan(void *ctx, struct poll_table *pt)
+{
+    struct poll_list *list = ctx;
+    int count = 0;
+
+    for (unsigned int i = 0; i < list->nfds; i++) {
+        struct pollfd *pfd = list->fds + i;
+
+        pfd->revents = do_pollfd(pfd, pt);
+        if (pfd->revents) {
+            count++;
+            // We won't sleep, so there's no need to queue on the rest
+            pt = NULL;
+        }
+    }
+    return count;
+}
+
+#define POLL_STACK_FDS  32
+
+static int do_sys_poll(struct pollfd __user *ufds, unsigned int nfds,
+    s64 timeout_ns)
+{
+    struct pollfd stack_fds[POLL_STACK_FDS];
+    struct poll_list list = { .fds = stack_fds, .nfds = nfds };
+    size_t size = nfds * sizeof(struct pollfd);
+    int count;
+
+    if (nfds > rlimit(RLIMIT_NOFILE))
+        return -EINVAL;
+    if (nfds > POLL_STACK_FDS) {
+        list.fds = kmalloc(size);
+        if (!list.fds)
+            return -ENOMEM;
+    }
+    if (copy_from_user(list.fds, ufds, size)) {
+        count = -EFAULT;
+        goto out;
+    }
+
+    count = do_poll_wait(poll_scan, &list, timeout_ns);
+    if (count < 0)
+        goto out;
+    for (unsigned int i = 0; i < nfds; i++) {
+        if (put_user(list.fds[i].revents, &ufds[i].revents)) {
+            count = -EFAULT;
+            break;
+        }
+    }
+
+out:
+    if (list.fds != stack_fds)
+        kfree(list.fds);
+    return count;
+}
+
+SYSCALL_DECL3(poll, struct pollfd __user *, ufds, unsigned int, nfds,
+    int, timeout_ms)
+{
+    s64 timeout_ns = timeout_ms < 0 ? -1 : (s64)timeout_ms * NS_PER_MS;
+    return do_sys_poll(ufds, nfds, timeout_ns);
+}
+
+SYSCALL_DECL5(ppoll, struct pollfd __user *, ufds, unsigned int, nfds,
+    const struct timespec __user *, tsp, const sigset_t __user *, sigmask,
+    size_t, sigsetsize)
+{
+    struct timespec ts;
+    s64 timeout_ns = -1;
+    sigset_t mask, oldmask = current->blocked;
+    int ret;
+
+    if (tsp) {
+        if (copy_from_user(&ts, tsp, sizeof(ts)))
+            return -EFAULT;
+        if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= NS_PER_SEC)
+            return -EINVAL;
+        timeout_ns = timespec_to_ktime(ts);
+    }
+    if (sigmask) {
+        if (sigsetsize != sizeof(sigset_t))
+            return -EINVAL;
+        if (get_user(mask, sigmask))
+            return -EFAULT;
+        // Like sigsuspend, the mask only applies while we wait
+        current->blocked = mask & ~(_SIGKILL | _SIGSTOP);
+    }
+
+    ret = do_sys_poll(ufds, nfds, timeout_ns);
+
+    if (sigmask)
+        current->blocked = oldmask;
+    return ret;
+}
+
+#define POLLIN_SET  (POLLRDNORM | POLLRDBAND | POLLIN | POLLHUP | POLLERR)
+#define POLLOUT_SET (POLLWRBAND | POLLWRNORM | POLLOUT | POLLERR)
+#define POLLEX_SET  (POLLPRI)
+
+#define FDS_LONGS(n)    (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+/*
+ * The three sets passed in and the three handed back, each words long.
+ */
+struct fd_set_bits {
+    int n;
+    unsigned int words;
+    unsigned long *in, *out, *ex;
+    unsigned long *res_in, *res_out, *res_ex;
+};
+
+static int select_scan(void *ctx, struct poll_table *pt)
+{
+    struct fd_set_bits *fds = ctx;
+    int count = 0;
+
+    memset(fds->res_in, 0, 3 * fds->words * sizeof(unsigned long));
+    for (unsigned int w = 0; w < fds->words; w++) {
+        unsigned long all = fds->in[w] | fds->out[w] | fds->ex[w];
+
+        while (all) {
+            unsigned int bit = __builtin_ctzl(all);
+            unsigned long b = 1UL << bit;
+            int fd = w * BITS_PER_LONG + bit;
+            unsigned int mask;
+            struct fd f;
+
+            all &= ~b;
+            if (fd >= fds->n)
+                break;
+            f = fdget(fd);
+            if (!f.file)
+                return -EBADF;
+            mask = vfs_poll(f.file, pt);
+            fdput(f);
+
+            if ((fds->in[w] & b) && (mask & POLLIN_SET)) {
+                fds->res_in[w] |= b;
+                count++;
+            }
+            if ((fds->out[w] & b) && (mask & POLLOUT_SET)) {
+                fds->res_out[w] |= b;
+                count++;
+            }
+            if ((fds->ex[w] & b) && (mask & POLLEX_SET)) {
+                fds->res_ex[w] |= b;
+                count++;
+            }
+            if (count)
+                pt = NULL;
+        }
+    }
+    return count;
+}
+
+// Sets covering the first 256 descriptors don't need the heap
+#define SELECT_STACK_LONGS  (6 * FDS_LONGS(256))
+
+static int get_fd_set(unsigned long *set, unsigned long __user *uset,
+    unsigned int words)
+{
+    if (!uset) {
+        memset(set, 0, words * sizeof(unsigned long));
+        return 0;
+    }
+    return copy_from_user(set, uset, words * sizeof(unsigned long)) ?
+        -EFAULT : 0;
+}
+
+static int set_fd_set(unsigned long __user *uset, unsigned long *set,
+    unsigned int words)
+{
+    if (!uset)
+        return 0;
+    return copy_to_user(uset, set, words * sizeof(unsigned long)) ?
+        -EFAULT : 0;
+}
+
+SYSCALL_DECL5(select, int, n, unsigned long __user *, inp,
+    unsigned long __user *, outp, unsigned long __user *, exp,
+    struct timeval __user *, tvp)
+{
+    unsigned long stack_bits[SELECT_STACK_LONGS];
+    unsigned long *bits = stack_bits;
+    struct fd_set_bits fds;
+    struct fdarray *fdt;
+    struct timeval tv;
+    s64 timeout_ns = -1;
+    int ret;
+
+    if (n < 0)
+        return -EINVAL;
+    if (tvp) {
+        if (copy_from_user(&tv, tvp, sizeof(tv)))
+            return -EFAULT;
+        if (tv.tv_sec < 0 || tv.tv_usec < 0 || tv.tv_usec >= 1000000)
+            return -EINVAL;
+        timeout_ns = tv.tv_sec * NS_PER_SEC + tv.tv_usec * NS_PER_US;
+    }
+
+    // Nothing past the end of the table can be open
+    fdt = __atomic_load_n(&current->files->fdt, __ATOMIC_ACQUIRE);
+    if ((unsigned int)n > fdt->max)
+        n = fdt->max;
+
+    fds.n = n;
+    fds.words = FDS_LONGS(n);
+    if (6 * fds.words > SELECT_STACK_LONGS) {
+        bits = kmalloc(6 * fds.words * sizeof(unsigned long));
+        if (!bits)
+            return -ENOMEM;
+    }
+    fds.in = bits;
+    fds.out = bits + fds.words;
+    fds.ex = bits + 2 * fds.words;
+    fds.res_in = bits + 3 * fds.words;
+    fds.res_out = bits + 4 * fds.words;
+    fds.res_ex = bits + 5 * fds.words;
+
+    if ((ret = get_fd_set(fds.in, inp, fds.words)) ||
+            (ret = get_fd_set(fds.out, outp, fds.words)) ||
+            (ret = get_fd_set(fds.ex, exp, fds.words)))
+        goto out;
+
+    ret = do_poll_wait(select_scan, &fds, timeout_ns);
+    if (ret < 0)
+        goto out;
+
+    if (set_fd_set(inp, fds.res_in, fds.words) ||
+            set_fd_set(outp, fds.res_out, fds.words) ||
+            set_fd_set(exp, fds.res_ex, fds.words))
+        ret = -EFAULT;
+
+out:
+    if (bits != stack_bits)
+        kfree(bits);
+    return ret;
+}
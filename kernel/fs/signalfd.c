@@ -0,0 +1,155 @@
+/*
+ * signalfd: read pending signals from a file instead of taking them in a
+ * handler. The signals are normally blocked, so do_raise doesn't wake the
+ * task for them; it wakes the signal handlers' signalfd queue instead.
+ * Only the signal number is known here, the rest of each record is zero.
+ */
+#include <lilac/signalfd.h>
+#include <lilac/anon_inodes.h>
+#include <lilac/fs.h>
+#include <lilac/poll.h>
+#include <lilac/process.h>
+#include <lilac/sched.h>
+#include <lilac/signal.h>
+#include <lilac/syscall.h>
+#include <lilac/uaccess.h>
+#include <lilac/uio.h>
+#include <lilac/wait.h>
+#include <lilac/err.h>
+#include <mm/kmalloc.h>
+
+struct signalfd_ctx {
+    sigset_t sigmask;
+    // Keeps the queue alive while the file outlives the tasks using it
+    struct sighandlers *sighand;
+};
+
+static inline sigset_t signalfd_pending(struct signalfd_ctx *ctx)
+{
+    return READ_ONCE(current->pending) & READ_ONCE(ctx->sigmask);
+}
+
+// Take the lowest signal in the mask off current's pending set, or 0
+static int signalfd_dequeue(struct signalfd_ctx *ctx)
+{
+    struct task *p = current;
+    sigset_t pending = signalfd_pending(ctx);
+    int sig;
+
+    if (!pending)
+        return 0;
+    sig = __builtin_ffsl(pending) - 1;
+    sigdelset(&p->pending, sig);
+    if (p->pending == 0)
+        p->flags.sig_pending = 0;
+    return sig;
+}
+
+static ssize_t signalfd_read(struct file *file, struct iov_iter *to,
+    __unused off_t *ppos)
+{
+    struct signalfd_ctx *ctx = file->f_data;
+    struct signalfd_siginfo info;
+    size_t count = iov_iter_count(to);
+    ssize_t done = 0;
+    int sig, err;
+
+    if (count < sizeof(info))
+        return -EINVAL;
+
+    while (done + sizeof(info) <= count) {
+        sig = signalfd_dequeue(ctx);
+        if (!sig) {
+            // Only block for the first record
+            if (done)
+                break;
+            if (file->f_mode & O_NONBLOCK)
+                return -EAGAIN;
+            err = wait_event_interruptible(ctx->sighand->signalfd_wq,
+                signalfd_pending(ctx));
+            if (err)
+                return err;
+            continue;
+        }
+
+        memset(&info, 0, sizeof(info));
+        info.ssi_signo = sig;
+        if (copy_to_iter(&info, sizeof(info), to) != sizeof(info))
+            return done ? done : -EFAULT;
+        done += sizeof(info);
+    }
+    return done;
+}
+
+static unsigned int signalfd_poll(struct file *file, struct poll_table *pt)
+{
+    struct signalfd_ctx *ctx = file->f_data;
+
+    poll_wait(file, &ctx->sighand->signalfd_wq, pt);
+    return signalfd_pending(ctx) ? POLLIN | POLLRDNORM : 0;
+}
+
+static int signalfd_release(__unused struct inode *inode, struct file *file)
+{
+    struct signalfd_ctx *ctx = file->f_data;
+
+    put_sighandlers(ctx->sighand);
+    kfree(ctx);
+    return 0;
+}
+
+static const struct file_operations signalfd_fops = {
+    .read_iter = signalfd_read,
+    .poll = signalfd_poll,
+    .release = signalfd_release,
+};
+
+/**
+ * Make a signalfd for the signals in mask, or with fd != -1 replace the
+ * mask of the signalfd fd already is. SIGKILL and SIGSTOP are never read.
+ */
+SYSCALL_DECL4(signalfd4, int, fd, const sigset_t __user *, user_mask,
+    size_t, sizemask, int, flags)
+{
+    struct signalfd_ctx *ctx;
+    sigset_t sigmask;
+    struct fd f;
+
+    if (flags & ~(SFD_CLOEXEC | SFD_NONBLOCK))
+        return -EINVAL;
+    if (sizemask != sizeof(sigset_t))
+        return -EINVAL;
+    if (copy_from_user(&sigmask, user_mask, sizeof(sigmask)))
+        return -EFAULT;
+    sigmask &= ~(_SIGKILL | _SIGSTOP);
+
+    if (fd != -1) {
+        f = fdget(fd);
+        if (!f.file)
+            return -EBADF;
+        if (f.file->f_op != &signalfd_fops) {
+            fdput(f);
+            return -EINVAL;
+        }
+        ctx = f.file->f_data;
+        WRITE_ONCE(ctx->sigmask, sigmask);
+        // Waiters may be able to read now
+        wake_all(&ctx->sighand->signalfd_wq);
+        fdput(f);
+        return fd;
+    }
+
+    ctx = kzmalloc(sizeof(*ctx));
+    if (!ctx)
+        return -ENOMEM;
+    ctx->sigmask = sigmask;
+    ctx->sighand = current->sighand;
+    get_sighandlers(ctx->sighand);
+
+    fd = anon_inode_getfd(&signalfd_fops, ctx, O_RDONLY | flags);
+    if (fd < 0) {
+        put_sighandlers(ctx->sighand);
+        kfree(ctx);
+    }
+    return fd;
+}
@@ -76,12 +76,13 @@ SYSCALL_DECL2(stat, const char*, path, struct stat*, buf)
 SYSCALL_DECL2(fstat, int, fd, struct stat*, buf)
 {
     struct stat st;
-    struct file *f = get_file_handle(fd);
-    if (IS_ERR_OR_NULL(f))
-        return -EBADF;
     if (!access_ok(buf, sizeof(struct stat)))
         return -EFAULT;
-    int err = vfs_stat(f, &st);
+    struct fd f = fdget(fd);
+    if (!f.file)
+        return -EBADF;
+    int err = vfs_stat(f.file, &st);
+    fdput(f);
     if (err < 0)
         return err;
     return copy_to_user(buf, &st, sizeof(st));
@@ -0,0 +1,228 @@
+/*
+ * timerfd: a timer_event that counts its expirations instead of waking a
+ * task. Reading returns the count since the last read and resets it. The
+ * callback runs from the timer interrupt of whichever CPU queued the event,
+ * so the count is atomic. settime takes the event out first, which waits
+ * for a running callback, so the interval and count change under nothing.
+ */
+#include <lilac/timerfd.h>
+#include <lilac/anon_inodes.h>
+#include <lilac/fs.h>
+#include <lilac/lilac.h>
+#include <lilac/poll.h>
+#include <lilac/sched.h>
+#include <lilac/syscall.h>
+#include <lilac/timer.h>
+#include <lilac/timer_event.h>
+#include <lilac/uaccess.h>
+#include <lilac/uio.h>
+#include <lilac/wait.h>
+#include <lilac/err.h>
+#include <mm/kmalloc.h>
+
+struct timerfd_ctx {
+    spinlock_t lock;            /* settime and gettime */
+    struct waitqueue wq;
+    struct timer_event ev;
+    int clockid;
+    ktime_t interval;
+    atomic_uint ticks;
+};
+
+static inline struct timespec ktime_to_timespec(ktime_t kt)
+{
+    return (struct timespec) { kt / NS_PER_SEC, kt % NS_PER_SEC };
+}
+
+// Called from the timer interrupt once the event is out of the tree
+static void timerfd_expire(struct timer_event *ev)
+{
+    struct timerfd_ctx *ctx = ev->context;
+    unsigned int ticks = 1;
+    ktime_t now;
+    s64 overrun;
+
+    if (ctx->interval) {
+        // Count the periods that went by while the tick was late
+        now = ktime_get();
+        ev->expires += ctx->interval;
+        if (ev->expires <= now) {
+            overrun = (now - ev->expires) / ctx->interval + 1;
+            ev->expires += overrun * ctx->interval;
+            ticks += overrun;
+        }
+        timer_ev_enqueue(ev, NULL);
+    }
+    ctx->ticks += ticks;
+    wake_all(&ctx->wq);
+}
+
+static void timerfd_get(struct timerfd_ctx *ctx, struct itimerspec *cur)
+{
+    ktime_t remaining = 0;
+
+    if (timer_ev_queued(&ctx->ev)) {
+        remaining = ctx->ev.expires - ktime_get();
+        // Due but not handled yet, which still counts as armed
+        if (remaining <= 0)
+            remaining = 1;
+    }
+    cur->it_value = ktime_to_timespec(remaining);
+    cur->it_interval = ktime_to_timespec(ctx->interval);
+}
+
+static ssize_t timerfd_read(struct file *file, struct iov_iter *to,
+    __unused off_t *ppos)
+{
+    struct timerfd_ctx *ctx = file->f_data;
+    u64 ticks;
+    int err;
+
+    if (iov_iter_count(to) < sizeof(ticks))
+        return -EINVAL;
+
+    while (!(ticks = atomic_exchange(&ctx->ticks, 0))) {
+        if (file->f_mode & O_NONBLOCK)
+            return -EAGAIN;
+        err = wait_event_interruptible(ctx->wq, ctx->ticks);
+        if (err)
+            return err;
+    }
+
+    if (copy_to_iter(&ticks, sizeof(ticks), to) != sizeof(ticks))
+        return -EFAULT;
+    return sizeof(ticks);
+}
+
+static unsigned int timerfd_poll(struct file *file, struct poll_table *pt)
+{
+    struct timerfd_ctx *ctx = file->f_data;
+
+    poll_wait(file, &ctx->wq, pt);
+    return ctx->ticks ? POLLIN | POLLRDNORM : 0;
+}
+
+static int timerfd_release(__unused struct inode *inode, struct file *file)
+{
+    struct timerfd_ctx *ctx = file->f_data;
+
+    timer_ev_dequeue(&ctx->ev);
+    kfree(ctx);
+    return 0;
+}
+
+static const struct file_operations timerfd_fops = {
+    .read_iter = timerfd_read,
+    .poll = timerfd_poll,
+    .release = timerfd_release,
+};
+
+static struct fd timerfd_fdget(int fd)
+{
+    struct fd f = fdget(fd);
+
+    if (f.file && f.file->f_op != &timerfd_fops) {
+        fdput(f);
+        f.file = NULL;
+    }
+    return f;
+}
+
+SYSCALL_DECL2(timerfd_create, int, clockid, int, flags)
+{
+    struct timerfd_ctx *ctx;
+    int fd;
+
+    if (clockid != CLOCK_REALTIME && clockid != CLOCK_MONOTONIC)
+        return -EINVAL;
+    if (flags & ~(TFD_CLOEXEC | TFD_NONBLOCK))
+        return -EINVAL;
+
+    ctx = kzmalloc(sizeof(*ctx));
+    if (!ctx)
+        return -ENOMEM;
+    spin_lock_init(&ctx->lock);
+    spin_lock_init(&ctx->wq.lock);
+    INIT_LIST_HEAD(&ctx->wq.task_list);
+    RB_CLEAR_NODE(&ctx->ev.node);
+    INIT_LIST_HEAD(&ctx->ev.task_list);
+    ctx->ev.callback = timerfd_expire;
+    ctx->ev.context = ctx;
+    ctx->clockid = clockid;
+
+    fd = anon_inode_getfd(&timerfd_fops, ctx, O_RDONLY | flags);
+    if (fd < 0)
+        kfree(ctx);
+    return fd;
+}
+
+/**
+ * Arm or disarm the timer. A zero it_value disarms it, otherwise it first
+ * fires at it_value, relative to now unless TFD_TIMER_ABSTIME is set, and
+ * then every it_interval if that is non-zero.
+ */
+SYSCALL_DECL4(timerfd_settime, int, fd, int, flags,
+    const struct itimerspec __user *, new_value,
+    struct itimerspec __user *, old_value)
+{
+    struct itimerspec new, old;
+    struct timerfd_ctx *ctx;
+    ktime_t expires;
+    struct fd f;
+
+    if (flags & ~TFD_TIMER_ABSTIME)
+        return -EINVAL;
+    if (copy_from_user(&new, new_value, sizeof(new)))
+        return -EFAULT;
+    if (!timespec_valid(&new.it_value) || !timespec_valid(&new.it_interval))
+        return -EINVAL;
+
+    f = timerfd_fdget(fd);
+    if (!f.file)
+        return -EBADF;
+    ctx = f.file->f_data;
+
+    expires = timespec_to_ktime(new.it_value);
+    if (expires && (flags & TFD_TIMER_ABSTIME)) {
+        // The tree runs on time since boot
+        if (ctx->clockid == CLOCK_REALTIME)
+            expires -= boot_unix_time * NS_PER_SEC;
+    } else if (expires) {
+        expires += ktime_get();
+    }
+
+    acquire_lock(&ctx->lock);
+    timerfd_get(ctx, &old);
+    timer_ev_dequeue(&ctx->ev);
+    ctx->ticks = 0;
+    ctx->interval = timespec_to_ktime(new.it_interval);
+    if (expires) {
+        ctx->ev.expires = expires;
+        timer_ev_enqueue(&ctx->ev, NULL);
+    }
+    release_lock(&ctx->lock);
+    fdput(f);
+
+    if (old_value && copy_to_user(old_value, &old, sizeof(old)))
+        return -EFAULT;
+    return 0;
+}
+
+SYSCALL_DECL2(timerfd_gettime, int, fd, struct itimerspec __user *, cur_value)
+{
+    struct itimerspec cur;
+    struct timerfd_ctx *ctx;
+    struct fd f;
+
+    f = timerfd_fdget(fd);
+    if (!f.file)
+        return -EBADF;
+    ctx = f.file->f_data;
+
+    acquire_lock(&ctx->lock);
+    timerfd_get(ctx, &cur);
+    release_lock(&ctx->lock);
+    fdput(f);
+
+    return copy_to_user(cur_value, &cur, sizeof(cur)) ? -EFAULT : 0;
+}
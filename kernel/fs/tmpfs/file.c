@@ -3,50 +3,228 @@
 #include <lilac/libc.h>
 #include <lilac/timer.h>
 #include <lilac/err.h>
+#include <lilac/memfd.h>
 #include <mm/kmalloc.h>
+#include <mm/page.h>
 
 #include "tmpfs_internal.h"
 
 
 static int tmpfs_close(struct inode *inode, struct file *file)
 {
+    struct tmpfs_cursor *cursor = file->f_data;
+
+    if (cursor && inode && S_ISDIR(inode->i_mode)) {
+        struct tmpfs_dir *dir = (struct tmpfs_dir*)inode->i_private;
+
+        acquire_lock(&dir->lock);
+        list_del(&cursor->entry.list);
+        release_lock(&dir->lock);
+        kfree(cursor);
+    }
     return 0;
 }
 
-static ssize_t tmpfs_read(struct file *file, void *buf, size_t cnt)
+/*
+ * Return the page at index with a reference held, allocating a zeroed one
+ * if alloc is set. Returns NULL for a hole or if memory ran out.
+ */
+static struct page *
+tmpfs_get_page(struct tmpfs_file *file, unsigned long index, bool alloc)
+{
+    struct page *pg, *new;
+
+    acquire_lock(&file->lock);
+    pg = radix_tree_lookup(&file->pages, index);
+    if (pg)
+        get_page(pg);
+    release_lock(&file->lock);
+    if (pg || !alloc)
+        return pg;
+
+    new = alloc_page(ALLOC_NORMAL);
+    if (!new)
+        return NULL;
+    clear_page(get_page_addr(new));
+
+    acquire_lock(&file->lock);
+    // Another writer may have filled the hole while we allocated
+    pg = radix_tree_lookup(&file->pages, index);
+    if (!pg) {
+        if (radix_tree_insert(&file->pages, index, new)) {
+            release_lock(&file->lock);
+            put_page(new);
+            return NULL;
+        }
+        file->nrpages++;
+        pg = new;
+        new = NULL;
+    }
+    get_page(pg);
+    release_lock(&file->lock);
+
+    if (new)
+        put_page(new);
+    return pg;
+}
+
+// Release every page of a file that is going away
+void tmpfs_free_pages(struct tmpfs_file *file)
+{
+    void *pages[16];
+    unsigned long indices[16];
+    unsigned int nr;
+
+    while ((nr = radix_tree_gang_lookup(&file->pages, pages, indices, 0,
+            ARRAY_SIZE(pages)))) {
+        for (unsigned int i = 0; i < nr; i++) {
+            radix_tree_delete(&file->pages, indices[i]);
+            put_page(pages[i]);
+        }
+    }
+    file->nrpages = 0;
+}
+
+/*
+ * Set the size of a regular file. Pages wholly past the new end are taken
+ * out of the file; a shared mapping still holding one keeps the frame, it
+ * just isn't part of the file anymore.
+ */
+int tmpfs_truncate(struct inode *inode, u64 size)
+{
+    struct tmpfs_file *file = (struct tmpfs_file*)inode->i_private;
+    unsigned long index = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    size_t offset = size & (PAGE_SIZE - 1);
+    void *pages[16];
+    unsigned long indices[16];
+    unsigned int nr;
+    int err = 0;
+
+    mutex_lock(&inode->i_mutex);
+    if ((size < inode->i_size && (file->seals & F_SEAL_SHRINK)) ||
+            (size > inode->i_size && (file->seals & F_SEAL_GROW))) {
+        err = -EPERM;
+        goto out;
+    }
+
+    // What was past the end reads back as zeroes if the file grows again
+    if (offset && size < inode->i_size) {
+        struct page *pg = tmpfs_get_page(file, size >> PAGE_SHIFT, false);
+        if (pg) {
+            memset(get_page_addr(pg) + offset, 0, PAGE_SIZE - offset);
+            put_page(pg);
+        }
+    }
+
+    acquire_lock(&file->lock);
+    inode->i_size = size;
+    release_lock(&file->lock);
+
+    do {
+        acquire_lock(&file->lock);
+        nr = radix_tree_gang_lookup(&file->pages, pages, indices, index,
+            ARRAY_SIZE(pages));
+        for (unsigned int i = 0; i < nr; i++)
+            radix_tree_delete(&file->pages, indices[i]);
+        file->nrpages -= nr;
+        release_lock(&file->lock);
+
+        for (unsigned int i = 0; i < nr; i++)
+            put_page(pages[i]);
+    } while (nr);
+
+    inode->i_mtime = inode->i_ctime = get_unix_time();
+out:
+    mutex_unlock(&inode->i_mutex);
+    return err;
+}
+
+static ssize_t tmpfs_read(struct file *file, struct iov_iter *to, off_t *ppos)
 {
     struct inode *inode = file->f_dentry->d_inode;
     struct tmpfs_file *tmp_inode = (struct tmpfs_file*)inode->i_private;
-    size_t read = 0;
+    size_t cnt, done = 0;
+    u64 pos = *ppos;
+
+    if (pos >= inode->i_size)
+        return 0;
+    cnt = MIN(iov_iter_count(to), inode->i_size - pos);
 
-    if (file->f_pos + cnt > inode->i_size)
-        cnt = inode->i_size - file->f_pos;
+    while (done < cnt) {
+        size_t offset = pos & (PAGE_SIZE - 1);
+        size_t n = MIN(PAGE_SIZE - offset, cnt - done);
+        struct page *pg = tmpfs_get_page(tmp_inode, pos >> PAGE_SHIFT, false);
+        size_t copied;
 
-    unsigned char *data = tmp_inode->data + file->f_pos;
-    while (cnt-- && *data) {
-        *(char*)buf++ = *data++;
-        read++;
+        if (pg) {
+            copied = copy_to_iter(get_page_addr(pg) + offset, n, to);
+            put_page(pg);
+        } else {
+            copied = iov_iter_zero(n, to);
+        }
+
+        pos += copied;
+        done += copied;
+        if (copied < n)
+            break;
     }
 
-    return read;
+    if (!done)
+        return -EFAULT;
+    *ppos = pos;
+    return done;
 }
 
-static ssize_t tmpfs_write(struct file *file, const void *buf, size_t cnt)
+static ssize_t tmpfs_write(struct file *file, struct iov_iter *from, off_t *ppos)
 {
     struct inode *inode = file->f_dentry->d_inode;
     struct tmpfs_file *tmp_inode = (struct tmpfs_file*)inode->i_private;
-    size_t written = 0;
+    size_t cnt = iov_iter_count(from);
+    size_t done = 0;
+    u64 pos = *ppos;
+    ssize_t err = -EFAULT;
+
+    // Seals are added under i_mutex, so they can't change during the write
+    mutex_lock(&inode->i_mutex);
+    if ((tmp_inode->seals & F_SEAL_WRITE) ||
+            ((tmp_inode->seals & F_SEAL_GROW) && pos + cnt > inode->i_size)) {
+        mutex_unlock(&inode->i_mutex);
+        return -EPERM;
+    }
+
+    while (done < cnt) {
+        size_t offset = pos & (PAGE_SIZE - 1);
+        size_t n = MIN(PAGE_SIZE - offset, cnt - done);
+        struct page *pg = tmpfs_get_page(tmp_inode, pos >> PAGE_SHIFT, true);
+        size_t copied;
+
+        if (!pg) {
+            err = -ENOMEM;
+            break;
+        }
+        copied = copy_from_iter(get_page_addr(pg) + offset, n, from);
+        put_page(pg);
 
-    if (file->f_pos + cnt > inode->i_size) {
-        tmp_inode->data = krealloc(tmp_inode->data, file->f_pos + cnt);
-        inode->i_size = file->f_pos + cnt;
+        pos += copied;
+        done += copied;
+        if (copied < n)
+            break;
     }
 
-    memcpy(tmp_inode->data + file->f_pos, buf, cnt);
+    if (!done) {
+        mutex_unlock(&inode->i_mutex);
+        return err;
+    }
 
-    written = cnt;
+    acquire_lock(&tmp_inode->lock);
+    if (pos > inode->i_size)
+        inode->i_size = pos;
+    release_lock(&tmp_inode->lock);
+    inode->i_mtime = get_unix_time();
+    mutex_unlock(&inode->i_mutex);
 
-    return written;
+    *ppos = pos;
+    return done;
 }
 
 static
@@ -54,36 +232,66 @@ int tmpfs_readdir(struct file *file, struct dirent *dirp, unsigned int count)
 {
     struct inode *inode = file->f_dentry->d_inode;
     struct tmpfs_dir *dir = (struct tmpfs_dir*)inode->i_private;
-    struct tmpfs_entry *entry = dir->children;
-    size_t pos = file->f_pos;
+    struct tmpfs_cursor *cursor = file->f_data;
+    struct tmpfs_entry *entry;
+    struct list_head *p;
+    off_t pos = file->f_pos;
     u32 i = 0;
+
+    acquire_lock(&dir->lock);
+
+    // Carry on from the cursor, only a seek makes us count from the start
+    if (cursor && cursor->pos == pos) {
+        p = cursor->entry.list.next;
+    } else {
+        off_t skip = pos;
+        for (p = dir->entries.next; p != &dir->entries; p = p->next) {
+            entry = list_entry(p, struct tmpfs_entry, list);
+            if (entry->inode && skip-- == 0)
+                break;
+        }
+    }
+
+    for (; p != &dir->entries && i < count; p = p->next) {
+        entry = list_entry(p, struct tmpfs_entry, list);
+        if (!entry->inode)
+            continue;
 #ifdef DEBUG_TMPFS
-    klog(LOG_DEBUG, "tmpfs_readdir: inode = %p, dir = %p\n", inode, dir);
-#endif
-    while (i < count && pos < dir->num_entries) {
-#ifdef DEBUG_TMPFS
-        klog(LOG_DEBUG, "tmpfs_readdir: reading entry %u/%lu: name=%s\n",
-            pos, dir->num_entries, entry->name);
+        klog(LOG_DEBUG, "tmpfs_readdir: reading entry %u: name=%s\n",
+            pos + i, entry->name);
 #endif
-        if (entry->inode) {
-            strncpy(dirp[i].d_name, entry->name, sizeof(dirp[i].d_name));
-            dirp[i].d_ino = entry->inode->i_ino;
-            dirp[i].d_off = pos;
-            dirp[i].d_reclen = sizeof(struct dirent);
-            dirp[i].d_type = S_ISDIR(entry->inode->i_mode) ? DT_DIR : DT_REG;
-            dirp[i].pad = 0;
-            ++pos;
-            ++i;
-        }
-        entry++;
+        strncpy(dirp[i].d_name, entry->name, sizeof(dirp[i].d_name));
+        dirp[i].d_ino = entry->inode->i_ino;
+        dirp[i].d_off = pos + i;
+        dirp[i].d_reclen = sizeof(struct dirent);
+        dirp[i].d_type = S_ISDIR(entry->inode->i_mode) ? DT_DIR : DT_REG;
+        dirp[i].pad = 0;
+        i++;
     }
 
+    if (cursor) {
+        if (p != &cursor->entry.list)
+            list_move_tail(&cursor->entry.list, p);
+        cursor->pos = pos + i;
+    }
+    release_lock(&dir->lock);
+
     return i;
 }
 
+// Shared mappings map the file's own pages, so there is nothing to write back
+static struct page *tmpfs_fault_page(struct inode *inode, unsigned long index)
+{
+    return tmpfs_get_page((struct tmpfs_file*)inode->i_private, index, true);
+}
+
+const struct address_space_operations tmpfs_aops = {
+    .fault_page = tmpfs_fault_page,
+};
+
 const struct file_operations tmpfs_fops = {
-    .read = tmpfs_read,
-    .write = tmpfs_write,
+    .read_iter = tmpfs_read,
+    .write_iter = tmpfs_write,
     .readdir = tmpfs_readdir,
     .release = tmpfs_close
 };
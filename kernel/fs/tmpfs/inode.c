@@ -3,13 +3,165 @@
 #include <lilac/libc.h>
 #include <lilac/timer.h>
 #include <lilac/err.h>
+#include <lilac/memfd.h>
 #include <lilac/uaccess.h>
+#include <lib/hash.h>
 #include <mm/kmalloc.h>
 
 #include "tmpfs_internal.h"
 
+/*
+ * Directory entries are hashed by the name hash the dcache already worked
+ * out, so lookups, creates and removes don't depend on the directory size.
+ * The table doubles whenever the entries outnumber its buckets.
+ */
+static inline struct hlist_head *
+tmpfs_bucket(struct tmpfs_dir *dir, u32 hash)
+{
+    return &dir->hash[hash_32(hash, dir->hash_bits)];
+}
+
+struct tmpfs_dir *tmpfs_alloc_dir(void)
+{
+    struct tmpfs_dir *dir = kzmalloc(sizeof(*dir));
+    if (!dir)
+        return NULL;
+
+    dir->hash = kzmalloc(sizeof(struct hlist_head) << TMPFS_DIR_MIN_BITS);
+    if (!dir->hash) {
+        kfree(dir);
+        return NULL;
+    }
+    dir->hash_bits = TMPFS_DIR_MIN_BITS;
+    spin_lock_init(&dir->lock);
+    INIT_LIST_HEAD(&dir->entries);
+    return dir;
+}
+
+void tmpfs_free_dir(struct tmpfs_dir *dir)
+{
+    struct tmpfs_entry *entry, *tmp;
+
+    list_for_each_entry_safe(entry, tmp, &dir->entries, list) {
+        if (entry->inode)
+            kfree(entry);
+    }
+    kfree(dir->hash);
+    kfree(dir);
+}
+
+struct tmpfs_file *tmpfs_alloc_file(void)
+{
+    struct tmpfs_file *file = kzmalloc(sizeof(*file));
+    if (!file)
+        return NULL;
+
+    spin_lock_init(&file->lock);
+    INIT_RADIX_TREE(&file->pages);
+    // Only memfds made with MFD_ALLOW_SEALING can be sealed
+    file->seals = F_SEAL_SEAL;
+    return file;
+}
+
+static struct tmpfs_entry *
+tmpfs_find_entry(struct tmpfs_dir *dir, const struct dentry *dentry)
+{
+    struct tmpfs_entry *entry;
+
+    hlist_for_each_entry(entry, tmpfs_bucket(dir, dentry->d_name_hash), hash) {
+        if (entry->name_hash == dentry->d_name_hash &&
+                entry->name_len == dentry->d_name_len &&
+                !memcmp(entry->name, dentry->d_name, entry->name_len))
+            return entry;
+    }
+    return NULL;
+}
+
+// Rehash into a table twice the size, the caller holds dir->lock
+static void tmpfs_grow_dir(struct tmpfs_dir *dir, struct hlist_head *new_hash)
+{
+    struct tmpfs_entry *entry;
+
+    kfree(dir->hash);
+    dir->hash = new_hash;
+    dir->hash_bits++;
+    list_for_each_entry(entry, &dir->entries, list) {
+        if (entry->inode)
+            hlist_add_head(&entry->hash, tmpfs_bucket(dir, entry->name_hash));
+    }
+}
+
+static int tmpfs_add_entry(struct inode *dir_inode, struct dentry *dentry,
+    struct inode *inode, unsigned short type)
+{
+    struct tmpfs_dir *dir = (struct tmpfs_dir*)dir_inode->i_private;
+    struct hlist_head *new_hash = NULL;
+    struct tmpfs_entry *entry;
+    unsigned int bits = dir->hash_bits;
+
+    entry = kzmalloc(sizeof(*entry) + dentry->d_name_len + 1);
+    if (!entry)
+        return -ENOMEM;
+    entry->inode = inode;
+    entry->type = type;
+    entry->name_hash = dentry->d_name_hash;
+    entry->name_len = dentry->d_name_len;
+    memcpy(entry->name, dentry->d_name, dentry->d_name_len + 1);
+
+    // Allocate outside the lock, a failure only means longer chains
+    if (dir->num_entries + 1 > (1UL << bits))
+        new_hash = kzmalloc(sizeof(struct hlist_head) << (bits + 1));
+
+    acquire_lock(&dir->lock);
+    if (new_hash && dir->hash_bits == bits) {
+        tmpfs_grow_dir(dir, new_hash);
+        new_hash = NULL;
+    }
+    hlist_add_head(&entry->hash, tmpfs_bucket(dir, entry->name_hash));
+    list_add_tail(&entry->list, &dir->entries);
+    dir->num_entries++;
+    release_lock(&dir->lock);
+
+    if (new_hash)
+        kfree(new_hash);
+    dir_inode->i_mtime = get_unix_time();
+    return 0;
+}
+
+static void tmpfs_remove_entry(struct inode *dir_inode, struct dentry *dentry)
+{
+    struct tmpfs_dir *dir = (struct tmpfs_dir*)dir_inode->i_private;
+    struct tmpfs_entry *entry;
+
+    acquire_lock(&dir->lock);
+    entry = tmpfs_find_entry(dir, dentry);
+    if (entry && entry->inode == dentry->d_inode) {
+        hlist_del(&entry->hash);
+        list_del(&entry->list);
+        dir->num_entries--;
+    } else {
+        entry = NULL;
+    }
+    release_lock(&dir->lock);
+
+    kfree(entry);
+    dir_inode->i_mtime = get_unix_time();
+}
+
 static int tmpfs_open(struct inode *inode, struct file *file)
 {
+    if (S_ISDIR(inode->i_mode)) {
+        struct tmpfs_dir *dir = (struct tmpfs_dir*)inode->i_private;
+        struct tmpfs_cursor *cursor = kzmalloc(sizeof(*cursor));
+        if (!cursor)
+            return -ENOMEM;
+
+        acquire_lock(&dir->lock);
+        list_add(&cursor->entry.list, &dir->entries);
+        release_lock(&dir->lock);
+        file->f_data = cursor;
+    }
+
     file->f_op = &tmpfs_fops;
     return 0;
 }
@@ -18,19 +170,17 @@ static struct dentry *tmpfs_lookup(struct inode *dir, struct dentry *dentry,
     unsigned int flags)
 {
     struct tmpfs_dir *parent = (struct tmpfs_dir*)dir->i_private;
-    struct tmpfs_entry *entry = (struct tmpfs_entry*)parent->children;
-    size_t i;
+    struct tmpfs_entry *entry;
 
-    for (i = 0; i < parent->num_entries; i++) {
-        if (!strcmp(entry->name, dentry->d_name)) {
-            iget(entry->inode);
-            dentry->d_inode = entry->inode;
-            return dentry;
-        }
-        entry++;
+    acquire_lock(&parent->lock);
+    entry = tmpfs_find_entry(parent, dentry);
+    if (entry) {
+        iget(entry->inode);
+        dentry->d_inode = entry->inode;
     }
+    release_lock(&parent->lock);
 
-    return NULL;
+    return entry ? dentry : NULL;
 }
 
 static const char *
@@ -44,90 +194,76 @@ static int
 tmpfs_create(struct inode *parent, struct dentry *new_dentry, umode_t mode)
 {
     struct inode *new_inode = parent->i_sb->s_op->alloc_inode(parent->i_sb);
-    struct tmpfs_file *file_info = kzmalloc(sizeof(*file_info));
+    struct tmpfs_file *file_info;
+    int err;
+
+    if (IS_ERR(new_inode))
+        return PTR_ERR(new_inode);
+    file_info = tmpfs_alloc_file();
+    if (!file_info) {
+        iput(new_inode);
+        return -ENOMEM;
+    }
 
     new_inode->i_private = file_info;
     new_inode->i_mode = mode | S_IFREG;
-    file_info->data = kmalloc(4096);
     new_inode->i_size = 0;
-    new_inode->i_count = 1;
-    new_inode->i_ctime = new_inode->i_mtime = new_inode->i_atime = get_unix_time();
-    new_dentry->d_inode = new_inode;
-
-    struct tmpfs_dir *parent_dir = (struct tmpfs_dir*)parent->i_private;
-    parent_dir->num_entries++;
-    parent_dir->children = krealloc(parent_dir->children,
-        parent_dir->num_entries * sizeof(struct tmpfs_entry));
+    new_inode->i_data.a_ops = &tmpfs_aops;
 
-    struct tmpfs_entry *new_entry = parent_dir->children +
-        parent_dir->num_entries - 1;
-    memset(new_entry, 0, sizeof(*new_entry));
-    new_entry->inode = new_inode;
-    strcpy(new_entry->name, new_dentry->d_name);
-    new_entry->type = TMPFS_FILE;
+    if ((err = tmpfs_add_entry(parent, new_dentry, new_inode, TMPFS_FILE))) {
+        iput(new_inode);
+        return err;
+    }
 
+    // One reference for the directory entry, one for the dentry
+    iget(new_inode);
+    new_dentry->d_inode = new_inode;
     return 0;
 }
 
 static int tmpfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
     struct inode *new_inode;
-    struct tmpfs_dir *parent = (struct tmpfs_dir*)dir->i_private;
-    struct tmpfs_dir *new_dir = kzmalloc(sizeof(struct tmpfs_dir));
+    struct tmpfs_dir *new_dir = tmpfs_alloc_dir();
+    int err;
+
     if (!new_dir) {
         klog(LOG_ERROR, "tmpfs_mkdir: Out of memory allocating tmpfs_dir\n");
         return -ENOMEM;
     }
 
-    new_dir->num_entries = 0;
-    new_dir->children = kzmalloc(4096);
-
     new_inode = dir->i_sb->s_op->alloc_inode(dir->i_sb);
+    if (IS_ERR(new_inode)) {
+        tmpfs_free_dir(new_dir);
+        return PTR_ERR(new_inode);
+    }
     new_inode->i_private = new_dir;
     new_inode->i_mode = mode | S_IFDIR;
-    new_inode->i_ctime = new_inode->i_mtime = new_inode->i_atime = get_unix_time();
-    dentry->d_inode = new_inode;
-
-    parent->num_entries++;
-    parent->children = krealloc(parent->children,
-        parent->num_entries * sizeof(struct tmpfs_entry));
 
-    struct tmpfs_entry *new_entry = parent->children + parent->num_entries - 1;
-    new_entry->inode = new_inode;
-    strcpy(new_entry->name, dentry->d_name);
-    new_entry->type = TMPFS_DIR;
+    if ((err = tmpfs_add_entry(dir, dentry, new_inode, TMPFS_DIR))) {
+        iput(new_inode);
+        return err;
+    }
 
+    iget(new_inode);
+    dentry->d_inode = new_inode;
     return 0;
 }
 
 static int tmpfs_rmdir(struct inode *dir, struct dentry *dentry)
 {
     struct inode *inode = dentry->d_inode;
-    struct tmpfs_dir *parent_dir = (struct tmpfs_dir*)dir->i_private;
     struct tmpfs_dir *target_dir = (struct tmpfs_dir*)inode->i_private;
 
     if (target_dir->num_entries > 0) {
         return -ENOTEMPTY;
     }
 
-    for (unsigned long i = 0; i < parent_dir->num_entries; i++) {
-        struct tmpfs_entry *entry = &parent_dir->children[i];
-        if (entry->inode == inode && strcmp(entry->name, dentry->d_name) == 0) {
-            // Remove entry by shifting others
-            for (unsigned long j = i; j < parent_dir->num_entries - 1; j++) {
-                parent_dir->children[j] = parent_dir->children[j + 1];
-            }
-            parent_dir->num_entries--;
-            parent_dir->children = krealloc(parent_dir->children,
-                parent_dir->num_entries * sizeof(struct tmpfs_entry));
-            break;
-        }
-    }
+    tmpfs_remove_entry(dir, dentry);
 
+    // The dentry keeps its own reference until the dcache lets go
     inode->i_nlink--;
-    if (inode->i_nlink == 0) {
-        inode->i_sb->s_op->destroy_inode(inode);
-    }
+    iput(inode);
 
     return 0;
 }
@@ -136,47 +272,33 @@ static int
 tmpfs_link(struct dentry *old_d, struct inode *dir, struct dentry *new_d)
 {
     struct inode *old_inode = old_d->d_inode;
+    int err;
+
     if (S_ISDIR(old_inode->i_mode))
         return -EPERM;
 
+    err = tmpfs_add_entry(dir, new_d, old_inode,
+        S_ISLNK(old_inode->i_mode) ? TMPFS_SYMLINK : TMPFS_FILE);
+    if (err)
+        return err;
+
+    // One reference for the new directory entry, one for new_d
+    iget(old_inode);
     iget(old_inode);
     old_inode->i_nlink++;
     new_d->d_inode = old_inode;
 
-    struct tmpfs_dir *dir_info = (struct tmpfs_dir*)dir->i_private;
-    dir_info->num_entries++;
-    dir_info->children = krealloc(dir_info->children,
-        dir_info->num_entries * sizeof(struct tmpfs_entry));
-
-    struct tmpfs_entry *new_entry = dir_info->children + dir_info->num_entries - 1;
-    memset(new_entry, 0, sizeof(*new_entry));
-    new_entry->inode = old_inode;
-    strcpy(new_entry->name, new_d->d_name);
-    new_entry->type = S_ISDIR(old_inode->i_mode) ? TMPFS_DIR : TMPFS_FILE;
-
     return 0;
 }
 
 static int tmpfs_unlink(struct inode *dir, struct dentry *dentry)
 {
     struct inode *inode = dentry->d_inode;
-    struct tmpfs_dir *dir_info = (struct tmpfs_dir*)dir->i_private;
-
-    for (unsigned long i = 0; i < dir_info->num_entries; i++) {
-        struct tmpfs_entry *entry = &dir_info->children[i];
-        if (entry->inode == inode && strcmp(entry->name, dentry->d_name) == 0) {
-            // Remove entry by shifting others
-            for (unsigned long j = i; j < dir_info->num_entries - 1; j++) {
-                dir_info->children[j] = dir_info->children[j + 1];
-            }
-            dir_info->num_entries--;
-            dir_info->children = krealloc(dir_info->children,
-                dir_info->num_entries * sizeof(struct tmpfs_entry));
-            break;
-        }
-    }
+
+    tmpfs_remove_entry(dir, dentry);
 
     inode->i_nlink--;
+    iput(inode);
 
     return 0;
 }
@@ -185,30 +307,35 @@ static int
 tmpfs_symlink(struct inode *dir, struct dentry *link_d, const char *target)
 {
     struct inode *new_inode = dir->i_sb->s_op->alloc_inode(dir->i_sb);
-    struct tmpfs_file *file_info = kzmalloc(sizeof(*file_info));
+    struct tmpfs_file *file_info;
+    size_t target_len = strlen(target);
+    int err;
+
+    if (IS_ERR(new_inode))
+        return PTR_ERR(new_inode);
+    file_info = tmpfs_alloc_file();
+    if (!file_info) {
+        iput(new_inode);
+        return -ENOMEM;
+    }
 
     new_inode->i_private = file_info;
     new_inode->i_mode = S_IFLNK | 0777;
-    size_t target_len = strlen(target);
     file_info->data = kmalloc(target_len + 1);
+    if (!file_info->data) {
+        iput(new_inode);
+        return -ENOMEM;
+    }
     memcpy(file_info->data, target, target_len + 1);
     new_inode->i_size = target_len;
-    new_inode->i_count = 1;
-    new_inode->i_ctime = new_inode->i_mtime = new_inode->i_atime = get_unix_time();
-    link_d->d_inode = new_inode;
-
-    struct tmpfs_dir *parent_dir = (struct tmpfs_dir*)dir->i_private;
-    parent_dir->num_entries++;
-    parent_dir->children = krealloc(parent_dir->children,
-        parent_dir->num_entries * sizeof(struct tmpfs_entry));
 
-    struct tmpfs_entry *new_entry = parent_dir->children +
-        parent_dir->num_entries - 1;
-    memset(new_entry, 0, sizeof(*new_entry));
-    new_entry->inode = new_inode;
-    strcpy(new_entry->name, link_d->d_name);
-    new_entry->type = TMPFS_SYMLINK;
+    if ((err = tmpfs_add_entry(dir, link_d, new_inode, TMPFS_SYMLINK))) {
+        iput(new_inode);
+        return err;
+    }
 
+    iget(new_inode);
+    link_d->d_inode = new_inode;
     return 0;
 }
 
@@ -236,5 +363,6 @@ const struct inode_operations tmpfs_iops = {
     .link = tmpfs_link,
     .unlink = tmpfs_unlink,
     .symlink = tmpfs_symlink,
-    .readlink = tmpfs_readlink
+    .readlink = tmpfs_readlink,
+    .truncate = tmpfs_truncate
 };
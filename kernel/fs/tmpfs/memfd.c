@@ -0,0 +1,175 @@
+/*
+ * Anonymous shared memory files. A memfd is a tmpfs regular file on an
+ * internal mount that has no name in any directory, so it goes away with
+ * the last file or mapping referring to it. Its pages are the tmpfs pages,
+ * which MAP_SHARED maps directly, so every process mapping the file shares
+ * the same frames.
+ */
+#include <lilac/fs.h>
+#include <lilac/memfd.h>
+#include <lilac/sched.h>
+#include <lilac/syscall.h>
+#include <lilac/uaccess.h>
+#include <lilac/log.h>
+#include <lilac/err.h>
+#include <lilac/libc.h>
+#include <fs/tmpfs.h>
+#include <fs/types.h>
+#include <mm/kmalloc.h>
+
+#include "tmpfs_internal.h"
+
+#define MFD_PREFIX      "memfd:"
+#define MFD_ALL_FLAGS   (MFD_CLOEXEC | MFD_ALLOW_SEALING)
+#define F_ALL_SEALS     (F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+static struct super_block *shm_sb;
+
+void memfd_init(void)
+{
+    struct super_block *sb = kzmalloc(sizeof(*sb));
+    struct dentry *root;
+
+    if (!sb) {
+        klog(LOG_ERROR, "memfd_init: Out of memory allocating superblock\n");
+        return;
+    }
+    sb->s_type = TMPFS;
+    sb->s_count = 1;
+    sb->s_active = true;
+    spin_lock_init(&sb->s_lock);
+    INIT_LIST_HEAD(&sb->s_inodes);
+
+    root = tmpfs_init(NULL, sb);
+    if (IS_ERR(root)) {
+        klog(LOG_ERROR, "memfd_init: Failed to set up the shm mount\n");
+        kfree(sb);
+        return;
+    }
+    root->d_name = kzmalloc(2);
+    if (root->d_name)
+        root->d_name[0] = '/';
+    shm_sb = sb;
+}
+
+// An open memfd with no descriptor, for the kernel's own shared memory
+struct file * memfd_alloc_file(const char *name, unsigned int flags)
+{
+    struct inode *inode;
+    struct tmpfs_file *info;
+    struct dentry *d;
+    struct file *file;
+
+    if (!shm_sb)
+        return ERR_PTR(-ENOSYS);
+
+    inode = shm_sb->s_op->alloc_inode(shm_sb);
+    if (IS_ERR(inode))
+        return ERR_CAST(inode);
+    info = tmpfs_alloc_file();
+    if (!info) {
+        iput(inode);
+        return ERR_PTR(-ENOMEM);
+    }
+    if (flags & MFD_ALLOW_SEALING)
+        info->seals = 0;
+
+    inode->i_private = info;
+    inode->i_mode = S_IFREG | S_IREAD | S_IWRITE;
+    inode->i_data.a_ops = &tmpfs_aops;
+    inode->i_fop = &tmpfs_fops;
+
+    // The dentry is never hashed, the last dput frees it and the inode
+    d = alloc_dentry(shm_sb->s_root, name);
+    if (IS_ERR(d)) {
+        iput(inode);
+        return ERR_CAST(d);
+    }
+    d->d_inode = inode;
+    d_drop(d);
+
+    file = alloc_file(d);
+    dput(d);
+    if (!file)
+        return ERR_PTR(-ENOMEM);
+    file->f_op = &tmpfs_fops;
+    file->f_inode = inode;
+    file->f_mode = O_RDWR | ((flags & MFD_CLOEXEC) ? O_CLOEXEC : 0);
+    return file;
+}
+
+SYSCALL_DECL2(memfd_create, const char __user *, uname, unsigned int, flags)
+{
+    char name[sizeof(MFD_PREFIX) + MFD_NAME_MAX];
+    struct file *file;
+    long len;
+    int fd;
+
+    if (flags & ~MFD_ALL_FLAGS)
+        return -EINVAL;
+
+    strcpy(name, MFD_PREFIX);
+    len = strncpy_from_user(name + sizeof(MFD_PREFIX) - 1, uname,
+        MFD_NAME_MAX + 1);
+    if (len < 0)
+        return len;
+    if (len > MFD_NAME_MAX)
+        return -EINVAL;
+
+    file = memfd_alloc_file(name, flags);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+    fd = get_next_fd(current->files, file);
+    if (fd < 0)
+        fput(file);
+    return fd;
+}
+
+/*
+ * Seals only ever get added. A write seal also has to be sure nothing can
+ * write through a mapping, so it fails while a shared writable one exists
+ * and keeps any more from being made.
+ */
+static int memfd_add_seals(struct file *file, unsigned int seals)
+{
+    struct inode *inode = file->f_dentry->d_inode;
+    struct tmpfs_file *info = (struct tmpfs_file*)inode->i_private;
+    int err = 0;
+
+    if (seals & ~F_ALL_SEALS)
+        return -EINVAL;
+    if ((file->f_mode & O_ACCMODE) == O_RDONLY)
+        return -EPERM;
+
+    mutex_lock(&inode->i_mutex);
+    if (info->seals & F_SEAL_SEAL) {
+        err = -EPERM;
+        goto out;
+    }
+    if ((seals & F_SEAL_WRITE) && !(info->seals & F_SEAL_WRITE) &&
+            (err = mapping_deny_writable(&inode->i_data)) < 0)
+        goto out;
+    info->seals |= seals;
+out:
+    mutex_unlock(&inode->i_mutex);
+    return err;
+}
+
+// Seals are tmpfs state, so any tmpfs regular file answers F_GET_SEALS
+long memfd_fcntl(struct file *file, int cmd, unsigned long arg)
+{
+    struct inode *inode = file->f_dentry ? file->f_dentry->d_inode : NULL;
+
+    if (file->f_op != &tmpfs_fops || !inode || !S_ISREG(inode->i_mode))
+        return -EINVAL;
+
+    switch (cmd) {
+        case F_ADD_SEALS:
+            return memfd_add_seals(file, arg);
+        case F_GET_SEALS:
+            return ((struct tmpfs_file*)inode->i_private)->seals;
+        default:
+            return -EINVAL;
+    }
+}
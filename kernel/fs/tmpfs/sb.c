@@ -24,6 +24,8 @@ static struct inode* tmpfs_alloc_inode(struct super_block *sb)
     inode->i_sb = sb;
     inode->i_op = &tmpfs_iops;
     inode->i_count = 1;
+    spin_lock_init(&inode->i_lock);
+    mutex_init(&inode->i_mutex);
     inode->i_atime = inode->i_mtime = inode->i_ctime = get_unix_time();
     inode->i_nlink = 1;
     list_add_tail(&inode->i_list, &sb->s_inodes);
@@ -33,8 +35,15 @@ static struct inode* tmpfs_alloc_inode(struct super_block *sb)
 
 static void tmpfs_destroy_inode(struct inode *inode)
 {
-    if (inode->i_private)
-        kfree(inode->i_private);
+    if (inode->i_private && S_ISDIR(inode->i_mode)) {
+        tmpfs_free_dir(inode->i_private);
+    } else if (inode->i_private) {
+        struct tmpfs_file *file = inode->i_private;
+        tmpfs_free_pages(file);
+        if (file->data)
+            kfree(file->data);
+        kfree(file);
+    }
     kfree(inode);
 }
 
@@ -43,7 +52,7 @@ struct dentry* tmpfs_init(void *device, struct super_block *sb)
     klog(LOG_DEBUG, "Initializing tmpfs\n");
     sb->s_op = &tmpfs_sops;
     sb->s_blocksize = 0x1000;
-    sb->s_maxbytes = 0xfffff;
+    sb->s_maxbytes = __LONG_MAX__;
 
     struct dentry *root_dentry = kzmalloc(sizeof(struct dentry));
     if (!root_dentry) {
@@ -56,7 +65,7 @@ struct dentry* tmpfs_init(void *device, struct super_block *sb)
         kfree(root_dentry);
         return ERR_CAST(root_inode);
     }
-    struct tmpfs_dir *root_dir = kzmalloc(sizeof(struct tmpfs_dir));
+    struct tmpfs_dir *root_dir = tmpfs_alloc_dir();
     if (!root_dir) {
         klog(LOG_ERROR, "tmpfs_init: Failed to allocate root tmpfs_dir\n");
         tmpfs_destroy_inode(root_inode);
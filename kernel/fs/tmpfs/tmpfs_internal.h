@@ -4,31 +4,66 @@
 #include <lilac/types.h>
 #include <lilac/sync.h>
 #include <lilac/fs.h>
+#include <lib/list.h>
+#include <lib/radix-tree.h>
 
 #define TMPFS_FILE      1
 #define TMPFS_DIR       2
 #define TMPFS_SYMLINK   3
 #define TMPFS_PIPE      4
 
+/* Smallest directory hash table, it doubles as entries are added */
+#define TMPFS_DIR_MIN_BITS  3
+
 struct tmpfs_entry {
-    struct inode *inode;
+    struct list_head list;      /* readdir order */
+    struct hlist_node hash;
+    struct inode *inode;        /* NULL for a readdir cursor */
     unsigned short type;
-    char name[NAME_MAX];
+    u32 name_hash;
+    u32 name_len;
+    char name[];
+};
+
+/*
+ * Where an open directory's readdir got to. It sits in the entry list like
+ * an entry, so removing entries around it never invalidates it.
+ */
+struct tmpfs_cursor {
+    off_t pos;                  /* f_pos the cursor is valid for */
+    struct tmpfs_entry entry;
 };
 
+/*
+ * File data lives in whole pages found through a radix tree by page index.
+ * Pages never written to aren't allocated and read back as zeroes. The
+ * pages are plain refcounted frames, so they can be mapped as they are.
+ */
 struct tmpfs_file {
     spinlock_t lock;
-    void *data;
+    struct radix_tree_root pages;   /* struct page * by page index */
+    unsigned long nrpages;
+    unsigned int seals;             /* F_SEAL_*, changed under i_mutex */
+    void *data;                     /* symlink target */
 };
 
 struct tmpfs_dir {
     spinlock_t lock;
     unsigned long num_entries;
-    struct tmpfs_entry *children;
+    unsigned int hash_bits;
+    struct hlist_head *hash;
+    struct list_head entries;
 };
 
 extern const struct super_operations tmpfs_sops;
 extern const struct inode_operations tmpfs_iops;
 extern const struct file_operations tmpfs_fops;
+extern const struct address_space_operations tmpfs_aops;
+
+struct tmpfs_dir *tmpfs_alloc_dir(void);
+void tmpfs_free_dir(struct tmpfs_dir *dir);
+struct tmpfs_file *tmpfs_alloc_file(void);
+void tmpfs_free_pages(struct tmpfs_file *file);
+int tmpfs_truncate(struct inode *inode, u64 size);
 
 #endif
@@ -1,17 +1,22 @@
 // Copyright (C) 2024 Jackson Brenneman
 // GPL-3.0-or-later (see LICENSE.txt)
 #include <lilac/fs.h>
+#include <lilac/exec_cache.h>
 
 #include <lilac/lilac.h>
 #include <lilac/libc.h>
+#include <lilac/memfd.h>
 #include <lilac/syscall.h>
 #include <lilac/device.h>
 #include <lilac/sched.h>
 #include <lilac/timer.h>
 #include <lilac/uaccess.h>
+#include <lilac/uio.h>
 #include <drivers/blkdev.h>
+#include <mm/page.h>
 #include <fs/fcntl.h>
 #include <fs/fat32.h>
+#include <fs/ext2.h>
 #include <fs/tmpfs.h>
 
 #include "utils.h"
@@ -19,7 +24,7 @@
 // #define DEBUG_VFS 1
 
 static fs_init_func_t init_ops[4] = {
-    fat32_init, NULL, tmpfs_init, NULL
+    fat32_init, ext2_init, tmpfs_init, NULL
 };
 
 struct dentry *root_dentry = NULL;
@@ -63,6 +68,8 @@ void fs_init(void)
     int dev_major = SATA_DEVICE;
     struct block_device *bdev;
 
+    dcache_init();
+
     if (scan_partitions(NULL))
         kerror("Partition scan failed\n");
     bdev = get_bdev(dev_major);
@@ -73,6 +80,12 @@ void fs_init(void)
 
     vfs_mount("tmpfs", "/tmp", "tmpfs", 0, NULL);
     vfs_mount("tmpfs", "/dev", "tmpfs", 0, NULL);
+    memfd_init();
+
+    // The image script puts an ext2 data partition after the ESP
+    bdev = lookup_bdev("sda2");
+    if (bdev && bdev->type == EXT2 && vfs_mount("sda2", "/mnt", "ext2", 0, NULL))
+        klog(LOG_WARN, "Failed to mount ext2 partition on /mnt\n");
     vfs_create("/dev/null", 0);
     vfs_create("/dev/zero", 0);
 
@@ -129,10 +142,87 @@ off_t vfs_lseek(struct file *file, off_t offset, int whence)
 
 SYSCALL_DECL3(lseek, int, fd, off_t, offset, int, whence)
 {
-    struct file *file = get_file_handle(fd);
-    if (IS_ERR(file))
-        return PTR_ERR(file);
-    return vfs_lseek(file, offset, whence);
+    struct fd f = fdget(fd);
+    off_t ret;
+
+    if (!f.file)
+        return -EBADF;
+    ret = vfs_lseek(f.file, offset, whence);
+    fdput(f);
+    return ret;
+}
+
+int vfs_fsync(struct file *file, int datasync)
+{
+    struct inode *inode = file->f_dentry ? file->f_dentry->d_inode : NULL;
+
+    if (!file->f_op || !file->f_op->fsync) {
+        // Nothing is cached for in-memory filesystems
+        if (inode && (S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode)))
+            return 0;
+        return -EINVAL;
+    }
+    return file->f_op->fsync(file, datasync);
+}
+
+SYSCALL_DECL0(sync)
+{
+    sync_filesystems();
+    return 0;
+}
+
+SYSCALL_DECL1(fsync, int, fd)
+{
+    struct fd f = fdget(fd);
+    int err;
+
+    if (!f.file)
+        return -EBADF;
+    err = vfs_fsync(f.file, 0);
+    fdput(f);
+    return err;
+}
+
+SYSCALL_DECL1(fdatasync, int, fd)
+{
+    struct fd f = fdget(fd);
+    int err;
+
+    if (!f.file)
+        return -EBADF;
+    err = vfs_fsync(f.file, 1);
+    fdput(f);
+    return err;
+}
+
+int vfs_ftruncate(struct file *file, off_t length)
+{
+    struct inode *inode = file->f_dentry ? file->f_dentry->d_inode : NULL;
+    int err;
+
+    if (length < 0)
+        return -EINVAL;
+    if (!inode || !S_ISREG(inode->i_mode) || (file->f_mode & O_ACCMODE) == O_RDONLY)
+        return -EINVAL;
+    if (!inode->i_op || !inode->i_op->truncate)
+        return -EPERM;
+    if ((u64)length > inode->i_sb->s_maxbytes)
+        return -EFBIG;
+    err = inode->i_op->truncate(inode, length);
+    exec_cache_invalidate(inode);
+    return err;
+}
+
+SYSCALL_DECL2(ftruncate, int, fd, off_t, length)
+{
+    struct fd f = fdget(fd);
+    int err;
+
+    if (!f.file)
+        return -EBADF;
+    err = vfs_ftruncate(f.file, length);
+    fdput(f);
+    return err;
 }
 
 struct dentry * vfs_lookup(const char *path)
@@ -144,11 +234,13 @@ struct dentry * vfs_lookup(const char *path)
     if (path[0] != '/')
         start = current->fs->cwd_d;
 
-    if (!strcmp(path, "."))
-        return start;
-
     if (!strcmp(path, "/"))
-        return root_dentry;
+        start = root_dentry;
+
+    if (!strcmp(path, ".") || !strcmp(path, "/")) {
+        dget(start);
+        return start;
+    }
 
     return lookup_path_from(start, path);
 }
@@ -173,29 +265,34 @@ struct file *vfs_open(const char *path, int flags, int mode)
     inode = dentry->d_inode;
     if (!inode) {
         if (flags & O_CREAT) {
-            int err = create_file_at(dentry, mode);
+            err = create_file_at(dentry, mode);
             if (err < 0) {
-                klog(LOG_DEBUG, "Failed to create file %s: %d\n", path, err);
-                return ERR_PTR(err);
+                klog(LOG_DEBUG, "Failed to create file %s: %ld\n", path, err);
+                goto error;
             }
             inode = dentry->d_inode;
         } else {
-            return ERR_PTR(-ENOENT);
+            err = -ENOENT;
+            goto error;
         }
     } else if ((flags & O_CREAT) && (flags & O_EXCL)) {
         klog(LOG_DEBUG, "VFS: File %s already exists\n", path);
-        return ERR_PTR(-EEXIST);
+        err = -EEXIST;
+        goto error;
     }
 
     if (S_ISDIR(inode->i_mode) && (flags & O_ACCMODE) != O_RDONLY) {
         klog(LOG_DEBUG, "VFS: Cannot open directory %s with write access\n", path);
-        return ERR_PTR(-EISDIR);
+        err = -EISDIR;
+        goto error;
     } else if (!S_ISDIR(inode->i_mode) && flags & O_DIRECTORY) {
         klog(LOG_DEBUG, "VFS: Not a directory: %s\n", path);
-        return ERR_PTR(-ENOTDIR);
+        err = -ENOTDIR;
+        goto error;
     }
 
     new_file = alloc_file(dentry);
+    dput(dentry);
     if (IS_ERR_OR_NULL(new_file))
         return ERR_PTR(-ENOMEM);
 
@@ -207,6 +304,10 @@ struct file *vfs_open(const char *path, int flags, int mode)
     new_file->f_mode = flags | (flags & ~(O_CREAT|O_EXCL|O_NOCTTY|O_TRUNC));
 
     return new_file;
+
+error:
+    dput(dentry);
+    return ERR_PTR(err);
 }
 SYSCALL_DECL3(open, const char*, path, int, flags, int, mode)
 {
@@ -240,159 +341,291 @@ error:
     return fd;
 }
 
-ssize_t vfs_read_at(struct file *file, void *buf, size_t count, unsigned long pos)
+/*
+ * Files that only have the buffer operations are handed one segment at a
+ * time at f_pos, which is moved past each; user memory goes through a
+ * bounce page so no transfer needs a buffer bigger than that.
+ */
+static ssize_t loop_rw_iter(const struct file_operations *fop,
+    struct file *file, struct iov_iter *iter, bool write)
 {
-    if (file->f_dentry) {
-        struct inode *inode = file->f_dentry->d_inode;
-        if (S_ISDIR(inode->i_mode))
-            return -EISDIR;
+    void *bounce = NULL;
+    ssize_t ret = 0, total = 0;
 
-        if (S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode))
-            return inode->i_fop->read(file, buf, count);
+    if (write ? !fop->write : !fop->read)
+        return -EINVAL;
+    if (iter_is_user(iter) && !(bounce = kmalloc(PAGE_SIZE)))
+        return -ENOMEM;
 
-        if (pos >= inode->i_size)
-            return 0;
-    }
+    while (iov_iter_count(iter)) {
+        void *buf = NULL;
+        size_t n = iov_iter_segment(iter, &buf);
 
-    unsigned long old_pos = file->f_pos;
-    file->f_pos = pos;
-    ssize_t bytes = file->f_op->read(file, buf, count);
-    file->f_pos = old_pos;
+        if (bounce) {
+            n = MIN(n, PAGE_SIZE);
+            buf = bounce;
+        }
 
-    return bytes;
+        if (write) {
+            if (bounce && copy_from_iter(bounce, n, iter) != n) {
+                ret = -EFAULT;
+                break;
+            }
+            ret = fop->write(file, buf, n);
+            if (!bounce && ret > 0)
+                iov_iter_advance(iter, ret);
+        } else {
+            ret = fop->read(file, buf, n);
+            if (ret > 0) {
+                if (!bounce)
+                    iov_iter_advance(iter, ret);
+                else if (copy_to_iter(bounce, ret, iter) != (size_t)ret)
+                    ret = -EFAULT;
+            }
+        }
+
+        if (ret <= 0)
+            break;
+        total += ret;
+        // The next segment carries on where this one stopped
+        file->f_pos += ret;
+        if ((size_t)ret < n)
+            break;
+    }
+
+    kfree(bounce);
+    return total ? total : ret;
 }
 
-ssize_t vfs_read(struct file *file, void *buf, size_t count)
+/*
+ * Device nodes go straight to the driver and have no file position;
+ * everything else moves *pos by what was transferred.
+ */
+static ssize_t do_iter_rw(struct file *file, struct iov_iter *iter,
+    off_t *pos, bool write)
 {
-    if (file->f_dentry) {
-        struct inode *inode = file->f_dentry->d_inode;
+    const struct file_operations *fop = file->f_op;
+    struct inode *inode = file->f_dentry ? file->f_dentry->d_inode : NULL;
+    off_t dev_pos = 0;
+    ssize_t ret;
+
+    if (inode) {
         if (S_ISDIR(inode->i_mode))
             return -EISDIR;
-
-        if (S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode))
-            return inode->i_fop->read(file, buf, count);
-
-        if (file->f_pos >= inode->i_size)
+        if (S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode)) {
+            fop = inode->i_fop;
+            pos = &dev_pos;
+        } else if (!write && *pos >= (off_t)inode->i_size) {
             return 0;
+        }
     }
+    if (!fop)
+        return -EINVAL;
+    if (!iov_iter_count(iter))
+        return 0;
 
-#ifdef DEBUG_VFS
-    klog(LOG_DEBUG, "vfs_read: Reading %lu bytes from file %s at pos %lu\n",
-        count, file->f_dentry ? file->f_dentry->d_name : "unknown", file->f_pos);
-#endif
+    if (write ? fop->write_iter : fop->read_iter) {
+        ret = write ? fop->write_iter(file, iter, pos) :
+            fop->read_iter(file, iter, pos);
+    } else {
+        // The buffer operations work at f_pos
+        off_t old_pos = file->f_pos;
+        file->f_pos = *pos;
+        ret = loop_rw_iter(fop, file, iter, write);
+        file->f_pos = old_pos;
+        if (ret > 0)
+            *pos += ret;
+    }
+
+    if (write && ret > 0 && inode && S_ISREG(inode->i_mode))
+        exec_cache_invalidate(inode);
+    return ret;
+}
+
+static inline bool file_has_pos(struct file *file)
+{
+    struct inode *inode = file->f_dentry ? file->f_dentry->d_inode : NULL;
+    return !inode || !(S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode));
+}
+
+/**
+ * Read or write at the file position, advancing it.
+ */
+ssize_t vfs_iter_read(struct file *file, struct iov_iter *to)
+{
+    ssize_t bytes;
+
+    if (!file_has_pos(file))
+        return do_iter_rw(file, to, &file->f_pos, false);
 
     mutex_lock(&file->f_pos_lock);
-    ssize_t bytes = file->f_op->read(file, buf, count);
-    if (bytes > 0)
-        file->f_pos += bytes;
+    bytes = do_iter_rw(file, to, &file->f_pos, false);
     mutex_unlock(&file->f_pos_lock);
-#ifdef DEBUG_VFS
-    klog(LOG_DEBUG, "vfs_read: Read %ld bytes from file %s at pos %lu\n",
-        bytes, file->f_dentry ? file->f_dentry->d_name : "unknown", file->f_pos);
-#endif
     return bytes;
 }
-SYSCALL_DECL3(read, int, fd, void*, buf, size_t, count)
+
+ssize_t vfs_iter_write(struct file *file, struct iov_iter *from)
 {
-    struct file *file;
-    unsigned char *kbuf;
     ssize_t bytes;
-    long err = -1;
 
-#ifdef DEBUG_VFS
-    klog(LOG_DEBUG, "syscall read: Reading from fd %d\n", fd);
-#endif
+    if (!file_has_pos(file))
+        return do_iter_rw(file, from, &file->f_pos, true);
 
-    file = get_file_handle(fd);
-    if (IS_ERR(file)) {
-#ifdef DEBUG_VFS
-        klog(LOG_DEBUG, "syscall read: Invalid fd %d\n", fd);
-#endif
-        return PTR_ERR(file);
-    }
+    mutex_lock(&file->f_pos_lock);
+    bytes = do_iter_rw(file, from, &file->f_pos, true);
+    mutex_unlock(&file->f_pos_lock);
+    return bytes;
+}
 
-    if ((file->f_mode & O_ACCMODE) == O_WRONLY)
-        return -EBADF;
+/**
+ * Read or write at pos, leaving the file position alone.
+ */
+ssize_t vfs_iter_read_at(struct file *file, struct iov_iter *to, off_t pos)
+{
+    return do_iter_rw(file, to, &pos, false);
+}
 
-    kbuf = kmalloc(count);
-    if (!kbuf)
-        return -ENOMEM;
+ssize_t vfs_iter_write_at(struct file *file, struct iov_iter *from, off_t pos)
+{
+    return do_iter_rw(file, from, &pos, true);
+}
 
-    bytes = vfs_read(file, kbuf, count);
-    if (bytes > 0)
-        err = copy_to_user(buf, kbuf, bytes);
+ssize_t vfs_read_at(struct file *file, void *buf, size_t count, unsigned long pos)
+{
+    struct kvec kv = { .iov_base = buf, .iov_len = count };
+    struct iov_iter iter;
 
-    kfree(kbuf);
-    return err ? err : bytes;
+    iov_iter_kvec(&iter, ITER_DEST, &kv, 1, count);
+    return vfs_iter_read_at(file, &iter, pos);
 }
 
+ssize_t vfs_read(struct file *file, void *buf, size_t count)
+{
+    struct kvec kv = { .iov_base = buf, .iov_len = count };
+    struct iov_iter iter;
+
+#ifdef DEBUG_VFS
+    klog(LOG_DEBUG, "vfs_read: Reading %lu bytes from file %s at pos %lu\n",
+        count, file->f_dentry ? file->f_dentry->d_name : "unknown", file->f_pos);
+#endif
+    iov_iter_kvec(&iter, ITER_DEST, &kv, 1, count);
+    return vfs_iter_read(file, &iter);
+}
 
 ssize_t vfs_write(struct file *file, const void *buf, size_t count)
 {
-    if (file->f_dentry) {
-        struct inode *inode = file->f_dentry->d_inode;
-        if (S_ISDIR(inode->i_mode))
-            return -EISDIR;
-        if (S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode)) {
-            return inode->i_fop->write(file, buf, count);
-        }
+    struct kvec kv = { .iov_base = (void*)buf, .iov_len = count };
+    struct iov_iter iter;
+
+    iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, count);
+    return vfs_iter_write(file, &iter);
+}
+
+/*
+ * Look fd up for a transfer in one direction. On success the caller owns
+ * *f and must fdput() it.
+ */
+static int get_rw_file(int fd, bool write, struct fd *f)
+{
+    *f = fdget(fd);
+    if (!f->file)
+        return -EBADF;
+    if ((f->file->f_mode & O_ACCMODE) == (write ? O_RDONLY : O_WRONLY)) {
+        fdput(*f);
+        return -EBADF;
     }
+    return 0;
+}
 
-    mutex_lock(&file->f_pos_lock);
-    ssize_t bytes = file->f_op->write(file, buf, count);
-    if (bytes > 0)
-        file->f_pos += bytes;
-    mutex_unlock(&file->f_pos_lock);
-    return bytes;
+// Positioned transfers need something seekable
+static int get_pos_file(int fd, off_t pos, bool write, struct fd *f)
+{
+    struct inode *inode;
+    int err;
+
+    if ((err = get_rw_file(fd, write, f)))
+        return err;
+    inode = f->file->f_dentry ? f->file->f_dentry->d_inode : NULL;
+    if (!inode || S_ISFIFO(inode->i_mode) || S_ISCHR(inode->i_mode))
+        err = -ESPIPE;
+    else if (pos < 0)
+        err = -EINVAL;
+    if (err)
+        fdput(*f);
+    return err;
 }
 
-SYSCALL_DECL3(write, int, fd, const void*, buf, size_t, count)
+SYSCALL_DECL3(read, int, fd, void*, buf, size_t, count)
 {
-    struct file *file;
-    unsigned char *kbuf;
-    ssize_t bytes;
-    long err;
+    struct fd f;
+    struct iovec iov;
+    struct iov_iter iter;
+    ssize_t ret;
 
 #ifdef DEBUG_VFS
-    klog(LOG_DEBUG, "syscall write: Writing to fd %d\n", fd);
+    klog(LOG_DEBUG, "syscall read: Reading from fd %d\n", fd);
 #endif
 
-    file = get_file_handle(fd);
-    if (IS_ERR(file)) {
+    if ((ret = get_rw_file(fd, false, &f)))
+        return ret;
+    if (!(ret = import_single_range(ITER_DEST, buf, count, &iov, &iter)))
+        ret = vfs_iter_read(f.file, &iter);
+    fdput(f);
+    return ret;
+}
+
+SYSCALL_DECL3(write, int, fd, const void*, buf, size_t, count)
+{
+    struct fd f;
+    struct iovec iov;
+    struct iov_iter iter;
+    ssize_t ret;
+
 #ifdef DEBUG_VFS
-        klog(LOG_DEBUG, "syscall write: Invalid fd %d\n", fd);
+    klog(LOG_DEBUG, "syscall write: Writing to fd %d\n", fd);
 #endif
-        return PTR_ERR(file);
-    }
 
-    if ((file->f_mode & O_ACCMODE) == O_RDONLY)
-        return -EBADF;
+    if ((ret = get_rw_file(fd, true, &f)))
+        return ret;
+    if (!(ret = import_single_range(ITER_SOURCE, (void*)buf, count, &iov, &iter)))
+        ret = vfs_iter_write(f.file, &iter);
+    fdput(f);
+    return ret;
+}
 
-    kbuf = kmalloc(count);
-    if (!kbuf)
-        return -ENOMEM;
+SYSCALL_DECL4(pread64, int, fd, void*, buf, size_t, count, off_t, pos)
+{
+    struct fd f;
+    struct iovec iov;
+    struct iov_iter iter;
+    ssize_t ret;
 
-    err = copy_from_user(kbuf, buf, count);
-    if (err) {
-        kfree(kbuf);
-        return err;
-    }
+    if ((ret = get_pos_file(fd, pos, false, &f)))
+        return ret;
+    if (!(ret = import_single_range(ITER_DEST, buf, count, &iov, &iter)))
+        ret = vfs_iter_read_at(f.file, &iter, pos);
+    fdput(f);
+    return ret;
+}
 
-    bytes = vfs_write(file, kbuf, count);
-    kfree(kbuf);
-    return bytes;
+SYSCALL_DECL4(pwrite64, int, fd, const void*, buf, size_t, count, off_t, pos)
+{
+    struct fd f;
+    struct iovec iov;
+    struct iov_iter iter;
+    ssize_t ret;
+
+    if ((ret = get_pos_file(fd, pos, true, &f)))
+        return ret;
+    if (!(ret = import_single_range(ITER_SOURCE, (void*)buf, count, &iov, &iter)))
+        ret = vfs_iter_write_at(f.file, &iter, pos);
+    fdput(f);
+    return ret;
 }
 
 int vfs_close(struct file *file)
 {
     klog(LOG_DEBUG, "vfs_close: file = %p, dentry = %p\n", file, file->f_dentry);
-#ifdef DEBUG_VFS_FULL
-    klog(LOG_DEBUG, "vfs_close: fdtable = %p, max = %d\n",
-        current->files->fdarray, current->files->max);
-    for (size_t i = 0; i < current->files->max; i++) {
-        klog(LOG_DEBUG, "table[%u] = %p\n", i, current->files->fdarray[i]);
-    }
-#endif
     if (file->f_op->flush)
         file->f_op->flush(file);
 
@@ -405,18 +638,15 @@ SYSCALL_DECL1(close, int, fd)
     struct file *file;
     long err;
 
-    file = get_file_handle(fd);
-    if (IS_ERR(file))
-        return PTR_ERR(file);
+    file = fd_remove(current->files, fd);
+    if (!file)
+        return -EBADF;
 
 #ifdef DEBUG_VFS
     klog(LOG_DEBUG, "syscall close: Closing fd %d, file %p, dentry %p\n",
         fd, file, file->f_dentry);
 #endif
     err = vfs_close(file);
-    acquire_lock(&current->files->lock);
-    current->files->fdarray[fd] = NULL;
-    release_lock(&current->files->lock);
     return err;
 }
 
@@ -445,23 +675,27 @@ ssize_t vfs_getdents(struct file *file, struct dirent *dirp, int buf_size)
 
 SYSCALL_DECL3(getdents, int, fd, struct dirent*, dirp, int, buf_size)
 {
-    struct file *file = get_file_handle(fd);
+    struct fd f;
     unsigned char *buf;
     ssize_t bytes;
 #ifdef DEBUG_VFS
     klog(LOG_DEBUG, "VFS: Getting directory entries for fd %d\n", fd);
 #endif
-    if (IS_ERR(file))
-        return PTR_ERR(file);
-
     if (buf_size > 0x8000)
         return -EINVAL;
 
+    f = fdget(fd);
+    if (!f.file)
+        return -EBADF;
+
     buf = kzmalloc(buf_size);
-    if (!buf)
+    if (!buf) {
+        fdput(f);
         return -ENOMEM;
+    }
 
-    bytes = vfs_getdents(file, (struct dirent *)buf, buf_size);
+    bytes = vfs_getdents(f.file, (struct dirent *)buf, buf_size);
+    fdput(f);
     long err = 0;
     if (bytes > 0)
         err = copy_to_user(dirp, buf, bytes);
@@ -496,18 +730,15 @@ static int vfs_do_mkdir(struct dentry * parent_d, const char *name, umode_t mode
     if (parent_i->i_op->mkdir == NULL)
         return -EPERM;
 
-    struct dentry *new_dentry = alloc_dentry(parent_d, name);
+    struct dentry *new_dentry = lookup_path_from(parent_d, name);
     if (IS_ERR(new_dentry))
         return PTR_ERR(new_dentry);
 
-    int err = parent_i->i_op->mkdir(parent_i, new_dentry, mode);
-    if (err < 0) {
-        destroy_dentry(new_dentry);
-        return err;
-    }
-
-    dcache_add(new_dentry);
-    return 0;
+    int err = -EEXIST;
+    if (!new_dentry->d_inode)
+        err = parent_i->i_op->mkdir(parent_i, new_dentry, mode);
+    dput(new_dentry);
+    return err < 0 ? err : 0;
 }
 
 int vfs_mkdir(const char *path, umode_t mode)
@@ -526,13 +757,15 @@ int vfs_mkdir(const char *path, umode_t mode)
     }
 
     if ((err = get_basename(name, path, NAME_MAX)))
-        goto error;
+        goto out;
 
     err = vfs_do_mkdir(parent_d, name, mode);
     if (err < 0)
-        goto error;
+        goto out;
 
     klog(LOG_DEBUG, "VFS: Created directory %s\n", path);
+out:
+    dput(parent_d);
 error:
     return err;
 }
@@ -565,6 +798,7 @@ int vfs_mkdirat(struct file *dirf, const char *path, umode_t mode)
     get_basename(name, path, NAME_MAX);
 
     err = vfs_do_mkdir(parent_d, name, mode);
+    dput(parent_d);
     if (err < 0)
         goto error;
     klog(LOG_DEBUG, "VFS: Created directory %s\n", path);
@@ -584,12 +818,13 @@ SYSCALL_DECL3(mkdirat, int, dirfd, const char*, path, umode_t, mode)
     if (is_absolute_path(path_buf)) {
         err = vfs_mkdir(path_buf, mode);
     } else {
-        struct file *dirf = get_file_handle(dirfd);
-        if (IS_ERR(dirf)) {
+        struct fd dirf = fdget(dirfd);
+        if (!dirf.file) {
             kfree(path_buf);
-            return PTR_ERR(dirf);
+            return -EBADF;
         }
-        err = vfs_mkdirat(dirf, path_buf, mode);
+        err = vfs_mkdirat(dirf.file, path_buf, mode);
+        fdput(dirf);
     }
 
     kfree(path_buf);
@@ -599,12 +834,13 @@ SYSCALL_DECL3(mkdirat, int, dirfd, const char*, path, umode_t, mode)
 int vfs_create(const char *path, umode_t mode)
 {
     char dirname[64];
-    char *basename = kmalloc(16);
+    char basename[NAME_MAX];
     struct inode *parent_inode;
-    struct dentry *parent;
+    struct dentry *parent, *new_dentry;
+    int err;
 
     get_dirname(dirname, path, 64);
-    get_basename(basename, path, 16);
+    get_basename(basename, path, NAME_MAX);
 
     parent = lookup_path(dirname);
     if (IS_ERR(parent)) {
@@ -614,15 +850,22 @@ int vfs_create(const char *path, umode_t mode)
     parent_inode = parent->d_inode;
     if (!parent_inode) {
         klog(LOG_DEBUG, "Parent inode not found\n");
+        dput(parent);
         return -ENOENT;
     }
 
-    struct dentry *new_dentry = alloc_dentry(parent, basename);
-    dcache_add(new_dentry);
+    new_dentry = lookup_path_from(parent, basename);
+    dput(parent);
+    if (IS_ERR(new_dentry))
+        return PTR_ERR(new_dentry);
 #ifdef DEBUG_VFS
     klog(LOG_DEBUG, "Creating %s\n", new_dentry->d_name);
 #endif
-    return parent_inode->i_op->create(parent_inode, new_dentry, mode);
+    err = -EEXIST;
+    if (!new_dentry->d_inode)
+        err = parent_inode->i_op->create(parent_inode, new_dentry, mode);
+    dput(new_dentry);
+    return err;
 }
 SYSCALL_DECL2(create, const char*, path, umode_t, mode)
 {
@@ -648,7 +891,7 @@ SYSCALL_DECL3(mknod, const char*, pathname, int, mode, dev_t, dev)
 
 int vfs_dup(int oldfd, int newfd)
 {
-    if (newfd < 0 || newfd >= 1024) {
+    if (newfd < 0 || (unsigned long)newfd >= rlimit(RLIMIT_NOFILE)) {
         klog(LOG_ERROR, "VFS: vfs_dup invalid newfd %d\n", newfd);
         return -EBADF;
     }
@@ -656,11 +899,10 @@ int vfs_dup(int oldfd, int newfd)
     if (oldfd == newfd)
         return newfd;
 
-    struct file *f = get_file_handle(oldfd);
-    if (IS_ERR(f))
-        return PTR_ERR(f);
-
-    fget(f);
+    // The new slot keeps the reference taken here
+    struct file *f = fget_fd(oldfd);
+    if (!f)
+        return -EBADF;
 
 #ifdef DEBUG_VFS
     klog(LOG_DEBUG, "vfs_dup: file %p, dentry %p, oldfd %d, newfd %d\n",
@@ -682,10 +924,9 @@ int vfs_dup(int oldfd, int newfd)
 
 int vfs_dupf(int fd)
 {
-    struct file *f = get_file_handle(fd);
-    if (IS_ERR(f))
-        return PTR_ERR(f);
-    fget(f);
+    struct file *f = fget_fd(fd);
+    if (!f)
+        return -EBADF;
     int new_fd = get_next_fd(current->files, f);
     if (new_fd < 0) {
         klog(LOG_ERROR, "VFS: vfs_dupf failed to get new fd\n");
@@ -732,14 +973,18 @@ int vfs_rmdir(const char *path)
         return PTR_ERR(dentry);
 
     struct inode *dir = dentry->d_parent->d_inode;
+    int err;
     if (dir->i_op->rmdir == NULL)
-        return -EPERM;
-    if (!dentry->d_inode)
-        return -ENOENT;
-    if (!S_ISDIR(dentry->d_inode->i_mode))
-        return -ENOTDIR;
-
-    return dir->i_op->rmdir(dir, dentry);
+        err = -EPERM;
+    else if (!dentry->d_inode)
+        err = -ENOENT;
+    else if (!S_ISDIR(dentry->d_inode->i_mode))
+        err = -ENOTDIR;
+    else if (!(err = dir->i_op->rmdir(dir, dentry)))
+        d_delete(dentry);
+
+    dput(dentry);
+    return err;
 }
 
 SYSCALL_DECL1(rmdir, const char*, path)
@@ -764,14 +1009,18 @@ int vfs_unlink(const char *path)
 
     struct inode *dir = dentry->d_parent->d_inode;
     struct inode *victim_i = dentry->d_inode;
+    int err;
     if (!victim_i)
-        return -ENOENT;
-    if (S_ISDIR(victim_i->i_mode))
-        return -EISDIR;
-    if (!dir->i_op->unlink)
-        return -EPERM;
-
-    return dir->i_op->unlink(dir, dentry);
+        err = -ENOENT;
+    else if (S_ISDIR(victim_i->i_mode))
+        err = -EISDIR;
+    else if (!dir->i_op->unlink)
+        err = -EPERM;
+    else if (!(err = dir->i_op->unlink(dir, dentry)))
+        d_delete(dentry);
+
+    dput(dentry);
+    return err;
 }
 
 SYSCALL_DECL1(unlink, const char*, path)
@@ -794,25 +1043,42 @@ int vfs_link(const char *oldpath, const char *newpath)
     if (IS_ERR(old_dentry))
         return PTR_ERR(old_dentry);
 
+    struct dentry *new_dentry = NULL;
     struct inode *old_inode = old_dentry->d_inode;
-    if (!old_inode)
-        return -ENOENT;
-    if (!S_ISREG(old_inode->i_mode)) // only link regular files currently
-        return -EPERM;
+    struct inode *dir;
+    int err;
 
-    struct dentry *new_dentry = vfs_lookup(newpath);
-    if (IS_ERR(new_dentry))
-        return PTR_ERR(new_dentry);
-    if (new_dentry->d_inode)
-        return -EEXIST;
+    if (!old_inode) {
+        err = -ENOENT;
+        goto out;
+    }
+    if (!S_ISREG(old_inode->i_mode)) { // only link regular files currently
+        err = -EPERM;
+        goto out;
+    }
 
-    struct inode *dir = new_dentry->d_parent->d_inode;
-    if (!dir)
-        return -ENOENT;
-    if (!dir->i_op->link)
-        return -EPERM;
+    new_dentry = vfs_lookup(newpath);
+    if (IS_ERR(new_dentry)) {
+        err = PTR_ERR(new_dentry);
+        new_dentry = NULL;
+        goto out;
+    }
 
-    return dir->i_op->link(old_dentry, dir, new_dentry);
+    dir = new_dentry->d_parent->d_inode;
+    if (new_dentry->d_inode)
+        err = -EEXIST;
+    else if (!dir)
+        err = -ENOENT;
+    else if (!dir->i_op->link)
+        err = -EPERM;
+    else
+        err = dir->i_op->link(old_dentry, dir, new_dentry);
+
+out:
+    if (new_dentry)
+        dput(new_dentry);
+    dput(old_dentry);
+    return err;
 }
 
 SYSCALL_DECL2(link, const char*, oldpath, const char*, newpath)
@@ -844,12 +1110,18 @@ int vfs_symlink(const char *target, const char *linkpath)
         return PTR_ERR(link_dentry);
 
     struct inode *dir = link_dentry->d_parent->d_inode;
-    if (!dir)
-        return -ENOENT;
-    if (!dir->i_op->symlink)
-        return -EPERM;
-
-    return dir->i_op->symlink(dir, link_dentry, target);
+    int err;
+    if (link_dentry->d_inode)
+        err = -EEXIST;
+    else if (!dir)
+        err = -ENOENT;
+    else if (!dir->i_op->symlink)
+        err = -EPERM;
+    else
+        err = dir->i_op->symlink(dir, link_dentry, target);
+
+    dput(link_dentry);
+    return err;
 }
 
 SYSCALL_DECL2(symlink, const char*, target, const char*, linkpath)
@@ -878,6 +1150,7 @@ SYSCALL_DECL3(readlink, const char*, path, char *, buf, int, bufsize)
 {
     struct dentry *dentry;
     char *path_buf;
+    long err;
 
     if (!access_ok(buf, bufsize))
         return -EFAULT;
@@ -887,105 +1160,294 @@ SYSCALL_DECL3(readlink, const char*, path, char *, buf, int, bufsize)
         return PTR_ERR(path_buf);
 
     dentry = vfs_lookup(path_buf);
+    kfree(path_buf);
     if (IS_ERR(dentry))
         return PTR_ERR(dentry);
+
     if (!dentry->d_inode)
-        return -ENOENT;
-    if (!S_ISLNK(dentry->d_inode->i_mode))
-        return -EINVAL;
-    if (!dentry->d_inode->i_op->readlink)
+        err = -ENOENT;
+    else if (!S_ISLNK(dentry->d_inode->i_mode))
+        err = -EINVAL;
+    else if (!dentry->d_inode->i_op->readlink)
+        err = -EINVAL;
+    else
+        err = dentry->d_inode->i_op->readlink(dentry, buf, bufsize);
+
+    dput(dentry);
+    return err;
+}
+
+/*
+ * The whole vector goes to the file as one transfer, pos < 0 meaning the
+ * file position.
+ */
+static ssize_t do_rw_vec(struct file *file, const struct iovec __user *uvec,
+    int iovcnt, off_t pos, bool write)
+{
+    struct iovec fast_iov[UIO_FASTIOV];
+    struct iovec *iov = fast_iov;
+    struct iov_iter iter;
+    ssize_t ret;
+
+    if (iovcnt < 0)
         return -EINVAL;
 
-    return dentry->d_inode->i_op->readlink(dentry, buf, bufsize);
-}
+    ret = import_iovec(write ? ITER_SOURCE : ITER_DEST, uvec, iovcnt,
+        UIO_FASTIOV, &iov, &iter);
+    if (ret < 0)
+        return ret;
 
-struct iovec {
-    void *iov_base;	/* Pointer to data.  */
-    size_t iov_len;	/* Length of data.  */
-};
+    if (pos < 0)
+        ret = write ? vfs_iter_write(file, &iter) : vfs_iter_read(file, &iter);
+    else
+        ret = write ? vfs_iter_write_at(file, &iter, pos) :
+            vfs_iter_read_at(file, &iter, pos);
+
+    kfree(iov);
+    return ret;
+}
 
 SYSCALL_DECL3(readv, int, fd, const struct iovec __user *, iov, int, iovcnt)
 {
-    struct file *file;
-    struct iovec kiov;
-    ssize_t total = 0;
+    struct fd f;
+    ssize_t ret;
 
-    if (iovcnt < 0 || iovcnt > 1024)
-        return -EINVAL;
+    if ((ret = get_rw_file(fd, false, &f)))
+        return ret;
+    ret = do_rw_vec(f.file, iov, iovcnt, -1, false);
+    fdput(f);
+    return ret;
+}
 
-    file = get_file_handle(fd);
-    if (IS_ERR(file))
-        return PTR_ERR(file);
+SYSCALL_DECL3(writev, int, fd, const struct iovec __user *, iov, int, iovcnt)
+{
+    struct fd f;
+    ssize_t ret;
 
-    if ((file->f_mode & O_ACCMODE) == O_WRONLY)
-        return -EBADF;
+    if ((ret = get_rw_file(fd, true, &f)))
+        return ret;
+    ret = do_rw_vec(f.file, iov, iovcnt, -1, true);
+    fdput(f);
+    return ret;
+}
 
-    for (int i = 0; i < iovcnt; i++) {
-        if (copy_from_user(&kiov, &iov[i], sizeof(kiov)))
-            return -EFAULT;
-        if (!kiov.iov_len)
-            continue;
-
-        unsigned char *kbuf = kmalloc(kiov.iov_len);
-        if (!kbuf)
-            return total > 0 ? total : -ENOMEM;
-
-        ssize_t bytes = vfs_read(file, kbuf, kiov.iov_len);
-        if (bytes > 0) {
-            if (copy_to_user(kiov.iov_base, kbuf, bytes)) {
-                kfree(kbuf);
-                return total > 0 ? total : -EFAULT;
-            }
-            total += bytes;
+// On 64 bit the whole offset arrives in pos_l, pos_h is only for 32 bit ABIs
+SYSCALL_DECL5(preadv, int, fd, const struct iovec __user *, iov, int, iovcnt,
+    unsigned long, pos_l, unsigned long, pos_h)
+{
+    off_t pos = pos_l;
+    struct fd f;
+    ssize_t ret;
+
+    if ((ret = get_pos_file(fd, pos, false, &f)))
+        return ret;
+    ret = do_rw_vec(f.file, iov, iovcnt, pos, false);
+    fdput(f);
+    return ret;
+}
+
+SYSCALL_DECL5(pwritev, int, fd, const struct iovec __user *, iov, int, iovcnt,
+    unsigned long, pos_l, unsigned long, pos_h)
+{
+    off_t pos = pos_l;
+    struct fd f;
+    ssize_t ret;
+
+    if ((ret = get_pos_file(fd, pos, true, &f)))
+        return ret;
+    ret = do_rw_vec(f.file, iov, iovcnt, pos, true);
+    fdput(f);
+    return ret;
+}
+
+// Pages staged per step of an in-kernel copy
+#define COPY_CHUNK_PAGES    16
+
+static inline size_t file_block_size(struct file *file)
+{
+    struct inode *inode = file->f_dentry ? file->f_dentry->d_inode : NULL;
+
+    if (!inode || !inode->i_sb || !inode->i_sb->s_blocksize)
+        return PAGE_SIZE;
+    return inode->i_sb->s_blocksize;
+}
+
+/**
+ * Copy up to count bytes from in at *in_pos to out, at *out_pos or at the
+ * file position if out_pos is NULL, without the data passing through user
+ * memory. Reads come from the page cache where in has one. After the first
+ * chunk every chunk starts on a block of out, so a filesystem that writes
+ * whole blocks, like FAT32 with its clusters, never reads the ends back.
+ */
+ssize_t vfs_copy_range(struct file *in, off_t *in_pos, struct file *out,
+    off_t *out_pos, size_t count)
+{
+    unsigned long pages = COPY_CHUNK_PAGES;
+    size_t bsize = file_block_size(out);
+    size_t chunk;
+    size_t done = 0;
+    struct iov_iter iter;
+    struct kvec kv;
+    ssize_t ret = 0;
+    void *buf;
+
+    if (!count)
+        return 0;
+    // Fall back to smaller chunks if memory is fragmented
+    while (!(buf = get_free_pages(pages, ALLOC_MAYFAIL)) && pages > 1)
+        pages /= 2;
+    if (!buf)
+        return -ENOMEM;
+    chunk = pages * PAGE_SIZE;
+    if (bsize > chunk || chunk % bsize)
+        bsize = PAGE_SIZE;
+
+    while (done < count) {
+        off_t opos = out_pos ? *out_pos : READ_ONCE(out->f_pos);
+        size_t n = MIN(count - done, chunk - opos % bsize);
+
+        kv = (struct kvec) { .iov_base = buf, .iov_len = n };
+        iov_iter_kvec(&iter, ITER_DEST, &kv, 1, n);
+        ret = vfs_iter_read_at(in, &iter, *in_pos);
+        if (ret <= 0)
+            break;
+
+        n = ret;
+        kv.iov_len = n;
+        iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, n);
+        if (out_pos) {
+            ret = vfs_iter_write_at(out, &iter, *out_pos);
+            if (ret > 0)
+                *out_pos += ret;
+        } else {
+            ret = vfs_iter_write(out, &iter);
         }
-        kfree(kbuf);
-        if (bytes < 0)
-            return total > 0 ? total : bytes;
-        if ((size_t)bytes < kiov.iov_len)
+        if (ret <= 0)
+            break;
+
+        // Only what reached out counts as read
+        *in_pos += ret;
+        done += ret;
+        if ((size_t)ret < n)
             break;
     }
-    return total;
+
+    free_pages(buf, pages);
+    return done ? (ssize_t)done : ret;
 }
 
-SYSCALL_DECL3(writev, int, fd, const struct iovec __user *, iov, int, iovcnt)
+static inline void file_pos_write(struct file *file, off_t pos)
 {
-    struct file *file;
-    struct iovec kiov;
-    ssize_t total = 0;
+    mutex_lock(&file->f_pos_lock);
+    file->f_pos = pos;
+    mutex_unlock(&file->f_pos_lock);
+}
 
-    if (iovcnt < 0 || iovcnt > 1024)
-        return -EINVAL;
+/*
+ * Without an offset the copy starts at in's file position and moves it,
+ * otherwise *offset is used and updated and in's position is left alone.
+ */
+SYSCALL_DECL4(sendfile, int, out_fd, int, in_fd, off_t __user *, offset,
+    size_t, count)
+{
+    struct fd in, out;
+    off_t pos;
+    ssize_t ret;
+
+    if ((ret = get_rw_file(in_fd, false, &in)))
+        return ret;
+    if ((ret = get_rw_file(out_fd, true, &out)))
+        goto out_in;
+
+    if (offset) {
+        ret = -EFAULT;
+        if (get_user(pos, offset))
+            goto out_out;
+        ret = -EINVAL;
+        if (pos < 0)
+            goto out_out;
+    } else {
+        pos = READ_ONCE(in.file->f_pos);
+    }
 
-    file = get_file_handle(fd);
-    if (IS_ERR(file))
-        return PTR_ERR(file);
+    ret = vfs_copy_range(in.file, &pos, out.file, NULL, MIN(count, MAX_RW_COUNT));
+    if (ret > 0) {
+        if (!offset)
+            file_pos_write(in.file, pos);
+        else if (put_user(pos, offset))
+            ret = -EFAULT;
+    }
 
-    if ((file->f_mode & O_ACCMODE) == O_RDONLY)
-        return -EBADF;
+out_out:
+    fdput(out);
+out_in:
+    fdput(in);
+    return ret;
+}
 
-    for (int i = 0; i < iovcnt; i++) {
-        if (copy_from_user(&kiov, &iov[i], sizeof(kiov)))
-            return -EFAULT;
-        if (!kiov.iov_len)
-            continue;
+// Both ends of copy_file_range are regular files
+static int get_copy_file(int fd, bool write, struct fd *f)
+{
+    struct inode *inode;
+    int err;
 
-        unsigned char *kbuf = kmalloc(kiov.iov_len);
-        if (!kbuf)
-            return total > 0 ? total : -ENOMEM;
+    if ((err = get_rw_file(fd, write, f)))
+        return err;
+    inode = f->file->f_dentry ? f->file->f_dentry->d_inode : NULL;
+    if (inode && S_ISDIR(inode->i_mode))
+        err = -EISDIR;
+    else if (!inode || !S_ISREG(inode->i_mode))
+        err = -EINVAL;
+    if (err)
+        fdput(*f);
+    return err;
+}
 
-        if (copy_from_user(kbuf, kiov.iov_base, kiov.iov_len)) {
-            kfree(kbuf);
-            return total > 0 ? total : -EFAULT;
-        }
+SYSCALL_DECL6(copy_file_range, int, fd_in, off_t __user *, off_in,
+    int, fd_out, off_t __user *, off_out, size_t, len, unsigned int, flags)
+{
+    struct fd in, out;
+    off_t pos_in, pos_out;
+    ssize_t ret;
 
-        ssize_t bytes = vfs_write(file, kbuf, kiov.iov_len);
-        kfree(kbuf);
-        if (bytes > 0)
-            total += bytes;
-        if (bytes < 0)
-            return total > 0 ? total : bytes;
-        if ((size_t)bytes < kiov.iov_len)
-            break;
+    if (flags)
+        return -EINVAL;
+    if ((ret = get_copy_file(fd_in, false, &in)))
+        return ret;
+    if ((ret = get_copy_file(fd_out, true, &out)))
+        goto out_in;
+
+    pos_in = READ_ONCE(in.file->f_pos);
+    pos_out = READ_ONCE(out.file->f_pos);
+    ret = -EFAULT;
+    if ((off_in && get_user(pos_in, off_in)) ||
+            (off_out && get_user(pos_out, off_out)))
+        goto out_out;
+
+    ret = -EINVAL;
+    len = MIN(len, MAX_RW_COUNT);
+    if (pos_in < 0 || pos_out < 0)
+        goto out_out;
+    // Overlapping ranges of one file would read back what was just written
+    if (in.file->f_dentry->d_inode == out.file->f_dentry->d_inode &&
+            pos_in < pos_out + (off_t)len && pos_out < pos_in + (off_t)len)
+        goto out_out;
+
+    ret = vfs_copy_range(in.file, &pos_in, out.file, &pos_out, len);
+    if (ret > 0) {
+        if (!off_in)
+            file_pos_write(in.file, pos_in);
+        else if (put_user(pos_in, off_in))
+            ret = -EFAULT;
+        if (!off_out)
+            file_pos_write(out.file, pos_out);
+        else if (put_user(pos_out, off_out))
+            ret = -EFAULT;
     }
-    return total;
+
+out_out:
+    fdput(out);
+out_in:
+    fdput(in);
+    return ret;
 }
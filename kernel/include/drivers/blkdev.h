@@ -57,5 +57,6 @@ __must_check
 int add_gendisk(struct gendisk *disk);
 int scan_partitions(struct gendisk *disk);
 struct block_device *get_bdev(int major);
+struct block_device *lookup_bdev(const char *name);
 
 #endif
@@ -0,0 +1,11 @@
+#ifndef _EXT2_H
+#define _EXT2_H
+
+#include <lilac/types.h>
+
+struct super_block;
+struct dentry;
+
+struct dentry *ext2_init(void *dev, struct super_block *sb);
+
+#endif
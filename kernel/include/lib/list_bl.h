@@ -88,6 +88,32 @@ static inline void hlist_bl_add_head(struct hlist_bl_node *n,
 	hlist_bl_set_first(h, n);
 }
 
+/*
+ * Like hlist_bl_add_head, but n is fully set up before it is published,
+ * so lockless readers walking the chain never see a half-linked node.
+ * The caller still holds the bucket lock against other writers.
+ */
+static inline void hlist_bl_add_head_lockless(struct hlist_bl_node *n,
+					struct hlist_bl_head *h)
+{
+	struct hlist_bl_node *first = hlist_bl_first(h);
+
+	n->next = first;
+	n->pprev = &h->first;
+	if (first)
+		first->pprev = &n->next;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	hlist_bl_set_first(h, n);
+}
+
+/* First node for a lockless reader, which must not cache the head */
+static inline struct hlist_bl_node *hlist_bl_first_lockless(
+					struct hlist_bl_head *h)
+{
+	return (struct hlist_bl_node *)
+		((unsigned long)READ_ONCE(h->first) & ~LIST_BL_LOCKMASK);
+}
+
 static inline void hlist_bl_add_before(struct hlist_bl_node *n,
 				       struct hlist_bl_node *next)
 {
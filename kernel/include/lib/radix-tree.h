@@ -0,0 +1,47 @@
+#ifndef _LIB_RADIX_TREE_H
+#define _LIB_RADIX_TREE_H
+
+#include <lilac/types.h>
+
+#define RADIX_TREE_MAP_SHIFT    6
+#define RADIX_TREE_MAP_SIZE     (1UL << RADIX_TREE_MAP_SHIFT)
+#define RADIX_TREE_MAP_MASK     (RADIX_TREE_MAP_SIZE - 1)
+
+struct radix_tree_node {
+    unsigned int count;     /* slots in use */
+    void *slots[RADIX_TREE_MAP_SIZE];
+};
+
+/*
+ * A sparse array of pointers indexed by unsigned long. The tree is only as
+ * tall as the largest index needs, so small files stay one node deep.
+ * There is no locking, the user serialises updates against lookups.
+ */
+struct radix_tree_root {
+    unsigned int height;    /* 0 when empty */
+    struct radix_tree_node *rnode;
+};
+
+#define RADIX_TREE_INIT { .height = 0, .rnode = NULL }
+
+static inline void INIT_RADIX_TREE(struct radix_tree_root *root)
+{
+    root->height = 0;
+    root->rnode = NULL;
+}
+
+static inline bool radix_tree_empty(const struct radix_tree_root *root)
+{
+    return root->rnode == NULL;
+}
+
+int radix_tree_insert(struct radix_tree_root *root, unsigned long index,
+    void *item);
+void *radix_tree_lookup(const struct radix_tree_root *root,
+    unsigned long index);
+void *radix_tree_delete(struct radix_tree_root *root, unsigned long index);
+unsigned int radix_tree_gang_lookup(const struct radix_tree_root *root,
+    void **results, unsigned long *indices, unsigned long first_index,
+    unsigned int max_items);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef _LILAC_ANON_INODES_H
+#define _LILAC_ANON_INODES_H
+
+#include <lilac/fs.h>
+
+struct file * anon_inode_getfile(const struct file_operations *fops,
+    void *priv, int flags);
+int anon_inode_getfd(const struct file_operations *fops, void *priv, int flags);
+
+#endif
@@ -2,14 +2,33 @@
 #ifndef LILAC_BIT_SPINLOCK_H
 #define LILAC_BIT_SPINLOCK_H
 
-// #include <linux/kernel.h>
-// #include <linux/preempt.h>
-// #include <linux/atomic.h>
-// #include <linux/bug.h>
+#include <lilac/types.h>
+#include <lilac/sync.h>
 
 #define __acquire(x) (void)0
 #define __release(x) (void)0
 
+#define cpu_relax() __pause()
+
+static inline int test_bit(int nr, const unsigned long *addr)
+{
+	return (__atomic_load_n(addr, __ATOMIC_RELAXED) >> nr) & 1;
+}
+
+static inline int test_and_set_bit_lock(int nr, unsigned long *addr)
+{
+	unsigned long mask = 1UL << nr;
+	return (__atomic_fetch_or(addr, mask, __ATOMIC_ACQUIRE) & mask) != 0;
+}
+
+static inline void clear_bit_unlock(int nr, unsigned long *addr)
+{
+	__atomic_fetch_and(addr, ~(1UL << nr), __ATOMIC_RELEASE);
+}
+
+/* Other bits in the word may change under us, so this stays atomic */
+#define __clear_bit_unlock clear_bit_unlock
+
 /*
  *  bit-based spin_lock()
  *
@@ -28,11 +47,11 @@ static inline void bit_spin_lock(int bitnum, unsigned long *addr)
 	// preempt_disable();
 #if defined(CONFIG_SMP) || defined(CONFIG_DEBUG_SPINLOCK)
 	while (unlikely(test_and_set_bit_lock(bitnum, addr))) {
-		preempt_enable();
+		// preempt_enable();
 		do {
 			cpu_relax();
 		} while (test_bit(bitnum, addr));
-		preempt_disable();
+		// preempt_disable();
 	}
 #endif
 	__acquire(bitlock);
@@ -46,7 +65,7 @@ static inline int bit_spin_trylock(int bitnum, unsigned long *addr)
 	// preempt_disable();
 #if defined(CONFIG_SMP) || defined(CONFIG_DEBUG_SPINLOCK)
 	if (unlikely(test_and_set_bit_lock(bitnum, addr))) {
-		preempt_enable();
+		// preempt_enable();
 		return 0;
 	}
 #endif
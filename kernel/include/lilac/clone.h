@@ -28,6 +28,11 @@
 // #define CLONE_NEWNET    0x40000000
 // #define CLONE_IO        0x80000000
 
+struct mm_info;
+struct fdtable;
+struct task_info;
+struct task;
+
 struct clone_args {
     unsigned long flags;
     void *stack;
@@ -35,6 +40,12 @@ struct clone_args {
     pid_t *child_tid;
     void *tls;
     int exit_signal;
+    /* Already set up for a spawned child, taken over instead of copied */
+    struct mm_info *mm;
+    struct fdtable *files;
+    struct task_info *info;
 };
 
+struct task * clone_process(struct clone_args *args);
+
 #endif /* _LILAC_CLONE_H */
@@ -128,6 +128,7 @@ struct exec_info {
 #define AT_SECURE       23
 #define AT_RANDOM       25
 #define AT_EXECFN       31
+#define AT_SYSINFO_EHDR 33
 
 int elf_load(struct file *elf_file, struct mm_info *mm, struct exec_info *info);
 
@@ -0,0 +1,10 @@
+#ifndef _LILAC_EVENTFD_H
+#define _LILAC_EVENTFD_H
+
+#include <lilac/fcntl.h>
+
+#define EFD_SEMAPHORE   1
+#define EFD_CLOEXEC     O_CLOEXEC
+#define EFD_NONBLOCK    O_NONBLOCK
+
+#endif
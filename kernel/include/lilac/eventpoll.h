@@ -0,0 +1,41 @@
+#ifndef _LILAC_EVENTPOLL_H
+#define _LILAC_EVENTPOLL_H
+
+#include <lilac/types.h>
+#include <lilac/poll.h>
+#include <lilac/fcntl.h>
+
+#define EPOLL_CLOEXEC   O_CLOEXEC
+
+#define EPOLL_CTL_ADD   1
+#define EPOLL_CTL_DEL   2
+#define EPOLL_CTL_MOD   3
+
+#define EPOLLIN         POLLIN
+#define EPOLLPRI        POLLPRI
+#define EPOLLOUT        POLLOUT
+#define EPOLLERR        POLLERR
+#define EPOLLHUP        POLLHUP
+#define EPOLLRDNORM     POLLRDNORM
+#define EPOLLRDBAND     POLLRDBAND
+#define EPOLLWRNORM     POLLWRNORM
+#define EPOLLWRBAND     POLLWRBAND
+#define EPOLLONESHOT    (1U << 30)
+#define EPOLLET         (1U << 31)
+
+#ifdef __x86_64__
+#define EPOLL_PACKED __attribute__((packed))
+#else
+#define EPOLL_PACKED
+#endif
+
+struct epoll_event {
+    u32 events;
+    u64 data;
+} EPOLL_PACKED;
+
+struct file;
+
+void eventpoll_release(struct file *file);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _LILAC_EXEC_CACHE_H
+#define _LILAC_EXEC_CACHE_H
+
+#include <lilac/types.h>
+#include <lilac/elf.h>
+#include <lilac/fs.h>
+#include <lib/list.h>
+
+struct page;
+
+/* A PT_LOAD segment as exec maps it, before the load bias is added */
+struct exec_seg {
+    uintptr_t vaddr;
+    u64 memsz;
+    u64 offset;
+    u64 filesz;
+    unsigned long vm_flags;
+    unsigned int nr_hot;        /* pinned pages at its start, prefaulted */
+};
+
+/*
+ * What exec needs from an ELF file, parsed once and kept on the inode until
+ * the file changes or memory runs short. Read-only segments keep the start
+ * of their page cache pinned, so the next exec finds it without any I/O.
+ */
+struct exec_image {
+    atomic_uint ref_count;
+    struct list_head lru;       /* under exec_cache_lock while cached */
+    struct inode *inode;        /* the file it was parsed from */
+    struct exec_info info;      /* entry points before the load bias */
+    char *interp;               /* PT_INTERP target, NULL if static */
+    struct page **pinned;
+    unsigned int nr_pinned;
+    unsigned int nr_segs;
+    struct exec_seg segs[];
+};
+
+struct exec_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long invalidations;
+    unsigned long pinned_pages;
+    unsigned long execs;        /* execve and posix_spawn that reached user */
+    u64 exec_ns_total;          /* from the syscall to the first user insn */
+    u64 exec_ns_max;
+};
+
+struct exec_image *exec_image_alloc(unsigned int nr_segs);
+void exec_image_put(struct exec_image *img);
+struct exec_image *exec_cache_lookup(struct inode *inode, unsigned int *gen);
+void exec_cache_insert(struct inode *inode, struct exec_image *img,
+    unsigned int gen);
+void __exec_cache_invalidate(struct inode *inode);
+void exec_cache_account(u64 ns);
+void exec_cache_init(void);
+void exec_cache_get_stats(struct exec_cache_stats *stats);
+void print_exec_cache_stats(void);
+
+// Call after anything that may have changed the file's contents
+static inline void exec_cache_invalidate(struct inode *inode)
+{
+    __atomic_fetch_add(&inode->i_exec_gen, 1, __ATOMIC_SEQ_CST);
+    if (READ_ONCE(inode->i_exec))
+        __exec_cache_invalidate(inode);
+}
+
+#endif
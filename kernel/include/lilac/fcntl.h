@@ -26,6 +26,14 @@ extern "C" {
 #define O_DSYNC O_SYNC
 #define O_RSYNC O_SYNC
 
+/* posix_fadvise(2) advice */
+#define POSIX_FADV_NORMAL     0
+#define POSIX_FADV_RANDOM     1
+#define POSIX_FADV_SEQUENTIAL 2
+#define POSIX_FADV_WILLNEED   3
+#define POSIX_FADV_DONTNEED   4
+#define POSIX_FADV_NOREUSE    5
+
 /* Encoding of the file mode.  */
 
 #define S_IFMT      0170000 /* These bits determine file type.  */
@@ -67,6 +75,8 @@ extern "C" {
 #define	F_CNVT 		12	/* Convert a fhandle to an open fd */
 #define	F_RSETLKW 	13	/* Set or Clear remote record-lock(Blocking) */
 #define	F_DUPFD_CLOEXEC	14	/* As F_DUPFD, but set close-on-exec flag */
+#define	F_ADD_SEALS	1033	/* Add seals to a memfd */
+#define	F_GET_SEALS	1034	/* Get the seals of a memfd */
 
 /* fcntl(2) flags (l_type field of flock structure) */
 #define	F_RDLCK		1	/* read lock */
@@ -1,17 +1,37 @@
 #ifndef _LILAC_FDTABLE_H
 #define _LILAC_FDTABLE_H
 
+#include <lilac/types.h>
+#include <lilac/sync.h>
+
 struct file;
 
-struct fdtable {
-    struct file **fdarray;
+/*
+ * The slots themselves, replaced wholesale when the table grows. Readers
+ * load the current array without taking the table lock, so a replaced
+ * array is kept until the table is freed rather than freed straight away;
+ * the sizes double, so that never costs more than the live array does.
+ */
+struct fdarray {
     unsigned int max;
+    struct file **fd;
+    unsigned long *open_fds;    /* bit set for each slot in use */
+    struct fdarray *old;        /* the array this one replaced */
+};
+
+struct fdtable {
+    struct fdarray *fdt;
     atomic_uint ref_count;
-    spinlock_t lock;
+    spinlock_t lock;            /* serialises changes, not lookups */
+    unsigned int next_fd;       /* no free slot below this */
 };
 
 struct fdtable * alloc_fdtable(unsigned int size);
-struct file * get_file_handle(int fd);
+struct fdtable * dup_fdtable(struct fdtable *src);
+void put_fdtable(struct fdtable *files);
+
+struct file * fd_lookup(struct fdtable *files, int fd);
+struct file * fd_remove(struct fdtable *files, int fd);
 int get_next_fd(struct fdtable *, struct file *);
 int get_fd_exact_replace(struct fdtable *files, int fd, struct file *file);
 int get_fd_start_at(struct fdtable *files, int start, struct file *file);
@@ -4,12 +4,14 @@
 #include <lilac/config.h>
 #include <lilac/types.h>
 #include <lib/list.h>
-// #include <lib/list_bl.h>
+#include <lib/list_bl.h>
 #include <lilac/sync.h>
 #include <lilac/fdtable.h>
+#include <lilac/uio.h>
 #include <fs/path.h>
 #include <fs/types.h>
 #include <fs/fcntl.h>
+#include <mm/filemap.h>
 
 /**
  * Based on the Linux VFS structures
@@ -22,6 +24,8 @@ struct dentry;
 struct super_block;
 struct dirent;
 struct vm_desc;
+struct poll_table;
+struct exec_image;
 
 struct inode {
     umode_t             i_mode;
@@ -51,6 +55,9 @@ struct inode {
     struct hlist_head   i_dentry;
 
     const struct file_operations *i_fop;
+    struct address_space i_data;    /* page cache */
+    struct exec_image  *i_exec;     /* parsed ELF, under exec_cache_lock */
+    unsigned int        i_exec_gen; /* bumped whenever the contents change */
 
     void *i_private; /* fs or device private pointer */
 };
@@ -69,15 +76,33 @@ struct __cacheline_align inode_operations {
     int (*rename)(struct inode *, struct dentry *,
                     struct inode *, struct dentry *);
     int (*readlink)(struct dentry *, char __user *, int);
+    // Set i_size of a regular file, dropping or zero filling the data
+    int (*truncate)(struct inode *, u64 size);
 };
 
 
+/* A path component: a slice of the path, not NUL terminated */
+struct qstr {
+    const char *name;
+    u32 len;
+    u32 hash;
+};
+
+/* d_flags */
+#define DCACHE_LRU      0x1     /* on the unused list */
+#define DCACHE_DROPPED  0x2     /* unhashed, freed on the last dput */
+#define DCACHE_DEAD     0x4     /* being freed, can't be picked up again */
+#define DCACHE_PAR_LOOKUP 0x8   /* filesystem lookup still in progress */
+
 struct dentry {
     atomic_uint d_count;
     spinlock_t  d_lock;
-    // struct hlist_bl_node d_hash; /* lookup hash list */
+    unsigned int d_flags;
+    struct hlist_bl_node d_hash;    /* lookup hash list */
     struct dentry *d_parent;        /* parent directory */
     char *d_name;
+    u32 d_name_len;
+    u32 d_name_hash;                /* see d_hash_name */
     struct inode *d_inode;          /* Where the name belongs to - NULL is negative */
 
     const struct dentry_operations *d_op;
@@ -89,6 +114,7 @@ struct dentry {
     struct hlist_head d_children;   /* our children */
 
     struct vfsmount *d_mount;
+    struct list_head d_lru;         /* unused list, under the LRU lock */
 };
 
 struct __cacheline_align dentry_operations {
@@ -166,6 +192,7 @@ struct file {
     struct mutex    f_pos_lock;
     struct dentry  *f_dentry;
     struct inode   *f_inode;
+    struct file_ra_state f_ra;
 
     const struct file_operations *f_op;
     union {
@@ -173,17 +200,24 @@ struct file {
         void *f_data; // other fs specific data
     };
     struct vfsmount *f_disk;
+    struct list_head f_ep_links;    /* epoll items watching this file */
 };
 
 struct file_operations {
     off_t   (*lseek)(struct file *, off_t, int);
     ssize_t (*read)(struct file *, void *, size_t);
     ssize_t (*write)(struct file *, const void *, size_t);
+    // Transfer at *pos, advancing it; preferred over read/write when set
+    ssize_t (*read_iter)(struct file *, struct iov_iter *, off_t *pos);
+    ssize_t (*write_iter)(struct file *, struct iov_iter *, off_t *pos);
     int     (*readdir)(struct file *, struct dirent *, unsigned int);
     int     (*flush)(struct file *);
     int     (*release)(struct inode *, struct file *);
     int     (*ioctl)(struct file *, int op, void *args);
     int     (*mmap)(struct file *, struct vm_desc *);
+    int     (*fsync)(struct file *, int datasync);
+    // Current readiness as POLL* bits, queueing on pt for changes
+    unsigned int (*poll)(struct file *, struct poll_table *pt);
 };
 
 
@@ -199,6 +233,12 @@ struct file* vfs_open(const char *path, int flags, int mode);
 ssize_t vfs_read_at(struct file *file, void *buf, size_t count, unsigned long pos);
 ssize_t vfs_read(struct file *file, void *buf, size_t count);
 ssize_t vfs_write(struct file *file, const void *buf, size_t count);
+ssize_t vfs_iter_read(struct file *file, struct iov_iter *to);
+ssize_t vfs_iter_write(struct file *file, struct iov_iter *from);
+ssize_t vfs_iter_read_at(struct file *file, struct iov_iter *to, off_t pos);
+ssize_t vfs_iter_write_at(struct file *file, struct iov_iter *from, off_t pos);
+ssize_t vfs_copy_range(struct file *in, off_t *in_pos, struct file *out,
+    off_t *out_pos, size_t count);
 int vfs_close(struct file *file);
 ssize_t vfs_getdents(struct file *file, struct dirent *dirp, int buf_size);
 int vfs_create(const char *path, umode_t mode);
@@ -207,13 +247,17 @@ int vfs_mount(const char *source, const char *target,
         const char *filesystemtype, unsigned long mountflags,
         const void *data);
 int vfs_umount(const char *target);
+int vfs_fsync(struct file *file, int datasync);
+int vfs_ftruncate(struct file *file, off_t length);
+int vfs_fadvise(struct file *file, off_t offset, off_t len, int advice);
+void sync_filesystems(void);
 int vfs_dupf(int fd);
 int vfs_dup(int oldfd, int newfd);
 
 struct dentry * vfs_lookup(const char *path);
 struct dentry * lookup_path_from(struct dentry *parent, const char *path);
 struct dentry * lookup_path(const char *path);
-struct dentry * dlookup(struct dentry *parent, char *name);
+struct dentry * dlookup(struct dentry *parent, const struct qstr *name);
 
 void fs_init(void);
 struct dentry *mount_bdev(struct block_device *bdev, int (*fill_super)(struct super_block*));
@@ -227,6 +271,11 @@ void dput(struct dentry *d);
 void destroy_dentry(struct dentry *d);
 void dcache_add(struct dentry *d);
 void dcache_remove(struct dentry *d);
+void d_hash_name(const struct dentry *parent, struct qstr *name);
+void d_delete(struct dentry *d);
+void d_drop(struct dentry *d);
+unsigned long shrink_dcache(unsigned long nr);
+void dcache_init(void);
 
 struct inode * alloc_inode(struct super_block *sb);
 void iget(struct inode *inode);
@@ -234,7 +283,30 @@ void iput(struct inode *inode);
 
 struct file * alloc_file(struct dentry *d);
 void fget(struct file *file);
+bool fget_not_zero(struct file *file);
 void fput(struct file *file);
+void file_lookup_begin(void);
+void file_lookup_end(void);
+
+/*
+ * A file looked up for the length of one syscall. The reference is only
+ * taken when the fd table is shared, fdput() drops it if it was.
+ */
+#define FDPUT_FPUT  1
+
+struct fd {
+    struct file *file;
+    unsigned int flags;
+};
+
+struct fd fdget(int fd);
+struct file * fget_fd(int fd);
+
+static inline void fdput(struct fd f)
+{
+    if (f.flags & FDPUT_FPUT)
+        fput(f.file);
+}
 
 typedef struct dentry *(*fs_init_func_t)(void*, struct super_block*);
 
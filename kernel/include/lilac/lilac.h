@@ -9,6 +9,9 @@
 #include <lilac/panic.h>
 #include <lilac/types.h>
 #include <mm/kmalloc.h>
+#if defined __i386__ || defined __x86_64__
+#include <asm/cpu-flags.h>
+#endif
 
 #define KERNEL_VERSION "0.1.0"
 #ifdef __x86_64__
@@ -45,6 +48,23 @@ static inline void arch_disable_interrupts(void)
 {
     asm volatile ("cli");
 }
+
+// Disable interrupts, returning the flags to put back with arch_irq_restore
+__always_inline
+static inline unsigned long arch_irq_save(void)
+{
+    unsigned long flags;
+
+    asm volatile ("pushf\n\tpop %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+__always_inline
+static inline void arch_irq_restore(unsigned long flags)
+{
+    if (flags & X86_FLAGS_IF)
+        arch_enable_interrupts();
+}
 #endif // __i386__ || __x86_64__
 
 #endif // _LILAC_LILAC_H
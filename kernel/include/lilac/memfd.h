@@ -0,0 +1,21 @@
+#ifndef _LILAC_MEMFD_H
+#define _LILAC_MEMFD_H
+
+#define MFD_CLOEXEC         0x0001U
+#define MFD_ALLOW_SEALING   0x0002U
+
+#define MFD_NAME_MAX        249
+
+/* F_ADD_SEALS and F_GET_SEALS arguments */
+#define F_SEAL_SEAL     0x0001  /* no more seals can be added */
+#define F_SEAL_SHRINK   0x0002  /* the size can't go down */
+#define F_SEAL_GROW     0x0004  /* the size can't go up */
+#define F_SEAL_WRITE    0x0008  /* the contents can't change */
+
+struct file;
+
+void memfd_init(void);
+struct file * memfd_alloc_file(const char *name, unsigned int flags);
+long memfd_fcntl(struct file *file, int cmd, unsigned long arg);
+
+#endif
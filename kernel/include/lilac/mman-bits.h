@@ -14,5 +14,20 @@
 #define MAP_FIXED      0x10
 #define MAP_ANON       0x20
 #define MAP_ANONYMOUS  MAP_ANON
+#define MAP_POPULATE   0x8000
+
+#define MREMAP_MAYMOVE 1
+#define MREMAP_FIXED   2
+
+#define MS_ASYNC       1
+#define MS_INVALIDATE  2
+#define MS_SYNC        4
+
+#define MADV_NORMAL      0
+#define MADV_RANDOM      1
+#define MADV_SEQUENTIAL  2
+#define MADV_WILLNEED    3
+#define MADV_DONTNEED    4
+#define MADV_FREE        8
 
 #endif
@@ -10,6 +10,9 @@
 // Linker sym
 extern char _percpu_start;
 extern char _percpu_end;
+extern char _percpu_load;   // the initial copy, in the kernel image
+
+struct task;
 
 struct __align(64) cpu_local {
     struct cpu_local *self;
@@ -18,26 +21,65 @@ struct __align(64) cpu_local {
     long scratch;
     void *priv; // architecture specific data
     void *user_stack;
+    struct task *curr; // current task, same as this CPU's rq->curr
 };
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wanalyzer-malloc-leak"
-static inline struct cpu_local * this_cpu_local(void)
-{
-    struct cpu_local *ptr;
+/*
+ * The per-CPU section is linked at address 0, so a variable's address is
+ * its offset into every CPU's copy, and %gs points at this CPU's copy with
+ * cpu_local at its start. The this_cpu_* accessors are single gs-relative
+ * instructions on a per-CPU variable or a member of one, so an interrupt
+ * on this CPU can't land in the middle of them.
+ */
+extern struct cpu_local cpu_local_storage;
+
+#define this_cpu_read(var) ({                                           \
+    __typeof__(var) __val;                                              \
+    asm volatile ("mov %%gs:%1, %0" : "=q"(__val) : "m"(var));          \
+    __val;                                                              \
+})
+
 #ifdef __x86_64__
-    ptr = (struct cpu_local*)__builtin_ia32_rdgsbase64();
+#define __this_cpu_op_q(op, var, val) \
+    asm volatile (op "q %1, %%gs:%0" : "+m"(var) : "re"((u64)(uintptr_t)(val)) : "cc")
 #else
-    asm volatile ("mov %%gs:0, %0" : "=r"(ptr));
+extern void __this_cpu_bad_size(void);
+#define __this_cpu_op_q(op, var, val) __this_cpu_bad_size()
 #endif
-    assert(ptr != NULL);
-    return ptr;
+
+#define __this_cpu_op(op, var, val) do {                                \
+    switch (sizeof(var)) {                                              \
+        case 1:                                                         \
+            asm volatile (op "b %1, %%gs:%0"                            \
+                : "+m"(var) : "qi"((u8)(uintptr_t)(val)) : "cc");                  \
+            break;                                                      \
+        case 2:                                                         \
+            asm volatile (op "w %1, %%gs:%0"                            \
+                : "+m"(var) : "ri"((u16)(uintptr_t)(val)) : "cc");                 \
+            break;                                                      \
+        case 4:                                                         \
+            asm volatile (op "l %1, %%gs:%0"                            \
+                : "+m"(var) : "ri"((u32)(uintptr_t)(val)) : "cc");                 \
+            break;                                                      \
+        default:                                                        \
+            __this_cpu_op_q(op, var, val);                              \
+            break;                                                      \
+    }                                                                   \
+} while (0)
+
+#define this_cpu_write(var, val)    __this_cpu_op("mov", var, val)
+#define this_cpu_add(var, val)      __this_cpu_op("add", var, val)
+#define this_cpu_inc(var)           this_cpu_add(var, 1)
+
+static inline struct cpu_local * this_cpu_local(void)
+{
+    return this_cpu_read(cpu_local_storage.self);
 }
-#pragma GCC diagnostic pop
 
-#define this_cpu_id() (this_cpu_local()->id)
+#define this_cpu_id() this_cpu_read(cpu_local_storage.id)
 
 
+// Each CPU's offset is the address of its copy, see above
 extern uintptr_t __per_cpu_offset[CONFIG_MAX_CPUS];
 
 #define DEFINE_PER_CPU(type, name) \
@@ -51,7 +93,7 @@ extern uintptr_t __per_cpu_offset[CONFIG_MAX_CPUS];
 #define per_cpu_ptr(ptr, cpu) \
     (shift_percpu_ptr(ptr, per_cpu_offset(cpu)))
 
-#define this_cpu_ptr(ptr) per_cpu_ptr(ptr, this_cpu_id())
+#define this_cpu_ptr(ptr) shift_percpu_ptr(ptr, (uintptr_t)this_cpu_local())
 #define get_cpu_var(var) this_cpu_ptr(&var)
 
 
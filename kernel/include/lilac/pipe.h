@@ -17,6 +17,7 @@ struct pipe_buf {
     struct waitqueue read_wq;   // wait queue for readers
     struct waitqueue write_wq;  // wait queue for writers
     spinlock_t lock;            // lock to protect pipe structure
+    mutex_t mutex;              // serializes copies in and out of buffer
     unsigned int files;         // number of open file handles
     unsigned int n_readers;     // number of readers
     unsigned int n_writers;     // number of writers
@@ -0,0 +1,53 @@
+#ifndef _LILAC_POLL_H
+#define _LILAC_POLL_H
+
+#include <lilac/types.h>
+#include <lilac/wait.h>
+
+#define POLLIN      0x001
+#define POLLPRI     0x002
+#define POLLOUT     0x004
+#define POLLERR     0x008
+#define POLLHUP     0x010
+#define POLLNVAL    0x020
+#define POLLRDNORM  0x040
+#define POLLRDBAND  0x080
+#define POLLWRNORM  0x100
+#define POLLWRBAND  0x200
+
+// What a file without a poll operation reports, it never blocks
+#define DEFAULT_POLLMASK (POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM)
+
+#define FD_SETSIZE  1024
+
+struct pollfd {
+    int fd;
+    short events;
+    short revents;
+};
+
+struct file;
+struct poll_table;
+
+typedef void (*poll_queue_proc)(struct file *, struct waitqueue *,
+    struct poll_table *);
+
+/*
+ * Passed to a file's poll operation so it can say which queues a change in
+ * its readiness is announced on. A NULL table or qproc only asks for the
+ * current state.
+ */
+struct poll_table {
+    poll_queue_proc qproc;
+};
+
+static inline void poll_wait(struct file *file, struct waitqueue *wq,
+    struct poll_table *pt)
+{
+    if (pt && pt->qproc && wq)
+        pt->qproc(file, wq, pt);
+}
+
+unsigned int vfs_poll(struct file *file, struct poll_table *pt);
+
+#endif
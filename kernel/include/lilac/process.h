@@ -7,12 +7,15 @@
 #include <lilac/sync.h>
 #include <lib/rbtree.h>
 #include <lilac/signal.h>
+#include <lilac/wait.h>
 #include <lib/hashtable.h>
 #include <lilac/fdtable.h>
+#include <lilac/resource.h>
 
 struct regs_state;
 struct file;
 struct mm_info;
+struct exec_info;
 
 #define TASK_RUNNING 0
 #define TASK_SLEEPING 1
@@ -25,6 +28,8 @@ struct task_info {
     char **argv;
     char **envp;
     struct file *exec_file;
+    struct exec_info *exec_info;    /* image loaded before the task first ran */
+    u64 exec_start;                 /* ns, when execve or posix_spawn began */
 };
 
 struct fs_info {
@@ -38,6 +43,7 @@ struct sighandlers {
     spinlock_t lock;
     atomic_uint ref_count;
     struct ksigaction actions[_NSIG];
+    struct waitqueue signalfd_wq;   /* signalfds watching these tasks */
 };
 
 struct task_flags {
@@ -48,6 +54,7 @@ struct task_flags {
     u8 signaled     :1;
     u8 interrupted  :1;
     u8 state_change :1;
+    u8 continued    :1;
 };
 
 struct task {
@@ -74,6 +81,8 @@ struct task {
     u8 policy;
     u8 cpu;
     bool on_rq;
+    bool fpu_used;  // fp_regs holds state, else the first FPU insn traps
+    int fpu_cpu;    // CPU that last loaded fp_regs, -1 if none
     u64 runtime;
     u64 vruntime;
     // u64 timeslice;
@@ -99,12 +108,17 @@ struct task {
     struct waitqueue *vfork_done;
 
     int exit_status;
-    bool parent_wait;
-    bool waiting_any;
+    struct waitqueue wait_chldexit; // woken on child state changes
+    struct list_head zombies;       // exited children, under wait_chldexit.lock
+    struct list_head zombie_node;   // on parent->zombies
+    unsigned int wait_seq;          // bumped on every child state change
+    u64 child_runtime;              // runtime of reaped children, in ns
 
     struct fs_info *fs;
     struct fdtable *files;
 
+    struct rlimit rlim[RLIM_NLIMITS];
+
     struct sighandlers *sighand;
     sigset_t pending;
     sigset_t blocked;
@@ -118,8 +132,11 @@ struct task {
 };
 
 struct task *init_process(void);
+void get_sighandlers(struct sighandlers *sh);
+void put_sighandlers(struct sighandlers *sh);
 int get_pid(void);
 void reap_task(struct task *p);
+void cleanup_task_info(struct task_info *info);
 __noreturn void do_exit(void);
 struct task * get_task_by_pid(int pid);
 struct task * get_pgrp_leader(int pgid);
@@ -128,6 +145,7 @@ struct task * get_any_pgrp_member(pid_t pgid);
 // Architecture-specific functions
 void             arch_pre_context_switch(struct task *prev, struct task *next);
 void             arch_post_context_switch(struct task *p);
+void             arch_switch_mm(struct task *next);
 struct mm_info * arch_process_mmap(bool is_64_bit);
 struct mm_info * arch_copy_mmap(struct mm_info *parent);
 void             arch_unmap_all_user_vm(struct mm_info *info);
@@ -136,9 +154,10 @@ void *           arch_user_stack(void);
 void *           arch_get_user_sp(void);
 void             arch_set_user_sp(struct task *p, void *sp);
 void *           arch_copy_regs(struct regs_state *src);
-void             save_fp_regs(struct task *p);
-void             restore_fp_regs(struct task *p);
+void             fpu_switch(struct task *prev);
+void             load_fp_regs(void);
 void             copy_fp_regs(struct task *dst, struct task *src);
+void             reset_fp_regs(struct task *p);
 void             arch_prepare_signal(void *pc, int signo);
 long             arch_restore_post_signal(void);
 
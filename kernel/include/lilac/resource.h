@@ -0,0 +1,75 @@
+#ifndef _LILAC_RESOURCE_H
+#define _LILAC_RESOURCE_H
+
+#include <lilac/types.h>
+#include <lilac/time.h>
+
+#define RLIMIT_CPU          0
+#define RLIMIT_FSIZE        1
+#define RLIMIT_DATA         2
+#define RLIMIT_STACK        3
+#define RLIMIT_CORE         4
+#define RLIMIT_RSS          5
+#define RLIMIT_NPROC        6
+#define RLIMIT_NOFILE       7
+#define RLIMIT_MEMLOCK      8
+#define RLIMIT_AS           9
+#define RLIMIT_LOCKS        10
+#define RLIMIT_SIGPENDING   11
+#define RLIMIT_MSGQUEUE     12
+#define RLIMIT_NICE         13
+#define RLIMIT_RTPRIO       14
+#define RLIMIT_RTTIME       15
+#define RLIM_NLIMITS        16
+
+#define RLIM_INFINITY       (~0UL)
+
+/* Open files a new process may have, and the most any process may ask for */
+#define INR_OPEN_CUR        1024
+#define INR_OPEN_MAX        4096
+#define NR_OPEN_LIMIT       (1024 * 1024)
+
+struct rlimit {
+    unsigned long rlim_cur;
+    unsigned long rlim_max;
+};
+
+struct rlimit64 {
+    u64 rlim_cur;
+    u64 rlim_max;
+};
+
+#define RUSAGE_SELF         0
+#define RUSAGE_CHILDREN     (-1)
+
+/*
+ * Only CPU time is accounted. The scheduler doesn't tell user and kernel
+ * time apart, so all of it shows up as ru_utime.
+ */
+struct rusage {
+    struct timeval ru_utime;
+    struct timeval ru_stime;
+    long ru_maxrss;
+    long ru_ixrss;
+    long ru_idrss;
+    long ru_isrss;
+    long ru_minflt;
+    long ru_majflt;
+    long ru_nswap;
+    long ru_inblock;
+    long ru_oublock;
+    long ru_msgsnd;
+    long ru_msgrcv;
+    long ru_nsignals;
+    long ru_nvcsw;
+    long ru_nivcsw;
+};
+
+struct task;
+
+void rlimit_init(struct rlimit *rlim);
+unsigned long task_rlimit(struct task *p, unsigned int limit);
+unsigned long rlimit(unsigned int limit);
+void fill_rusage(struct rusage *ru, u64 runtime);
+
+#endif
@@ -4,6 +4,7 @@
 #define _KERNEL_SCHED_H
 
 #include <lilac/process.h>
+#include <lilac/percpu.h>
 
 void sched_init(void);
 void sched_ap_rq_init(int cpu);
@@ -12,9 +13,13 @@ void schedule(void);
 void sched_tick(void);
 void yield(void);
 void schedule_task(struct task *new_task);
-struct task * get_current_task(void);
 struct task * find_child_by_pid(struct task *parent, int pid);
 
+static inline struct task * get_current_task(void)
+{
+    return this_cpu_read(cpu_local_storage.curr);
+}
+
 #define current get_current_task()
 
 void idle(void);
@@ -0,0 +1,38 @@
+#ifndef _LILAC_SPAWN_H
+#define _LILAC_SPAWN_H
+
+#include <lilac/types.h>
+#include <lilac/signal.h>
+
+/* spawn_attr flags, the same bits as posix_spawnattr_setflags */
+#define POSIX_SPAWN_RESETIDS    0x01    /* accepted, there are no ids to reset */
+#define POSIX_SPAWN_SETPGROUP   0x02
+#define POSIX_SPAWN_SETSIGDEF   0x04
+#define POSIX_SPAWN_SETSIGMASK  0x08
+#define POSIX_SPAWN_SETSID      0x80
+
+/* spawn_file_action commands */
+#define SPAWN_FA_CLOSE  1
+#define SPAWN_FA_DUP2   2
+#define SPAWN_FA_OPEN   3
+
+#define SPAWN_MAX_ACTIONS   64
+
+/* Applied in order to the child's copy of the caller's descriptors */
+struct spawn_file_action {
+    int cmd;
+    int fd;             /* descriptor the action leaves set up in the child */
+    int srcfd;          /* SPAWN_FA_DUP2 */
+    int oflag;          /* SPAWN_FA_OPEN */
+    mode_t mode;        /* SPAWN_FA_OPEN */
+    const char *path;   /* SPAWN_FA_OPEN */
+};
+
+struct spawn_attr {
+    unsigned int flags;
+    pid_t pgroup;           /* POSIX_SPAWN_SETPGROUP, 0 for a new group */
+    sigset_t sigmask;       /* POSIX_SPAWN_SETSIGMASK */
+    sigset_t sigdefault;    /* POSIX_SPAWN_SETSIGDEF */
+};
+
+#endif
@@ -6,8 +6,12 @@
 #include <lilac/math.h>
 #include <lilac/time.h>
 
-#define CLOCK_REALTIME  0
-#define CLOCK_MONOTONIC 1
+#define CLOCK_REALTIME          0
+#define CLOCK_MONOTONIC         1
+#define CLOCK_MONOTONIC_RAW     4
+#define CLOCK_REALTIME_COARSE   5
+#define CLOCK_MONOTONIC_COARSE  6
+#define CLOCK_BOOTTIME          7
 
 struct timestamp {
     u16 year;
@@ -27,6 +31,7 @@ struct clock_source {
         u32 shift;
     } scale;
     u64 start_tick;
+    u32 vclock_mode;    // how the vDSO reads it, 0 if it can't
 };
 
 extern struct clock_source *__system_clock;
@@ -49,6 +54,7 @@ extern time_t boot_unix_time;
 extern void (*handle_tick)(unsigned long ms);
 
 void set_clock_source(struct clock_source *clock);
+void clock_sync_vdso(void);
 
 static inline u64 read_ticks(void)
 {
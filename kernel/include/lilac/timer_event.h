@@ -4,8 +4,11 @@
 #include <lilac/types.h>
 #include <lib/rbtree.h>
 
+struct timer_ev_base;
+
 struct timer_event {
     struct rb_node node;
+    struct timer_ev_base *base; /* CPU it was last queued on */
     ktime_t expires;
     struct task *p;
     void (*callback)(struct timer_event *);
@@ -0,0 +1,11 @@
+#ifndef _LILAC_TIMERFD_H
+#define _LILAC_TIMERFD_H
+
+#include <lilac/fcntl.h>
+
+#define TFD_TIMER_ABSTIME   1
+
+#define TFD_CLOEXEC         O_CLOEXEC
+#define TFD_NONBLOCK        O_NONBLOCK
+
+#endif
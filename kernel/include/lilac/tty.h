@@ -105,6 +105,7 @@
 #define L_EXTPROC(tty)	_L_FLAG((tty), EXTPROC)
 
 struct file;
+struct iov_iter;
 struct console;
 struct device;
 struct tty;
@@ -127,8 +128,8 @@ struct tty_operations {
 };
 
 struct tty_ldisc_ops {
-    ssize_t (*read)(struct tty *tty, struct file *file, u8 *buf, size_t nr, unsigned long offset);
-    ssize_t (*write)(struct tty *tty, struct file *file, const u8 *buf, size_t nr);
+    ssize_t (*read)(struct tty *tty, struct file *file, struct iov_iter *to);
+    ssize_t (*write)(struct tty *tty, struct file *file, struct iov_iter *from);
     void (*set_termios)(struct tty *tty, const struct termios *old);
     void (*receive_buf)(struct tty *tty, const u8 *cp, const u8 *fp, size_t count);
 };
@@ -0,0 +1,76 @@
+#ifndef _LILAC_UIO_H
+#define _LILAC_UIO_H
+
+#include <lilac/types.h>
+#include <lilac/config.h>
+
+struct iovec {
+    void __user *iov_base;  /* Pointer to data.  */
+    size_t iov_len;         /* Length of data.  */
+};
+
+struct kvec {
+    void *iov_base;
+    size_t iov_len;
+};
+
+#define UIO_FASTIOV     8
+#define UIO_MAXIOV      1024
+
+/* Largest single transfer, keeps byte counts positive in an int */
+#define MAX_RW_COUNT    0x7ffff000UL
+
+/* Direction of an iov_iter: data is copied into a destination, out of a source */
+#define ITER_DEST       0
+#define ITER_SOURCE     1
+
+enum iter_type {
+    ITER_IOVEC,     /* user memory */
+    ITER_KVEC,      /* kernel memory */
+};
+
+/*
+ * A cursor over a list of memory segments, so file operations can copy
+ * straight to and from the caller's buffers in whatever chunks suit them.
+ */
+struct iov_iter {
+    u8 iter_type;
+    bool data_source;           /* ITER_SOURCE */
+    size_t iov_offset;          /* offset into the current segment */
+    size_t count;               /* bytes left */
+    union {
+        const struct iovec *iov;
+        const struct kvec *kvec;
+    };
+    unsigned long nr_segs;
+};
+
+static inline size_t iov_iter_count(const struct iov_iter *i)
+{
+    return i->count;
+}
+
+static inline bool iter_is_user(const struct iov_iter *i)
+{
+    return i->iter_type == ITER_IOVEC;
+}
+
+void iov_iter_init(struct iov_iter *i, int direction, const struct iovec *iov,
+    unsigned long nr_segs, size_t count);
+void iov_iter_kvec(struct iov_iter *i, int direction, const struct kvec *kvec,
+    unsigned long nr_segs, size_t count);
+size_t iov_iter_segment(struct iov_iter *i, void **base);
+void iov_iter_advance(struct iov_iter *i, size_t bytes);
+void iov_iter_truncate(struct iov_iter *i, size_t count);
+
+size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i);
+size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i);
+size_t iov_iter_zero(size_t bytes, struct iov_iter *i);
+
+ssize_t import_iovec(int direction, const struct iovec __user *uvec,
+    unsigned int nr_segs, unsigned int fast_segs, struct iovec **iovp,
+    struct iov_iter *i);
+int import_single_range(int direction, void __user *buf, size_t len,
+    struct iovec *iov, struct iov_iter *i);
+
+#endif
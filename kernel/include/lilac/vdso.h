@@ -0,0 +1,21 @@
+#ifndef _LILAC_VDSO_H
+#define _LILAC_VDSO_H
+
+#include <lilac/types.h>
+
+struct mm_info;
+struct clock_source;
+
+#ifdef __x86_64__
+void vdso_init(void);
+void vdso_cpu_init(int cpu);
+uintptr_t vdso_map(struct mm_info *mm);
+void vdso_update_clock(struct clock_source *cs, ktime_t base_ns);
+#else
+static inline void vdso_init(void) {}
+static inline void vdso_cpu_init(int cpu) {}
+static inline uintptr_t vdso_map(struct mm_info *mm) { return 0; }
+static inline void vdso_update_clock(struct clock_source *cs, ktime_t base_ns) {}
+#endif
+
+#endif
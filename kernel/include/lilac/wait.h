@@ -5,21 +5,31 @@
 #include <lilac/sync.h>
 #include <lib/list.h>
 
-#define WNOHANG 1
-#define WUNTRACED 2
+#define WNOHANG     0x00000001
+#define WUNTRACED   0x00000002
+#define WSTOPPED    WUNTRACED
+#define WEXITED     0x00000004
+#define WCONTINUED  0x00000008
+#define WNOWAIT     0x01000000  /* leave the child waitable */
 
 #define WAIT_ANY -1
 #define WAIT_PGRP 0
 
+/* waitid idtype */
+#define P_ALL   0
+#define P_PID   1
+#define P_PGID  2
+
 #define SEXITED     0x00
 #define SSIGNALED   0x01
 #define SSTOPPED    0x7f
 #define SCORE       0x80
 
-#define WEXITED(exitval) (exitval << 8)
+#define W_EXITCODE(exitval) (exitval << 8)
 #define WSIGNALED(sig) (sig & 0x7f)
-#define WSTOPPED(sig) (SSTOPPED | ((sig & 0x7f) << 8))
+#define W_STOPCODE(sig) (SSTOPPED | ((sig & 0x7f) << 8))
 #define WCOREDUMP(sig) ((sig & 0x7f) | SCORE)
+#define W_CONTINUED 0xffff
 
 
 struct waitqueue {
@@ -32,7 +42,14 @@ struct waitqueue {
     .task_list = LIST_HEAD_INIT(name.task_list) \
 }
 
-typedef int (*wq_wake_func_t)();
+struct wq_entry;
+
+/*
+ * An entry with a wakeup function isn't a sleeping task. It stays queued
+ * until its owner takes it off and the function is called on every wakeup,
+ * which is how poll and epoll watch several queues at once.
+ */
+typedef int (*wq_wake_func_t)(struct wq_entry *);
 
 struct wq_entry {
     struct task *task;
@@ -48,10 +65,39 @@ struct wq_entry {
 
 #define WQ_ENTRY_EMPTY(name) (list_empty(&name.entry))
 
+void add_wait_queue(struct waitqueue *wq, struct wq_entry *wait);
+void remove_wait_queue(struct waitqueue *wq, struct wq_entry *wait);
+
+int prepare_to_wait(struct waitqueue *wq, struct wq_entry *wait);
+void finish_wait(struct waitqueue *wq, struct wq_entry *wait);
+
+/*
+ * Sleep on wq until cond holds, or return -EINTR if a signal comes first.
+ * cond is checked after queueing, so a wakeup that races with the check
+ * isn't lost. Callers need lilac/sched.h.
+ */
+#define wait_event_interruptible(wq, cond) ({ \
+    struct wq_entry __wait = WQ_ENTRY_INIT(__wait, NULL, NULL); \
+    int __ret; \
+    for (;;) { \
+        __ret = prepare_to_wait(&(wq), &__wait); \
+        if (cond) { \
+            __ret = 0; \
+            break; \
+        } \
+        if (__ret) \
+            break; \
+        schedule(); \
+    } \
+    finish_wait(&(wq), &__wait); \
+    __ret; \
+})
+
 int sleep_on(struct waitqueue *wq);
 struct task * wake_first(struct waitqueue *wq);
 void wake_all(struct waitqueue *wq);
 
 void notify_parent(struct task *parent, struct task *child);
+void notify_parent_state(struct task *child);
 
 #endif // LILAC_WAIT_H
@@ -0,0 +1,63 @@
+#ifndef _MM_FILEMAP_H
+#define _MM_FILEMAP_H
+
+#include <lilac/types.h>
+#include <lib/rbtree.h>
+
+struct file;
+struct inode;
+struct iov_iter;
+struct page;
+
+struct address_space_operations {
+    // Fill nr_pages contiguous pages at buf with file data from page index
+    int (*readpages)(struct inode *inode, unsigned long index, void *buf,
+        unsigned int nr_pages);
+    // Page to map at index for MAP_SHARED, returned with a reference held
+    struct page *(*fault_page)(struct inode *inode, unsigned long index);
+    // Write a page dirtied through a shared mapping back to the file
+    int (*writepage)(struct file *file, struct page *page, unsigned long index);
+};
+
+/*
+ * Cached pages of one inode, keyed by page index. They are clean copies of
+ * the file, except where a shared mapping wrote to one and it hasn't been
+ * written back yet.
+ */
+struct address_space {
+    struct rb_root pages;
+    unsigned long nrpages;
+    const struct address_space_operations *a_ops;
+    int i_mmap_writable;    /* shared writable mappings, -1 once denied */
+};
+
+#define RA_MIN_PAGES        4
+#define RA_DEFAULT_PAGES    32      /* 128 KiB */
+#define RA_MAX_PAGES        64
+
+/* Per open file readahead state */
+struct file_ra_state {
+    unsigned long start;        /* first page of the current window */
+    unsigned int size;          /* pages in the current window */
+    unsigned int async_size;    /* read the next window with this many left */
+    unsigned int ra_pages;      /* largest window, 0 disables readahead */
+    unsigned long prev_index;   /* last page the reader touched */
+};
+
+void file_ra_state_init(struct file_ra_state *ra);
+ssize_t filemap_read(struct file *file, struct iov_iter *to, off_t *ppos);
+int force_page_cache_readahead(struct file *file, unsigned long index,
+    unsigned long nr_pages);
+void filemap_write_update(struct address_space *mapping, off_t pos,
+    const void *buf, size_t len);
+void invalidate_unmapped_pages(struct address_space *mapping,
+    unsigned long start, unsigned long end);
+void truncate_inode_pages(struct address_space *mapping);
+struct page *filemap_get_page(struct inode *inode, unsigned long index);
+int filemap_writepage(struct file *file, struct page *page,
+    unsigned long index);
+int mapping_map_writable(struct address_space *mapping);
+void mapping_unmap_writable(struct address_space *mapping);
+int mapping_deny_writable(struct address_space *mapping);
+
+#endif
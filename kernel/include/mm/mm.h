@@ -4,8 +4,10 @@
 #include <lilac/types.h>
 #include <lilac/rwsem.h>
 #include <lilac/mman-bits.h>
+#include <mm/tlb.h>
 
-struct tlb_inval;
+struct page;
+struct file;
 
 struct mm_info {
     struct vm_desc *mmap;
@@ -23,6 +25,8 @@ struct mm_info {
     uintptr_t arg_start, arg_end;
     uintptr_t env_start, env_end;
     size_t total_vm;
+    atomic_ulong tlb_gen;   /* bumped whenever its user mappings are flushed */
+    struct mm_tlb_ctx tlb_ctx[CONFIG_MAX_CPUS];
 };
 
 struct mm_info * alloc_mm_info(void);
@@ -41,6 +45,8 @@ struct mm_info * alloc_mm_info(void);
 #define VM_SHARED       0x0008
 #define VM_IO           0x0010
 #define VM_PFNMAP       0x0020
+#define VM_SEQ_READ     0x0040  /* madvise(MADV_SEQUENTIAL) */
+#define VM_RAND_READ    0x0080  /* madvise(MADV_RANDOM) */
 
 #define VM_PROT_MASK    (VM_READ | VM_WRITE | VM_EXEC)
 
@@ -67,6 +73,18 @@ struct vm_desc {
 struct vm_desc * find_vma(struct mm_info *mm, uintptr_t addr);
 
 void vma_list_insert(struct vm_desc *vma, struct vm_desc **list);
+void vma_get_file(struct vm_desc *vma);
+void vma_free(struct vm_desc *vma);
+int vma_writeback(struct vm_desc *vma, uintptr_t start, uintptr_t end);
+
+// Page index in vm_file of the page mapped at addr
+static inline unsigned long vma_file_index(struct vm_desc *vma, uintptr_t addr)
+{
+    return (vma->seg_offset + (addr - vma->seg_vaddr)) >> PAGE_SHIFT;
+}
+
+int mm_map_file(struct mm_info *mm, uintptr_t start, size_t length,
+    int vm_flags, struct file *file, unsigned long offset);
 
 void * sbrk(intptr_t increment);
 
@@ -86,9 +104,13 @@ enum fault_return {
 };
 
 int mm_fault(struct vm_desc *vma, uintptr_t addr, unsigned long flags);
+int mm_populate(struct vm_desc *vma, uintptr_t start, uintptr_t end);
 
 void drop_user_page_range(uintptr_t start, size_t size);
 void update_user_page_range(uintptr_t start, size_t size, int flags);
+struct page * clear_user_page_dirty(uintptr_t vaddr);
+bool user_page_mapped(uintptr_t vaddr);
+void move_user_page_range(uintptr_t old, uintptr_t new, size_t size);
 
 #ifdef DEBUG_MM
 extern unsigned long mm_dbg_fault_file_pages_alloc;
@@ -36,6 +36,7 @@ unsigned long ___phys_addr(unsigned long x)
 
 #define ALLOC_NORMAL    0x0
 #define ALLOC_DMA       0x1
+#define ALLOC_MAYFAIL   0x2     /* return NULL instead of panicking */
 
 
 struct page {
@@ -48,10 +49,22 @@ struct page {
 extern struct page *phys_frames;
 extern u8 *const phys_mem_mapping;
 
+/*
+ * A cache that can give memory back. When the frame allocator runs dry it
+ * asks each one to free up to nr_to_scan objects before giving up.
+ */
+struct shrinker {
+    unsigned long (*scan)(unsigned long nr_to_scan);
+    struct list_head list;
+};
+
+void register_shrinker(struct shrinker *s);
+
 void pmem_init(void);
 void * arch_map_frame_bitmap(size_t size);
 
 void *alloc_frames(u32 num_pages);
+void *try_alloc_frames(u32 num_pages);
 void free_frames(void *frame, u32 num_pages);
 
 static inline void *alloc_frame(void)
@@ -76,6 +89,12 @@ void free_pages(void *addr, u32 pgcnt);
 void * get_free_pages(u32 pgcnt, u32 flags);
 void * get_zeroed_pages(u32 pgcnt, u32 flags);
 
+/* The arch picks how these and memcpy/memset run for the CPU at boot */
+void clear_page(void *page);
+void clear_pages(void *addr, u32 pgcnt);
+void copy_page(void *dst, const void *src);
+void mem_bench(void);
+
 static inline
 struct page * alloc_page(u32 flags)
 {
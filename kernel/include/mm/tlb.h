@@ -11,6 +11,29 @@ struct tlb_inval {
     bool full;
 };
 
+/*
+ * An mm's tag in one CPU's TLB, from the generation of tags it was handed
+ * out in, and the mm's tlb_gen that CPU's entries are known to be current
+ * with. Zeroed, it matches no generation.
+ */
+struct mm_tlb_ctx {
+    u32 asid_gen;
+    u16 asid;
+    u64 tlb_gen;
+};
+
+struct tlb_stats {
+    unsigned long switches;         /* address space switches */
+    unsigned long switches_warm;    /* ... that kept the mm's TLB entries */
+    unsigned long rollovers;        /* a CPU ran out of tags */
+    unsigned long kernel_flushes;   /* all tags dropped for a kernel unmap */
+};
+
 int arch_tlb_flush_mmu(struct tlb_inval *tlb);
+void tlb_mm_changed(struct mm_info *mm);
+void tlb_kernel_changed(void);
+void tlb_cpu_init(void);
+void tlb_get_stats(struct tlb_stats *stats);
+void print_tlb_stats(void);
 
 #endif
@@ -23,10 +23,13 @@ int add_device(const char *path, const struct file_operations *fops,
         return PTR_ERR(dentry);
 
     struct inode *inode = dentry->d_inode;
-    if (!inode)
+    if (!inode) {
+        dput(dentry);
         return -ENOENT;
+    }
     inode->i_fop = fops;
     inode->i_op = iops;
+    dput(dentry);
 
     return 0;
 }
@@ -45,11 +48,14 @@ int dev_create(const char *path, const struct file_operations *fops,
         return PTR_ERR(dentry);
 
     struct inode *inode = dentry->d_inode;
-    if (!inode)
+    if (!inode) {
+        dput(dentry);
         return -ENOENT;
+    }
     inode->i_fop = fops;
     inode->i_op = iops;
     inode->i_mode = mode;
+    dput(dentry);
 
     return 0;
 }
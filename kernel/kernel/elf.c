@@ -2,9 +2,11 @@
 // GPL-3.0-or-later (see LICENSE.txt)
 #include <lilac/elf.h>
 
+#include <lilac/exec_cache.h>
 #include <lilac/lilac.h>
 #include <lilac/libc.h>
 #include <lilac/process.h>
+#include <lilac/sched.h>
 #include <lilac/fs.h>
 #include <mm/mm.h>
 #include <mm/kmm.h>
@@ -110,6 +112,7 @@ static int elf32_load(struct elf_header *hdr, struct mm_info *mm, struct file *e
         desc->start = vma_start;
         desc->end = vma_end;
         desc->vm_file = elff;
+        fget(elff);
         desc->vm_pgoff = PAGE_ROUND_DOWN(phdr[i].p_offset) / PAGE_SIZE;
         desc->seg_vaddr = seg_vaddr;
         desc->seg_offset = phdr[i].p_offset;
@@ -136,100 +139,25 @@ static int elf32_load(struct elf_header *hdr, struct mm_info *mm, struct file *e
 #define INTERP_BASE 0x7f0000000000ULL
 
 /*
- * Open and map the ELF interpreter (an ET_DYN shared object) at INTERP_BASE.
- * Returns the interpreter entry point (INTERP_BASE + e_entry), or 0 on error.
+ * Read the program headers of a 64-bit ELF into a new exec_image, keeping
+ * the PT_LOAD segments, the PT_INTERP path and what the auxv needs.
  */
-static uintptr_t load_interp(const char *path, struct mm_info *mm)
+static struct exec_image * elf64_parse(struct elf_header *hdr, struct file *elff)
 {
-    struct file *f = vfs_open(path, 0, 0);
-    if (IS_ERR_OR_NULL(f)) {
-        klog(LOG_ERROR, "load_interp: cannot open %s\n", path);
-        return 0;
-    }
-
-    struct elf_header hdr;
-    if (vfs_read_at(f, &hdr, sizeof hdr, 0) != sizeof hdr) {
-        klog(LOG_ERROR, "load_interp: short read on %s\n", path);
-        vfs_close(f);
-        return 0;
-    }
-
-    if (hdr.sig != ELF_MAGIC || hdr.class != 2 || hdr.elf64.mach != X86_64) {
-        klog(LOG_ERROR, "load_interp: bad ELF in %s\n", path);
-        vfs_close(f);
-        return 0;
-    }
-
-    int n = hdr.elf64.p_tbl_num_ents;
-    struct elf64_pheader *phdr = kmalloc(hdr.elf64.p_entry_sz * n);
-    if (!phdr) {
-        vfs_close(f);
-        return 0;
-    }
-
-    if (vfs_read_at(f, phdr, hdr.elf64.p_entry_sz * n, hdr.elf64.p_tbl_off) <= 0) {
-        klog(LOG_ERROR, "load_interp: failed to read phdrs from %s\n", path);
-        kfree(phdr);
-        vfs_close(f);
-        return 0;
-    }
-
-    for (int i = 0; i < n; i++) {
-        if (phdr[i].type != LOAD_SEG || phdr[i].p_memsz == 0)
-            continue;
-
-        struct vm_desc *desc = kzmalloc(sizeof *desc);
-        if (!desc) {
-            kfree(phdr);
-            vfs_close(f);
-            return 0;
-        }
-
-        // Interpreter is ET_DYN: p_vaddr values are relative to INTERP_BASE.
-        uintptr_t seg_vaddr = INTERP_BASE + phdr[i].p_vaddr;
-        uintptr_t vma_start = PAGE_ROUND_DOWN(seg_vaddr);
-        uintptr_t vma_end = PAGE_ROUND_UP(seg_vaddr + phdr[i].p_memsz);
+    struct exec_image *img;
+    unsigned int nr_segs = 0;
+    int err;
 
-        if (phdr[i].flags & READ)
-            desc->vm_flags |= VM_READ;
-        if (phdr[i].flags & WRIT)
-            desc->vm_flags |= VM_WRITE;
-        if (phdr[i].flags & EXEC)
-            desc->vm_flags |= VM_EXEC;
-
-        desc->mm = mm;
-        desc->start = vma_start;
-        desc->end = vma_end;
-        desc->vm_file = f;
-        desc->vm_pgoff = PAGE_ROUND_DOWN(phdr[i].p_offset) / PAGE_SIZE;
-        desc->seg_vaddr = seg_vaddr;
-        desc->seg_offset = phdr[i].p_offset;
-        desc->vm_fsize = phdr[i].p_filesz;
-
-        vma_list_insert(desc, &mm->mmap);
-    }
-
-    kfree(phdr);
-
-    uintptr_t entry = INTERP_BASE + hdr.elf64.entry;
-    klog(LOG_DEBUG, "load_interp: %s loaded at base %lx, entry %lx\n",
-        path, (unsigned long)INTERP_BASE, (unsigned long)entry);
-    return entry;
-}
-
-static int elf64_load(struct elf_header *hdr, struct mm_info *mm, struct file *elff,
-                      struct exec_info *info)
-{
     if (hdr->elf64.mach != X86_64) {
         klog(LOG_ERROR, "Invalid machine type\n");
-        return -EINVAL;
+        return ERR_PTR(-EINVAL);
     }
 
     int n = hdr->elf64.p_tbl_num_ents;
     struct elf64_pheader *phdr = kmalloc(hdr->elf64.p_entry_sz * n);
     if (!phdr) {
         klog(LOG_ERROR, "Failed to allocate memory for program header table\n");
-        return -ENOMEM;
+        return ERR_PTR(-ENOMEM);
     }
 
     if (vfs_read_at(elff, (void*)phdr,
@@ -237,7 +165,7 @@ static int elf64_load(struct elf_header *hdr, struct mm_info *mm, struct file *e
             hdr->elf64.p_tbl_off) <= 0) {
         kfree(phdr);
         klog(LOG_ERROR, "Failed to read program header table\n");
-        return -EIO;
+        return ERR_PTR(-EIO);
     }
 
 #ifdef DEBUG_ELF
@@ -254,11 +182,21 @@ static int elf64_load(struct elf_header *hdr, struct mm_info *mm, struct file *e
     }
 #endif
 
+    for (int i = 0; i < n; i++) {
+        if (phdr[i].type == LOAD_SEG && phdr[i].p_memsz)
+            nr_segs++;
+    }
+    img = exec_image_alloc(nr_segs);
+    if (!img) {
+        klog(LOG_ERROR, "Out of memory loading ELF\n");
+        kfree(phdr);
+        return ERR_PTR(-ENOMEM);
+    }
+
     /*
      * First pass: PT_PHDR (for AT_PHDR), PT_INTERP path, and
      * the first PT_LOAD (for AT_PHDR fallback computation)
      */
-    char *interp_path = NULL;
     void *at_phdr = NULL;
     bool have_phdr_seg = false;
     u64 first_load_vaddr = 0, first_load_offset = (u64)-1;
@@ -271,26 +209,25 @@ static int elf64_load(struct elf_header *hdr, struct mm_info *mm, struct file *e
             break;
         case INTERP_SEG:
             if (phdr[i].p_filesz == 0 ||
-                phdr[i].p_filesz >= PATH_MAX) {
+                phdr[i].p_filesz >= PATH_MAX || img->interp) {
                 klog(LOG_ERROR, "PT_INTERP: bad path length %llu\n",
                      (unsigned long long)phdr[i].p_filesz);
-                kfree(phdr);
-                return -EINVAL;
+                err = -EINVAL;
+                goto error;
             }
-            interp_path = kmalloc(PATH_MAX);
-            if (!interp_path) {
+            img->interp = kmalloc(phdr[i].p_filesz + 1);
+            if (!img->interp) {
                 klog(LOG_ERROR, "Failed to allocate memory for PT_INTERP path\n");
-                kfree(phdr);
-                return -ENOMEM;
+                err = -ENOMEM;
+                goto error;
             }
-            if (vfs_read_at(elff, interp_path,
+            if (vfs_read_at(elff, img->interp,
                     phdr[i].p_filesz, phdr[i].p_offset) <= 0) {
-                kfree(phdr);
-                kfree(interp_path);
                 klog(LOG_ERROR, "Failed to read PT_INTERP path\n");
-                return -EIO;
+                err = -EIO;
+                goto error;
             }
-            interp_path[phdr[i].p_filesz] = '\0';
+            img->interp[phdr[i].p_filesz] = '\0';
             break;
         case LOAD_SEG:
             if (phdr[i].p_offset < first_load_offset) {
@@ -312,84 +249,180 @@ static int elf64_load(struct elf_header *hdr, struct mm_info *mm, struct file *e
         at_phdr = (void *)(uintptr_t)(first_load_vaddr - first_load_offset
                                       + hdr->elf64.p_tbl_off);
 
-    // Second pass: create VMAs for PT_LOAD segments
+    // Second pass: the PT_LOAD segments to map
     for (int i = 0; i < n; i++) {
-        if (phdr[i].type != LOAD_SEG)
+        if (phdr[i].type != LOAD_SEG || phdr[i].p_memsz == 0)
             continue;
         if (phdr[i].align > PAGE_SIZE)
             kerror("Alignment greater than page size\n");
 
+        struct exec_seg *seg = &img->segs[img->nr_segs++];
+        seg->vaddr = phdr[i].p_vaddr;
+        seg->memsz = phdr[i].p_memsz;
+        seg->offset = phdr[i].p_offset;
+        seg->filesz = phdr[i].p_filesz;
+        if (phdr[i].flags & READ)
+            seg->vm_flags |= VM_READ;
+        if (phdr[i].flags & WRIT)
+            seg->vm_flags |= VM_WRITE;
+        if (phdr[i].flags & EXEC)
+            seg->vm_flags |= VM_EXEC;
+
+        if ((seg->vm_flags & VM_WRITE) && (seg->vm_flags & VM_EXEC))
+            klog(LOG_WARN, "Segment is both writable and executable\n");
+    }
+
+    kfree(phdr);
+
+    img->info.app_entry = (void *)hdr->elf64.entry;
+    img->info.entry = img->info.app_entry;
+    img->info.at_phdr = at_phdr;
+    img->info.phnum = (u16)hdr->elf64.p_tbl_num_ents;
+    img->info.phentsize = (u16)hdr->elf64.p_entry_sz;
+    img->info.interp_base = 0;
+    return img;
+
+error:
+    kfree(phdr);
+    exec_image_put(img);
+    return ERR_PTR(err);
+}
+
+/*
+ * The parsed image of a 64-bit ELF, from the exec cache unless the file
+ * changed since it was last execed. -ENOEXEC if it isn't one.
+ */
+static struct exec_image * elf64_get_image(struct file *f)
+{
+    struct inode *inode = f->f_dentry->d_inode;
+    struct exec_image *img;
+    struct elf_header hdr;
+    unsigned int gen;
+
+    if ((img = exec_cache_lookup(inode, &gen)))
+        return img;
+
+    if (vfs_read_at(f, &hdr, sizeof hdr, 0) != sizeof hdr)
+        return ERR_PTR(-EIO);
+    if (hdr.sig != ELF_MAGIC || hdr.class != 2)
+        return ERR_PTR(-ENOEXEC);
+
+    img = elf64_parse(&hdr, f);
+    if (!IS_ERR(img))
+        exec_cache_insert(inode, img, gen);
+    return img;
+}
+
+/*
+ * Add a VMA for each of img's segments, moved up by bias. When mm is the
+ * running one, the pinned start of each read-only segment is faulted in
+ * now, in one pass per segment instead of a fault per page.
+ */
+static int elf64_map(struct exec_image *img, struct file *elff,
+    struct mm_info *mm, uintptr_t bias)
+{
+    bool prefault = mm == current->mm;
+
+    for (unsigned int i = 0; i < img->nr_segs; i++) {
+        struct exec_seg *seg = &img->segs[i];
         struct vm_desc *desc = kzmalloc(sizeof *desc);
         if (!desc) {
             klog(LOG_ERROR, "Out of memory loading ELF\n");
-            if (interp_path)
-                kfree(interp_path);
-            kfree(phdr);
             return -ENOMEM;
         }
 
-        uintptr_t seg_vaddr = phdr[i].p_vaddr;  // exact segment VA
-        uintptr_t vma_start = PAGE_ROUND_DOWN(seg_vaddr);
-        uintptr_t vma_end = PAGE_ROUND_UP(seg_vaddr + phdr[i].p_memsz);
-
-        if (phdr[i].flags & READ)
-            desc->vm_flags |= VM_READ;
-        if (phdr[i].flags & WRIT)
-            desc->vm_flags |= VM_WRITE;
-        if (phdr[i].flags & EXEC)
-            desc->vm_flags |= VM_EXEC;
+        uintptr_t seg_vaddr = bias + seg->vaddr;  // exact segment VA
 
         desc->mm = mm;
-        desc->start = vma_start;
-        desc->end = vma_end;
+        desc->start = PAGE_ROUND_DOWN(seg_vaddr);
+        desc->end = PAGE_ROUND_UP(seg_vaddr + seg->memsz);
+        desc->vm_flags = seg->vm_flags;
         desc->vm_file = elff;
-        desc->vm_pgoff = PAGE_ROUND_DOWN(phdr[i].p_offset) / PAGE_SIZE;
+        fget(elff);
+        desc->vm_pgoff = PAGE_ROUND_DOWN(seg->offset) / PAGE_SIZE;
         desc->seg_vaddr = seg_vaddr;
-        desc->seg_offset = phdr[i].p_offset;
-        desc->vm_fsize = phdr[i].p_filesz; // file-backed size
-
-        if ((desc->vm_flags & VM_WRITE) && (desc->vm_flags & VM_EXEC))
-            klog(LOG_WARN, "Segment is both writable and executable\n");
+        desc->seg_offset = seg->offset;
+        desc->vm_fsize = seg->filesz; // file-backed size
 
         vma_list_insert(desc, &mm->mmap);
+
+        if (prefault && seg->nr_hot)
+            mm_populate(desc, desc->start,
+                MIN(desc->end, desc->start + seg->nr_hot * PAGE_SIZE));
     }
+    return 0;
+}
 
-    kfree(phdr);
+/*
+ * Open and map the ELF interpreter (an ET_DYN shared object) at INTERP_BASE.
+ * Returns the interpreter entry point (INTERP_BASE + e_entry), or 0 on error.
+ */
+static uintptr_t load_interp(const char *path, struct mm_info *mm)
+{
+    struct exec_image *img;
+    uintptr_t entry = 0;
 
-    info->app_entry = (void *)hdr->elf64.entry;
-    info->at_phdr = at_phdr;
-    info->phnum = (u16)hdr->elf64.p_tbl_num_ents;
-    info->phentsize = (u16)hdr->elf64.p_entry_sz;
+    struct file *f = vfs_open(path, 0, 0);
+    if (IS_ERR_OR_NULL(f)) {
+        klog(LOG_ERROR, "load_interp: cannot open %s\n", path);
+        return 0;
+    }
 
-    if (interp_path) {
-        klog(LOG_DEBUG, "elf64_load: interpreter = %s\n", interp_path);
-        uintptr_t interp_entry = load_interp(interp_path, mm);
+    img = elf64_get_image(f);
+    if (IS_ERR(img)) {
+        klog(LOG_ERROR, "load_interp: bad ELF in %s\n", path);
+        vfs_close(f);
+        return 0;
+    }
+
+    // Interpreter is ET_DYN: p_vaddr values are relative to INTERP_BASE.
+    if (!elf64_map(img, f, mm, INTERP_BASE))
+        entry = INTERP_BASE + (uintptr_t)img->info.app_entry;
+    exec_image_put(img);
+    // The segments hold their own references to the file
+    vfs_close(f);
+
+    klog(LOG_DEBUG, "load_interp: %s loaded at base %lx, entry %lx\n",
+        path, (unsigned long)INTERP_BASE, (unsigned long)entry);
+    return entry;
+}
+
+static int elf64_load(struct exec_image *img, struct mm_info *mm,
+                      struct file *elff, struct exec_info *info)
+{
+    int err = elf64_map(img, elff, mm, 0);
+    if (err)
+        return err;
+
+    *info = img->info;
+    if (img->interp) {
+        klog(LOG_DEBUG, "elf64_load: interpreter = %s\n", img->interp);
+        uintptr_t interp_entry = load_interp(img->interp, mm);
         if (!interp_entry) {
-            klog(LOG_ERROR, "Failed to load interpreter: %s\n", interp_path);
-            kfree(interp_path);
+            klog(LOG_ERROR, "Failed to load interpreter: %s\n", img->interp);
             return -ENOENT;
         }
         info->interp_base = INTERP_BASE;
         info->entry       = (void *)interp_entry;
-    } else {
-        info->interp_base = 0;
-        info->entry = info->app_entry;
     }
-
-    kfree(interp_path);
     return 0;
 }
-#else
-static int elf64_load(struct elf_header *hdr, struct mm_info *mm, struct file *elff,
-                      struct exec_info *info)
-{
-    return -ENOEXEC;
-}
 #endif
 
 int elf_load(struct file *f, struct mm_info *mm, struct exec_info *info)
 {
     struct elf_header elf;
+#ifdef __x86_64__
+    struct exec_image *img = elf64_get_image(f);
+    if (!IS_ERR(img)) {
+        int ret = elf64_load(img, mm, f, info);
+        exec_image_put(img);
+        return ret;
+    }
+    if (PTR_ERR(img) != -ENOEXEC)
+        return PTR_ERR(img);
+#endif
+
     if (vfs_read_at(f, (void*)&elf, sizeof elf, 0) != sizeof elf)
         return -EIO;
 
@@ -400,8 +433,6 @@ int elf_load(struct file *f, struct mm_info *mm, struct exec_info *info)
 
     if (elf.class == 1) {
         return elf32_load(&elf, mm, f, info);
-    } else if (elf.class == 2 && sizeof(void*) == 8) {
-        return elf64_load(&elf, mm, f, info);
     } else {
         klog(LOG_ERROR, "Invalid ELF class\n");
         return -ENOEXEC;
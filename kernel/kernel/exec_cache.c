@@ -0,0 +1,236 @@
+/*
+ * Parsed ELF images kept on their inodes, so execing the same binaries over
+ * and over skips reading and parsing the headers, and the text they start
+ * with stays in memory for the next exec to prefault.
+ */
+#include <lilac/exec_cache.h>
+#include <lilac/log.h>
+#include <lilac/sync.h>
+#include <mm/kmalloc.h>
+#include <mm/kmm.h>
+#include <mm/mm.h>
+#include <mm/page.h>
+#include <stdatomic.h>
+
+#define EXEC_IMAGE_MAX_PINNED   64  /* 256 KiB of text per image */
+
+/*
+ * Covers every inode's i_exec and the LRU, so the shrinker can drop images
+ * without taking a lock per inode. Nothing allocates while holding it.
+ */
+static spinlock_t exec_cache_lock = SPINLOCK_INIT;
+static LIST_HEAD(exec_image_lru);   /* least recently used first */
+
+static atomic_ulong exec_cache_hits;
+static atomic_ulong exec_cache_misses;
+static atomic_ulong exec_cache_invalidations;
+static atomic_ulong exec_cache_pinned;
+static atomic_ulong exec_count;
+static atomic_ulong exec_ns_total;
+static atomic_ulong exec_ns_max;
+
+struct exec_image *exec_image_alloc(unsigned int nr_segs)
+{
+    struct exec_image *img;
+
+    img = kzmalloc(sizeof(*img) + nr_segs * sizeof(img->segs[0]));
+    if (!img)
+        return NULL;
+    img->ref_count = 1;
+    INIT_LIST_HEAD(&img->lru);
+    return img;
+}
+
+void exec_image_put(struct exec_image *img)
+{
+    if (--img->ref_count)
+        return;
+
+    for (unsigned int i = 0; i < img->nr_pinned; i++)
+        put_page(img->pinned[i]);
+    atomic_fetch_sub(&exec_cache_pinned, img->nr_pinned);
+    kfree(img->pinned);
+    kfree(img->interp);
+    kfree(img);
+}
+
+/*
+ * Hold the frames the file keeps for the start of each read-only segment.
+ * A held frame counts as mapped, so the page cache never evicts it, and
+ * the segment's first nr_hot pages are prefaulted from it on exec.
+ */
+static void exec_image_pin(struct exec_image *img, struct inode *inode)
+{
+    const struct address_space_operations *a_ops = inode->i_data.a_ops;
+    unsigned long max_index = PAGE_UP_COUNT(inode->i_size);
+
+    if (!a_ops || !a_ops->fault_page)
+        return;
+    img->pinned = kcalloc(EXEC_IMAGE_MAX_PINNED, sizeof(struct page*));
+    if (!img->pinned)
+        return;
+
+    for (unsigned int i = 0; i < img->nr_segs; i++) {
+        struct exec_seg *seg = &img->segs[i];
+        unsigned long index = seg->offset / PAGE_SIZE;
+        unsigned long nr = PAGE_UP_COUNT(seg->offset % PAGE_SIZE + seg->filesz);
+
+        if (seg->vm_flags & VM_WRITE)
+            continue;
+        for (; seg->nr_hot < nr && index < max_index; index++) {
+            struct page *pg;
+
+            if (img->nr_pinned == EXEC_IMAGE_MAX_PINNED)
+                goto out;
+            if (!(pg = a_ops->fault_page(inode, index)))
+                goto out;
+            img->pinned[img->nr_pinned++] = pg;
+            seg->nr_hot++;
+        }
+    }
+out:
+    atomic_fetch_add(&exec_cache_pinned, img->nr_pinned);
+}
+
+/**
+ * The cached image of inode with a reference held, or NULL. gen is set for
+ * exec_cache_insert, so an image parsed after a miss is only cached if the
+ * file didn't change while it was being read.
+ */
+struct exec_image *exec_cache_lookup(struct inode *inode, unsigned int *gen)
+{
+    struct exec_image *img;
+
+    *gen = __atomic_load_n(&inode->i_exec_gen, __ATOMIC_SEQ_CST);
+    acquire_lock(&exec_cache_lock);
+    img = inode->i_exec;
+    if (img) {
+        img->ref_count++;
+        list_move_tail(&img->lru, &exec_image_lru);
+    }
+    release_lock(&exec_cache_lock);
+
+    atomic_fetch_add(img ? &exec_cache_hits : &exec_cache_misses, 1);
+    return img;
+}
+
+void exec_cache_insert(struct inode *inode, struct exec_image *img,
+    unsigned int gen)
+{
+    // Stores through a shared mapping never pass the invalidation hooks
+    if (READ_ONCE(inode->i_data.i_mmap_writable) > 0)
+        return;
+    exec_image_pin(img, inode);
+
+    acquire_lock(&exec_cache_lock);
+    if (inode->i_exec) {
+        release_lock(&exec_cache_lock);
+        return;
+    }
+    /*
+     * Publish, then check for a write since the lookup. A writer bumps
+     * the generation before looking at i_exec, so either it sees the image
+     * and drops it or this sees the new generation.
+     */
+    img->inode = inode;
+    inode->i_exec = img;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&inode->i_exec_gen, __ATOMIC_SEQ_CST) != gen) {
+        inode->i_exec = NULL;
+        release_lock(&exec_cache_lock);
+        return;
+    }
+    img->ref_count++;
+    list_add_tail(&img->lru, &exec_image_lru);
+    release_lock(&exec_cache_lock);
+}
+
+void __exec_cache_invalidate(struct inode *inode)
+{
+    struct exec_image *img;
+
+    acquire_lock(&exec_cache_lock);
+    img = inode->i_exec;
+    if (img) {
+        inode->i_exec = NULL;
+        list_del_init(&img->lru);
+    }
+    release_lock(&exec_cache_lock);
+
+    if (img) {
+        atomic_fetch_add(&exec_cache_invalidations, 1);
+        exec_image_put(img);
+    }
+}
+
+// Drop up to nr of the least recently execed images and their pinned text
+static unsigned long shrink_exec_cache(unsigned long nr)
+{
+    LIST_HEAD(dispose);
+    struct exec_image *img, *tmp;
+    unsigned long freed = 0;
+
+    acquire_lock(&exec_cache_lock);
+    list_for_each_entry_safe(img, tmp, &exec_image_lru, lru) {
+        if (freed == nr)
+            break;
+        img->inode->i_exec = NULL;
+        list_move(&img->lru, &dispose);
+        freed++;
+    }
+    release_lock(&exec_cache_lock);
+
+    // Unhooked from their inodes, nothing else can reach the list now
+    list_for_each_entry_safe(img, tmp, &dispose, lru) {
+        list_del_init(&img->lru);
+        exec_image_put(img);
+    }
+    return freed;
+}
+
+static struct shrinker exec_cache_shrinker = {
+    .scan = shrink_exec_cache,
+};
+
+void exec_cache_init(void)
+{
+    register_shrinker(&exec_cache_shrinker);
+}
+
+// Time from an execve or posix_spawn call to the new image's first insn
+void exec_cache_account(u64 ns)
+{
+    unsigned long max = atomic_load(&exec_ns_max);
+
+    atomic_fetch_add(&exec_count, 1);
+    atomic_fetch_add(&exec_ns_total, ns);
+    while (ns > max && !atomic_compare_exchange_weak(&exec_ns_max, &max, ns))
+        ;
+}
+
+void exec_cache_get_stats(struct exec_cache_stats *stats)
+{
+    if (stats == NULL)
+        return;
+
+    stats->hits = atomic_load(&exec_cache_hits);
+    stats->misses = atomic_load(&exec_cache_misses);
+    stats->invalidations = atomic_load(&exec_cache_invalidations);
+    stats->pinned_pages = atomic_load(&exec_cache_pinned);
+    stats->execs = atomic_load(&exec_count);
+    stats->exec_ns_total = atomic_load(&exec_ns_total);
+    stats->exec_ns_max = atomic_load(&exec_ns_max);
+}
+
+void print_exec_cache_stats(void)
+{
+    struct exec_cache_stats stats;
+
+    exec_cache_get_stats(&stats);
+    klog(LOG_INFO,
+        "exec cache: hits=%lu misses=%lu invalidations=%lu pinned=%lu\n",
+        stats.hits, stats.misses, stats.invalidations, stats.pinned_pages);
+    klog(LOG_INFO, "exec: count=%lu avg=%lluns max=%lluns\n", stats.execs,
+        stats.execs ? stats.exec_ns_total / stats.execs : 0,
+        stats.exec_ns_max);
+}
@@ -11,12 +11,12 @@
 
 static atomic_int num_tasks = 1;
 
-static inline void get_sighandlers(struct sighandlers *sh)
+void get_sighandlers(struct sighandlers *sh)
 {
     sh->ref_count++;
 }
 
-static inline void put_sighandlers(struct sighandlers *sh)
+void put_sighandlers(struct sighandlers *sh)
 {
     if (--sh->ref_count == 0)
         kfree(sh);
@@ -29,6 +29,8 @@ struct sighandlers * alloc_sighandlers(void)
         return NULL;
     sh->ref_count = 1;
     spin_lock_init(&sh->lock);
+    spin_lock_init(&sh->signalfd_wq.lock);
+    INIT_LIST_HEAD(&sh->signalfd_wq.task_list);
     return sh;
 }
 
@@ -50,23 +52,6 @@ static void copy_fs_info(struct fs_info *dst, struct fs_info *src)
     dst->cwd_d = src->cwd_d;
 }
 
-static int copy_files(struct fdtable *dst, struct fdtable *src)
-{
-    if (dst->fdarray)
-        kfree(dst->fdarray);
-    dst->fdarray = kcalloc(src->max, sizeof(struct file*));
-    if (dst->fdarray == NULL)
-        return -ENOMEM;
-    dst->max = src->max;
-    for (size_t i = 0; i < src->max; i++) {
-        dst->fdarray[i] = src->fdarray[i];
-        if (dst->fdarray[i]) {
-            fget(dst->fdarray[i]);
-        }
-    }
-    return 0;
-}
-
 static void copy_sighandlers(struct sighandlers *dst, struct sighandlers *src)
 {
     for (int i = 0; i < _NSIG; i++)
@@ -104,6 +89,7 @@ struct task *init_process(void)
     this->state = TASK_RUNNING;
     this->fs = alloc_fs_info();
     this->files = alloc_fdtable(8);
+    rlimit_init(this->rlim);
     this->fs->root_d = get_root_dentry();
     this->fs->cwd_d = this->fs->root_d;
     dget(this->fs->root_d);
@@ -115,6 +101,10 @@ struct task *init_process(void)
     this->sighand = alloc_sighandlers();
     INIT_LIST_HEAD(&this->children);
     INIT_LIST_HEAD(&this->sibling);
+    spin_lock_init(&this->wait_chldexit.lock);
+    INIT_LIST_HEAD(&this->wait_chldexit.task_list);
+    INIT_LIST_HEAD(&this->zombies);
+    INIT_LIST_HEAD(&this->zombie_node);
     hash_add(pid_table, &this->pid_hash, this->pid);
     hash_add(pgid_table, &this->pgid_hash, this->pgid);
     hash_add(sid_table, &this->sid_hash, this->sid);
@@ -124,7 +114,7 @@ struct task *init_process(void)
 }
 
 // TODO error handling
-static struct task * clone_process(struct clone_args *args)
+struct task * clone_process(struct clone_args *args)
 {
     unsigned long flags = args->flags;
     struct task *cur = current, *parent = current;
@@ -134,8 +124,13 @@ static struct task * clone_process(struct clone_args *args)
 
     child->rq_node = (struct rb_node){0};
     INIT_LIST_HEAD(&child->children);
+    spin_lock_init(&child->wait_chldexit.lock);
+    INIT_LIST_HEAD(&child->wait_chldexit.task_list);
+    INIT_LIST_HEAD(&child->zombies);
+    INIT_LIST_HEAD(&child->zombie_node);
     child->on_rq = false;
-    child->parent_wait = false;
+    child->runtime = 0;
+    child->child_runtime = 0;
 
     child->pid = ++num_tasks;
     if (flags & CLONE_THREAD) {
@@ -176,7 +171,9 @@ static struct task * clone_process(struct clone_args *args)
     if (!child->kstack_base) {
         panic("Failed to allocate kernel stack for child process\n");
     }
-    if (flags & CLONE_VM) {
+    if (args->mm) {
+        child->mm = args->mm;
+    } else if (flags & CLONE_VM) {
         cur->mm->ref_count++;
     } else {
         child->mm = arch_copy_mmap(cur->mm);
@@ -191,10 +188,15 @@ static struct task * clone_process(struct clone_args *args)
     }
     copy_fp_regs(child, cur);
 
-    child->info.path = strdup(cur->info.path);
-    child->info.argv = NULL;
-    child->info.envp = NULL;
-    fget(child->info.exec_file);
+    if (args->info) {
+        child->info = *args->info;
+    } else {
+        child->info.path = strdup(cur->info.path);
+        child->info.argv = NULL;
+        child->info.envp = NULL;
+        child->info.exec_info = NULL;
+        fget(child->info.exec_file);
+    }
 
     if (flags & CLONE_FS) {
         child->fs->ref_count++;
@@ -203,11 +205,12 @@ static struct task * clone_process(struct clone_args *args)
         copy_fs_info(child->fs, cur->fs);
     }
 
-    if (flags & CLONE_FILES) {
+    if (args->files) {
+        child->files = args->files;
+    } else if (flags & CLONE_FILES) {
         child->files->ref_count++;
     } else {
-        child->files = alloc_fdtable(cur->files->max);
-        copy_files(child->files, cur->files);
+        child->files = dup_fdtable(cur->files);
     }
 
     if (flags & CLONE_SIGHAND) {
@@ -236,6 +239,7 @@ static void return_from_fork(void)
         }
     }
     klog(LOG_DEBUG, "PID %d: Returning from fork\n", p->pid);
+    load_fp_regs();
     arch_return_from_fork(p->regs, p->kstack, p->tls);
 }
 
@@ -358,20 +362,7 @@ void exec_mm_release(struct task *tsk, struct mm_info *mm)
 
 static void cleanup_fs(struct fs_info *fs, struct fdtable *files)
 {
-    if (!--files->ref_count) {
-        for (size_t i = 0; i < files->max; i++) {
-            if (files->fdarray[i]) {
-                struct file *file = files->fdarray[i];
-    #ifdef DEBUG_VFS
-                klog(LOG_DEBUG, "Cleaning up file descriptor %d, file %p\n", i, file);
-    #endif
-                vfs_close(file);
-                files->fdarray[i] = NULL;
-            }
-        }
-        kfree(files->fdarray);
-        kfree(files);
-    }
+    put_fdtable(files);
 
     if (!--fs->ref_count) {
         dput(fs->cwd_d);
@@ -380,7 +371,7 @@ static void cleanup_fs(struct fs_info *fs, struct fdtable *files)
     }
 }
 
-static void cleanup_task_info(struct task_info *info)
+void cleanup_task_info(struct task_info *info)
 {
     klog(LOG_DEBUG, "Cleaning up task info\n");
     if (info->path) {
@@ -391,6 +382,8 @@ static void cleanup_task_info(struct task_info *info)
         vfs_close(info->exec_file);
         info->exec_file = NULL;
     }
+    kfree(info->exec_info);
+    info->exec_info = NULL;
     if (info->argv) {
         for (int i = 0; info->argv[i]; i++)
             kfree(info->argv[i]);
@@ -459,7 +452,7 @@ __noreturn void do_exit(void)
 
 __noreturn void exit(int status)
 {
-    current->exit_status = WEXITED(status);
+    current->exit_status = W_EXITCODE(status);
     klog(LOG_INFO, "Process %d exited with status %d\n", current->pid, status);
     do_exit();
     panic("exit: Should never be reached\n");
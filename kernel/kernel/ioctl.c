@@ -4,12 +4,13 @@
 
 SYSCALL_DECL3(ioctl, int, fd, unsigned long, op, void *, argp)
 {
-    struct file *f = get_file_handle(fd);
-    if (IS_ERR(f))
-        return PTR_ERR(f);
+    struct fd f = fdget(fd);
+    long ret = -ENOTTY;
 
-    if (!f->f_op->ioctl)
-        return -ENOTTY;
-
-    return f->f_op->ioctl(f, op, argp);
+    if (!f.file)
+        return -EBADF;
+    if (f.file->f_op->ioctl)
+        ret = f.file->f_op->ioctl(f.file, op, argp);
+    fdput(f);
+    return ret;
 }
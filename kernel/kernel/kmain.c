@@ -3,6 +3,7 @@
 #include <lilac/lilac.h>
 #include <lilac/boot.h>
 #include <mm/kmm.h>
+#include <mm/page.h>
 #include <lilac/percpu.h>
 #include <lilac/fs.h>
 #include <lilac/sched.h>
@@ -14,6 +15,8 @@
 #include <acpi/acpi.h>
 #include <lib/icxxabi.h>
 #include <lilac/futex.h>
+#include <lilac/exec_cache.h>
+#include <lilac/vdso.h>
 
 extern void (*__init_array_start[])(void);
 extern void (*__init_array_end[])(void);
@@ -43,6 +46,9 @@ void start_kernel(void)
     arch_setup();
 
     timer_init();
+#ifdef DEBUG_MEMBENCH
+    mem_bench();
+#endif
     syscall_init();
     smp_init();
 
@@ -52,7 +58,9 @@ void start_kernel(void)
     arch_enable_interrupts();
 
     fs_init();
+    vdso_init();
     futex_init();
+    exec_cache_init();
     sched_init();
     fb_init();
     kbd_init();
@@ -1,20 +1,23 @@
 #include <lilac/pipe.h>
 #include <lilac/lilac.h>
 #include <lilac/fs.h>
+#include <lilac/poll.h>
 #include <lilac/syscall.h>
 #include <mm/kmm.h>
 #include <mm/page.h>
 #include <lilac/uaccess.h>
 #include <lilac/timer.h>
 
-ssize_t pipe_read(struct file *f, void *buf, size_t count);
-ssize_t pipe_write(struct file *f, const void *buf, size_t count);
+ssize_t pipe_read(struct file *f, struct iov_iter *to, off_t *ppos);
+ssize_t pipe_write(struct file *f, struct iov_iter *from, off_t *ppos);
 int pipe_close(struct inode *i, struct file *f);
+unsigned int pipe_poll(struct file *f, struct poll_table *pt);
 
 static const struct file_operations pipe_fops = {
-    .read = pipe_read,
-    .write = pipe_write,
+    .read_iter = pipe_read,
+    .write_iter = pipe_write,
     .release = pipe_close,
+    .poll = pipe_poll,
 };
 
 struct inode * pipe_alloc_inode()
@@ -55,6 +58,7 @@ struct pipe_buf * create_pipe(size_t buf_size)
     }
 
     p->buf_size = buf_size;
+    mutex_init(&p->mutex);
     INIT_LIST_HEAD(&p->read_wq.task_list);
     INIT_LIST_HEAD(&p->write_wq.task_list);
     p->n_readers = 1;
@@ -82,14 +86,35 @@ void destroy_pipe(struct pipe_buf *p)
     kfree(p);
 }
 
-ssize_t pipe_read(struct file *f, void *buf, size_t count)
+/*
+ * Copy between the ring buffer and an iterator in at most two pieces. The
+ * copy runs without the spinlock since it can fault; only the reader moves
+ * read_pos and only the writer moves write_pos, so the region is stable.
+ */
+static size_t pipe_copy(struct pipe_buf *pipe, unsigned int pos, size_t len,
+    struct iov_iter *iter, bool to_iter)
 {
-    if (count == 0 || !buf || !f)
-        return 0;
+    size_t first = MIN(len, pipe->buf_size - pos);
+    size_t done;
+
+    done = to_iter ? copy_to_iter(pipe->buffer + pos, first, iter) :
+        copy_from_iter(pipe->buffer + pos, first, iter);
+    if (done == first && len > first) {
+        done += to_iter ? copy_to_iter(pipe->buffer, len - first, iter) :
+            copy_from_iter(pipe->buffer, len - first, iter);
+    }
+    return done;
+}
 
+ssize_t pipe_read(struct file *f, struct iov_iter *to, off_t *ppos)
+{
+    size_t count = iov_iter_count(to);
+    if (count == 0 || !f)
+        return 0;
 
     struct pipe_buf *pipe = f->pipe;
-    int pos, to_read;
+    unsigned int pos;
+    size_t to_read;
     if (!pipe) {
         klog(LOG_ERROR, "pipe_read: Invalid pipe buffer\n");
         return -EIO;
@@ -98,30 +123,37 @@ ssize_t pipe_read(struct file *f, void *buf, size_t count)
 #ifdef DEBUG_PIPE
     klog(LOG_DEBUG, "pipe_read: Reading %lu bytes from pipe %p\n", count, pipe);
 #endif
-    if (pipe->data_size == 0) {
+    while (READ_ONCE(pipe->data_size) == 0) {
         if (pipe->n_writers == 0) {
             klog(LOG_DEBUG, "pipe_read: No writers, returning 0 bytes\n");
             return 0; // EOF
         }
-        sleep_on(&pipe->read_wq);
+        if (sleep_on(&pipe->read_wq) == -EINTR)
+            return -EINTR;
     }
 
+    mutex_lock(&pipe->mutex);
     acquire_lock(&pipe->lock);
-
     pos = pipe->read_pos;
     to_read = MIN(count, pipe->data_size);
-    memcpy(buf, pipe->buffer + pos, to_read);
+    release_lock(&pipe->lock);
+
+    to_read = pipe_copy(pipe, pos, to_read, to, true);
+
+    acquire_lock(&pipe->lock);
     pipe->read_pos = (pos + to_read) % pipe->buf_size;
     pipe->data_size -= to_read;
-
     release_lock(&pipe->lock);
+    mutex_unlock(&pipe->mutex);
+
     wake_first(&pipe->write_wq);
-    return to_read;
+    return to_read ? (ssize_t)to_read : -EFAULT;
 }
 
-ssize_t pipe_write(struct file *f, const void *buf, size_t count)
+ssize_t pipe_write(struct file *f, struct iov_iter *from, off_t *ppos)
 {
-    if (count == 0 || !buf || !f)
+    size_t count = iov_iter_count(from);
+    if (count == 0 || !f)
         return 0;
     struct pipe_buf *pipe = f->pipe;
     if (!pipe) {
@@ -146,21 +178,53 @@ ssize_t pipe_write(struct file *f, const void *buf, size_t count)
         }
     }
 
+    mutex_lock(&pipe->mutex);
+    acquire_lock(&pipe->lock);
+    unsigned int pos = pipe->write_pos;
+    size_t to_write = MIN(count, pipe->buf_size - pipe->data_size);
+    release_lock(&pipe->lock);
+
+    to_write = pipe_copy(pipe, pos, to_write, from, false);
+
     acquire_lock(&pipe->lock);
-    int pos = pipe->write_pos;
-    unsigned int to_write = MIN(count, pipe->buf_size - pipe->data_size);
-    memcpy(pipe->buffer + pos, buf, to_write);
     pipe->write_pos = (pos + to_write) % pipe->buf_size;
     pipe->data_size += to_write;
     release_lock(&pipe->lock);
+    mutex_unlock(&pipe->mutex);
 
     wake_first(&pipe->read_wq);
 
     if (to_write != count) {
-        klog(LOG_WARN, "pipe_write: Partial write (%d of %lu bytes)\n", to_write, count);
+        klog(LOG_WARN, "pipe_write: Partial write (%lu of %lu bytes)\n", to_write, count);
     }
 
-    return to_write;
+    return to_write ? (ssize_t)to_write : -EFAULT;
+}
+
+/*
+ * Each end only waits on its own queue: readers are woken when data comes
+ * in or the last writer goes, writers when space frees up or the last
+ * reader goes.
+ */
+unsigned int pipe_poll(struct file *f, struct poll_table *pt)
+{
+    struct pipe_buf *pipe = f->pipe;
+    unsigned int mask = 0;
+
+    if ((f->f_mode & O_ACCMODE) == O_RDONLY) {
+        poll_wait(f, &pipe->read_wq, pt);
+        if (READ_ONCE(pipe->data_size))
+            mask |= POLLIN | POLLRDNORM;
+        if (!READ_ONCE(pipe->n_writers))
+            mask |= POLLHUP;
+    } else {
+        poll_wait(f, &pipe->write_wq, pt);
+        if (READ_ONCE(pipe->data_size) < pipe->buf_size)
+            mask |= POLLOUT | POLLWRNORM;
+        if (!READ_ONCE(pipe->n_readers))
+            mask |= POLLERR;
+    }
+    return mask;
 }
 
 int pipe_close(struct inode *i, struct file *f)
@@ -173,6 +237,8 @@ int pipe_close(struct inode *i, struct file *f)
 
     if ((f->f_mode & O_ACCMODE) == O_WRONLY) {
         p->n_writers--;
+        if (p->n_writers == 0)
+            wake_all(&p->read_wq);
     } else if ((f->f_mode & O_ACCMODE) == O_RDONLY) {
         p->n_readers--;
         if (p->n_readers == 0)
@@ -5,11 +5,14 @@
 #include <lilac/lilac.h>
 #include <lilac/clone.h>
 #include <lilac/elf.h>
+#include <lilac/exec_cache.h>
 #include <lilac/fs.h>
 #include <lilac/sched.h>
+#include <lilac/spawn.h>
 #include <lilac/syscall.h>
 #include <lilac/timer.h>
 #include <lilac/uaccess.h>
+#include <lilac/vdso.h>
 #include <lilac/wait.h>
 #include <mm/mm.h>
 #include <mm/kmm.h>
@@ -289,7 +292,12 @@ void start_process(void)
     klog(LOG_DEBUG, "Process %d starting\n", current->pid);
 
     struct exec_info einfo = {0};
-    if (load_executable(current, &einfo) < 0) {
+    if (current->info.exec_info) {
+        // posix_spawn already loaded the image into this mm
+        einfo = *current->info.exec_info;
+        kfree(current->info.exec_info);
+        current->info.exec_info = NULL;
+    } else if (load_executable(current, &einfo) < 0) {
         klog(LOG_ERROR, "Failed to load executable, exiting\n");
         exit(1);
     }
@@ -304,6 +312,7 @@ void start_process(void)
     mem->start_brk = mem->brk = desc ? desc->end : 0;
     mem->start_stack = (uintptr_t)(__USER_STACK - __USER_STACK_SZ);
     set_vm_areas(mem);
+    uintptr_t vdso_base = vdso_map(mem);
     mmap_write_unlock(mem);
 
     unsigned long argc = count_task_vec(current->info.argv);
@@ -338,7 +347,7 @@ void start_process(void)
      *
      * musl's _start_c / _dlstart_c receive sp as their first argument.
      */
-#define N_AUXV_PAIRS 14   /* number of AT_* pairs written below, excluding AT_NULL */
+#define N_AUXV_PAIRS 15   /* number of AT_* pairs written below, excluding AT_NULL */
     size_t nslots = 1 + (argc + 1) + (envc + 1) + (N_AUXV_PAIRS + 1) * 2;
     uintptr_t *sp = (uintptr_t *)__USER_STACK - nslots;
     sp = (uintptr_t *)((uintptr_t)sp & ~(uintptr_t)0xf);
@@ -388,14 +397,22 @@ void start_process(void)
     AUXV_PAIR(AT_EUID,   0);
     AUXV_PAIR(AT_GID,    0);
     AUXV_PAIR(AT_EGID,   0);
+    AUXV_PAIR(AT_SYSINFO_EHDR, vdso_base);
     AUXV_PAIR(AT_NULL,   0);
 #undef AUXV_PAIR
 #undef N_AUXV_PAIRS
 
+    if (current->info.exec_start) {
+        exec_cache_account(ktime_get() - current->info.exec_start);
+        current->info.exec_start = 0;
+    }
+
     klog(LOG_DEBUG, "Going to user mode: entry=%p sp=%p argc=%lu argv=%p envp=%p\n",
          einfo.entry, sp, argc, argv_ptr, envp_ptr);
     klog(LOG_DEBUG, "  AT_PHDR=%p AT_BASE=%lx AT_ENTRY=%p\n",
          einfo.at_phdr, einfo.interp_base, einfo.app_entry);
+    reset_fp_regs(current);
+    load_fp_regs();
     jump_usermode(einfo.entry, (void*)sp, current->kstack);
 }
 
@@ -426,6 +443,7 @@ static void exec_and_return(void)
 
     exec_mm_release(current, old_mm);
 
+    arch_switch_mm(task);
     jump_new_proc(task);
     panic("exec_and_return: Should never be reached\n");
     unreachable();
@@ -444,7 +462,9 @@ static int set_task_args(struct task_info *info, char *const argv[])
         ssize_t len = strnlen_user(argv[i], 127) + 1;
         if (len < 0)
             return -EFAULT;
-        info->argv = krealloc(info->argv, (i + 1) * sizeof(char*));
+        // Kept terminated so a partial copy can still be freed
+        info->argv = krealloc(info->argv, (i + 2) * sizeof(char*));
+        info->argv[i + 1] = NULL;
         info->argv[i] = kmalloc(len + 1);
         err = strncpy_from_user(info->argv[i], argv[i], len + 1);
         if (err < 0)
@@ -468,7 +488,9 @@ static int set_task_env(struct task_info *info, char *const envp[])
         ssize_t len = strnlen_user(envp[i], 127) + 1;
         if (len < 0)
             return -EFAULT;
-        info->envp = krealloc(info->envp, (i + 1) * sizeof(char*));
+        // Kept terminated so a partial copy can still be freed
+        info->envp = krealloc(info->envp, (i + 2) * sizeof(char*));
+        info->envp[i + 1] = NULL;
         info->envp[i] = kmalloc(len + 1);
         err = strncpy_from_user(info->envp[i], envp[i], len + 1);
         if (err < 0)
@@ -514,10 +536,28 @@ static int do_execve(const char *path, char *const argv[], char *const envp[])
     }
 
     klog(LOG_INFO, "Executing %s\n", info->path);
+    info->exec_start = ktime_get();
     exec_and_return();
     unreachable();
 }
 
+// Copy a NULL terminated user array of user pointers into buf, 32 slots
+static int get_user_vec(char **buf, char *const *uvec)
+{
+    int i = 0;
+    while (1) {
+        char *ptr = NULL;
+        if (get_user(ptr, &uvec[i]) < 0)
+            return -EFAULT;
+        buf[i] = ptr;
+        if (!ptr)
+            return 0;
+        i++;
+        if (i >= 31)
+            return -EINVAL;
+    }
+}
+
 SYSCALL_DECL3(execve, const char*, path, char* const*, argv, char* const*, envp)
 {
     int err = 0;
@@ -542,39 +582,10 @@ SYSCALL_DECL3(execve, const char*, path, char* const*, argv, char* const*, envp)
         return -ENOMEM;
     }
 
-    int i = 0;
-    while (1) {
-        char *argp = NULL;
-        if (get_user(argp, &argv[i]) < 0) {
-            err = -EFAULT;
-            goto out;
-        }
-        argv_buf[i] = argp;
-        if (!argp)
-            break;
-        i++;
-        if (i >= 31) {
-            err = -EINVAL;
-            goto out;
-        }
-    }
-
-    i = 0;
-    while (1) {
-        char *env = NULL;
-        if (get_user(env, &envp[i]) < 0) {
-            err = -EFAULT;
-            goto out;
-        }
-        envp_buf[i] = env;
-        if (!env)
-            break;
-        i++;
-        if (i >= 31) {
-            err = -EINVAL;
-            goto out;
-        }
-    }
+    if ((err = get_user_vec(argv_buf, argv)) < 0)
+        goto out;
+    if ((err = get_user_vec(envp_buf, envp)) < 0)
+        goto out;
 
     err = do_execve(path_buf, argv_buf, envp_buf);
 out:
@@ -586,11 +597,256 @@ out:
 }
 
 
+// Free an mm that never ran, none of its VMAs have any pages mapped yet
+static void free_unused_mm(struct mm_info *mm)
+{
+    struct vm_desc *desc = mm->mmap, *next;
+
+    for (; desc; desc = next) {
+        next = desc->vm_next;
+        vma_free(desc);
+    }
+    free_page(phys_to_virt(mm->pgd));
+    kfree(mm);
+}
+
+/*
+ * Apply the file actions to the child's table. Nothing else can see the
+ * table yet, so lookups don't need its lock.
+ */
+static int spawn_file_actions(struct fdtable *files,
+    const struct spawn_file_action *actions, unsigned int nr)
+{
+    for (unsigned int i = 0; i < nr; i++) {
+        const struct spawn_file_action *fa = &actions[i];
+        struct file *file;
+        char *path;
+        int err;
+
+        switch (fa->cmd) {
+            case SPAWN_FA_CLOSE:
+                // Like glibc, closing a descriptor that isn't open is fine
+                file = fd_remove(files, fa->fd);
+                if (file)
+                    vfs_close(file);
+                break;
+            case SPAWN_FA_DUP2:
+                file = fd_lookup(files, fa->srcfd);
+                if (!file)
+                    return -EBADF;
+                fget(file);
+                if ((err = get_fd_exact_replace(files, fa->fd, file)) < 0) {
+                    fput(file);
+                    return err;
+                }
+                break;
+            case SPAWN_FA_OPEN:
+                path = get_user_path(fa->path);
+                if (IS_ERR(path))
+                    return PTR_ERR(path);
+                file = vfs_open(path, fa->oflag, fa->mode);
+                kfree(path);
+                if (IS_ERR(file))
+                    return PTR_ERR(file);
+                if ((err = get_fd_exact_replace(files, fa->fd, file)) < 0) {
+                    fput(file);
+                    return err;
+                }
+                break;
+            default:
+                return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static int spawn_check_attr(const struct spawn_attr *attr)
+{
+    struct task *target;
+
+    if (!(attr->flags & POSIX_SPAWN_SETPGROUP))
+        return 0;
+    // The child would already lead its new session when setpgid ran
+    if (attr->flags & POSIX_SPAWN_SETSID)
+        return -EPERM;
+    if (attr->pgroup < 0)
+        return -EINVAL;
+    if (attr->pgroup == 0)
+        return 0;
+    target = get_any_pgrp_member(attr->pgroup);
+    if (!target || target->sid != current->sid)
+        return -EPERM;
+    return 0;
+}
+
+// The same as setsid and setpgid in the child, but before it ever runs
+static void spawn_apply_attr(struct task *child, const struct spawn_attr *attr)
+{
+    if (attr->flags & POSIX_SPAWN_SETSIGMASK)
+        child->blocked = SIG_APPLY_MASK(attr->sigmask, _SIGKILL | _SIGSTOP);
+
+    if (attr->flags & POSIX_SPAWN_SETSIGDEF) {
+        for (int i = 1; i < _NSIG; i++) {
+            if (sigismember(&attr->sigdefault, i))
+                child->sighand->actions[i].sa.sa_handler = SIG_DFL;
+        }
+    }
+
+    if (attr->flags & POSIX_SPAWN_SETSID) {
+        hash_del(&child->sid_hash);
+        hash_del(&child->pgid_hash);
+        child->sid = child->pid;
+        child->pgid = child->pid;
+        child->ctty = NULL;
+        hash_add(sid_table, &child->sid_hash, child->sid);
+        hash_add(pgid_table, &child->pgid_hash, child->pgid);
+    } else if (attr->flags & POSIX_SPAWN_SETPGROUP) {
+        hash_del(&child->pgid_hash);
+        child->pgid = attr->pgroup ? attr->pgroup : child->pid;
+        hash_add(pgid_table, &child->pgid_hash, child->pgid);
+    }
+}
+
+/*
+ * Start a new process running path without forking the caller first. The
+ * child gets a new mm the image is loaded straight into, so none of the
+ * caller's address space is ever copied. Everything that can fail is done
+ * before the child exists, so errors come back here rather than as the
+ * child's exit status.
+ */
+SYSCALL_DECL6(posix_spawn, const char*, path, char* const*, argv,
+    char* const*, envp, const struct spawn_file_action*, actions,
+    unsigned int, nr_actions, const struct spawn_attr*, uattr)
+{
+    struct spawn_attr attr = {0};
+    struct spawn_file_action *fa = NULL;
+    struct task_info info = {0};
+    struct fdtable *files = NULL;
+    struct mm_info *mm = NULL;
+    char **vec = NULL;
+    struct task *child;
+    struct file *file;
+    char *path_buf;
+    long err;
+
+    if (!access_ok(path, 1) || !access_ok(argv, 1) || !access_ok(envp, 1))
+        return -EFAULT;
+    if (nr_actions > SPAWN_MAX_ACTIONS)
+        return -EINVAL;
+    if (uattr && copy_from_user(&attr, uattr, sizeof(attr)))
+        return -EFAULT;
+    info.exec_start = ktime_get();
+    if ((err = spawn_check_attr(&attr)) < 0)
+        return err;
+
+    path_buf = get_user_path(path);
+    if (IS_ERR(path_buf))
+        return PTR_ERR(path_buf);
+    info.path = path_buf;
+
+    if (nr_actions) {
+        fa = kmalloc(nr_actions * sizeof(*fa));
+        if (!fa) {
+            err = -ENOMEM;
+            goto error;
+        }
+        if (copy_from_user(fa, actions, nr_actions * sizeof(*fa))) {
+            err = -EFAULT;
+            goto error;
+        }
+    }
+
+    vec = kmalloc(sizeof(char*) * 32);
+    if (!vec) {
+        err = -ENOMEM;
+        goto error;
+    }
+    if ((err = get_user_vec(vec, argv)) < 0 ||
+            (err = set_task_args(&info, vec)) < 0)
+        goto error;
+    if ((err = get_user_vec(vec, envp)) < 0 ||
+            (err = set_task_env(&info, vec)) < 0)
+        goto error;
+
+    file = vfs_open(path_buf, 0, 0);
+    if (IS_ERR_OR_NULL(file)) {
+        klog(LOG_DEBUG, "posix_spawn: file %s not found\n", path_buf);
+        err = file ? PTR_ERR(file) : -ENOENT;
+        goto error;
+    }
+    info.exec_file = file;
+    if (!S_ISREG(file->f_dentry->d_inode->i_mode)) {
+        err = -EACCES;
+        goto error;
+    }
+
+    info.exec_info = kzmalloc(sizeof(*info.exec_info));
+    if (!info.exec_info) {
+        err = -ENOMEM;
+        goto error;
+    }
+    mm = arch_process_mmap(sizeof(void*) == 8);
+    mmap_write_lock(mm);
+    err = elf_load(file, mm, info.exec_info);
+    mmap_write_unlock(mm);
+    if (err < 0) {
+        klog(LOG_DEBUG, "posix_spawn: Failed to load %s: %ld\n", path_buf, err);
+        goto error;
+    }
+
+    files = dup_fdtable(current->files);
+    if (!files) {
+        err = -ENOMEM;
+        goto error;
+    }
+    if ((err = spawn_file_actions(files, fa, nr_actions)) < 0)
+        goto error;
+
+    struct clone_args args = {
+        .exit_signal = SIGCHLD,
+        .mm = mm,
+        .files = files,
+        .info = &info,
+    };
+    child = clone_process(&args);
+    if (IS_ERR_OR_NULL(child)) {
+        err = child ? PTR_ERR(child) : -ENOMEM;
+        goto error;
+    }
+
+    // What exec would have done to the handlers, then the requested changes
+    for (int i = 0; i < _NSIG; i++) {
+        if ((long)child->sighand->actions[i].sa.sa_handler > (long)SIG_IGN)
+            child->sighand->actions[i].sa.sa_handler = SIG_DFL;
+    }
+    spawn_apply_attr(child, &attr);
+
+    child->pc = (uintptr_t)start_process;
+    child->state = TASK_RUNNING;
+    klog(LOG_INFO, "Spawning %s as %d\n", info.path, child->pid);
+    schedule_task(child);
+
+    kfree(vec);
+    kfree(fa);
+    return child->pid;
+
+error:
+    if (files)
+        put_fdtable(files);
+    if (mm)
+        free_unused_mm(mm);
+    cleanup_task_info(&info);
+    kfree(vec);
+    kfree(fa);
+    return err;
+}
+
 SYSCALL_DECL1(chdir, const char*, path)
 {
     char *path_buf;
     long err = 0;
     struct task *task = current;
+    struct dentry *old;
 
     path_buf = get_user_path(path);
     if (IS_ERR(path_buf))
@@ -600,21 +856,24 @@ SYSCALL_DECL1(chdir, const char*, path)
     if (IS_ERR(d)) {
         err = PTR_ERR(d);
         goto out;
-    } else if (!d || !d->d_inode) {
+    } else if (!d->d_inode) {
         err = -ENOENT;
+        dput(d);
         goto out;
     }
 
     if (!S_ISDIR(d->d_inode->i_mode)) {
         err = -ENOTDIR;
+        dput(d);
         goto out;
     }
 
+    // The lookup's reference becomes the cwd's
     acquire_lock(&task->fs->lock);
-    dget(d);
-    dput(task->fs->cwd_d);
+    old = task->fs->cwd_d;
     task->fs->cwd_d = d;
     release_lock(&task->fs->lock);
+    dput(old);
 out:
     kfree(path_buf);
     return err;
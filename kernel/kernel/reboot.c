@@ -1,4 +1,5 @@
 #include <lilac/config.h>
+#include <lilac/fs.h>
 #include <lilac/lilac.h>
 #include <lilac/log.h>
 #include <lilac/syscall.h>
@@ -35,6 +36,8 @@ __noreturn void kernel_reboot(void)
 
 SYSCALL_DECL1(reboot, unsigned long, how)
 {
+    // FAT and FSInfo updates are deferred until sync
+    sync_filesystems();
     for (;;) {
         arch_disable_interrupts();
         switch (how) {
@@ -0,0 +1,136 @@
+// Per-process resource limits
+#include <lilac/config.h>
+#include <lilac/resource.h>
+#include <lilac/process.h>
+#include <lilac/sched.h>
+#include <lilac/syscall.h>
+#include <lilac/uaccess.h>
+#include <lilac/err.h>
+#include <lilac/libc.h>
+
+void rlimit_init(struct rlimit *rlim)
+{
+    for (int i = 0; i < RLIM_NLIMITS; i++) {
+        rlim[i].rlim_cur = RLIM_INFINITY;
+        rlim[i].rlim_max = RLIM_INFINITY;
+    }
+    rlim[RLIMIT_NOFILE].rlim_cur = INR_OPEN_CUR;
+    rlim[RLIMIT_NOFILE].rlim_max = INR_OPEN_MAX;
+    rlim[RLIMIT_STACK].rlim_cur = __USER_STACK_SZ;
+    rlim[RLIMIT_CORE].rlim_cur = 0;
+}
+
+unsigned long task_rlimit(struct task *p, unsigned int limit)
+{
+    return READ_ONCE(p->rlim[limit].rlim_cur);
+}
+
+unsigned long rlimit(unsigned int limit)
+{
+    return task_rlimit(current, limit);
+}
+
+/*
+ * Read and optionally replace one limit of p. Limits aren't shared between
+ * threads here, each task has its own copy from the one that cloned it.
+ */
+static int do_prlimit(struct task *p, unsigned int resource,
+    const struct rlimit *new_rlim, struct rlimit *old_rlim)
+{
+    struct rlimit *rlim;
+
+    if (resource >= RLIM_NLIMITS)
+        return -EINVAL;
+    if (new_rlim) {
+        if (new_rlim->rlim_cur > new_rlim->rlim_max)
+            return -EINVAL;
+        if (resource == RLIMIT_NOFILE && new_rlim->rlim_max > NR_OPEN_LIMIT)
+            return -EPERM;
+    }
+
+    rlim = p->rlim + resource;
+    acquire_lock(&p->lock);
+    if (old_rlim)
+        *old_rlim = *rlim;
+    if (new_rlim)
+        *rlim = *new_rlim;
+    release_lock(&p->lock);
+    return 0;
+}
+
+SYSCALL_DECL2(getrlimit, unsigned int, resource, struct rlimit __user *, rlim)
+{
+    struct rlimit value;
+    int err = do_prlimit(current, resource, NULL, &value);
+
+    if (err)
+        return err;
+    return copy_to_user(rlim, &value, sizeof(value)) ? -EFAULT : 0;
+}
+
+SYSCALL_DECL2(setrlimit, unsigned int, resource,
+    const struct rlimit __user *, rlim)
+{
+    struct rlimit value;
+
+    if (copy_from_user(&value, rlim, sizeof(value)))
+        return -EFAULT;
+    return do_prlimit(current, resource, &value, NULL);
+}
+
+static inline unsigned long rlim64_to_rlim(u64 v)
+{
+    return v >= RLIM_INFINITY ? RLIM_INFINITY : (unsigned long)v;
+}
+
+SYSCALL_DECL4(prlimit64, pid_t, pid, unsigned int, resource,
+    const struct rlimit64 __user *, new_rlim, struct rlimit64 __user *, old_rlim)
+{
+    struct rlimit64 value64;
+    struct rlimit new, old;
+    struct task *p = pid ? get_task_by_pid(pid) : current;
+    int err;
+
+    if (!p)
+        return -ESRCH;
+    if (new_rlim) {
+        if (copy_from_user(&value64, new_rlim, sizeof(value64)))
+            return -EFAULT;
+        new.rlim_cur = rlim64_to_rlim(value64.rlim_cur);
+        new.rlim_max = rlim64_to_rlim(value64.rlim_max);
+    }
+
+    err = do_prlimit(p, resource, new_rlim ? &new : NULL,
+        old_rlim ? &old : NULL);
+    if (err || !old_rlim)
+        return err;
+
+    value64.rlim_cur = old.rlim_cur == RLIM_INFINITY ? ~0ULL : old.rlim_cur;
+    value64.rlim_max = old.rlim_max == RLIM_INFINITY ? ~0ULL : old.rlim_max;
+    return copy_to_user(old_rlim, &value64, sizeof(value64)) ? -EFAULT : 0;
+}
+
+// A rusage reporting runtime nanoseconds of CPU time
+void fill_rusage(struct rusage *ru, u64 runtime)
+{
+    memset(ru, 0, sizeof(*ru));
+    ru->ru_utime.tv_sec = runtime / NS_PER_SEC;
+    ru->ru_utime.tv_usec = (runtime % NS_PER_SEC) / NS_PER_US;
+}
+
+SYSCALL_DECL2(getrusage, int, who, struct rusage __user *, ru)
+{
+    struct rusage value;
+
+    switch (who) {
+    case RUSAGE_SELF:
+        fill_rusage(&value, current->runtime);
+        break;
+    case RUSAGE_CHILDREN:
+        fill_rusage(&value, current->child_runtime);
+        break;
+    default:
+        return -EINVAL;
+    }
+    return copy_to_user(ru, &value, sizeof(value)) ? -EFAULT : 0;
+}
@@ -8,6 +8,7 @@
 #include <lilac/syscall.h>
 #include <lilac/percpu.h>
 #include <lilac/timer.h>
+#include <lilac/uaccess.h>
 #include <mm/mm.h>
 #include <mm/kmm.h>
 
@@ -30,7 +31,8 @@ static struct sighandlers root_sighand = {
         [SIGTERM] = {.sa.sa_handler = SIG_IGN, .sa.sa_flags = SA_RESTART},
         [SIGCHLD] = {.sa.sa_handler = SIG_DFL, .sa.sa_flags = SA_NOCLDSTOP | SA_NOCLDWAIT | SA_RESTART},
         [SIGKILL] = {.sa.sa_handler = SIG_IGN, .sa.sa_flags = SA_RESTART},
-    }
+    },
+    .signalfd_wq = WAITQUEUE_INIT(root_sighand.signalfd_wq),
 };
 
 struct task __rootp = {
@@ -94,18 +96,14 @@ volatile int sched_timer = -1;
 
 extern void __context_switch_asm(struct task *prev, struct task *next);
 
-struct task* get_current_task(void)
-{
-    return rqs[this_cpu_id()].curr;
-}
-
 static inline struct rq *cpu_rq(int cpu)
 {
     assert(cpu >= 0 && cpu < boot_info.ncpus);
     return &rqs[cpu];
 }
 
-#define this_cpu_rq() cpu_rq(this_cpu_id())
+// Our own id is always in range, so skip cpu_rq's check
+#define this_cpu_rq() (&rqs[this_cpu_id()])
 
 struct task * find_child_by_pid(struct task *parent, int pid)
 {
@@ -300,11 +298,9 @@ static void context_switch(struct task *prev, struct task *next)
     klog(LOG_DEBUG, "\tPC: %p\n", next->pc);
     klog(LOG_DEBUG, "\tStack: %p\n", next->kstack);
 #endif
-    save_fp_regs(prev);
     arch_pre_context_switch(prev, next);
     __context_switch_asm(prev, next);
     arch_post_context_switch(prev);
-    restore_fp_regs(prev);
 }
 
 struct task *cross_cpu_task(int this_cpu)
@@ -379,6 +375,7 @@ void schedule(void)
 
     if (next != cur) {
         rq->curr = next;
+        this_cpu_write(cpu_local_storage.curr, next);
         context_switch(cur, next);
         sched_post_switch_unlock();
         cur->exec_started = read_ticks();
@@ -430,6 +427,16 @@ SYSCALL_DECL0(sched_yield)
     return 0;
 }
 
+// The vDSO answers this itself when the cpu has rdpid or rdtscp
+SYSCALL_DECL3(getcpu, unsigned int*, cpu, unsigned int*, node, void*, unused)
+{
+    if (cpu && put_user((unsigned int)this_cpu_id(), cpu))
+        return -EFAULT;
+    if (node && put_user(0U, node))
+        return -EFAULT;
+    return 0;
+}
+
 void sched_ap_rq_init(int cpu)
 {
     extern char ap_stack[];
@@ -442,6 +449,7 @@ void sched_ap_rq_init(int cpu)
 
     rq->cpu = (u8)cpu;
     rq->curr = idle;
+    this_cpu_write(cpu_local_storage.curr, idle);
     rq->idle = idle;
 
     idle->pgd = arch_get_pgd();
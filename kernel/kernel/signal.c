@@ -43,7 +43,9 @@ int handle_signal(void)
         } else if (sig_bit & STOP_SIG) {
             klog(LOG_INFO, "handling stop signal %d\n", sig);
             set_task_stopped(p);
-            p->exit_status = WSTOPPED(sig);
+            p->exit_status = W_STOPCODE(sig);
+            p->flags.continued = 0;
+            notify_parent_state(p);
             do_raise(p->parent, SIGCHLD);
             p->flags.need_resched = 1;
         } else if (sig_bit & _SIGCONT) {
@@ -96,6 +98,9 @@ int do_raise(struct task *p, int sig)
     if (sig == SIGCONT && p->state == TASK_STOPPED) {
         klog(LOG_DEBUG, "Continuing stopped process %d due to SIGCONT\n", p->pid);
         set_task_running(p);
+        p->flags.state_change = 0;
+        p->flags.continued = 1;
+        notify_parent_state(p);
     }
 
     if (sig & pending) {
@@ -110,6 +115,8 @@ int do_raise(struct task *p, int sig)
 
     sigaddset(&p->pending, sig);
     p->flags.sig_pending = 1;
+    if (!list_empty(&p->sighand->signalfd_wq.task_list))
+        wake_all(&p->sighand->signalfd_wq);
 
     if (p->state == TASK_SLEEPING && !sigisblocked(p, sig)) {
         klog(LOG_DEBUG, "Waking up process %d for signal %d\n", p->pid, sig);
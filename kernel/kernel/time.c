@@ -6,6 +6,7 @@
 #include <lilac/sched.h>
 #include <lilac/percpu.h>
 #include <lilac/uaccess.h>
+#include <lilac/vdso.h>
 
 static void nop(__unused unsigned long x) {}
 
@@ -15,7 +16,23 @@ atomic_uint time_seq = 0;
 ktime_t system_time_base_ns = 0;
 static spinlock_t clock_write_lock = SPINLOCK_INIT;
 
-DEFINE_PER_CPU(struct rb_root_cached, timer_event_tree) = RB_ROOT_CACHED;
+/*
+ * Each CPU's tick runs the events queued on that CPU. An event remembers
+ * that CPU's base, so a task that has since migrated, or another task
+ * sharing the event, takes it out of the right tree. The base lock keeps
+ * that from racing the tick, which drops it only to run a callback and
+ * marks the event running meanwhile. Interrupts are off while it is held.
+ */
+struct timer_ev_base {
+    spinlock_t lock;
+    struct rb_root_cached tree;
+    struct timer_event *running;    /* callback in progress, never dereferenced */
+};
+
+static DEFINE_PER_CPU(struct timer_ev_base, timer_ev_base) = {
+    .lock = SPINLOCK_INIT,
+    .tree = RB_ROOT_CACHED,
+};
 
 void timer_ev_tick(void);
 
@@ -41,6 +58,7 @@ void set_clock_source(struct clock_source *clock)
 
     WRITE_ONCE(ticks_per_ms, clock->freq_hz / 1000);
     WRITE_ONCE(__system_clock, clock);
+    vdso_update_clock(clock, current_ns);
 
     atomic_store_explicit(&time_seq, seq + 2, memory_order_release);
 
@@ -50,6 +68,14 @@ void set_clock_source(struct clock_source *clock)
          clock->name, clock->freq_hz);
 }
 
+// The vDSO is set up after the first clock source, bring it up to date
+void clock_sync_vdso(void)
+{
+    acquire_lock(&clock_write_lock);
+    vdso_update_clock(__system_clock, system_time_base_ns);
+    release_lock(&clock_write_lock);
+}
+
 void timer_init(void)
 {
     timer_tick_init();
@@ -112,6 +138,59 @@ SYSCALL_DECL2(gettimeofday, struct timeval*, tv, struct timezone*, tz)
     return 0;
 }
 
+// Nanoseconds on clock which, the same reading the vDSO takes
+static int clock_read_ns(int which, s64 *ns)
+{
+    switch (which) {
+        case CLOCK_REALTIME:
+        case CLOCK_REALTIME_COARSE:
+            *ns = boot_unix_time * NS_PER_SEC + get_sys_time_ns();
+            return 0;
+        case CLOCK_MONOTONIC:
+        case CLOCK_MONOTONIC_RAW:
+        case CLOCK_MONOTONIC_COARSE:
+        case CLOCK_BOOTTIME:
+            *ns = get_sys_time_ns();
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+SYSCALL_DECL2(clock_gettime, int, which, struct timespec*, tp)
+{
+    struct timespec ts;
+    s64 ns;
+    int err;
+
+    err = clock_read_ns(which, &ns);
+    if (err < 0)
+        return err;
+    ts.tv_sec = ns / NS_PER_SEC;
+    ts.tv_nsec = ns % NS_PER_SEC;
+    if (copy_to_user(tp, &ts, sizeof(ts)))
+        return -EFAULT;
+    return 0;
+}
+
+SYSCALL_DECL2(clock_getres, int, which, struct timespec*, tp)
+{
+    struct timespec ts = { .tv_sec = 0 };
+    u64 freq = clock_freq();
+    s64 ns;
+    int err;
+
+    err = clock_read_ns(which, &ns);
+    if (err < 0)
+        return err;
+    if (!tp)
+        return 0;
+    ts.tv_nsec = freq >= NS_PER_SEC ? 1 : (NS_PER_SEC + freq - 1) / freq;
+    if (copy_to_user(tp, &ts, sizeof(ts)))
+        return -EFAULT;
+    return 0;
+}
+
 static inline struct timer_event *
 timer_ev_add(struct timer_event *ev, struct rb_root_cached *tree)
 {
@@ -142,6 +221,7 @@ struct timer_event * create_timer_event(struct task *p, ktime_t expires,
     ev->expires = expires;
     ev->callback = callback ? callback : timer_ev_default_callback;
     ev->context = context;
+    ev->base = NULL;
     INIT_LIST_HEAD(&ev->task_list);
     RB_CLEAR_NODE(&ev->node);
     return ev;
@@ -152,34 +232,80 @@ void destroy_timer_event(struct timer_event *ev)
     kfree(ev);
 }
 
+// p is NULL for events that belong to an object rather than a task
 void timer_ev_enqueue(struct timer_event *ev, struct task *p)
 {
-    struct rb_root_cached *root = get_cpu_var(timer_event_tree);
-    timer_ev_add(ev, root);
-    list_add_tail(&ev->task_list, &p->timer_ev_list);
+    unsigned long flags = arch_irq_save();
+    struct timer_ev_base *base = get_cpu_var(timer_ev_base);
+
+    acquire_lock(&base->lock);
+    ev->base = base;
+    timer_ev_add(ev, &base->tree);
+    release_lock(&base->lock);
+    if (p)
+        list_add_tail(&ev->task_list, &p->timer_ev_list);
+    arch_irq_restore(flags);
 }
 
+/**
+ * Take ev out of the tree it was queued on, from any CPU. If its callback
+ * is running on another CPU, wait for it, so the caller may free ev or
+ * queue it again once this returns.
+ */
 void timer_ev_dequeue(struct timer_event *ev)
 {
-    struct rb_root_cached *root = get_cpu_var(timer_event_tree);
-    timer_ev_del(ev, root);
-    list_del(&ev->task_list);
+    struct timer_ev_base *base = ev->base;
+    unsigned long flags;
+    bool running;
+
+    if (!base)
+        return;
+
+    flags = arch_irq_save();
+    for (;;) {
+        acquire_lock(&base->lock);
+        if (timer_ev_queued(ev))
+            timer_ev_del(ev, &base->tree);
+        running = base->running == ev && base != get_cpu_var(timer_ev_base);
+        release_lock(&base->lock);
+        if (!running)
+            break;
+        // The callback may queue it again, so look once more when it's done
+        while (READ_ONCE(base->running) == ev)
+            __pause();
+    }
+    list_del_init(&ev->task_list);
+    arch_irq_restore(flags);
 }
 
 void timer_ev_tick(void)
 {
-    ktime_t now_ns = ktime_get();
-    struct rb_root_cached *root = get_cpu_var(timer_event_tree);
+    struct timer_ev_base *base;
     struct rb_node *node;
+    ktime_t now_ns;
+
+    // Most ticks have nothing queued, don't read the clock for those
+    if (!this_cpu_read(timer_ev_base.tree.rb_leftmost))
+        return;
+    base = get_cpu_var(timer_ev_base);
+    now_ns = ktime_get();
 
-    while ((node = root->rb_leftmost) != NULL) {
+    acquire_lock(&base->lock);
+    while ((node = base->tree.rb_leftmost) != NULL) {
         struct timer_event *ev = rb_entry(node, struct timer_event, node);
         if (ev->expires > now_ns)
             break;
 
-        timer_ev_dequeue(ev);
+        timer_ev_del(ev, &base->tree);
+        list_del_init(&ev->task_list);
+        // The callback may free ev or queue it again, it isn't touched after
+        base->running = ev;
+        release_lock(&base->lock);
         ev->callback(ev);
+        acquire_lock(&base->lock);
+        base->running = NULL;
     }
+    release_lock(&base->lock);
 }
 
 __attribute__((optimize("O0")))
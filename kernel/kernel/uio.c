@@ -0,0 +1,220 @@
+// Copying to and from segmented user or kernel buffers
+#include <lilac/uio.h>
+#include <lilac/lilac.h>
+#include <lilac/libc.h>
+#include <lilac/err.h>
+#include <lilac/uaccess.h>
+#include <mm/kmalloc.h>
+
+void iov_iter_init(struct iov_iter *i, int direction, const struct iovec *iov,
+    unsigned long nr_segs, size_t count)
+{
+    *i = (struct iov_iter) {
+        .iter_type = ITER_IOVEC,
+        .data_source = direction,
+        .iov = iov,
+        .nr_segs = nr_segs,
+        .iov_offset = 0,
+        .count = count,
+    };
+}
+
+void iov_iter_kvec(struct iov_iter *i, int direction, const struct kvec *kvec,
+    unsigned long nr_segs, size_t count)
+{
+    *i = (struct iov_iter) {
+        .iter_type = ITER_KVEC,
+        .data_source = direction,
+        .kvec = kvec,
+        .nr_segs = nr_segs,
+        .iov_offset = 0,
+        .count = count,
+    };
+}
+
+// Both segment types share a layout, only the address space differs
+static inline const struct kvec *iter_seg(const struct iov_iter *i)
+{
+    return i->kvec;
+}
+
+void iov_iter_advance(struct iov_iter *i, size_t bytes)
+{
+    bytes = MIN(bytes, i->count);
+    i->count -= bytes;
+
+    while (bytes) {
+        size_t left = iter_seg(i)->iov_len - i->iov_offset;
+        if (bytes < left) {
+            i->iov_offset += bytes;
+            return;
+        }
+        bytes -= left;
+        i->kvec++;
+        i->nr_segs--;
+        i->iov_offset = 0;
+    }
+}
+
+void iov_iter_truncate(struct iov_iter *i, size_t count)
+{
+    if (i->count > count)
+        i->count = count;
+}
+
+/**
+ * Point *base at the rest of the current segment and return its length,
+ * stepping over empty segments. Returns 0 once the iterator is used up.
+ */
+size_t iov_iter_segment(struct iov_iter *i, void **base)
+{
+    if (!i->count)
+        return 0;
+    while (iter_seg(i)->iov_len == i->iov_offset) {
+        i->kvec++;
+        i->nr_segs--;
+        i->iov_offset = 0;
+    }
+    *base = iter_seg(i)->iov_base + i->iov_offset;
+    return MIN(iter_seg(i)->iov_len - i->iov_offset, i->count);
+}
+
+/*
+ * Walk the segments copying up to bytes, stopping early if a user page
+ * can't be reached. The ranges were checked when the iterator was built,
+ * so only the fault fixup in arch_user_copy is needed here.
+ */
+static size_t iterate_copy(void *addr, size_t bytes, struct iov_iter *i,
+    bool to_iter)
+{
+    size_t done = 0;
+
+    bytes = MIN(bytes, i->count);
+    while (done < bytes) {
+        void *base = NULL;
+        size_t n = MIN(iov_iter_segment(i, &base), bytes - done);
+        size_t left = 0;
+
+        if (iter_is_user(i)) {
+            left = to_iter ? arch_user_copy(base, addr + done, n) :
+                arch_user_copy(addr + done, base, n);
+        } else if (to_iter) {
+            memcpy(base, addr + done, n);
+        } else {
+            memcpy(addr + done, base, n);
+        }
+
+        iov_iter_advance(i, n - left);
+        done += n - left;
+        if (left)
+            break;
+    }
+
+    return done;
+}
+
+/**
+ * Copy bytes from addr into the iterator and advance it.
+ * Returns the number of bytes copied, short only on a fault.
+ */
+size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i)
+{
+    if (i->data_source)
+        return 0;
+    return iterate_copy((void*)addr, bytes, i, true);
+}
+
+/**
+ * Copy bytes out of the iterator into addr and advance it.
+ * Returns the number of bytes copied, short only on a fault.
+ */
+size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i)
+{
+    if (!i->data_source)
+        return 0;
+    return iterate_copy(addr, bytes, i, false);
+}
+
+/**
+ * Fill bytes of the iterator with zeroes and advance it, for holes.
+ * Returns the number of bytes zeroed, short only on a fault.
+ */
+size_t iov_iter_zero(size_t bytes, struct iov_iter *i)
+{
+    static const u8 zeroes[PAGE_SIZE];
+    size_t done = 0, n, c;
+
+    while (done < bytes) {
+        n = MIN(bytes - done, sizeof(zeroes));
+        c = copy_to_iter(zeroes, n, i);
+        done += c;
+        if (c < n)
+            break;
+    }
+    return done;
+}
+
+/**
+ * Copy a user iovec array in and set up an iterator over it. Arrays of up
+ * to fast_segs entries are copied into *iovp, larger ones are allocated and
+ * *iovp is pointed at them; either way the caller passes *iovp to kfree,
+ * which is NULL for the caller's own array.
+ * Returns the total length or a negative errno.
+ */
+ssize_t import_iovec(int direction, const struct iovec __user *uvec,
+    unsigned int nr_segs, unsigned int fast_segs, struct iovec **iovp,
+    struct iov_iter *i)
+{
+    struct iovec *iov = *iovp;
+    size_t total = 0;
+    ssize_t err = -EFAULT;
+
+    if (nr_segs > UIO_MAXIOV)
+        return -EINVAL;
+    if (nr_segs > fast_segs) {
+        iov = kmalloc(nr_segs * sizeof(struct iovec));
+        if (!iov)
+            return -ENOMEM;
+    }
+
+    if (nr_segs && copy_from_user(iov, uvec, nr_segs * sizeof(struct iovec)))
+        goto error;
+
+    for (unsigned int n = 0; n < nr_segs; n++) {
+        size_t len = iov[n].iov_len;
+
+        if ((ssize_t)len < 0) {
+            err = -EINVAL;
+            goto error;
+        }
+        // Like Linux, quietly shorten the transfer instead of failing it
+        if (len > MAX_RW_COUNT - total)
+            iov[n].iov_len = len = MAX_RW_COUNT - total;
+        if (len && !access_ok(iov[n].iov_base, len))
+            goto error;
+        total += len;
+    }
+
+    iov_iter_init(i, direction, iov, nr_segs, total);
+    *iovp = iov == *iovp ? NULL : iov;
+    return total;
+
+error:
+    if (iov != *iovp)
+        kfree(iov);
+    *iovp = NULL;
+    return err;
+}
+
+int import_single_range(int direction, void __user *buf, size_t len,
+    struct iovec *iov, struct iov_iter *i)
+{
+    len = MIN(len, MAX_RW_COUNT);
+    if (len && !access_ok(buf, len))
+        return -EFAULT;
+
+    iov->iov_base = buf;
+    iov->iov_len = len;
+    iov_iter_init(i, direction, iov, 1, len);
+    return 0;
+}
@@ -4,14 +4,11 @@
 #include <lilac/sched.h>
 #include <lilac/syscall.h>
 #include <lilac/uaccess.h>
+#include <lilac/libc.h>
+#include <user/siginfo.h>
 
 #pragma GCC diagnostic ignored "-Wanalyzer-malloc-leak"
 
-static struct waitqueue wait_q = {
-    .lock = SPINLOCK_INIT,
-    .task_list = LIST_HEAD_INIT(wait_q.task_list),
-};
-
 static inline
 struct wq_entry * alloc_wq_entry(struct task *p)
 {
@@ -55,22 +52,20 @@ static void remove_wait_entry(struct wq_entry *wait, struct waitqueue *wq)
     }
 }
 
-static struct wq_entry *find_waiting_task(struct waitqueue *wq, int pid)
+void add_wait_queue(struct waitqueue *wq, struct wq_entry *wait)
 {
-    struct wq_entry *wait = NULL;
-    if (list_empty(&wq->task_list)) {
-        klog(LOG_DEBUG, "No tasks waiting in waitqueue for pid %d\n", pid);
-        return NULL;
-    }
-    list_for_each_entry(wait, &wq->task_list, entry) {
-        if (wait->task->pid == pid)
-            return wait;
-    }
-    return NULL;
+    add_wait_entry(wait, wq);
+}
+
+void remove_wait_queue(struct waitqueue *wq, struct wq_entry *wait)
+{
+    acquire_lock(&wq->lock);
+    __remove_wait_entry(wait);
+    release_lock(&wq->lock);
 }
 
 // Called by task when it wakes in case it was interrupted while waiting
-int finish_wait(struct waitqueue *wq, struct wq_entry *wq_ent)
+static int finish_sleep(struct waitqueue *wq, struct wq_entry *wq_ent)
 {
     set_task_running(current);
     remove_wait_entry(wq_ent, wq);
@@ -95,168 +90,287 @@ static int sleep_task_on(struct task *p, struct waitqueue *wq, wq_wake_func_t ca
     wait->wakeup = callback;
     add_wait_entry(wait, wq);
     yield();
-    return finish_wait(wq, wait);
+    return finish_sleep(wq, wait);
+}
+
+/*
+ * Queue wait for current unless a wakeup already took it off, then mark
+ * current sleeping. Returns -EINTR if an unblocked signal is pending; that
+ * is checked after the state change so do_raise can't slip in between.
+ */
+int prepare_to_wait(struct waitqueue *wq, struct wq_entry *wait)
+{
+    wait->task = current;
+    wait->wakeup = NULL;
+    acquire_lock(&wq->lock);
+    if (list_empty(&wait->entry))
+        __add_wait_entry(wait, wq);
+    release_lock(&wq->lock);
+
+    set_task_sleeping(current);
+    return sig_get_active(current) ? -EINTR : 0;
 }
 
+void finish_wait(struct waitqueue *wq, struct wq_entry *wait)
+{
+    set_task_running(current);
+    remove_wait_entry(wait, wq);
+    task_interrupted_ack();
+}
+
+/*
+ * What a wait call asks for and what it found. pid is as for waitpid: one
+ * child if positive, any child for WAIT_ANY, otherwise a process group.
+ */
+struct wait_opts {
+    pid_t pid;
+    int options;
+
+    pid_t child_pid;
+    int code;           /* CLD_* */
+    int status;         /* waitpid status word */
+    u64 runtime;        /* the child's and its reaped children's */
+};
+
+static bool wait_eligible(const struct wait_opts *wo, struct task *child)
+{
+    if (wo->pid > 0)
+        return child->pid == wo->pid;
+    if (wo->pid == WAIT_ANY)
+        return true;
+    return child->pgid == (wo->pid == WAIT_PGRP ? current->pgid : -wo->pid);
+}
 
-static struct task * find_exited_child(struct task *parent, int pid)
+static bool has_eligible_child(const struct wait_opts *wo)
 {
     struct task *child;
-    list_for_each_entry(child, &parent->children, sibling) {
-        if (child->state == TASK_ZOMBIE && (pid == WAIT_ANY || child->pid == pid)) {
-            return child;
+
+    if (wo->pid > 0) {
+        child = get_task_by_pid(wo->pid);
+        return child && child->parent == current;
+    }
+    list_for_each_entry(child, &current->children, sibling) {
+        if (wait_eligible(wo, child))
+            return true;
+    }
+    return false;
+}
+
+static void wait_found(struct wait_opts *wo, struct task *child, int code,
+    int status)
+{
+    wo->child_pid = child->pid;
+    wo->code = code;
+    wo->status = status;
+    wo->runtime = child->runtime + child->child_runtime;
+}
+
+/*
+ * The oldest eligible zombie, taken off the list unless WNOWAIT leaves it
+ * there. Waiting for any child takes the head of the list, and a single
+ * child is found through the pid hash, so neither walks the children.
+ */
+static struct task * take_zombie(struct wait_opts *wo)
+{
+    struct waitqueue *wq = &current->wait_chldexit;
+    struct task *child, *found = NULL;
+
+    acquire_lock(&wq->lock);
+    if (wo->pid > 0) {
+        child = get_task_by_pid(wo->pid);
+        if (child && child->parent == current && !list_empty(&child->zombie_node))
+            found = child;
+    } else {
+        list_for_each_entry(child, &current->zombies, zombie_node) {
+            if (wait_eligible(wo, child)) {
+                found = child;
+                break;
+            }
         }
     }
-    return NULL;
+    if (found && !(wo->options & WNOWAIT))
+        list_del_init(&found->zombie_node);
+    release_lock(&wq->lock);
+    return found;
 }
 
-static struct task * find_stopped_child(struct task *parent, int pid)
+// Only asked for with WUNTRACED or WCONTINUED, so a walk is fine here
+static struct task * find_state_change(struct wait_opts *wo)
 {
+    bool consume = !(wo->options & WNOWAIT);
     struct task *child;
-    list_for_each_entry(child, &parent->children, sibling) {
-        if (child->state == TASK_STOPPED &&
-        (pid == WAIT_ANY || child->pid == pid) &&
-        child->flags.state_change) {
-            child->flags.state_change = 0;
+
+    list_for_each_entry(child, &current->children, sibling) {
+        if (!wait_eligible(wo, child))
+            continue;
+        if ((wo->options & WSTOPPED) && child->state == TASK_STOPPED &&
+                child->flags.state_change) {
+            if (consume)
+                child->flags.state_change = 0;
+            wait_found(wo, child, CLD_STOPPED, child->exit_status);
+            return child;
+        }
+        if ((wo->options & WCONTINUED) && child->flags.continued) {
+            if (consume)
+                child->flags.continued = 0;
+            wait_found(wo, child, CLD_CONTINUED, W_CONTINUED);
             return child;
         }
     }
     return NULL;
 }
 
-static pid_t handle_exited_child(struct task *child, int *status)
+// Free a zombie, adding its CPU time to what the caller's children used
+static void release_child(struct task *child)
 {
-    pid_t child_pid = child->pid;
-    if (status) {
-        *status = child->exit_status;
-        klog(LOG_DEBUG, "wait_any: Child %d exited with status %d\n", child_pid, *status);
-    }
+    current->child_runtime += child->runtime + child->child_runtime;
     reap_task(child);
     kfree(child);
-    return child_pid;
 }
 
-static pid_t handle_stopped_child(struct task *child, int *status)
+// The pid of a child to report, 0 if there is none yet or -ECHILD if never
+static pid_t wait_check(struct wait_opts *wo)
 {
-    klog(LOG_DEBUG, "wait_any: Child %d has stopped\n", child->pid);
-    if (status)
-        *status = child->exit_status;
-    return child->pid;
-}
+    struct task *child;
 
-static pid_t wait_for(struct task *p, int *status, bool nohang, bool wait_stopped)
-{
-    u8 state = READ_ONCE(p->state);
+    if ((wo->options & WEXITED) && (child = take_zombie(wo))) {
+        int status = child->exit_status;
 
-    if (state == TASK_ZOMBIE) {
-        return handle_exited_child(p, status);
-    } else if (state == TASK_STOPPED && wait_stopped) {
-        return handle_stopped_child(p, status);
+        wait_found(wo, child, (status & 0x7f) ? CLD_KILLED : CLD_EXITED, status);
+        if (!(wo->options & WNOWAIT))
+            release_child(child);
+        return wo->child_pid;
     }
+    if ((wo->options & (WSTOPPED | WCONTINUED)) && find_state_change(wo))
+        return wo->child_pid;
+    return has_eligible_child(wo) ? 0 : -ECHILD;
+}
 
-    if (nohang) {
-        klog(LOG_DEBUG, "Task %d has not exited yet, returning immediately\n", p->pid);
-        return 0;
+/*
+ * Children report to the parent's own queue, so nobody else is woken by
+ * them. wait_seq is read before each check, and any change reported after
+ * it makes the sleep return, so one can't slip in between.
+ */
+static pid_t do_wait(struct wait_opts *wo)
+{
+    struct waitqueue *wq = &current->wait_chldexit;
+    unsigned int seq;
+    pid_t ret;
+    int err;
+
+    for (;;) {
+        seq = READ_ONCE(current->wait_seq);
+        ret = wait_check(wo);
+        if (ret || (wo->options & WNOHANG))
+            return ret;
+
+        err = wait_event_interruptible(*wq, READ_ONCE(current->wait_seq) != seq);
+        if (err)
+            return err;
     }
+}
 
-    klog(LOG_DEBUG, "Process %d: Waiting for task %d\n", get_pid(), p->pid);
-    p->parent_wait = true;
-    int ret = sleep_task_on(current, &wait_q, NULL);
-    if (ret < 0) {
-#ifdef DEBUG_SCHED
-        klog(LOG_DEBUG, "sleep_task_on returned %d while waiting for task %d\n", ret, p->pid);
-#endif
-        return ret;
-    }
+// TODO: POSIX says when SIGCHLD is SIG_IGN, then wait all children and return ECHILD
 
-    pid_t pid = p->pid;
-    klog(LOG_DEBUG, "Task %d has exited or stopped, continuing task %d\n", pid, get_pid());
-    if (status)
-        *status = p->exit_status;
+static long kernel_wait4(pid_t pid, int __user *status, int options,
+    struct rusage __user *ru)
+{
+    struct wait_opts wo = { .pid = pid };
+    struct rusage r;
+    pid_t ret;
+
+    if (options & ~(WNOHANG | WUNTRACED | WCONTINUED))
+        return -EINVAL;
+    // INT_MIN has no process group to negate to
+    if (pid == -__INT_MAX__ - 1)
+        return -ESRCH;
+
+    wo.options = options | WEXITED;
+    ret = do_wait(&wo);
+    if (ret <= 0)
+        return ret;
 
-    if (p->state == TASK_ZOMBIE) {
-        reap_task(p);
-        kfree(p);
+    if (status && put_user(wo.status, status))
+        return -EFAULT;
+    if (ru) {
+        fill_rusage(&r, wo.runtime);
+        if (copy_to_user(ru, &r, sizeof(r)))
+            return -EFAULT;
     }
-    return pid;
+    return ret;
 }
 
-
-static pid_t check_children(int *status, bool wait_stopped)
+SYSCALL_DECL3(waitpid, int, pid, int __user *, status, int, options)
 {
-    struct task *child = find_exited_child(current, WAIT_ANY);
-    if (child)
-        return handle_exited_child(child, status);
-
-    if (wait_stopped) {
-        child = find_stopped_child(current, WAIT_ANY);
-        if (child)
-            return handle_stopped_child(child, status);
-    }
-
-    return 0;
+    return kernel_wait4(pid, status, options, NULL);
 }
 
-static pid_t wait_any(int *status, bool nohang, bool wait_stopped)
+SYSCALL_DECL4(wait4, int, pid, int __user *, status, int, options,
+    struct rusage __user *, ru)
 {
-    pid_t result;
+    return kernel_wait4(pid, status, options, ru);
+}
 
-    if (list_empty(&current->children)) {
-        klog(LOG_DEBUG, "Process %d has no children to wait for\n", current->pid);
-        return -ECHILD;
+SYSCALL_DECL5(waitid, int, idtype, int, id, siginfo_t __user *, infop,
+    int, options, struct rusage __user *, ru)
+{
+    struct wait_opts wo = { .options = options };
+    siginfo_t info;
+    struct rusage r;
+    pid_t ret;
+
+    if (options & ~(WNOHANG | WNOWAIT | WEXITED | WSTOPPED | WCONTINUED))
+        return -EINVAL;
+    if (!(options & (WEXITED | WSTOPPED | WCONTINUED)))
+        return -EINVAL;
+
+    switch (idtype) {
+    case P_ALL:
+        wo.pid = WAIT_ANY;
+        break;
+    case P_PID:
+        if (id <= 0)
+            return -EINVAL;
+        wo.pid = id;
+        break;
+    case P_PGID:
+        if (id < 0)
+            return -EINVAL;
+        wo.pid = id ? -id : WAIT_PGRP;
+        break;
+    default:
+        return -EINVAL;
     }
 
-    // Check if any child has already exited or stopped
-    result = check_children(status, wait_stopped);
-    if (result != 0)
-        return result;
-
-    if (nohang)
-        return 0;
-
-    current->waiting_any = true;
-    sleep_task_on(current, &wait_q, NULL);
-
-    result = check_children(status, wait_stopped);
-    if (result != 0)
-        return result;
+    ret = do_wait(&wo);
+    if (ret < 0)
+        return ret;
 
-    if (!list_empty(&current->children)) {
-        klog(LOG_INFO, "wait_any: No child has exited after being woken up, returning -EINTR\n");
-        return -EINTR; // interrupted by signal
+    // Nothing to report under WNOHANG leaves si_pid zero
+    memset(&info, 0, sizeof(info));
+    if (ret) {
+        info.si_signo = SIGCHLD;
+        info.si_code = wo.code;
+        info.si_pid = wo.child_pid;
+        switch (wo.code) {
+        case CLD_KILLED:
+            info.si_status = wo.status & 0x7f;
+            break;
+        case CLD_CONTINUED:
+            info.si_status = SIGCONT;
+            break;
+        default:
+            info.si_status = (wo.status >> 8) & 0xff;
+        }
     }
-
-    return -ECHILD; // no children at all
-}
-
-// TODO: POSIX says when SIGCHLD is SIG_IGN, then wait all children and return ECHILD
-
-SYSCALL_DECL3(waitpid, int, pid, int*, status, int, options)
-{
-    if (status && !access_ok(status, sizeof(int)))
+    if (infop && copy_to_user(infop, &info, sizeof(info)))
         return -EFAULT;
-
-    int ret = 0;
-    int status_val = 0;
-    if (pid == -1) {
-        ret = wait_any(&status_val, options & WNOHANG, options & WUNTRACED);
-        if (ret > 0 && status)
-            return put_user(status_val, status) ? -EFAULT : ret;
-        return ret;
-    } else if (pid < -1 || pid == 0) {
-        // pid_t pgid = (pid < -1) ? -pid : current->pgid;
-        return -EINVAL; // TODO: implement process group waiting
+    if (ru) {
+        fill_rusage(&r, ret ? wo.runtime : 0);
+        if (copy_to_user(ru, &r, sizeof(r)))
+            return -EFAULT;
     }
-
-    struct task *p = find_child_by_pid(current, pid);
-    if (!p)
-        return -ECHILD;
-    if (p->ppid != current->pid)
-        return -ECHILD;
-    ret = wait_for(p, &status_val, options & WNOHANG, options & WUNTRACED);
-    if (ret > 0 && status)
-        return put_user(status_val, status) ? -EFAULT : ret;
-    return ret;
+    return 0;
 }
 
 int sleep_on(struct waitqueue *wq)
@@ -264,25 +378,25 @@ int sleep_on(struct waitqueue *wq)
     return sleep_task_on(current, wq, NULL);
 }
 
-static void wakeup_by_pid_on(int pid, struct waitqueue *wq)
-{
-    struct wq_entry *wq_ent = find_waiting_task(wq, pid);
-    if (!wq_ent)
-        return;
-    remove_wait_entry(wq_ent, wq);
-    set_task_running(wq_ent->task);
-}
-
+/*
+ * Wake the first sleeping task on wq. Entries with a wakeup function are
+ * all notified, they only watch the queue and never count as the first.
+ */
 struct task * wake_first(struct waitqueue *wq)
 {
-    struct wq_entry *wait = NULL;
+    struct wq_entry *wait, *tmp;
     struct task *task = NULL;
 
-    if (!list_empty(&wq->task_list)) {
-        wait = list_first_entry(&wq->task_list, struct wq_entry, entry);
-        task = wait->task;
-        remove_wait_entry(wait, wq);
+    acquire_lock(&wq->lock);
+    list_for_each_entry_safe(wait, tmp, &wq->task_list, entry) {
+        if (wait->wakeup) {
+            wait->wakeup(wait);
+        } else if (!task) {
+            task = wait->task;
+            __remove_wait_entry(wait);
+        }
     }
+    release_lock(&wq->lock);
 
     if (task)
         set_task_running(task);
@@ -296,24 +410,49 @@ void wake_all(struct waitqueue *wq)
 
     acquire_lock(&wq->lock);
     list_for_each_entry_safe(wait, tmp, &wq->task_list, entry) {
+        if (wait->wakeup) {
+            wait->wakeup(wait);
+            continue;
+        }
         __remove_wait_entry(wait);
         set_task_running(wait->task);
     }
     release_lock(&wq->lock);
 }
 
+// Queue an exited child for its parent's wait calls and wake them
 void notify_parent(struct task *parent, struct task *child)
 {
+    struct waitqueue *wq;
+
     if (!parent || !child) {
         klog(LOG_ERROR, "Invalid parent or child task in notify_parent\n");
         return;
     }
     klog(LOG_DEBUG, "Notifying parent %d of child %d exit\n", parent->pid, child->pid);
-    if (child->parent_wait || parent->waiting_any) {
-        parent->waiting_any = false;
-        wakeup_by_pid_on(parent->pid, &wait_q);
-    }
+    wq = &parent->wait_chldexit;
+    acquire_lock(&wq->lock);
+    list_add_tail(&child->zombie_node, &parent->zombies);
+    parent->wait_seq++;
+    release_lock(&wq->lock);
+    wake_all(wq);
+
     if (child->exit_signal > 0) {
         do_raise(parent, child->exit_signal);
     }
 }
+
+// Wake the parent's wait calls for a child that stopped or continued
+void notify_parent_state(struct task *child)
+{
+    struct task *parent = child->parent;
+    struct waitqueue *wq;
+
+    if (!parent)
+        return;
+    wq = &parent->wait_chldexit;
+    acquire_lock(&wq->lock);
+    parent->wait_seq++;
+    release_lock(&wq->lock);
+    wake_all(wq);
+}
@@ -0,0 +1,184 @@
+// Sparse pointer arrays indexed by unsigned long
+#include <lib/radix-tree.h>
+#include <lilac/err.h>
+#include <mm/kmalloc.h>
+
+#define RADIX_TREE_MAX_HEIGHT \
+    ((sizeof(unsigned long) * 8 + RADIX_TREE_MAP_SHIFT - 1) / RADIX_TREE_MAP_SHIFT)
+
+static inline unsigned long radix_tree_maxindex(unsigned int height)
+{
+    unsigned int bits = height * RADIX_TREE_MAP_SHIFT;
+
+    if (bits >= sizeof(unsigned long) * 8)
+        return ~0UL;
+    return (1UL << bits) - 1;
+}
+
+/**
+ * Store item at index.
+ * Returns 0, -EEXIST if the slot is taken or -ENOMEM.
+ */
+int radix_tree_insert(struct radix_tree_root *root, unsigned long index,
+    void *item)
+{
+    struct radix_tree_node *node, *child;
+    unsigned int shift, offset;
+
+    if (!root->height)
+        root->height = 1;
+
+    // Grow from the top until index fits, the old tree becomes slot 0
+    while (index > radix_tree_maxindex(root->height)) {
+        if (root->rnode) {
+            node = kzmalloc(sizeof(*node));
+            if (!node)
+                return -ENOMEM;
+            node->slots[0] = root->rnode;
+            node->count = 1;
+            root->rnode = node;
+        }
+        root->height++;
+    }
+
+    if (!root->rnode) {
+        root->rnode = kzmalloc(sizeof(*node));
+        if (!root->rnode)
+            return -ENOMEM;
+    }
+
+    node = root->rnode;
+    for (shift = (root->height - 1) * RADIX_TREE_MAP_SHIFT; shift;
+            shift -= RADIX_TREE_MAP_SHIFT) {
+        offset = (index >> shift) & RADIX_TREE_MAP_MASK;
+        child = node->slots[offset];
+        if (!child) {
+            child = kzmalloc(sizeof(*child));
+            if (!child) {
+                // Let delete prune whatever empty nodes we left behind
+                radix_tree_delete(root, index);
+                return -ENOMEM;
+            }
+            node->slots[offset] = child;
+            node->count++;
+        }
+        node = child;
+    }
+
+    offset = index & RADIX_TREE_MAP_MASK;
+    if (node->slots[offset])
+        return -EEXIST;
+    node->slots[offset] = item;
+    node->count++;
+    return 0;
+}
+
+void *radix_tree_lookup(const struct radix_tree_root *root, unsigned long index)
+{
+    struct radix_tree_node *node = root->rnode;
+    unsigned int shift;
+
+    if (!node || index > radix_tree_maxindex(root->height))
+        return NULL;
+
+    for (shift = (root->height - 1) * RADIX_TREE_MAP_SHIFT; shift;
+            shift -= RADIX_TREE_MAP_SHIFT) {
+        node = node->slots[(index >> shift) & RADIX_TREE_MAP_MASK];
+        if (!node)
+            return NULL;
+    }
+    return node->slots[index & RADIX_TREE_MAP_MASK];
+}
+
+/**
+ * Remove the item at index, freeing any nodes left empty.
+ * Returns the item, or NULL if there wasn't one.
+ */
+void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
+{
+    struct radix_tree_node *path[RADIX_TREE_MAX_HEIGHT];
+    unsigned int offsets[RADIX_TREE_MAX_HEIGHT];
+    struct radix_tree_node *node = root->rnode;
+    unsigned int shift, depth = 0;
+    void *item = NULL;
+
+    if (!node || index > radix_tree_maxindex(root->height))
+        return NULL;
+
+    shift = (root->height - 1) * RADIX_TREE_MAP_SHIFT;
+    while (1) {
+        offsets[depth] = (index >> shift) & RADIX_TREE_MAP_MASK;
+        path[depth++] = node;
+        if (!shift)
+            break;
+        node = node->slots[offsets[depth - 1]];
+        if (!node)
+            break;
+        shift -= RADIX_TREE_MAP_SHIFT;
+    }
+
+    if (!shift) {
+        item = node->slots[offsets[depth - 1]];
+        if (item) {
+            node->slots[offsets[depth - 1]] = NULL;
+            node->count--;
+        }
+    }
+
+    while (depth-- && !path[depth]->count) {
+        kfree(path[depth]);
+        if (depth) {
+            path[depth - 1]->slots[offsets[depth - 1]] = NULL;
+            path[depth - 1]->count--;
+        } else {
+            root->rnode = NULL;
+            root->height = 0;
+        }
+    }
+
+    return item;
+}
+
+static void __gang_lookup(struct radix_tree_node *node, unsigned int shift,
+    unsigned long base, unsigned long first, void **results,
+    unsigned long *indices, unsigned int max_items, unsigned int *nr)
+{
+    for (unsigned long i = 0; i < RADIX_TREE_MAP_SIZE && *nr < max_items; i++) {
+        unsigned long index;
+
+        if (!node->slots[i])
+            continue;
+        index = base + (i << shift);
+        if (index + ((1UL << shift) - 1) < first)
+            continue;
+
+        if (!shift) {
+            results[*nr] = node->slots[i];
+            if (indices)
+                indices[*nr] = index;
+            (*nr)++;
+        } else {
+            __gang_lookup(node->slots[i], shift - RADIX_TREE_MAP_SHIFT, index,
+                first, results, indices, max_items, nr);
+        }
+    }
+}
+
+/**
+ * Collect up to max_items items at or after first_index, in index order.
+ * If indices isn't NULL it receives the index of each one.
+ * Returns the number found.
+ */
+unsigned int radix_tree_gang_lookup(const struct radix_tree_root *root,
+    void **results, unsigned long *indices, unsigned long first_index,
+    unsigned int max_items)
+{
+    unsigned int nr = 0;
+
+    if (!root->rnode || first_index > radix_tree_maxindex(root->height))
+        return 0;
+
+    __gang_lookup(root->rnode, (root->height - 1) * RADIX_TREE_MAP_SHIFT, 0,
+        first_index, results, indices, max_items, &nr);
+    return nr;
+}
@@ -1,11 +1,26 @@
 #include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned long word_t;
+#define WSIZE sizeof(word_t)
 
 int memcmp(const void *aptr, const void *bptr, size_t size)
 {
 	const unsigned char *a = (const unsigned char*)aptr;
 	const unsigned char *b = (const unsigned char*)bptr;
-	size_t i;
-	for (i = 0; i < size; i++) {
+	size_t i = 0;
+
+	/* Skip equal words, the bytes of the first differing one decide */
+	if (!(((uintptr_t)a ^ (uintptr_t)b) & (WSIZE - 1))) {
+		while (((uintptr_t)(a + i) & (WSIZE - 1)) && i < size && a[i] == b[i])
+			i++;
+		if (!((uintptr_t)(a + i) & (WSIZE - 1))) {
+			while (i + WSIZE <= size &&
+					*(const word_t*)(a + i) == *(const word_t*)(b + i))
+				i += WSIZE;
+		}
+	}
+	for (; i < size; i++) {
 		if (a[i] < b[i])
 			return -1;
 		else if (b[i] < a[i])
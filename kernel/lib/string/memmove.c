@@ -1,16 +1,51 @@
 #include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned long word_t;
+#define WSIZE sizeof(word_t)
+
+void *memcpy(void *restrict dstptr, const void *restrict srcptr, size_t size);
 
 void *memmove(void *dstptr, const void *srcptr, size_t size)
 {
 	unsigned char *dst = (unsigned char*)dstptr;
 	const unsigned char *src = (const unsigned char*)srcptr;
-	size_t i;
+	int words = !(((uintptr_t)dst ^ (uintptr_t)src) & (WSIZE - 1));
+
+	/* Apart, so memcpy's faster copy is safe */
+	if (dst + size <= src || src + size <= dst)
+		return memcpy(dstptr, srcptr, size);
+
 	if (dst < src) {
-		for (i = 0; i < size; i++)
-			dst[i] = src[i];
+		if (words) {
+			while (((uintptr_t)dst & (WSIZE - 1)) && size) {
+				*dst++ = *src++;
+				size--;
+			}
+			for (; size >= WSIZE; size -= WSIZE) {
+				*(word_t*)dst = *(const word_t*)src;
+				dst += WSIZE;
+				src += WSIZE;
+			}
+		}
+		while (size--)
+			*dst++ = *src++;
 	} else {
-		for (i = size; i != 0; i--)
-			dst[i-1] = src[i-1];
+		dst += size;
+		src += size;
+		if (words) {
+			while (((uintptr_t)dst & (WSIZE - 1)) && size) {
+				*--dst = *--src;
+				size--;
+			}
+			for (; size >= WSIZE; size -= WSIZE) {
+				dst -= WSIZE;
+				src -= WSIZE;
+				*(word_t*)dst = *(const word_t*)src;
+			}
+		}
+		while (size--)
+			*--dst = *--src;
 	}
 	return dstptr;
 }
@@ -1,11 +1,29 @@
 #include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned long word_t;
+#define WSIZE sizeof(word_t)
+#define ONES ((word_t)-1 / 0xff)
+#define HIGHS (ONES * 0x80)
+/* Non-zero when some byte of x is zero */
+#define HAS_ZERO(x) (((x) - ONES) & ~(x) & HIGHS)
 
 size_t strlen(const char *str)
 {
-	size_t len = 0;
-	while (str[len])
-		len++;
-	return len;
+	const char *s = str;
+	const word_t *w;
+
+	while ((uintptr_t)s & (WSIZE - 1)) {
+		if (!*s)
+			return s - str;
+		s++;
+	}
+	/* Aligned words never cross into the next page */
+	for (w = (const word_t*)s; !HAS_ZERO(*w); w++)
+		;
+	for (s = (const char*)w; *s; s++)
+		;
+	return s - str;
 }
 
 size_t strnlen(const char *str, size_t max)
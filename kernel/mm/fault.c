@@ -39,8 +39,25 @@ static inline void * fault_page_alloc(void)
     return page;
 }
 
-// TODO flags
-static int do_file_fault(struct vm_desc *vma, uintptr_t pgaddr, unsigned long flags)
+static int vma_page_flags(struct vm_desc *vma)
+{
+    int mem_pflags = MEM_PF_USER;
+    if (vma->vm_flags & VM_READ)
+        mem_pflags |= MEM_PF_READ;
+    if (vma->vm_flags & VM_WRITE)
+        mem_pflags |= MEM_PF_WRITE;
+    if (!(vma->vm_flags & VM_EXEC))
+        mem_pflags |= MEM_PF_NO_EXEC;
+    return mem_pflags;
+}
+
+static inline bool vma_is_shared_file(struct vm_desc *vma)
+{
+    return vma->vm_file && (vma->vm_flags & (VM_SHARED | VM_IO)) == VM_SHARED;
+}
+
+// Fill a private page with the part of the file vma maps at pgaddr
+static int do_file_page(struct vm_desc *vma, uintptr_t pgaddr, struct page **pgp)
 {
     struct file *f = vma->vm_file;
     uintptr_t seg_vaddr  = vma->seg_vaddr;   /* exact ELF p_vaddr */
@@ -65,8 +82,8 @@ static int do_file_fault(struct vm_desc *vma, uintptr_t pgaddr, unsigned long fl
                         : 0;
 
     if (off_in_seg >= fsize) {
-        memset(buf, 0, PAGE_SIZE);
-        goto map_page_out;
+        clear_page(buf);
+        goto out;
     }
 
     /* We will place file bytes into buf at offset start_in_page and read at most
@@ -84,8 +101,8 @@ static int do_file_fault(struct vm_desc *vma, uintptr_t pgaddr, unsigned long fl
          pgaddr, start_in_page, off_in_seg, file_offset, bytes_to_read);
 #endif
 
-    vfs_lseek(f, file_offset, 0);
-    ssize_t bytes = vfs_read(f, buf + start_in_page, bytes_to_read);
+    // Positioned, so the mapping doesn't move the file offset under its owner
+    ssize_t bytes = vfs_read_at(f, buf + start_in_page, bytes_to_read, file_offset);
     if (bytes < 0) {
         free_page(buf);
         return FAULT_FILE_ERROR;
@@ -98,48 +115,56 @@ static int do_file_fault(struct vm_desc *vma, uintptr_t pgaddr, unsigned long fl
     if (filled < PAGE_SIZE)
         memset(buf + filled, 0, PAGE_SIZE - filled);
 
-map_page_out:
-    {
-        int mem_pflags = MEM_PF_USER;
-        if (vma->vm_flags & VM_READ)
-            mem_pflags |= MEM_PF_READ;
-        if (vma->vm_flags & VM_WRITE)
-            mem_pflags |= MEM_PF_WRITE;
-        if (!(vma->vm_flags & VM_EXEC))
-            mem_pflags |= MEM_PF_NO_EXEC;
-
-        acquire_lock(&vma->mm->page_table_lock);
-        map_page((void *)virt_to_phys(buf), (void *)pgaddr, mem_pflags);
-        release_lock(&vma->mm->page_table_lock);
-    }
-
+out:
+    *pgp = virt_to_page(buf);
     return FAULT_SUCCESS;
 }
 
-// TODO flags
-static int do_anon_fault(struct vm_desc *vma, uintptr_t pgaddr, unsigned long flags)
+/*
+ * The file's own page for a shared mapping, so stores go straight to the
+ * page cache and every mapping of the file sees them. The hardware dirty
+ * bit records which pages need writing back.
+ */
+static int do_shared_page(struct vm_desc *vma, uintptr_t pgaddr, struct page **pgp)
+{
+    struct inode *inode = vma->vm_file->f_dentry->d_inode;
+    unsigned long index = vma_file_index(vma, pgaddr);
+
+    if (index >= PAGE_UP_COUNT(inode->i_size))
+        return FAULT_FILE_ERROR;
+
+    *pgp = inode->i_data.a_ops->fault_page(inode, index);
+    return *pgp ? FAULT_SUCCESS : FAULT_FILE_ERROR;
+}
+
+static int do_anon_page(struct vm_desc *vma, uintptr_t pgaddr, struct page **pgp)
 {
     void *page = get_zeroed_pages(1, ALLOC_NORMAL);
+    if (!page)
+        return FAULT_OOM;
 #ifdef DEBUG_MM
     mm_dbg_fault_anon_pages_alloc++;
 #endif
-    int mem_pflags = MEM_PF_USER;
-    if (vma->vm_flags & VM_READ)
-        mem_pflags |= MEM_PF_READ;
-    if (vma->vm_flags & VM_WRITE)
-        mem_pflags |= MEM_PF_WRITE;
-    if (!(vma->vm_flags & VM_EXEC))
-        mem_pflags |= MEM_PF_NO_EXEC;
-    acquire_lock(&vma->mm->page_table_lock);
-    map_page((void*)virt_to_phys(page), (void*)pgaddr, mem_pflags);
-    release_lock(&vma->mm->page_table_lock);
+    *pgp = virt_to_page(page);
     return FAULT_SUCCESS;
 }
 
+// The page to map at pgaddr, with a reference held for the mapping
+static int fault_get_page(struct vm_desc *vma, uintptr_t pgaddr, struct page **pgp)
+{
+    if (vma_is_shared_file(vma))
+        return do_shared_page(vma, pgaddr, pgp);
+    if (vma->vm_file)
+        return do_file_page(vma, pgaddr, pgp);
+    return do_anon_page(vma, pgaddr, pgp);
+}
+
 // Handle user memory faults
 int mm_fault(struct vm_desc *vma, uintptr_t addr, unsigned long flags)
 {
     uintptr_t page_start = PAGE_ROUND_DOWN(addr);
+    struct page *pg;
+    int ret;
 
     if (!check_access(vma, flags))
         return FAULT_PROT_VIOLATION;
@@ -149,8 +174,71 @@ int mm_fault(struct vm_desc *vma, uintptr_t addr, unsigned long flags)
         kerror("Page table entry already exists for address %lx\n", addr);
     }
 
-    if (vma->vm_file)
-        return do_file_fault(vma, page_start, flags);
-    else
-        return do_anon_fault(vma, page_start, flags);
+    ret = fault_get_page(vma, page_start, &pg);
+    if (ret != FAULT_SUCCESS)
+        return ret;
+
+    acquire_lock(&vma->mm->page_table_lock);
+    map_page((void*)page_to_phys(pg), (void*)page_start, vma_page_flags(vma));
+    release_lock(&vma->mm->page_table_lock);
+    return FAULT_SUCCESS;
+}
+
+#define POPULATE_BATCH  32
+
+/*
+ * Fault in [start, end) of vma ahead of use (MAP_POPULATE). Pages are
+ * prepared a batch at a time and mapped in one pass under the
+ * page_table_lock, rather than one fault and lock round trip per page.
+ * Pages that are already mapped are left alone.
+ */
+int mm_populate(struct vm_desc *vma, uintptr_t start, uintptr_t end)
+{
+    struct page *pages[POPULATE_BATCH];
+    struct mm_info *mm = vma->mm;
+    int mem_pflags = vma_page_flags(vma);
+    int ret = FAULT_SUCCESS;
+    unsigned int i, n;
+    uintptr_t addr;
+
+    if ((vma->vm_flags & VM_IO) || !(vma->vm_flags & VM_PROT_MASK))
+        return 0;
+
+    // Read the file in a few large requests rather than a page per fault
+    if (vma->vm_file) {
+        unsigned long first = vma_file_index(vma, start);
+        force_page_cache_readahead(vma->vm_file, first,
+            vma_file_index(vma, end - 1) - first + 1);
+    }
+
+    while (start < end && ret == FAULT_SUCCESS) {
+        for (n = 0, addr = start; addr < end && n < POPULATE_BATCH;
+                n++, addr += PAGE_SIZE) {
+            pages[n] = NULL;
+            if (user_page_mapped(addr))
+                continue;
+            ret = fault_get_page(vma, addr, &pages[n]);
+            if (ret != FAULT_SUCCESS)
+                break;
+        }
+
+        acquire_lock(&mm->page_table_lock);
+        for (i = 0; i < n; i++) {
+            addr = start + i * PAGE_SIZE;
+            if (!pages[i] || user_page_mapped(addr))
+                continue;
+            map_page((void*)page_to_phys(pages[i]), (void*)addr, mem_pflags);
+            pages[i] = NULL;
+        }
+        release_lock(&mm->page_table_lock);
+
+        // Lost a race with a fault on another thread
+        for (i = 0; i < n; i++) {
+            if (pages[i])
+                put_page(pages[i]);
+        }
+        start += n * PAGE_SIZE;
+    }
+
+    return ret == FAULT_SUCCESS ? 0 : ret == FAULT_OOM ? -ENOMEM : -EIO;
 }
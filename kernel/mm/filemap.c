@@ -0,0 +1,606 @@
+// Page cache and readahead for regular files
+#include <mm/filemap.h>
+#include <mm/kmm.h>
+#include <mm/page.h>
+#include <mm/kmalloc.h>
+#include <lilac/exec_cache.h>
+#include <lilac/fs.h>
+#include <lilac/fdtable.h>
+#include <lilac/libc.h>
+#include <lilac/log.h>
+#include <lilac/err.h>
+#include <lilac/sync.h>
+#include <lilac/syscall.h>
+
+#define PAGE_CACHE_MAX_PAGES    8192    /* 32 MiB */
+
+struct cached_page {
+    struct rb_node node;
+    struct list_head lru;
+    struct address_space *mapping;
+    unsigned long index;
+    void *virt;
+    unsigned int refs;      /* readers copying out of the page */
+    unsigned int writeback; /* writepage calls copying out of the page */
+};
+
+/*
+ * One lock covers every mapping and the global LRU, so eviction never has
+ * to take a second lock. Readers pin a page and copy out of it unlocked,
+ * since copying to user memory can fault and read another file.
+ *
+ * The cache holds one reference to each frame and shared mappings of the
+ * file hold the others, so a frame outlives its cached_page while mapped.
+ */
+static spinlock_t page_cache_lock = SPINLOCK_INIT;
+static LIST_HEAD(page_cache_lru);   /* least recently used first */
+static unsigned long page_cache_pages;
+
+static int cached_page_cmp(const void *key, const struct rb_node *node)
+{
+    unsigned long index = *(const unsigned long*)key;
+    const struct cached_page *cp = rb_entry(node, struct cached_page, node);
+
+    if (index < cp->index)
+        return -1;
+    return index > cp->index;
+}
+
+static int cached_page_node_cmp(struct rb_node *a, const struct rb_node *b)
+{
+    return cached_page_cmp(&rb_entry(a, struct cached_page, node)->index, b);
+}
+
+static inline struct cached_page *
+__find_page(struct address_space *mapping, unsigned long index)
+{
+    struct rb_node *node = rb_find(&index, &mapping->pages, cached_page_cmp);
+    return node ? rb_entry(node, struct cached_page, node) : NULL;
+}
+
+// First cached page at or after index
+static struct cached_page *
+__find_page_from(struct address_space *mapping, unsigned long index)
+{
+    struct rb_node *node = mapping->pages.rb_node;
+    struct cached_page *cp, *match = NULL;
+
+    while (node) {
+        cp = rb_entry(node, struct cached_page, node);
+        if (cp->index < index) {
+            node = node->rb_right;
+        } else {
+            match = cp;
+            if (cp->index == index)
+                break;
+            node = node->rb_left;
+        }
+    }
+    return match;
+}
+
+static inline bool page_is_mapped(struct cached_page *cp)
+{
+    return atomic_load(&virt_to_page(cp->virt)->refcount) > 1;
+}
+
+static inline void cached_page_free(struct cached_page *cp)
+{
+    put_page(virt_to_page(cp->virt));
+    kfree(cp);
+}
+
+// A pinned page is unhooked now and freed by its last reader
+static void __remove_page(struct cached_page *cp, struct list_head *freed)
+{
+    rb_erase(&cp->node, &cp->mapping->pages);
+    cp->mapping->nrpages--;
+    page_cache_pages--;
+    if (cp->refs) {
+        list_del_init(&cp->lru);
+        cp->mapping = NULL;
+    } else {
+        list_move(&cp->lru, freed);
+    }
+}
+
+static void free_cached_pages(struct list_head *freed)
+{
+    struct cached_page *cp, *tmp;
+
+    list_for_each_entry_safe(cp, tmp, freed, lru)
+        cached_page_free(cp);
+}
+
+static void page_cache_put(struct cached_page *cp)
+{
+    bool dead;
+
+    acquire_lock(&page_cache_lock);
+    dead = !--cp->refs && !cp->mapping;
+    release_lock(&page_cache_lock);
+
+    if (dead)
+        cached_page_free(cp);
+}
+
+static void page_cache_insert(struct address_space *mapping,
+    struct cached_page *cp)
+{
+    LIST_HEAD(freed);
+    struct cached_page *victim;
+    unsigned long scan;
+
+    acquire_lock(&page_cache_lock);
+    if (rb_find_add(&cp->node, &mapping->pages, cached_page_node_cmp)) {
+        // Someone else read this page in first
+        INIT_LIST_HEAD(&cp->lru);
+        list_add(&cp->lru, &freed);
+    } else {
+        cp->mapping = mapping;
+        list_add_tail(&cp->lru, &page_cache_lru);
+        mapping->nrpages++;
+        page_cache_pages++;
+
+        // Mapped pages stay, so every mapping of a page shares one frame
+        for (scan = page_cache_pages;
+                page_cache_pages > PAGE_CACHE_MAX_PAGES && scan; scan--) {
+            victim = list_first_entry(&page_cache_lru, struct cached_page, lru);
+            if (page_is_mapped(victim))
+                list_move_tail(&victim->lru, &page_cache_lru);
+            else
+                __remove_page(victim, &freed);
+        }
+    }
+    release_lock(&page_cache_lock);
+
+    free_cached_pages(&freed);
+}
+
+void file_ra_state_init(struct file_ra_state *ra)
+{
+    ra->start = 0;
+    ra->size = 0;
+    ra->async_size = 0;
+    ra->ra_pages = RA_DEFAULT_PAGES;
+    ra->prev_index = -1UL;
+}
+
+/*
+ * Read pages [index, index + nr_pages) that aren't cached yet. Each run of
+ * missing pages goes to the filesystem as one contiguous buffer so it can
+ * be fetched with as few disk requests as possible.
+ */
+static int __do_page_cache_readahead(struct inode *inode, unsigned long index,
+    unsigned long nr_pages)
+{
+    struct address_space *mapping = &inode->i_data;
+    unsigned long end, run;
+    struct cached_page *cp;
+    void *buf;
+    int err;
+
+    if (!mapping->a_ops || !mapping->a_ops->readpages || !inode->i_size)
+        return -EINVAL;
+
+    end = MIN(index + nr_pages, PAGE_UP_COUNT(inode->i_size));
+    while (index < end) {
+        acquire_lock(&page_cache_lock);
+        while (index < end && __find_page(mapping, index))
+            index++;
+        for (run = 0; index + run < end && run < RA_MAX_PAGES &&
+                !__find_page(mapping, index + run); run++)
+            ;
+        release_lock(&page_cache_lock);
+        if (!run)
+            break;
+
+        // Fall back to smaller runs if memory is fragmented
+        while (run > 1 && !(buf = get_free_pages(run, ALLOC_MAYFAIL)))
+            run /= 2;
+        if (run == 1)
+            buf = get_free_pages(1, ALLOC_NORMAL);
+        if (!buf)
+            return -ENOMEM;
+
+        err = mapping->a_ops->readpages(inode, index, buf, run);
+        if (err) {
+            free_pages(buf, run);
+            return err;
+        }
+
+        for (unsigned long i = 0; i < run; i++) {
+            cp = kmalloc(sizeof(*cp));
+            if (!cp) {
+                free_pages(buf + i * PAGE_SIZE, run - i);
+                return -ENOMEM;
+            }
+            cp->index = index + i;
+            cp->virt = buf + i * PAGE_SIZE;
+            cp->refs = 0;
+            cp->writeback = 0;
+            page_cache_insert(mapping, cp);
+        }
+        index += run;
+    }
+
+    return 0;
+}
+
+int force_page_cache_readahead(struct file *file, unsigned long index,
+    unsigned long nr_pages)
+{
+    struct inode *inode = file->f_dentry->d_inode;
+
+    while (nr_pages) {
+        unsigned long n = MIN(nr_pages, RA_MAX_PAGES);
+        int err = __do_page_cache_readahead(inode, index, n);
+        if (err)
+            return err;
+        index += n;
+        nr_pages -= n;
+    }
+    return 0;
+}
+
+static inline unsigned int ra_next_size(struct file_ra_state *ra)
+{
+    unsigned int size = ra->size < RA_MIN_PAGES ? RA_MIN_PAGES : ra->size * 2;
+    return MIN(size, ra->ra_pages);
+}
+
+// Cache miss: pick a new window based on how this read follows the last one
+static int page_cache_sync_readahead(struct file *file, unsigned long index,
+    unsigned long req_pages)
+{
+    struct file_ra_state *ra = &file->f_ra;
+    struct inode *inode = file->f_dentry->d_inode;
+
+    if (!ra->ra_pages)
+        return __do_page_cache_readahead(inode, index, req_pages);
+
+    if (index == ra->prev_index + 1 || index == ra->start + ra->size)
+        ra->size = ra_next_size(ra);
+    else
+        ra->size = MIN(RA_MIN_PAGES, ra->ra_pages);
+
+    ra->start = index;
+    ra->size = MAX(ra->size, MIN(req_pages, ra->ra_pages));
+    ra->async_size = ra->size / 2;
+    return __do_page_cache_readahead(inode, ra->start, ra->size);
+}
+
+/*
+ * The reader reached the marker page of a window it is streaming through:
+ * read the following window before it gets there. There is no I/O thread
+ * to hand this to, so it is issued here, but as one large request.
+ */
+static void page_cache_async_readahead(struct file *file)
+{
+    struct file_ra_state *ra = &file->f_ra;
+
+    ra->start += ra->size;
+    ra->size = ra_next_size(ra);
+    ra->async_size = ra->size;
+    __do_page_cache_readahead(file->f_dentry->d_inode, ra->start, ra->size);
+}
+
+// Read from *ppos through the page cache into the iterator, advancing *ppos
+ssize_t filemap_read(struct file *file, struct iov_iter *to, off_t *ppos)
+{
+    struct inode *inode = file->f_dentry->d_inode;
+    struct address_space *mapping = &inode->i_data;
+    struct file_ra_state *ra = &file->f_ra;
+    u64 pos = *ppos;
+    unsigned long last;
+    size_t count, copied = 0;
+    int retries = 0;
+    int err = 0;
+
+    if (pos >= inode->i_size || !iov_iter_count(to))
+        return 0;
+    count = MIN(iov_iter_count(to), inode->i_size - pos);
+    last = (pos + count - 1) >> PAGE_SHIFT;
+
+    while (copied < count) {
+        unsigned long index = pos >> PAGE_SHIFT;
+        size_t offset = pos & (PAGE_SIZE - 1);
+        size_t n = MIN(PAGE_SIZE - offset, count - copied);
+        size_t done;
+        struct cached_page *cp;
+        bool marker;
+
+        acquire_lock(&page_cache_lock);
+        cp = __find_page(mapping, index);
+        if (!cp) {
+            release_lock(&page_cache_lock);
+            // A page can be evicted before we get back to it; don't spin
+            if (retries++ > 2) {
+                err = -EIO;
+                break;
+            }
+            err = page_cache_sync_readahead(file, index, last - index + 1);
+            if (err)
+                break;
+            continue;
+        }
+
+        cp->refs++;
+        list_move_tail(&cp->lru, &page_cache_lru);
+        marker = ra->async_size && ra->ra_pages &&
+            index == ra->start + ra->size - ra->async_size;
+        release_lock(&page_cache_lock);
+
+        done = copy_to_iter(cp->virt + offset, n, to);
+        page_cache_put(cp);
+
+        pos += done;
+        copied += done;
+        if (done < n) {
+            err = -EFAULT;
+            break;
+        }
+
+        if (marker && index != ra->prev_index)
+            page_cache_async_readahead(file);
+
+        ra->prev_index = index;
+        retries = 0;
+    }
+
+    *ppos = pos;
+    return copied ? (ssize_t)copied : err;
+}
+
+// What to do with a page in the range that a process has mapped
+enum inval_mapped {
+    INVAL_DROP,         /* drop it anyway, the frame lives on in the mapping */
+    INVAL_KEEP,         /* leave it cached */
+};
+
+static void __invalidate_pages(struct address_space *mapping,
+    unsigned long start, unsigned long end, enum inval_mapped mapped)
+{
+    LIST_HEAD(freed);
+    struct cached_page *cp;
+    unsigned long index = start;
+
+    acquire_lock(&page_cache_lock);
+    while ((cp = __find_page_from(mapping, index)) && cp->index <= end) {
+        index = cp->index + 1;
+        if (mapped == INVAL_DROP || !page_is_mapped(cp))
+            __remove_page(cp, &freed);
+    }
+    release_lock(&page_cache_lock);
+
+    free_cached_pages(&freed);
+}
+
+/*
+ * A write just put len bytes from buf at pos in the file. Cached pages
+ * nobody has mapped are dropped. Mapped ones get the bytes copied in, so
+ * the mappings and later faults keep sharing the frame, and stores made
+ * through it that aren't written back yet survive.
+ */
+void filemap_write_update(struct address_space *mapping, off_t pos,
+    const void *buf, size_t len)
+{
+    LIST_HEAD(freed);
+    struct cached_page *cp;
+    unsigned long index = pos >> PAGE_SHIFT;
+    unsigned long end;
+
+    if (!len)
+        return;
+    end = (pos + len - 1) >> PAGE_SHIFT;
+
+    acquire_lock(&page_cache_lock);
+    while ((cp = __find_page_from(mapping, index)) && cp->index <= end) {
+        off_t page_pos = (off_t)cp->index << PAGE_SHIFT;
+        off_t from = MAX(pos, page_pos);
+        off_t to = MIN(pos + (off_t)len, page_pos + (off_t)PAGE_SIZE);
+
+        index = cp->index + 1;
+        if (!page_is_mapped(cp))
+            __remove_page(cp, &freed);
+        // Written back from its own contents, which may be newer than buf
+        else if (!cp->writeback)
+            memcpy(cp->virt + (from - page_pos), buf + (from - pos), to - from);
+    }
+    release_lock(&page_cache_lock);
+
+    free_cached_pages(&freed);
+}
+
+/*
+ * Reclaim the cached pages start..end (inclusive) nobody has mapped, as
+ * POSIX_FADV_DONTNEED asks. Mapped pages may hold stores not written back.
+ */
+void invalidate_unmapped_pages(struct address_space *mapping,
+    unsigned long start, unsigned long end)
+{
+    __invalidate_pages(mapping, start, end, INVAL_KEEP);
+}
+
+// The file is going away or shrinking, mapped frames live on in their mappings
+void truncate_inode_pages(struct address_space *mapping)
+{
+    __invalidate_pages(mapping, 0, -1UL, INVAL_DROP);
+}
+
+/*
+ * Shared writable mappings of a file are counted so a write seal can tell
+ * whether one still exists. Denying them pins the count at -1, after which
+ * no new one can be made.
+ */
+int mapping_map_writable(struct address_space *mapping)
+{
+    int n = __atomic_load_n(&mapping->i_mmap_writable, __ATOMIC_RELAXED);
+
+    do {
+        if (n < 0)
+            return -EPERM;
+    } while (!__atomic_compare_exchange_n(&mapping->i_mmap_writable, &n, n + 1,
+            true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    // Stores through the mapping won't pass the write path's invalidation
+    exec_cache_invalidate(container_of(mapping, struct inode, i_data));
+    return 0;
+}
+
+void mapping_unmap_writable(struct address_space *mapping)
+{
+    __atomic_fetch_sub(&mapping->i_mmap_writable, 1, __ATOMIC_RELEASE);
+}
+
+// -EBUSY while a shared writable mapping exists
+int mapping_deny_writable(struct address_space *mapping)
+{
+    int n = 0;
+
+    if (__atomic_compare_exchange_n(&mapping->i_mmap_writable, &n, -1,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return 0;
+    return n < 0 ? 0 : -EBUSY;
+}
+
+/*
+ * The frame caching page index of inode for a shared mapping, read in if
+ * needed and returned with a reference held. NULL on I/O error or no memory.
+ */
+struct page *filemap_get_page(struct inode *inode, unsigned long index)
+{
+    struct address_space *mapping = &inode->i_data;
+    struct cached_page *cp;
+    struct page *pg;
+
+    for (int retries = 0; retries < 3; retries++) {
+        acquire_lock(&page_cache_lock);
+        cp = __find_page(mapping, index);
+        if (cp) {
+            pg = virt_to_page(cp->virt);
+            get_page(pg);
+            list_move_tail(&cp->lru, &page_cache_lru);
+            release_lock(&page_cache_lock);
+            return pg;
+        }
+        release_lock(&page_cache_lock);
+
+        if (__do_page_cache_readahead(inode, index, RA_MIN_PAGES))
+            return NULL;
+    }
+    return NULL;
+}
+
+/*
+ * Write back a page a shared mapping dirtied. The cached page is marked for
+ * the length of the write, so the invalidation the filesystem does after
+ * it doesn't reread the page over data written to it since.
+ */
+int filemap_writepage(struct file *file, struct page *page,
+    unsigned long index)
+{
+    struct inode *inode = file->f_dentry->d_inode;
+    struct address_space *mapping = &inode->i_data;
+    off_t pos = (off_t)index << PAGE_SHIFT;
+    struct cached_page *cp;
+    struct iov_iter iter;
+    struct kvec kv;
+    ssize_t ret;
+
+    // Whatever is past the end of the file was truncated under the mapping
+    if (pos >= (off_t)inode->i_size)
+        return 0;
+    kv.iov_base = get_page_addr(page);
+    kv.iov_len = MIN(PAGE_SIZE, inode->i_size - pos);
+
+    acquire_lock(&page_cache_lock);
+    cp = __find_page(mapping, index);
+    if (cp && cp->virt == kv.iov_base) {
+        cp->refs++;
+        cp->writeback++;
+    } else {
+        cp = NULL;
+    }
+    release_lock(&page_cache_lock);
+
+    iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, kv.iov_len);
+    ret = vfs_iter_write_at(file, &iter, pos);
+
+    if (cp) {
+        acquire_lock(&page_cache_lock);
+        cp->writeback--;
+        release_lock(&page_cache_lock);
+        page_cache_put(cp);
+    }
+
+    if (ret < 0)
+        return ret;
+    return (size_t)ret < kv.iov_len ? -EIO : 0;
+}
+
+static void file_ra_set_advice(struct file_ra_state *ra, int advice)
+{
+    switch (advice) {
+    case POSIX_FADV_NORMAL:
+        ra->ra_pages = RA_DEFAULT_PAGES;
+        break;
+    case POSIX_FADV_SEQUENTIAL:
+        ra->ra_pages = RA_MAX_PAGES;
+        break;
+    case POSIX_FADV_RANDOM:
+        ra->ra_pages = 0;
+        break;
+    }
+}
+
+int vfs_fadvise(struct file *file, off_t offset, off_t len, int advice)
+{
+    struct inode *inode = file->f_dentry ? file->f_dentry->d_inode : NULL;
+    unsigned long start, end;
+
+    if (!inode || S_ISFIFO(inode->i_mode))
+        return -ESPIPE;
+    if (offset < 0 || len < 0)
+        return -EINVAL;
+
+    start = offset >> PAGE_SHIFT;
+    if (len == 0 || offset + len > (off_t)inode->i_size)
+        end = PAGE_UP_COUNT(inode->i_size);
+    else
+        end = PAGE_UP_COUNT(offset + len);
+
+    switch (advice) {
+    case POSIX_FADV_NORMAL:
+    case POSIX_FADV_SEQUENTIAL:
+    case POSIX_FADV_RANDOM:
+        file_ra_set_advice(&file->f_ra, advice);
+        return 0;
+    case POSIX_FADV_WILLNEED:
+        if (!S_ISREG(inode->i_mode) || start >= end)
+            return 0;
+        // Best effort, a failed read just means less is cached
+        force_page_cache_readahead(file, start, end - start);
+        return 0;
+    case POSIX_FADV_DONTNEED:
+        if (start < end)
+            invalidate_unmapped_pages(&inode->i_data, start, end - 1);
+        return 0;
+    case POSIX_FADV_NOREUSE:
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+SYSCALL_DECL4(fadvise64, int, fd, off_t, offset, off_t, len, int, advice)
+{
+    struct fd f = fdget(fd);
+    int err;
+
+    if (!f.file)
+        return -EBADF;
+    err = vfs_fadvise(f.file, offset, len, advice);
+    fdput(f);
+    return err;
+}
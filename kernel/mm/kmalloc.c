@@ -140,7 +140,6 @@ void *kmalloc(size_t size)
 {
     if (size <= 0) return NULL;
     assert(BUCKETS >= log2(SUPERBLOCKSIZE)-MIN_ALLOC_POWER);
-    assert(this_cpu_id() < CONFIG_MAX_CPUS && __per_cpu_offset[this_cpu_id()] != 0);
 
     void *alloc = NULL;
 
@@ -267,11 +266,15 @@ void kfree(const void *ptr)
     }
 
     /* Local free: process pending remote frees first */
-    struct kmem_cpu *kmem = this_cpu_ptr(&kmem_objects);
-    acquire_lock(&kmem->remote_free_lock);
-    struct remote_free *rf = kmem->remote_free_list;
-    kmem->remote_free_list = NULL;
-    release_lock(&kmem->remote_free_lock);
+    struct remote_free *rf = NULL;
+    // Unlocked peek, a free that races with it is picked up next time
+    if (this_cpu_read(kmem_objects.remote_free_list)) {
+        struct kmem_cpu *kmem = this_cpu_ptr(&kmem_objects);
+        acquire_lock(&kmem->remote_free_lock);
+        rf = kmem->remote_free_list;
+        kmem->remote_free_list = NULL;
+        release_lock(&kmem->remote_free_lock);
+    }
 
     while (rf != NULL) {
         struct remote_free *next = rf->next;
@@ -237,8 +237,7 @@ error:
 }
 
 
-__maybe_unused static
-struct vm_desc *vma_create_new_at(struct mm_info *mm, uintptr_t vaddr,
+static struct vm_desc *vma_create_new_at(struct mm_info *mm, uintptr_t vaddr,
     size_t length, int flags)
 {
     uintptr_t end = PAGE_ROUND_UP(vaddr + length);
@@ -282,6 +281,7 @@ static int vma_split(struct vm_desc *vma, uintptr_t start, uintptr_t end)
     if (!tail)
         return -ENOMEM;
     *tail = *vma;
+    vma_get_file(tail);
     tail->start = end;
     vma->end = start;
     // Insert the tail after the current vma
@@ -311,7 +311,7 @@ static int vma_unmap_range(struct vm_desc *vma, uintptr_t start, uintptr_t end)
         if (vma->start >= start && vma->end <= end) {
             // Entirely contained
             vma_list_remove(vma, &vma->mm->mmap);
-            kfree(vma);
+            vma_free(vma);
         } else if (vma->start < start && vma->end > end) {
             // VMA spans beyond both sides
             err = vma_split(vma, start, end);
@@ -337,8 +337,81 @@ static int vma_unmap_range(struct vm_desc *vma, uintptr_t start, uintptr_t end)
     return 1;
 }
 
+// The page cache a shared writable mapping of vma is counted against
+static struct address_space * vma_writable_mapping(struct vm_desc *vma)
+{
+    if (!vma->vm_file ||
+            (vma->vm_flags & (VM_SHARED|VM_WRITE|VM_IO)) != (VM_SHARED|VM_WRITE))
+        return NULL;
+    return &vma->vm_file->f_dentry->d_inode->i_data;
+}
+
+/*
+ * Take the references a copy of a VMA holds on its file. The original
+ * already counts as a writable mapping, so the count can't be denied.
+ */
+void vma_get_file(struct vm_desc *vma)
+{
+    struct address_space *mapping = vma_writable_mapping(vma);
+
+    if (!vma->vm_file)
+        return;
+    fget(vma->vm_file);
+    if (mapping)
+        __atomic_fetch_add(&mapping->i_mmap_writable, 1, __ATOMIC_RELAXED);
+}
+
+// Free a VMA that is off the list, dropping its reference to the file
+void vma_free(struct vm_desc *vma)
+{
+    struct address_space *mapping = vma_writable_mapping(vma);
+
+    if (mapping)
+        mapping_unmap_writable(mapping);
+    if (vma->vm_file)
+        fput(vma->vm_file);
+    kfree(vma);
+}
+
+/*
+ * Write back the pages in [start, end) of a shared file mapping that were
+ * stored to through the page tables. The dirty bit is cleared before the
+ * write, so a store racing with it dirties the page again for next time.
+ */
+int vma_writeback(struct vm_desc *vma, uintptr_t start, uintptr_t end)
+{
+    const struct address_space_operations *a_ops;
+    struct mm_info *mm = vma->mm;
+    struct page *pg;
+    int err = 0, ret;
+
+    if (!(vma->vm_flags & VM_SHARED) || !vma->vm_file ||
+            (vma->vm_flags & VM_IO))
+        return 0;
+    a_ops = vma->vm_file->f_dentry->d_inode->i_data.a_ops;
+    if (!a_ops->writepage)
+        return 0;
+
+    for (; start < end; start += PAGE_SIZE) {
+        acquire_lock(&mm->page_table_lock);
+        pg = clear_user_page_dirty(start);
+        if (pg)
+            get_page(pg);
+        release_lock(&mm->page_table_lock);
+        if (!pg)
+            continue;
+
+        ret = a_ops->writepage(vma->vm_file, pg, vma_file_index(vma, start));
+        put_page(pg);
+        if (ret && !err)
+            err = ret;
+    }
+    return err;
+}
+
 static int mmap_unmap_range(struct mm_info *mm, uintptr_t start, uintptr_t end)
 {
+    struct vm_desc *vma;
     int err = 0;
     struct tlb_inval tlb = {
         .mm = mm,
@@ -350,6 +423,12 @@ static int mmap_unmap_range(struct mm_info *mm, uintptr_t start, uintptr_t end)
     klog(LOG_DEBUG, "mmap_unmap_range: unmapping range %p - %p\n",
         (void*)start, (void*)end);
 
+    // The dirty bits go with the page tables, so harvest them first
+    for (vma = mm->mmap; vma && vma->start < end; vma = vma->vm_next) {
+        if (vma->end > start)
+            vma_writeback(vma, MAX(start, vma->start), MIN(end, vma->end));
+    }
+
     err = vma_unmap_range(mm->mmap, start, end);
     if (err <= 0)
         goto error;
@@ -363,22 +442,65 @@ error:
     return err;
 }
 
-// TODO: implement file-backed mmap properly
+/*
+ * Back vma with file from offset. Private mappings fault in copies of the
+ * file, shared ones map the page cache and are written back from there.
+ * The VMA holds a reference to the file until it is freed.
+ */
 int do_mmap_file(struct vm_desc *vma, struct file *file, unsigned long offset)
 {
-    vma->vm_file = file;
+    struct inode *inode = file->f_dentry ? file->f_dentry->d_inode : NULL;
+    const struct address_space_operations *a_ops;
+    int err;
+
     vma->vm_pgoff = offset / PAGE_SIZE;
     if (file->f_op && file->f_op->mmap) {
         vma->vm_flags |= VM_IO;
-        return file->f_op->mmap(file, vma);
+        err = file->f_op->mmap(file, vma);
+        if (err < 0)
+            return err;
+    } else {
+        a_ops = inode ? inode->i_data.a_ops : NULL;
+        if ((vma->vm_flags & VM_SHARED) && (!a_ops || !a_ops->fault_page))
+            return -ENODEV;
+        // A write sealed file can't be mapped shared and writable
+        if ((vma->vm_flags & (VM_SHARED|VM_WRITE)) == (VM_SHARED|VM_WRITE) &&
+                (err = mapping_map_writable(&inode->i_data)) < 0)
+            return err;
+        vma->seg_vaddr = vma->start;
+        vma->seg_offset = offset;
+        vma->vm_fsize = vma->end - vma->start;
     }
-    vma->seg_vaddr = vma->start;
-    vma->seg_offset = offset;
-    vma->vm_fsize = vma->end - vma->start;
+
+    fget(file);
+    vma->vm_file = file;
     return 0;
 }
 
 
+/*
+ * Map length bytes of file from offset at the fixed address start, for the
+ * mappings the kernel sets up itself. Nothing may be mapped there already.
+ * The caller holds the mmap write lock.
+ */
+int mm_map_file(struct mm_info *mm, uintptr_t start, size_t length,
+    int vm_flags, struct file *file, unsigned long offset)
+{
+    struct vm_desc *vma;
+    int err;
+
+    vma = vma_create_new_at(mm, start, length, vm_flags);
+    if (IS_ERR(vma))
+        return PTR_ERR(vma);
+    err = do_mmap_file(vma, file, offset);
+    if (err < 0) {
+        kfree(vma);
+        return err;
+    }
+    vma_list_insert(vma, &mm->mmap);
+    return 0;
+}
+
 SYSCALL_DECL6(mmap, void*, addr, size_t, length, int, prot,
     int, flags, int, fd, off_t, offset)
 {
@@ -445,20 +567,22 @@ SYSCALL_DECL6(mmap, void*, addr, size_t, length, int, prot,
         goto free_vma;
     }
 
-    struct file *file = get_file_handle(fd);
-    if (IS_ERR_OR_NULL(file)) {
+    struct fd f = fdget(fd);
+    if (!f.file) {
         ret = -EBADF;
         goto free_vma;
     }
 
-    int mode = file->f_mode & O_ACCMODE;
+    int mode = f.file->f_mode & O_ACCMODE;
     if (((mode == O_WRONLY) && (mflags & VM_READ)) ||
         ((mode == O_RDONLY) && (mflags & VM_WRITE))) {
+        fdput(f);
         ret = -EACCES;
         goto free_vma;
     }
 
-    ret = do_mmap_file(vma, file, offset);
+    ret = do_mmap_file(vma, f.file, offset);
+    fdput(f);
     if (ret < 0) {
         goto free_vma;
     }
@@ -470,8 +594,12 @@ SYSCALL_DECL6(mmap, void*, addr, size_t, length, int, prot,
 free_vma:
     if (vma)
         kfree(vma);
-out:
+    goto out;
 success:
+    // Best effort, whatever isn't populated is faulted in on use
+    if (flags & MAP_POPULATE)
+        mm_populate(vma, vma->start, vma->end);
+out:
     mmap_write_unlock(current->mm);
     return ret;
 }
@@ -500,11 +628,215 @@ SYSCALL_DECL2(munmap, void*, addr, size_t, length)
     return ret;
 }
 
+/*
+ * Shared mappings map the page cache itself, so there is nothing to
+ * invalidate and no background writeback to start: MS_ASYNC writes the
+ * dirty pages now, MS_SYNC also waits for them to reach the disk.
+ */
+SYSCALL_DECL3(msync, void *, addr, size_t, len, int, flags)
+{
+    struct mm_info *mm = current->mm;
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = PAGE_ROUND_UP(start + len);
+    struct vm_desc *vma;
+    int err = 0, ret;
+
+    if (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC))
+        return -EINVAL;
+    if ((flags & MS_ASYNC) && (flags & MS_SYNC))
+        return -EINVAL;
+    if (start & (PAGE_SIZE-1) || end < start || end > __USER_MAX_ADDR)
+        return -EINVAL;
+    if (start == end)
+        return 0;
+
+    mmap_read_lock(mm);
+    if (!mm_range_is_mapped(mm, start, end)) {
+        mmap_read_unlock(mm);
+        return -ENOMEM;
+    }
+
+    for (vma = find_vma(mm, start); vma && vma->start < end; vma = vma->vm_next) {
+        ret = vma_writeback(vma, MAX(start, vma->start), MIN(end, vma->end));
+        if (!ret && (flags & MS_SYNC) && (vma->vm_flags & VM_SHARED) &&
+                vma->vm_file && !(vma->vm_flags & VM_IO))
+            ret = vfs_fsync(vma->vm_file, 0);
+        if (ret && !err)
+            err = ret;
+    }
+    mmap_read_unlock(mm);
+
+    return err;
+}
+
+// Largest range one last-level page table maps, mremap moves these whole
+#define MREMAP_TABLE_SIZE   0x200000UL
+
+// A file mapping that maps the file up to its end keeps doing so as it grows
+static void vma_set_end(struct vm_desc *vma, uintptr_t new_end)
+{
+    if (vma->vm_file && vma->seg_vaddr + vma->vm_fsize >= vma->end)
+        vma->vm_fsize += new_end - vma->end;
+    vma->end = new_end;
+}
+
+/*
+ * Move the pages of [old, old + old_len), which is all of vma, to a new
+ * VMA of new_len bytes at new_addr, or wherever there is room if new_addr
+ * is 0. The page table entries are moved, the data is never copied.
+ */
+static long mremap_move(struct mm_info *mm, struct vm_desc *vma,
+    uintptr_t old, size_t old_len, uintptr_t new_addr, size_t new_len)
+{
+    struct tlb_inval tlb = {
+        .mm = mm,
+        .start = old,
+        .end = old + old_len,
+        .full = false,
+    };
+    struct vm_desc *new_vma;
+    uintptr_t start;
+
+    if (new_addr) {
+        new_vma = kzmalloc(sizeof(*new_vma));
+        if (!new_vma)
+            return -ENOMEM;
+        start = new_addr;
+    } else {
+        // Keep the offset within a page table so whole tables can move
+        size_t slack = new_len >= MREMAP_TABLE_SIZE ? MREMAP_TABLE_SIZE : 0;
+        new_vma = vma_create_new_after(mm, __USER_MMAP_START, new_len + slack,
+            vma->vm_flags);
+        if (IS_ERR(new_vma))
+            return PTR_ERR(new_vma);
+        start = new_vma->start;
+        if (slack)
+            start += (old - start) & (slack - 1);
+    }
+
+    *new_vma = *vma;
+    new_vma->vm_next = NULL;
+    new_vma->vm_prev = NULL;
+    new_vma->start = start;
+    new_vma->end = start + old_len;
+    new_vma->seg_vaddr = vma->seg_vaddr + (start - old);
+    vma_get_file(new_vma);
+
+    acquire_lock(&mm->page_table_lock);
+    move_user_page_range(old, start, old_len);
+    // Only frees the page tables the move left empty
+    drop_user_page_range(old, old_len);
+    arch_tlb_flush_mmu(&tlb);
+    release_lock(&mm->page_table_lock);
+
+    // total_vm loses old_len here and gains new_len on the insert
+    vma_list_remove(vma, &mm->mmap);
+    vma_free(vma);
+    vma_set_end(new_vma, start + new_len);
+    vma_list_insert(new_vma, &mm->mmap);
+    return start;
+}
+
+static long do_mremap(struct mm_info *mm, uintptr_t old, size_t old_len,
+    size_t new_len, int flags, uintptr_t new_addr)
+{
+    uintptr_t old_end = old + old_len;
+    struct vm_desc *vma;
+    long err;
+
+    // Like Linux, the new address means nothing without MREMAP_FIXED
+    if (!(flags & MREMAP_FIXED))
+        new_addr = 0;
+
+    if (flags & MREMAP_FIXED) {
+        if (new_addr & (PAGE_SIZE-1) || !new_addr ||
+                new_addr + new_len < new_addr ||
+                new_addr + new_len > __USER_MAX_ADDR)
+            return -EINVAL;
+        if (new_addr < old_end && old < new_addr + new_len)
+            return -EINVAL;
+    }
+
+    vma = find_vma(mm, old);
+    if (!vma || vma->end < old_end)
+        return -EFAULT;
+    // Device mappings are set up whole by the driver's mmap
+    if (vma->vm_flags & VM_IO)
+        return -EINVAL;
+
+    // Only clear the destination once the move can't fail on the source
+    if (flags & MREMAP_FIXED) {
+        err = mmap_unmap_range(mm, new_addr, new_addr + new_len);
+        if (err < 0)
+            return err;
+        // The unmap may have split or freed the VMA around the range
+        vma = find_vma(mm, old);
+    }
+
+    // Shrinking just drops the tail
+    if (new_len < old_len) {
+        err = mmap_unmap_range(mm, old + new_len, old_end);
+        if (err < 0)
+            return err;
+        old_len = new_len;
+        old_end = old + old_len;
+    }
+
+    if (!(flags & MREMAP_FIXED)) {
+        if (new_len == old_len)
+            return old;
+        // Grow in place if the range ends the VMA and the gap after it fits
+        if (old_end == vma->end &&
+                find_gap_after(vma, old_end, new_len - old_len) == old_end &&
+                old + new_len <= __USER_MAX_ADDR) {
+            mm->total_vm += new_len - old_len;
+            vma_set_end(vma, old + new_len);
+            return old;
+        }
+        if (!(flags & MREMAP_MAYMOVE))
+            return -ENOMEM;
+    }
+
+    // Give the range a VMA of its own to move
+    if (vma->start < old) {
+        if ((err = vma_split(vma, old, old)) < 0)
+            return err;
+        vma = vma->vm_next;
+    }
+    if (vma->end > old_end && (err = vma_split(vma, old_end, old_end)) < 0)
+        return err;
+
+    return mremap_move(mm, vma, old, old_len, new_addr, new_len);
+}
+
 SYSCALL_DECL5(mremap, void*, old_addr, size_t, old_length, size_t, new_length,
     int, flags, void*, new_addr)
 {
-    // TODO
-    return -ENOSYS;
+    struct mm_info *mm = current->mm;
+    uintptr_t old = (uintptr_t)old_addr;
+    size_t old_len = PAGE_ROUND_UP(old_length);
+    size_t new_len = PAGE_ROUND_UP(new_length);
+    long ret;
+
+    klog(LOG_DEBUG, "mremap (old: %p, old_length: %lu, new_length: %lu,"
+        " flags: 0x%x, new: %p)\n", old_addr, old_length, new_length, flags,
+        new_addr);
+
+    if (flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED))
+        return -EINVAL;
+    if ((flags & MREMAP_FIXED) && !(flags & MREMAP_MAYMOVE))
+        return -EINVAL;
+    if (old & (PAGE_SIZE-1) || !old_len || !new_len)
+        return -EINVAL;
+    if (old + old_len < old || old + old_len > __USER_MAX_ADDR)
+        return -EINVAL;
+    if (new_len < new_length || new_len > __USER_MAX_ADDR)
+        return -ENOMEM;
+
+    mmap_write_lock(mm);
+    ret = do_mremap(mm, old, old_len, new_len, flags, (uintptr_t)new_addr);
+    mmap_write_unlock(mm);
+    return ret;
 }
 
 int brk(void *addr)
@@ -611,23 +943,32 @@ SYSCALL_DECL1(sbrk, intptr_t, increment)
     return (uintptr_t)_brk;
 }
 
-// TODO: flimsy HACK, not POSIX
-SYSCALL_DECL2(memfd_create, const char *, name, __unused unsigned int, flags)
+/*
+ * Making a shared file mapping writable counts it against the file, which
+ * fails once the file is write sealed. The page tables are left to the
+ * caller; a failure only ever leaves them less permissive than the VMA.
+ */
+static int vma_set_prot(struct vm_desc *vma, int prot_flags)
 {
-    klog(LOG_WARN, "memfd_create is not fully implemented, using a temporary"
-        "file as a placeholder\n");
-    static int n = 0;
-    char buf[64];
-    while (*name && *name == '/')
-        name++;
-    snprintf(buf, 64, "/tmp/%s/%d", name, n);
-    struct file *f = vfs_open(buf, O_CREAT, S_IREAD|S_IWRITE);
-    return get_next_fd(current->files, f);
+    struct address_space *old = vma_writable_mapping(vma), *new;
+    int old_flags = vma->vm_flags;
+
+    vma->vm_flags = (old_flags & ~VM_PROT_MASK) | prot_flags;
+    new = vma_writable_mapping(vma);
+    if (new && !old && mapping_map_writable(new) < 0) {
+        vma->vm_flags = old_flags;
+        return -EACCES;
+    }
+    if (old && !new)
+        mapping_unmap_writable(old);
+    return 0;
 }
 
 static int mm_update_region(struct vm_desc *vma, uintptr_t pgaddr,
     uintptr_t end, int prot_flags)
 {
+    int err;
+
     if (!vma) return -EINVAL;
     // If start address is not the beginning of the VMA
     if (vma->start < pgaddr) {
@@ -641,7 +982,8 @@ static int mm_update_region(struct vm_desc *vma, uintptr_t pgaddr,
     }
 
     while (vma && vma->end <= end) {
-        vma->vm_flags = (vma->vm_flags & ~VM_PROT_MASK) | prot_flags;
+        if ((err = vma_set_prot(vma, prot_flags)) < 0)
+            return err;
         if (vma->end == end)
             break;
         vma = vma->vm_next;
@@ -655,7 +997,8 @@ static int mm_update_region(struct vm_desc *vma, uintptr_t pgaddr,
         int ret = vma_split(vma, end, end);
         if (ret < 0)
             return ret;
-        vma->vm_flags = (vma->vm_flags & ~VM_PROT_MASK) | prot_flags;
+        if ((err = vma_set_prot(vma, prot_flags)) < 0)
+            return err;
     }
 
     int mem_flags = vma_flags_to_user_mem_flags(prot_flags);
@@ -706,3 +1049,117 @@ SYSCALL_DECL3(mprotect, void *, addr, size_t, len, int, prot)
 
     return do_mprotect(current->mm, pgaddr, end, convert_mmap_flags(prot, 0));
 }
+
+// Pass a madvise hint for the part of a file mapping in [start, end) on
+// to the readahead state of the backing file
+static int madvise_file_range(struct vm_desc *vma, uintptr_t start,
+    uintptr_t end, int advice)
+{
+    size_t seg_end = vma->seg_offset + vma->vm_fsize;
+    size_t off_start, off_end;
+
+    if (start < vma->seg_vaddr)
+        start = vma->seg_vaddr;
+    if (end <= start)
+        return 0;
+
+    off_start = vma->seg_offset + (start - vma->seg_vaddr);
+    off_end = MIN(seg_end, vma->seg_offset + (end - vma->seg_vaddr));
+    if (off_end <= off_start)
+        return 0;
+
+    return vfs_fadvise(vma->vm_file, off_start, off_end - off_start, advice);
+}
+
+/*
+ * Throw away the pages in [start, end): anonymous memory reads back as
+ * zeroes and private file pages are read again from the file. Shared file
+ * pages are written back first, the data lives on in the page cache.
+ */
+static int madvise_dontneed(struct vm_desc *vma, uintptr_t start,
+    uintptr_t end)
+{
+    struct mm_info *mm = vma->mm;
+    struct tlb_inval tlb = {
+        .mm = mm,
+        .start = start,
+        .end = end,
+        .full = false,
+    };
+
+    if (vma->vm_flags & VM_IO)
+        return -EINVAL;
+
+    vma_writeback(vma, start, end);
+    acquire_lock(&mm->page_table_lock);
+    drop_user_page_range(start, end - start);
+    arch_tlb_flush_mmu(&tlb);
+    release_lock(&mm->page_table_lock);
+    return 0;
+}
+
+static int madvise_vma(struct vm_desc *vma, uintptr_t start, uintptr_t end,
+    int advice)
+{
+    switch (advice) {
+    case MADV_DONTNEED:
+        return madvise_dontneed(vma, start, end);
+    case MADV_FREE:
+        // Nothing to reclaim lazily from, so the pages go right away
+        if (vma->vm_file || (vma->vm_flags & VM_SHARED))
+            return -EINVAL;
+        return madvise_dontneed(vma, start, end);
+    case MADV_NORMAL:
+        vma->vm_flags &= ~(VM_SEQ_READ | VM_RAND_READ);
+        break;
+    case MADV_SEQUENTIAL:
+        vma->vm_flags = (vma->vm_flags & ~VM_RAND_READ) | VM_SEQ_READ;
+        break;
+    case MADV_RANDOM:
+        vma->vm_flags = (vma->vm_flags & ~VM_SEQ_READ) | VM_RAND_READ;
+        break;
+    case MADV_WILLNEED:
+        break;
+    }
+
+    // MADV_* and POSIX_FADV_* share values for these hints
+    if (vma->vm_file)
+        return madvise_file_range(vma, start, end, advice);
+    return 0;
+}
+
+SYSCALL_DECL3(madvise, void *, addr, size_t, len, int, advice)
+{
+    struct mm_info *mm = current->mm;
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = PAGE_ROUND_UP(start + len);
+    struct vm_desc *vma;
+    long ret = 0;
+
+    if (start & (PAGE_SIZE-1) || end < start || end > __USER_MAX_ADDR)
+        return -EINVAL;
+
+    switch (advice) {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+    case MADV_WILLNEED:
+    case MADV_DONTNEED:
+    case MADV_FREE:
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    mmap_write_lock(mm);
+    for (vma = mm->mmap; vma && vma->start < end; vma = vma->vm_next) {
+        if (vma->end <= start)
+            continue;
+        ret = madvise_vma(vma, MAX(start, vma->start), MIN(end, vma->end), advice);
+        if (ret)
+            break;
+    }
+    mmap_write_unlock(mm);
+
+    return ret;
+}
@@ -15,6 +15,11 @@ static u32 BITMAP_SIZE;
 static volatile size_t *pg_frame_bitmap;
 static volatile spinlock_t pg_frame_bm_lock = SPINLOCK_INIT;
 
+static LIST_HEAD(shrinker_list);
+static spinlock_t shrinker_lock = SPINLOCK_INIT;
+
+#define SHRINK_BATCH 128
+
 static atomic_ulong allocated_frames = 0;
 static unsigned long reserved_frames = 0;
 static unsigned long total_frames = 0;
@@ -85,13 +90,16 @@ void pmem_init(void)
 struct page * alloc_pages(u32 pgcnt, u32 flags)
 {
     uintptr_t phys, base;
-    base = phys = (uintptr_t)alloc_frames(pgcnt);
+    if (flags & ALLOC_MAYFAIL)
+        base = phys = (uintptr_t)try_alloc_frames(pgcnt);
+    else
+        base = phys = (uintptr_t)alloc_frames(pgcnt);
     if (!base)
         return NULL;
 
     struct page *pg = phys_to_page(phys);
     while (pgcnt--) {
-        pg->flags = flags;
+        pg->flags = flags & ~ALLOC_MAYFAIL;
         pg->refcount = 1;
         pg++;
     }
@@ -121,17 +129,40 @@ void * get_zeroed_pages(u32 pgcnt, u32 flags)
 {
     void *addr = get_free_pages(pgcnt, flags);
     if (addr)
-        memset(addr, 0, pgcnt * PAGE_SIZE);
+        clear_pages(addr, pgcnt);
     return addr;
 }
 
+void register_shrinker(struct shrinker *s)
+{
+    acquire_lock(&shrinker_lock);
+    list_add_tail(&s->list, &shrinker_list);
+    release_lock(&shrinker_lock);
+}
+
+// Ask the caches to let go of some memory, returning how much they freed
+static unsigned long shrink_caches(unsigned long nr)
+{
+    struct shrinker *s;
+    unsigned long freed = 0;
+
+    // Shrinkers are only ever added, so the list can be walked unlocked
+    list_for_each_entry(s, &shrinker_list, list)
+        freed += s->scan(nr);
+    return freed;
+}
+
 // --------
 
-void* alloc_frames(u32 num_pages)
+// Like alloc_frames, but NULL when there is no run of num_pages free
+void* try_alloc_frames(u32 num_pages)
 {
+    bool retried = false;
+
     if (num_pages == 0)
         return 0;
 
+retry:
     acquire_lock(&pg_frame_bm_lock);
 
     void *ptr = NULL;
@@ -151,14 +182,31 @@ void* alloc_frames(u32 num_pages)
             count = 0;
     }
 
-    if (ptr == NULL)
-        panic("Out of memory");
-
     release_lock(&pg_frame_bm_lock);
+    if (ptr == NULL) {
+        if (!retried && shrink_caches(SHRINK_BATCH)) {
+            retried = true;
+            goto retry;
+        }
+        return NULL;
+    }
+
     allocated_frames += num_pages;
     return ptr;
 }
 
+void* alloc_frames(u32 num_pages)
+{
+    void *ptr;
+
+    if (num_pages == 0)
+        return 0;
+    ptr = try_alloc_frames(num_pages);
+    if (!ptr)
+        panic("Out of memory");
+    return ptr;
+}
+
 void free_frames(void *frame, u32 num_pages)
 {
     if (num_pages == 0)
@@ -12,11 +12,14 @@ fi
 dd if=/dev/zero of=uefi.img bs=512 count=1GB
 
 parted uefi.img --script mklabel gpt
-parted uefi.img --script mkpart ESP fat32 1MiB 100%
+parted uefi.img --script mkpart ESP fat32 1MiB 75%
+parted uefi.img --script mkpart data ext2 75% 100%
 parted uefi.img --script set 1 esp on
 
 LOOPDEV=$(sudo losetup --find --show --partscan uefi.img)
 sudo mkfs.fat -F32 -n LILACOS "${LOOPDEV}p1"
+# Mounted on /mnt by the kernel at boot
+sudo mke2fs -q -t ext2 -L LILACDATA "${LOOPDEV}p2"
 
 sudo mkdir -p /mnt/lilac
 sudo mount "${LOOPDEV}p1" /mnt/lilac
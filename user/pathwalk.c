@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define DEPTH 8
+
+static long elapsed_us(struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000000L +
+        (now.tv_usec - start->tv_usec);
+}
+
+static void report(const char *what, int iters, struct timeval *start)
+{
+    long us = elapsed_us(start);
+    printf("%-24s %8d iters %10ld us %8ld ns/op\n", what, iters, us,
+        us * 1000 / iters);
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 100000;
+    char path[256] = "/tmp/pw";
+    char missing[300];
+    struct timeval start;
+    int fd;
+
+    if (iters <= 0)
+        iters = 100000;
+
+    // Build /tmp/pw/d0/d1/.../file
+    mkdir(path, 0755);
+    for (int i = 0; i < DEPTH; i++) {
+        size_t len = strlen(path);
+        snprintf(path + len, sizeof(path) - len, "/d%d", i);
+        mkdir(path, 0755);
+    }
+    snprintf(missing, sizeof(missing), "%s/nothere", path);
+    strcat(path, "/file");
+    fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    close(fd);
+
+    printf("Path walk benchmark: %s\n", path);
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < iters; i++)
+        access(path, F_OK);
+    report("access (hit)", iters, &start);
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < iters; i++)
+        access(missing, F_OK);
+    report("access (negative)", iters, &start);
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < iters; i++) {
+        fd = open(path, O_RDONLY);
+        if (fd >= 0)
+            close(fd);
+    }
+    report("open+close", iters, &start);
+
+    return 0;
+}